@@ -0,0 +1,232 @@
+/**
+ * @file block_path.cpp
+ * @brief Measures the cost of downloading a block from a single peer
+ *
+ * A fake peer on the loopback serves every request immediately, so the numbers show
+ * the overhead of our own receive, request and send path: heap allocations made
+ * per downloaded block and the throughput of a single connection.
+ *
+ * Usage: block_path_bench [number of pieces] [epoll|io_uring]
+ */
+
+#include "config.hpp"
+#include "event_loop.hpp"
+#include "peer_connection.hpp"
+#include "peer_message.hpp"
+#include "piece.hpp"
+#include "piece_arena.hpp"
+
+#include <arpa/inet.h>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// allocations are counted per thread, so the fake peer doesn't affect the result
+static thread_local size_t t_allocations = 0;
+
+void *operator new(const size_t size)
+{
+	++t_allocations;
+	if (void *ptr = std::malloc(size == 0 ? 1 : size))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t /*size*/) noexcept
+{
+	std::free(ptr);
+}
+
+static constexpr size_t piece_length = 256 * 1024;
+
+static bool read_exactly(const int fd, std::span<uint8_t> buffer)
+{
+	while (!buffer.empty())
+	{
+		const ssize_t n = ::read(fd, buffer.data(), buffer.size());
+		if (n <= 0)
+		{
+			return false;
+		}
+		buffer = buffer.subspan(static_cast<size_t>(n));
+	}
+	return true;
+}
+
+static void write_all(const int fd, std::span<iovec> iov)
+{
+	while (!iov.empty())
+	{
+		ssize_t n = ::writev(fd, iov.data(), static_cast<int>(iov.size()));
+		if (n <= 0)
+		{
+			return;
+		}
+		while (!iov.empty() && static_cast<size_t>(n) >= iov.front().iov_len)
+		{
+			n -= static_cast<ssize_t>(iov.front().iov_len);
+			iov = iov.subspan(1);
+		}
+		if (!iov.empty())
+		{
+			iov.front().iov_base = static_cast<uint8_t *>(iov.front().iov_base) + n;
+			iov.front().iov_len -= static_cast<size_t>(n);
+		}
+	}
+}
+
+/**
+ * @brief Answers the handshake and serves every request with zeroes
+ */
+static void fake_peer(const int listener, const size_t bitfield_message_size)
+{
+	const int fd = accept(listener, nullptr, nullptr);
+	if (fd == -1)
+	{
+		return;
+	}
+
+	std::vector<uint8_t> greeting(68 + bitfield_message_size);
+	if (!read_exactly(fd, greeting))
+	{
+		close(fd);
+		return;
+	}
+	std::array<iovec, 1> hs = { { { greeting.data(), 68 } } };
+	write_all(fd, hs);
+
+	const std::vector<uint8_t> block(RequestQueue::max_block_size);
+	std::array<uint8_t, 17> request{};
+	while (read_exactly(fd, request))
+	{
+		uint32_t length = 0;
+		std::memcpy(&length, request.data() + 4 + 1 + 4 + 4, sizeof length);
+		std::array<uint8_t, 13> header{};
+		const uint32_t message_length = htonl(1 + 4 + 4 + ntohl(length));
+		std::memcpy(header.data(), &message_length, sizeof message_length);
+		header[4] = 7;
+		// index and begin are the same as in the request
+		std::memcpy(header.data() + 5, request.data() + 5, 8);
+
+		std::array<iovec, 2> iov = { { { header.data(), header.size() },
+					       { const_cast<uint8_t *>(block.data()), ntohl(length) } } };
+		write_all(fd, iov);
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t pieces = argc > 1 ? std::stoul(argv[1]) : 256;
+	config::set_value("event_loop", argc > 2 ? argv[2] : "epoll");
+
+	const int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof addr;
+	if (listener == -1 || bind(listener, reinterpret_cast<sockaddr *>(&addr), addr_len) == -1 ||
+	    listen(listener, 1) == -1 ||
+	    getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) == -1)
+	{
+		std::cerr << "Failed to set up the fake peer" << '\n';
+		return 1;
+	}
+
+	const message::Bitfield bitfield(pieces);
+	const std::jthread peer(fake_peer, listener, bitfield.serialized().size());
+
+	const std::unique_ptr<EventLoop> loop = make_event_loop();
+	const std::array<uint8_t, 20> info_hash{};
+	const std::array<uint8_t, 20> peer_id{};
+	const message::Handshake handshake(info_hash, peer_id);
+	PieceArena arena(4 * piece_length, false);
+	PeerConnection conn;
+	conn.connect(*loop, 0, "127.0.0.1", std::to_string(ntohs(addr.sin_port)), handshake,
+		     bitfield);
+
+	size_t next_piece = 0;
+	size_t completed = 0;
+	size_t blocks = 0;
+	conn.create_requests_for_piece(next_piece++, piece_length, arena.acquire(piece_length));
+	(void)conn.send_request();
+
+	t_allocations = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	while (completed < pieces)
+	{
+		for (const auto &ev : loop->wait(-1))
+		{
+			conn.complete_io(ev);
+			if ((ev.events & (EventLoop::readable | EventLoop::received)) != 0)
+			{
+				int rc = 0;
+				do
+				{
+					rc = conn.recv();
+					while (const auto message = conn.next_message())
+					{
+						if (message->size() <= 4 || (*message)[4] != 7)
+						{
+							continue;
+						}
+						++blocks;
+						if (conn.add_block(message.value()) == 1)
+						{
+							const ReceivedPiece piece = conn.get_received_piece();
+							++completed;
+						}
+						if (conn.send_request() == 1 && next_piece < pieces)
+						{
+							conn.create_requests_for_piece(
+								next_piece++, piece_length,
+								arena.acquire(piece_length));
+							(void)conn.send_request();
+						}
+					}
+				} while (rc == 0);
+			}
+			if ((ev.events & EventLoop::error) != 0 && conn.loop_performs_io())
+			{
+				std::cerr << "The fake peer closed the connection" << '\n';
+				return 1;
+			}
+			(void)conn.send();
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	const size_t allocations = t_allocations;
+	conn.disconnect();
+
+	const double mib = static_cast<double>(pieces * piece_length) / (1024.0 * 1024.0);
+	std::cout << "blocks: " << blocks << '\n'
+		  << "allocations per block: "
+		  << static_cast<double>(allocations) / static_cast<double>(blocks) << '\n'
+		  << "throughput: " << mib / elapsed.count() << " MiB/s" << '\n';
+	close(listener);
+	return 0;
+}
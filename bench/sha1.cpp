@@ -0,0 +1,64 @@
+/**
+ * @file sha1.cpp
+ * @brief Measures the piece hashing throughput of every SHA1 kernel on a single core
+ *
+ * Pieces are hashed in batches of the size the kernel prefers, the same way the hash
+ * pool feeds them, so the multi-buffer kernel gets all its lanes filled.
+ *
+ * Usage: sha1_bench [number of pieces] [piece length in KiB]
+ */
+
+#include "sha1.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+	const size_t pieces = argc > 1 ? std::stoul(argv[1]) : 512;
+	const size_t piece_length = (argc > 2 ? std::stoul(argv[2]) : 256) * 1024;
+
+	// the data doesn't matter, but it should not be all zero pages
+	std::vector<uint8_t> data(pieces * piece_length);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = static_cast<uint8_t>(i * 2654435761U >> 24);
+	}
+	std::vector<std::span<const uint8_t>> inputs;
+	for (size_t i = 0; i < pieces; ++i)
+	{
+		inputs.emplace_back(data.data() + i * piece_length, piece_length);
+	}
+	std::vector<sha1::Digest> outputs(pieces);
+
+	std::cout << "best kernel: " << sha1::kernel_name(sha1::best_kernel()) << '\n';
+	for (const auto kernel : { sha1::Kernel::EVP, sha1::Kernel::SHA_NI, sha1::Kernel::AVX2 })
+	{
+		if (!sha1::is_supported(kernel))
+		{
+			std::cout << sha1::kernel_name(kernel) << ": not supported" << '\n';
+			continue;
+		}
+
+		const size_t batch = sha1::preferred_batch(kernel);
+		const auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < pieces; i += batch)
+		{
+			const size_t count = std::min(batch, pieces - i);
+			sha1::hash(std::span(inputs).subspan(i, count),
+				   std::span(outputs).subspan(i, count), kernel);
+		}
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		const double gb = static_cast<double>(data.size()) / 1e9;
+		std::cout << sha1::kernel_name(kernel) << ": " << gb / elapsed.count() << " GB/s"
+			  << '\n';
+	}
+	return 0;
+}
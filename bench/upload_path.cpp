@@ -0,0 +1,329 @@
+/**
+ * @file upload_path.cpp
+ * @brief Measures the cost of uploading blocks to a single peer
+ *
+ * A fake peer on the loopback keeps a window of requests in flight and reads the blocks
+ * as fast as they come, so the numbers show the overhead of our own request handling,
+ * storage reads and send path: heap allocations made per uploaded block and the
+ * throughput of a single connection. The data is read from a file that is in the page
+ * cache. It goes through a PieceCache as in the client, with the missing pieces read by
+ * a DiskWriter thread, or straight from the file with sendfile() if the budget of the cache
+ * is 0. Cached blocks may be sent with MSG_ZEROCOPY,
+ * although on the loopback the kernel copies them anyway.
+ *
+ * Usage: upload_path_bench [number of pieces] [cache budget in MiB] [zerocopy 0/1]
+ */
+
+#include "disk_writer.hpp"
+#include "event_loop.hpp"
+#include "peer_connection.hpp"
+#include "peer_message.hpp"
+#include "piece_cache.hpp"
+#include "storage.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <new>
+#include <span>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// allocations are counted per thread, so the fake peer doesn't affect the result
+static thread_local size_t t_allocations = 0;
+
+void *operator new(const size_t size)
+{
+	++t_allocations;
+	if (void *ptr = std::malloc(size == 0 ? 1 : size))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t /*size*/) noexcept
+{
+	std::free(ptr);
+}
+
+static constexpr size_t piece_length = 256 * 1024;
+static constexpr size_t block_size = PeerConnection::max_block_size;
+// requests the fake peer keeps in flight
+static constexpr size_t window = 64;
+
+static bool read_exactly(const int fd, std::span<uint8_t> buffer)
+{
+	while (!buffer.empty())
+	{
+		const ssize_t n = ::read(fd, buffer.data(), buffer.size());
+		if (n <= 0)
+		{
+			return false;
+		}
+		buffer = buffer.subspan(static_cast<size_t>(n));
+	}
+	return true;
+}
+
+static bool write_exactly(const int fd, std::span<const uint8_t> buffer)
+{
+	while (!buffer.empty())
+	{
+		const ssize_t n = ::write(fd, buffer.data(), buffer.size());
+		if (n <= 0)
+		{
+			return false;
+		}
+		buffer = buffer.subspan(static_cast<size_t>(n));
+	}
+	return true;
+}
+
+/**
+ * @brief Answers the handshake, says it is interested and downloads every piece
+ */
+static void fake_peer(const int listener, const size_t bitfield_message_size, const size_t pieces)
+{
+	const int fd = accept(listener, nullptr, nullptr);
+	if (fd == -1)
+	{
+		return;
+	}
+
+	std::vector<uint8_t> greeting(68 + bitfield_message_size);
+	if (!read_exactly(fd, greeting) ||
+	    !write_exactly(fd, std::span(greeting).first(68)) ||
+	    !write_exactly(fd, message::Interested().serialized()))
+	{
+		close(fd);
+		return;
+	}
+
+	const size_t blocks = pieces * piece_length / block_size;
+	size_t requested = 0;
+	size_t received = 0;
+	std::vector<uint8_t> message(message::PieceHeader::size + block_size);
+	std::array<uint8_t, 5> unchoke{};
+	if (!read_exactly(fd, unchoke))
+	{
+		close(fd);
+		return;
+	}
+	while (received < blocks)
+	{
+		while (requested < blocks && requested - received < window)
+		{
+			const message::Request rq(static_cast<uint32_t>(requested * block_size / piece_length),
+						  static_cast<uint32_t>(requested * block_size % piece_length),
+						  block_size);
+			if (!write_exactly(fd, rq.serialized()))
+			{
+				close(fd);
+				return;
+			}
+			++requested;
+		}
+		if (!read_exactly(fd, message))
+		{
+			break;
+		}
+		++received;
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t pieces = argc > 1 ? std::stoul(argv[1]) : 256;
+	const size_t cache_budget = (argc > 2 ? std::stoul(argv[2]) : 64) * 1024 * 1024;
+	const bool zerocopy = argc > 3 && std::stoul(argv[3]) != 0;
+	std::signal(SIGPIPE, SIG_IGN);
+
+	const auto path = std::filesystem::temp_directory_path() / "upload_path_bench";
+	{
+		const std::vector<char> piece(piece_length, 'x');
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		for (size_t i = 0; i < pieces; ++i)
+		{
+			out.write(piece.data(), static_cast<std::streamsize>(piece.size()));
+		}
+	}
+	PwriteStorage storage(FileLayout({ { path, 0, pieces * piece_length } }, piece_length), 1);
+
+	const int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof addr;
+	if (listener == -1 || bind(listener, reinterpret_cast<sockaddr *>(&addr), addr_len) == -1 ||
+	    listen(listener, 1) == -1 ||
+	    getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) == -1)
+	{
+		std::cerr << "Failed to set up the fake peer" << '\n';
+		return 1;
+	}
+
+	const message::Bitfield bitfield(pieces);
+	const std::jthread peer(fake_peer, listener, bitfield.serialized().size(), pieces);
+
+	EpollEventLoop loop;
+	const std::array<uint8_t, 20> info_hash{};
+	const std::array<uint8_t, 20> peer_id{};
+	const message::Handshake handshake(info_hash, peer_id);
+	PeerConnection conn;
+	conn.connect(loop, 0, "127.0.0.1", std::to_string(ntohs(addr.sin_port)), handshake,
+		     bitfield);
+	if (zerocopy && !conn.enable_zerocopy())
+	{
+		std::cerr << "MSG_ZEROCOPY is not supported" << '\n';
+	}
+
+	// the same as Download::serve_uploads() and Download::read_callback()
+	PieceCache cache(cache_budget);
+	DiskWriter disk(
+		1, 1, [](const ReceivedPiece & /*piece*/) {},
+		[&storage](const size_t index) {
+			auto data = std::make_shared<std::vector<uint8_t>>(piece_length);
+			storage.read(index * piece_length, *data);
+			return data;
+		});
+	constexpr uint64_t read_token = 1;
+	DiskWriter::ReadQueue reads;
+	loop.add(reads.get_fd(), read_token, EventLoop::readable);
+	bool reading = false;
+	// the piece that was read last, it is served even if it doesn't fit into the cache
+	DiskWriter::ReadResult last_read;
+	const auto serve = [&] {
+		bool ret = false;
+		while (const auto request = conn.next_upload())
+		{
+			const size_t index = request->get_index();
+			if (!cache.enabled())
+			{
+				conn.send_file_block(request.value(),
+						     storage.file_ranges(index * piece_length +
+										 request->get_begin(),
+									 request->get_length()));
+			}
+			else
+			{
+				PieceCache::Data piece = cache.find(index);
+				if (!piece && last_read.index == index)
+				{
+					piece = last_read.data;
+				}
+				if (!piece)
+				{
+					conn.requeue_upload(request.value());
+					if (!reading)
+					{
+						disk.submit_read(reads, index);
+						reading = true;
+					}
+					return ret;
+				}
+				conn.send_cached_block(request.value(), std::move(piece));
+			}
+			ret = true;
+		}
+		return ret;
+	};
+
+	const size_t total = pieces * piece_length;
+	t_allocations = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	while (conn.bytes_uploaded() < total || conn.should_wait_for_send())
+	{
+		for (const auto &ev : loop.wait(-1))
+		{
+			if (ev.token == read_token)
+			{
+				for (auto &result : reads.take_results())
+				{
+					if (result.data == nullptr)
+					{
+						return 1;
+					}
+					cache.insert(result.index, result.data);
+					last_read = std::move(result);
+				}
+				reading = false;
+			}
+			else if ((ev.events & EventLoop::error) != 0)
+			{
+				(void)conn.release_zerocopy_blocks();
+			}
+			if (ev.token != read_token && (ev.events & EventLoop::readable) != 0)
+			{
+				int rc = 0;
+				do
+				{
+					rc = conn.recv();
+					while (const auto message = conn.next_message())
+					{
+						if (message->size() <= 4)
+						{
+							continue;
+						}
+						if ((*message)[4] == 2)
+						{
+							conn.send_unchoke();
+						}
+						else if ((*message)[4] == 6)
+						{
+							(void)conn.queue_upload(message::Request(message.value()));
+						}
+					}
+				} while (rc == 0);
+			}
+			(void)serve();
+			while (conn.send() == 0 && serve())
+			{
+			}
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	const size_t allocations = t_allocations;
+	conn.disconnect();
+
+	const size_t blocks = total / block_size;
+	const double mib = static_cast<double>(total) / (1024.0 * 1024.0);
+	std::cout << "blocks: " << blocks << '\n'
+		  << "allocations per block: "
+		  << static_cast<double>(allocations) / static_cast<double>(blocks) << '\n'
+		  << "throughput: " << mib / elapsed.count() << " MiB/s" << '\n';
+	if (cache.enabled())
+	{
+		const PieceCache::Stats stats = cache.get_stats();
+		std::cout << "cache hit ratio: "
+			  << static_cast<double>(stats.hits) /
+				     static_cast<double>(std::max<size_t>(stats.hits + stats.misses, 1))
+			  << '\n';
+	}
+	close(listener);
+	std::filesystem::remove(path);
+	return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/**
+ * @brief Receive or send buffer of a connection
+ *
+ * The data is appended to the end and consumed from the beginning. Instead of wrapping
+ * around, the unconsumed data is moved to the front once there is no space left at the
+ * end, so every message is always stored contiguously and can be viewed in place.
+ * Since consumed messages are usually whole, there is rarely more than a part of a
+ * single message to move.
+ *
+ * The buffer grows to fit a message bigger than its capacity and shrinks back once
+ * the message is consumed.
+ */
+class ByteBuffer {
+	size_t m_capacity;
+	std::vector<uint8_t> m_data;
+	size_t m_begin = 0;
+	size_t m_end = 0;
+
+public:
+	/**
+	 * @param capacity The amount of data the buffer normally holds
+	 */
+	explicit ByteBuffer(size_t capacity);
+
+	/**
+	 * @brief Returns the free space at the end of the buffer
+	 *
+	 * @param min_size The space needed, the buffer is compacted or grown if there is less
+	 */
+	[[nodiscard]] std::span<uint8_t> prepare(size_t min_size);
+	/**
+	 * @brief Appends the bytes written to the span returned by prepare()
+	 */
+	void commit(size_t size);
+	/**
+	 * @brief Appends the bytes to the end of the data
+	 */
+	void append(std::span<const uint8_t> bytes);
+	/**
+	 * @brief Returns the data that is appended but not consumed yet
+	 *
+	 * @note The span is invalidated by prepare()
+	 */
+	[[nodiscard]] std::span<const uint8_t> data() const;
+	/**
+	 * @brief Removes the bytes from the beginning of the data
+	 *
+	 * @note The consumed bytes stay in place until the next prepare(), so they can still
+	 * be viewed
+	 */
+	void consume(size_t size);
+
+	[[nodiscard]] size_t size() const;
+	[[nodiscard]] bool empty() const;
+	[[nodiscard]] size_t capacity() const;
+
+	void clear();
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "event_loop.hpp"
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Results that worker threads hand back to a single reactor
+ *
+ * Workers push the results from any thread, and the reactor is woken up through the
+ * descriptor, which should be registered in its loop as readable. The queue is not
+ * bounded, the producer decides how much work it accepts.
+ */
+template <typename Result>
+class CompletionQueue {
+	std::mutex m_mutex;
+	std::vector<Result> m_results;
+	EventNotifier m_notifier;
+
+public:
+	CompletionQueue() = default;
+
+	CompletionQueue(const CompletionQueue &other) = delete;
+	CompletionQueue &operator=(const CompletionQueue &other) = delete;
+	CompletionQueue(CompletionQueue &&other) = delete;
+	CompletionQueue &operator=(CompletionQueue &&other) = delete;
+
+	/**
+	 * @brief Adds the result and wakes up the reactor. Can be called from any thread
+	 */
+	void push(Result &&result)
+	{
+		{
+			const std::lock_guard lock(m_mutex);
+			m_results.push_back(std::move(result));
+		}
+		m_notifier.notify();
+	}
+
+	/**
+	 * @brief Takes the results. Must be called after every event on the descriptor
+	 */
+	[[nodiscard]] std::vector<Result> take_results()
+	{
+		m_notifier.drain();
+		const std::lock_guard lock(m_mutex);
+		return std::exchange(m_results, {});
+	}
+
+	/**
+	 * @brief Returns the descriptor that becomes readable when there are results
+	 */
+	[[nodiscard]] int get_fd() const
+	{
+		return m_notifier.get_fd();
+	}
+};
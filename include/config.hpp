@@ -1,6 +1,8 @@
 #pragma once
 
 #include <filesystem>
+#include <optional>
+#include <string>
 
 namespace config
 {
@@ -15,4 +17,21 @@ void create_downloads_dir();
 [[nodiscard]] std::filesystem::path get_path_to_cache_dir();
 [[nodiscard]] std::filesystem::path get_path_to_downloads_dir();
 
+/**
+ * @brief Returns the value of the key from configs.conf
+ *
+ * @return The value or std::nullopt if the key is not present
+ */
+[[nodiscard]] std::optional<std::string> get_value(const std::string &key);
+/**
+ * @brief Returns the value of the key from configs.conf converted to integer
+ *
+ * @return The value or default_value if the key is not present or is not a number
+ */
+[[nodiscard]] long long get_int(const std::string &key, long long default_value);
+/**
+ * @brief Overrides the value of the key, as if it was read from configs.conf
+ */
+void set_value(const std::string &key, const std::string &value);
+
 } // namespace config
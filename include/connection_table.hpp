@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+/**
+ * @brief Stable reference to a connection stored in ConnectionTable
+ *
+ * Besides the index of the slot it stores the generation of the slot. Each time a slot
+ * is freed its generation is incremented, so a handle of a closed connection never refers
+ * to a connection that reused the slot later.
+ */
+struct ConnectionHandle {
+	uint32_t index = 0;
+	uint32_t generation = 0;
+
+	/**
+	 * @brief Packs the handle into a single integer that can be used as an event loop token
+	 */
+	[[nodiscard]] uint64_t token() const
+	{
+		return (static_cast<uint64_t>(generation) << 32) | index;
+	}
+
+	[[nodiscard]] static ConnectionHandle from_token(const uint64_t token)
+	{
+		return { static_cast<uint32_t>(token), static_cast<uint32_t>(token >> 32) };
+	}
+
+	auto operator<=>(const ConnectionHandle &other) const = default;
+};
+
+/**
+ * @brief Growable table of connections
+ *
+ * Slots are created on demand, up to the limit, and freed slots are reused through a
+ * free list. Each connection is allocated separately, so references to it stay valid while
+ * the table grows, and a freed slot doesn't hold any memory of the connection.
+ */
+template <typename T>
+class ConnectionTable {
+	struct Slot {
+		std::unique_ptr<T> value;
+		uint32_t generation = 0;
+	};
+
+	std::vector<Slot> m_slots;
+	std::vector<uint32_t> m_free_slots;
+	size_t m_size = 0;
+	size_t m_max_size = 0;
+
+public:
+	/**
+	 * @param max_size The maximum number of connections stored at the same time
+	 */
+	explicit ConnectionTable(const size_t max_size)
+		: m_max_size(max_size)
+	{
+	}
+
+	/**
+	 * @brief Creates a new default-constructed connection
+	 *
+	 * @return The handle of the connection or std::nullopt if the table is full
+	 */
+	[[nodiscard]] std::optional<ConnectionHandle> insert()
+	{
+		if (full())
+		{
+			return std::nullopt;
+		}
+
+		uint32_t index = 0;
+		if (!m_free_slots.empty())
+		{
+			index = m_free_slots.back();
+			m_free_slots.pop_back();
+		}
+		else
+		{
+			index = static_cast<uint32_t>(m_slots.size());
+			m_slots.emplace_back();
+		}
+
+		Slot &slot = m_slots[index];
+		slot.value = std::make_unique<T>();
+		++m_size;
+		return ConnectionHandle{ index, slot.generation };
+	}
+
+	/**
+	 * @brief Destroys the connection and frees its slot
+	 *
+	 * Erasing by a stale handle does nothing
+	 */
+	void erase(const ConnectionHandle handle)
+	{
+		if (get(handle) == nullptr)
+		{
+			return;
+		}
+		Slot &slot = m_slots[handle.index];
+		slot.value.reset();
+		++slot.generation;
+		m_free_slots.push_back(handle.index);
+		--m_size;
+	}
+
+	/**
+	 * @return The pointer to the connection or nullptr if the handle is stale
+	 */
+	[[nodiscard]] T *get(const ConnectionHandle handle)
+	{
+		if (handle.index >= m_slots.size())
+		{
+			return nullptr;
+		}
+		Slot &slot = m_slots[handle.index];
+		if (slot.generation != handle.generation)
+		{
+			return nullptr;
+		}
+		return slot.value.get();
+	}
+
+	/**
+	 * @brief Calls func(handle, connection) for every stored connection
+	 *
+	 * @note func must not insert or erase connections
+	 */
+	template <typename F>
+	void for_each(F &&func)
+	{
+		for (size_t i = 0; i < m_slots.size(); ++i)
+		{
+			Slot &slot = m_slots[i];
+			if (slot.value != nullptr)
+			{
+				func(ConnectionHandle{ static_cast<uint32_t>(i), slot.generation },
+				     *slot.value);
+			}
+		}
+	}
+
+	[[nodiscard]] size_t size() const
+	{
+		return m_size;
+	}
+
+	[[nodiscard]] size_t max_size() const
+	{
+		return m_max_size;
+	}
+
+	[[nodiscard]] bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	[[nodiscard]] bool full() const
+	{
+		return m_size >= m_max_size;
+	}
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "completion_queue.hpp"
+#include "piece.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Writes verified pieces to disk and reads them back off the event loop threads
+ *
+ * Pieces are written by a few worker threads with the function given to the constructor.
+ * Each reactor collects the pieces it submitted from its own CompletionQueue, whose
+ * descriptor should be registered in the loop as readable, and only then considers them
+ * downloaded.
+ *
+ * The queue is bounded softly: submit() never blocks, but once capacity pieces are waiting
+ * full() reports it, so that no new pieces are assigned to peers until the disk catches up.
+ *
+ * The same workers read the pieces peers request from us, so the reactors never wait for
+ * the disk. Reads are taken before writes, since a peer is waiting for them, and they don't
+ * count towards the capacity.
+ */
+class DiskWriter {
+public:
+	using WriteFunction = std::function<void(const ReceivedPiece &)>;
+	using PieceData = std::shared_ptr<const std::vector<uint8_t>>;
+	using ReadFunction = std::function<PieceData(size_t index)>;
+
+	struct Result {
+		ReceivedPiece piece;
+		// false if the write function has thrown
+		bool written = false;
+	};
+
+	struct Stats {
+		// pieces that are queued or being written
+		size_t depth = 0;
+		size_t max_depth = 0;
+		size_t pieces_written = 0;
+		size_t write_errors = 0;
+		// from submit() until the write is finished
+		std::chrono::nanoseconds total_latency{ 0 };
+		std::chrono::nanoseconds max_latency{ 0 };
+		// spent in the write function alone
+		std::chrono::nanoseconds total_write_time{ 0 };
+	};
+
+	struct ReadResult {
+		size_t index = 0;
+		// nullptr if the read function has thrown
+		PieceData data;
+	};
+
+	// results of the pieces submitted by a single reactor
+	using CompletionQueue = ::CompletionQueue<Result>;
+	using ReadQueue = ::CompletionQueue<ReadResult>;
+
+private:
+	struct Job {
+		ReceivedPiece piece;
+		CompletionQueue *queue = nullptr;
+		std::chrono::steady_clock::time_point submitted;
+	};
+
+	struct ReadJob {
+		size_t index = 0;
+		ReadQueue *queue = nullptr;
+	};
+
+	WriteFunction m_write;
+	ReadFunction m_read;
+	size_t m_capacity;
+
+	std::mutex m_mutex;
+	std::condition_variable_any m_cv;
+	std::deque<Job> m_jobs;
+	std::deque<ReadJob> m_reads;
+	Stats m_stats;
+	// full() has returned true since the queue was last below capacity
+	bool m_reported_full = false;
+	std::function<void()> m_on_available;
+
+	// must be the last member, so the workers are stopped before anything else is destroyed
+	std::vector<std::jthread> m_workers;
+
+	void work(std::stop_token stop);
+	void write(Job job);
+	void read(const ReadJob &job);
+
+public:
+	/**
+	 * @param threads The number of worker threads
+	 * @param capacity The number of pieces after which the queue is considered full
+	 * @param write Writes the piece, throws if it could not be written
+	 * @param read Reads the piece with the index, throws if it could not be read
+	 */
+	DiskWriter(size_t threads, size_t capacity, WriteFunction write, ReadFunction read = {});
+
+	DiskWriter(const DiskWriter &other) = delete;
+	DiskWriter &operator=(const DiskWriter &other) = delete;
+	DiskWriter(DiskWriter &&other) = delete;
+	DiskWriter &operator=(DiskWriter &&other) = delete;
+
+	/**
+	 * @brief Queues the piece for writing, even if the queue is full
+	 *
+	 * @param queue The queue the result will be delivered to. Must outlive the writer
+	 */
+	void submit(CompletionQueue &queue, ReceivedPiece piece);
+	/**
+	 * @brief Queues the piece for reading with the read function
+	 *
+	 * @param queue The queue the result will be delivered to. Must outlive the writer
+	 */
+	void submit_read(ReadQueue &queue, size_t index);
+	/**
+	 * @brief Returns true if there are capacity or more pieces waiting to be written
+	 */
+	[[nodiscard]] bool full();
+	/**
+	 * @brief Sets the function called once the queue drains after full() returned true
+	 *
+	 * Is called from a worker thread.
+	 */
+	void set_on_available(std::function<void()> on_available);
+	[[nodiscard]] Stats get_stats();
+};
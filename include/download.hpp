@@ -1,21 +1,45 @@
 #pragma once
 
 #include "announce_list.hpp"
+#include "connection_table.hpp"
+#include "disk_writer.hpp"
 #include "download_strategy.hpp"
+#include "event_loop.hpp"
 #include "file_handler.hpp"
+#include "file_layout.hpp"
+#include "hash_pool.hpp"
 #include "metainfo_file.hpp"
+#include "completion_queue.hpp"
 #include "peer_connection.hpp"
+#include "peer_listener.hpp"
 #include "peer_message.hpp"
 #include "piece.hpp"
+#include "piece_arena.hpp"
+#include "piece_cache.hpp"
+#include "recheck.hpp"
+#include "resolver.hpp"
+#include "resume_data.hpp"
+#include "storage.hpp"
+#include "timer_wheel.hpp"
 #include "tracker_connection.hpp"
 #include "utils.hpp"
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <map>
 #include <memory>
-#include <poll.h>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
+#include <stop_token>
 #include <string>
+#include <thread>
 #include <vector>
 
 struct Peer {
@@ -27,73 +51,323 @@ struct Peer {
 };
 
 class Download {
+	/**
+	 * @brief Reactor that owns a part of peer connections
+	 *
+	 * Every shard is served by its own thread. Connections never move between shards,
+	 * so they are accessed without any locks. The state shared between shards
+	 * is the strategy, our bitfield and the peer backlog.
+	 */
+	/**
+	 * @brief Piece requested by peers of a shard that is being read from the storage
+	 */
+	struct PendingRead {
+		// is only set while the waiting peers are served
+		PieceCache::Data data;
+		// tokens of the peers whose next request is for the piece
+		std::set<uint64_t> peers;
+	};
+
+	/**
+	 * @brief Peer routed to a shard by the listener
+	 */
+	struct IncomingPeer {
+		TCPClient socket;
+		std::array<uint8_t, message::Handshake::size> handshake{};
+	};
+
+	struct Shard {
+		// must outlive all the connections, since they unregister themselves on destruction
+		std::unique_ptr<EventLoop> loop = make_event_loop();
+		EventNotifier notifier;
+		ConnectionTable<PeerConnection> peer_connections;
+		// timers of peers are scheduled with ConnectionHandle::token() as a token
+		TimerWheel timers;
+		// pieces are submitted with ConnectionHandle::token() of the peer they came from
+		HashPool::CompletionQueue hashed_pieces;
+		// verified pieces, that are marked as downloaded once they are on disk
+		DiskWriter::CompletionQueue written_pieces;
+		// pieces read by the disk writer for the upload path
+		DiskWriter::ReadQueue read_pieces;
+		// pieces being read, by their indices
+		std::map<size_t, PendingRead> pending_reads;
+		// pieces verified by any shard, that peers of this shard should be told about
+		std::mutex have_mutex;
+		std::vector<size_t> have_pieces;
+		// incoming peers handed to the shard by the listener thread
+		CompletionQueue<IncomingPeer> incoming_peers;
+		// the connections and the incoming peers handed to the shard, see reserve_slot()
+		std::atomic<size_t> peers = 0;
+		const size_t max_peers;
+
+		explicit Shard(size_t max_peers);
+	};
+
+	// must be created before any thread is started, so that none of them gets the signals
+	ShutdownSignal m_shutdown_signal;
+	// stops the first shard, the others are stopped through their jthreads
+	std::stop_source m_stop_source;
+
 	std::array<uint8_t, utils::id_length> m_connection_id = utils::generate_connection_id();
 
 	MetainfoFile m_metainfo;
 	AnnounceList m_announce_list;
+	// is always DownloadStrategySynchronized, since it is shared between shards
 	std::unique_ptr<DownloadStrategy> m_dl_strategy;
 
 	message::Handshake m_handshake;
+	std::mutex m_bitfield_mutex;
 	message::Bitfield m_bitfield;
+	size_t m_pieces_have = 0;
+	// block bytes queued for all the peers
+	std::atomic<size_t> m_bytes_uploaded = 0;
+	size_t m_uploaded_at_last_report = 0;
+	std::chrono::steady_clock::time_point m_last_report = std::chrono::steady_clock::now();
+
+	static constexpr long long m_default_resume_interval = 60;
+	std::mutex m_resume_mutex;
+	// the number of pieces in the last saved record
+	size_t m_pieces_saved = 0;
 
 	std::vector<FileHandler> m_dl_layout;
+	// where the pieces lie in the files, shared by the recheck and the storage
+	FileLayout m_layout;
+	// is created once the files are, the backend is picked by the config
+	std::unique_ptr<Storage> m_storage;
+	static constexpr long long m_default_upload_cache = 64; // in MiB
+	// verified pieces for the upload path, filled by read-ahead once a peer requests them
+	PieceCache m_piece_cache;
+	// cached blocks are sent with MSG_ZEROCOPY instead of being copied into send buffers
+	bool m_zerocopy;
+	std::mutex m_backlog_mutex;
 	std::set<Peer> m_peer_backlog;
 	std::set<Peer> m_peers_in_use_or_banned;
 	// std::vector<ReceivedPiece> m_pieces;
 
 	long long m_last_piece_size = 0;
 
-	static constexpr int m_max_peers = 10;
+	static constexpr long long m_default_piece_memory = 256; // in MiB
+	// buffers of the pieces being downloaded, no new pieces are assigned once it is exhausted
+	PieceArena m_piece_arena;
+
+	static constexpr long long m_default_max_peers = 50;
+	std::atomic<size_t> m_connected_peers = 0;
+	// is owned by the process, nullptr if no connections are accepted
+	PeerListener *m_listener;
+	// the port announced to the tracker, 0 if there is none
+	uint16_t m_listen_port = 0;
 
 	static constexpr long long m_timeout_on_failure = 300;
+	static constexpr long long m_tracker_response_timeout = 15;
 
-	std::vector<PeerConnection> m_peer_connections{ m_max_peers };
+	enum class Timers : uint32_t {
+		KEEPALIVE,
+		CONNECT,
+		REQUEST,
+		ANNOUNCE,
+		TRACKER_RESPONSE,
+		SAVE_RESUME,
+	};
+
+	// peers are reported by the loop with ConnectionHandle::token() as a token
+	static constexpr uint64_t m_tracker_token = std::numeric_limits<uint64_t>::max();
+	static constexpr uint64_t m_wakeup_token = std::numeric_limits<uint64_t>::max() - 1;
+	static constexpr uint64_t m_resolver_token = std::numeric_limits<uint64_t>::max() - 2;
+	static constexpr uint64_t m_hash_token = std::numeric_limits<uint64_t>::max() - 3;
+	static constexpr uint64_t m_signal_token = std::numeric_limits<uint64_t>::max() - 4;
+	static constexpr uint64_t m_resume_token = std::numeric_limits<uint64_t>::max() - 5;
+	static constexpr uint64_t m_write_token = std::numeric_limits<uint64_t>::max() - 6;
+	static constexpr uint64_t m_incoming_token = std::numeric_limits<uint64_t>::max() - 7;
+	static constexpr uint64_t m_read_token = std::numeric_limits<uint64_t>::max() - 8;
+
+	// lookups are only started and finished by the first shard
+	Resolver m_resolver;
+	static constexpr uint64_t m_tracker_lookup_id = 0;
+	uint64_t m_next_lookup_id = m_tracker_lookup_id + 1;
+	std::map<uint64_t, Peer> m_resolving_peers;
+
+	std::vector<std::unique_ptr<Shard>> m_shards;
+	// is registered in the loop of the first shard
 	TrackerConnection m_tracker_connection;
-	// m_fds.back() is tracker pollfd
-	std::vector<struct pollfd> m_fds{ m_max_peers + 1, { -1, 0, 0 } };
+	EventRegistration m_resolver_registration;
+	// scheduled in the timers of the first shard
+	TimerHandle m_announce_timer;
+	TimerHandle m_tracker_response_timer;
+	// must be destroyed before the shards, since it delivers results to their queues
+	HashPool m_hash_pool;
+	static constexpr long long m_default_disk_queue = 16;
+	// must be destroyed before the shards and the files, for the same reason
+	DiskWriter m_disk_writer;
+	// shard 0 is served by the thread that called start()
+	std::vector<std::jthread> m_threads;
 
 	// general methods
 
 	void create_download_layout();
+	/**
+	 * @brief Marks the pieces that are already on disk as downloaded
+	 *
+	 * The pieces are taken from the fast-resume record, only the files that changed since
+	 * it was saved are verified. They are verified by "recheck_threads" threads, all
+	 * the cores by default.
+	 */
 	void check_layout();
+	[[nodiscard]] std::vector<std::filesystem::path> file_paths() const;
+	[[nodiscard]] std::filesystem::path resume_data_path() const;
+	/**
+	 * @brief Writes the fast-resume record if pieces were added since the last one
+	 *
+	 * Can be called from any shard.
+	 */
+	void save_resume_data();
 	void preallocate_files();
+	/**
+	 * @brief Creates the storage the pieces are written to, after the files are created
+	 */
+	void create_storage();
 	[[nodiscard]] size_t number_of_pieces() const;
 	static void copy_metainfo_file_to_cache(const std::string &path_to_torrent);
+	void create_shards();
+	/**
+	 * @brief Takes a slot of the shard for a new connection, can be called from any thread
+	 *
+	 * @return false if the shard is full
+	 */
+	[[nodiscard]] static bool reserve_slot(Shard &shard);
+	/**
+	 * @brief Hands the peer routed by the listener to the shard with the most free slots
+	 *
+	 * Is called on the thread of the listener. The peer is closed if every shard is full.
+	 */
+	void route_incoming_peer(TCPClient socket, std::span<const uint8_t> handshake);
+
+	[[nodiscard]] message::Bitfield copy_bitfield();
+	/**
+	 * @return false if the piece was already marked
+	 */
+	bool set_piece_as_have(size_t index);
+	[[nodiscard]] bool has_piece(size_t index);
 
 	// async methods
 
 	[[nodiscard]] bool has_peers_connected() const;
 
-	void handshake_cb(size_t index, std::span<const uint8_t> view);
-	void keepalive_cb(size_t index, std::span<const uint8_t> view);
-	void choke_cb(size_t index, std::span<const uint8_t> view);
-	void unchoke_cb(size_t index, std::span<const uint8_t> view);
-	void interested_cb(size_t index, std::span<const uint8_t> view);
-	void notinterested_cb(size_t index, std::span<const uint8_t> view);
-	void have_cb(size_t index, std::span<const uint8_t> view);
-	void bitfield_cb(size_t index, std::span<const uint8_t> view);
-	void request_cb(size_t index, std::span<const uint8_t> view);
-	void block_cb(size_t index, std::span<const uint8_t> view);
-	void cancel_cb(size_t index, std::span<const uint8_t> view);
-	void port_cb(size_t index, std::span<const uint8_t> view);
-
-	void peer_callback(size_t index);
+	void handshake_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void keepalive_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void choke_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void unchoke_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void interested_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void notinterested_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void have_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void bitfield_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void request_cb(Shard &shard, ConnectionHandle handle, PeerConnection &conn,
+			std::span<const uint8_t> view);
+	/**
+	 * @brief Queues the requested blocks for the peer, while its send queue has room
+	 *
+	 * The blocks are sent from the piece cache. On a miss the whole piece is read into the
+	 * cache by the disk writer, since the peer is likely to request the rest of it, and
+	 * the peer is served again from read_callback(). Without the cache the blocks are sent
+	 * straight from the files.
+	 *
+	 * @return true if any block was queued
+	 */
+	bool serve_uploads(Shard &shard, ConnectionHandle handle, PeerConnection &conn);
+	/**
+	 * @brief Caches the pieces read for the upload path and serves the peers waiting for them
+	 */
+	void read_callback(Shard &shard);
+	void block_cb(Shard &shard, ConnectionHandle handle, PeerConnection &conn,
+		      std::span<const uint8_t> view);
+	void cancel_cb(PeerConnection &conn, std::span<const uint8_t> view);
+	void port_cb(PeerConnection &conn, std::span<const uint8_t> view);
+
+	void peer_callback(Shard &shard, ConnectionHandle handle, PeerConnection &conn,
+			   std::span<const uint8_t> view);
+	/**
+	 * @brief Asks the strategy for the next piece and requests it from the peer
+	 *
+	 * @return true if the requests were placed into the queue
+	 */
+	[[nodiscard]] bool assign_next_piece(PeerConnection &conn);
+	/**
+	 * @brief Assigns pieces to the peers that were left idle because of the memory budget
+	 */
+	void resume_idle_peers(Shard &shard);
+	/**
+	 * @brief Passes the verified pieces to the disk writer
+	 */
+	void hash_callback(Shard &shard);
+	/**
+	 * @brief Marks the pieces that are on disk as downloaded and tells every shard about them
+	 */
+	void write_callback(Shard &shard);
+	/**
+	 * @brief Logs the upload rate and the disk writer stats, is called by the first shard
+	 */
+	void report_stats();
+	/**
+	 * @brief Sends Have for the pieces verified since the last call to the peers of the shard
+	 */
+	void broadcast_haves(Shard &shard);
 	void tracker_callback();
+	void resolver_callback();
 
-	void proceed_peer(size_t index);
-	void proceed_tracker();
+	void proceed_peer(Shard &shard, ConnectionHandle handle, PeerConnection &conn,
+			  const EventLoop::Event &event);
+	void proceed_tracker(uint32_t events);
 
 	void add_peers_to_backlog(std::vector<struct Peer> &peer_addrs);
-	void connect_to_peer(size_t index);
+	[[nodiscard]] std::optional<Peer> take_peer_from_backlog();
+	[[nodiscard]] bool connect_to_peer(Shard &shard);
+	void connect_to_free_slots(Shard &shard);
+	/**
+	 * @brief Takes the peers routed to the shard, and processes the handshakes they sent
+	 */
+	void accept_peers(Shard &shard);
+	static void schedule_peer_timers(Shard &shard, uint64_t token);
+	void disconnect_peer(Shard &shard, ConnectionHandle handle);
+	void resolve_peer_addresses(std::vector<Peer> &peers);
+	[[nodiscard]] bool connect_to_current_tracker(std::span<const Endpoint> endpoints);
 	void connect_to_tracker();
+	void tracker_failed();
 
-	void update_time_peer(size_t index);
-	void update_time_tracker();
+	static TimerHandle schedule_timer(Shard &shard, std::chrono::seconds delay, uint64_t token,
+					  Timers type);
+	void schedule_announce(long long seconds);
+	void schedule_resume_save();
+	void timer_callback(Shard &shard, TimerWheel::Timer timer);
+	void peer_timer_callback(Shard &shard, PeerConnection &conn, uint64_t token, Timers type);
+	void tracker_timer_callback(Timers type);
 
-	void poll();
+	void poll(Shard &shard);
+	void run(Shard &shard, std::stop_token stop);
 
 public:
-	explicit Download(const std::string &path_to_torrent);
+	/**
+	 * @param listener The listener of the process, which routes the incoming peers of the
+	 * torrent to the download. Must outlive the download. No peers are accepted without it
+	 */
+	explicit Download(const std::string &path_to_torrent, PeerListener *listener = nullptr);
+
+	Download(const Download &other) = delete;
+	Download &operator=(const Download &other) = delete;
+	Download(Download &&other) = delete;
+	Download &operator=(Download &&other) = delete;
+
+	~Download();
 
+	/**
+	 * @brief Starts the download
+	 *
+	 * Spawns a thread for every shard but the first one, which is served by the calling
+	 * thread. The number of shards is set with "threads" config key and defaults to
+	 * the number of cores. Returns after SIGINT or SIGTERM, once the fast-resume record
+	 * is saved.
+	 */
 	void start();
+	/**
+	 * @brief Makes start() return as if SIGINT was received. Can be called from any thread
+	 */
+	void stop();
 };
@@ -5,6 +5,8 @@
 
 #include <cstddef>
 #include <cstdlib>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 
@@ -47,3 +49,26 @@ public:
 	void mark_as_downloaded(size_t index) override;
 	void mark_as_discarded(size_t index) override;
 };
+
+/**
+ * @brief Thread-safe wrapper around any other strategy
+ *
+ * Reactor threads share a single strategy through this class. Every call is performed
+ * under the same lock, so each of them is atomic relative to the others.
+ */
+class DownloadStrategySynchronized : public DownloadStrategy {
+private:
+	std::unique_ptr<DownloadStrategy> m_strategy;
+	std::mutex m_mutex;
+
+public:
+	explicit DownloadStrategySynchronized(std::unique_ptr<DownloadStrategy> strategy);
+
+	bool have_missing_pieces(const message::Bitfield &bitfield) override;
+	bool is_piece_missing(const message::Have &have) override;
+
+	[[nodiscard]] tl::expected<size_t, ReturnStatus>
+	next_piece_to_dl(const message::Bitfield &bitfield) override;
+	void mark_as_downloaded(size_t index) override;
+	void mark_as_discarded(size_t index) override;
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <sys/epoll.h>
+#include <vector>
+
+/**
+ * @brief Edge-triggered readiness reactor
+ *
+ * Every file descriptor is registered together with an opaque token that is handed back
+ * when the descriptor becomes ready, so the owner can find the corresponding connection
+ * without scanning all of them.
+ *
+ * All descriptors are registered in edge-triggered mode. This means that after getting
+ * an event the owner must read (or write) until the call would block, otherwise
+ * it will not be notified again.
+ */
+class EventLoop {
+public:
+	static constexpr uint32_t readable = EPOLLIN;
+	static constexpr uint32_t writable = EPOLLOUT;
+	static constexpr uint32_t error = EPOLLERR | EPOLLHUP;
+	// only reported by the loops that perform the I/O, see performs_io()
+	static constexpr uint32_t received = 1U << 16;
+	static constexpr uint32_t sent = 1U << 17;
+
+	struct Event {
+		uint64_t token;
+		uint32_t events;
+		// the bytes the loop received or sent for the owner, is only set with received
+		// or sent. Is valid until the next wait() call
+		std::span<const uint8_t> data{};
+	};
+
+	/**
+	 * @brief Starts watching the file descriptor
+	 *
+	 * @param fd The file descriptor to watch
+	 * @param token The value that will be returned with every event of this descriptor
+	 * @param events The combination of readable and writable flags
+	 * @throws std::runtime_error If the descriptor could not be registered
+	 */
+	virtual void add(int fd, uint64_t token, uint32_t events) = 0;
+	/**
+	 * @brief Changes the set of events the owner of descriptor is interested in
+	 *
+	 * @note If the descriptor is already ready for any of the new events, the event will be
+	 * reported by the next wait() call even though this loop is edge-triggered
+	 * @throws std::runtime_error If the registration could not be changed
+	 */
+	virtual void modify(int fd, uint64_t token, uint32_t events) = 0;
+	/**
+	 * @brief Stops watching the file descriptor
+	 *
+	 * Removing a descriptor that is not registered is not an error
+	 */
+	virtual void remove(int fd) = 0;
+	/**
+	 * @brief Waits until some descriptors are ready or timeout expires
+	 *
+	 * @param timeout_ms Timeout in milliseconds, -1 means infinite timeout
+	 * @return The span of ready events. It is valid until the next call to wait()
+	 * @throws std::runtime_error If waiting failed
+	 */
+	[[nodiscard]] virtual std::span<const Event> wait(int timeout_ms) = 0;
+
+	/**
+	 * @brief Checks whether the loop can receive and send by itself
+	 *
+	 * Such a loop takes the syscalls off the owners of the sockets: the data is received
+	 * into the buffers of the loop and sends are queued with the next wait(), so a
+	 * single syscall serves every socket of the loop.
+	 */
+	[[nodiscard]] virtual bool performs_io() const;
+	/**
+	 * @brief Receives from the socket by the loop until it is removed
+	 *
+	 * The socket is not reported readable anymore. Instead, every chunk of data comes with
+	 * a received event, and a closed or failed connection is reported with an error event.
+	 *
+	 * @throws std::logic_error If the loop doesn't perform the I/O
+	 */
+	virtual void receive(int fd);
+	/**
+	 * @brief Sends the data from the socket by the loop
+	 *
+	 * The send is reported with a sent event that holds the part of the data that was
+	 * sent, which may be shorter than the whole. A failure is reported with an error
+	 * event. Only one send of a descriptor may be in progress.
+	 *
+	 * @param owner Keeps the data alive until the kernel is done with it, which may be
+	 * after the descriptor is removed
+	 * @throws std::logic_error If the loop doesn't perform the I/O
+	 */
+	virtual void send(int fd, std::shared_ptr<const void> owner,
+			  std::span<const uint8_t> data);
+
+	virtual ~EventLoop() = default;
+};
+
+/**
+ * @brief EventLoop implemented with epoll
+ *
+ * This is the default backend that is always available
+ */
+class EpollEventLoop final : public EventLoop {
+	int m_epfd = -1;
+
+	std::vector<struct epoll_event> m_epoll_events;
+	std::vector<Event> m_ready;
+
+public:
+	/**
+	 * @brief Creates a new epoll instance
+	 *
+	 * @param max_events The maximum amount of events returned by a single wait() call
+	 * @throws std::runtime_error If epoll instance could not be created
+	 */
+	explicit EpollEventLoop(size_t max_events = 256);
+
+	EpollEventLoop(const EpollEventLoop &other) = delete;
+	EpollEventLoop &operator=(const EpollEventLoop &other) = delete;
+	EpollEventLoop(EpollEventLoop &&other) = delete;
+	EpollEventLoop &operator=(EpollEventLoop &&other) = delete;
+
+	void add(int fd, uint64_t token, uint32_t events) override;
+	void modify(int fd, uint64_t token, uint32_t events) override;
+	void remove(int fd) override;
+	[[nodiscard]] std::span<const Event> wait(int timeout_ms) override;
+
+	~EpollEventLoop() override;
+};
+
+/**
+ * @brief Creates the event loop backend selected with "event_loop" config key
+ *
+ * Possible values are "epoll" (default) and "io_uring". The latter is only available
+ * if the application was built with USE_IO_URING option. If io_uring can't be set up
+ * on this host, epoll is used instead.
+ */
+[[nodiscard]] std::unique_ptr<EventLoop> make_event_loop();
+
+/**
+ * @brief Registration of a single file descriptor in the EventLoop
+ *
+ * Connections use it to tell the loop which events they are interested in. It remembers
+ * the current interest, so epoll is only touched when the interest actually changes.
+ */
+class EventRegistration {
+	EventLoop *m_loop = nullptr;
+	int m_fd = -1;
+	uint64_t m_token = 0;
+	uint32_t m_events = 0;
+
+public:
+	EventRegistration() = default;
+
+	EventRegistration(const EventRegistration &other) = delete;
+	EventRegistration &operator=(const EventRegistration &other) = delete;
+
+	EventRegistration(EventRegistration &&other) noexcept;
+	EventRegistration &operator=(EventRegistration &&other) noexcept;
+
+	/**
+	 * @brief Registers the descriptor in the loop, detaching the previous one if needed
+	 */
+	void attach(EventLoop &loop, int fd, uint64_t token, uint32_t events);
+	/**
+	 * @brief Replaces the set of events the owner is interested in
+	 */
+	void set_events(uint32_t events);
+	/**
+	 * @brief Unregisters the descriptor. Must be called before the descriptor is closed
+	 */
+	void detach();
+
+	[[nodiscard]] bool attached() const;
+	/**
+	 * @brief Checks whether the loop receives and sends for the owner, see
+	 * EventLoop::performs_io()
+	 */
+	[[nodiscard]] bool performs_io() const;
+	/**
+	 * @brief Makes the loop receive from the descriptor, see EventLoop::receive()
+	 */
+	void receive();
+	/**
+	 * @brief Makes the loop send the data, see EventLoop::send()
+	 */
+	void send(std::shared_ptr<const void> owner, std::span<const uint8_t> data);
+
+	~EventRegistration();
+};
+
+/**
+ * @brief Wakes up an EventLoop from another thread
+ *
+ * RAII wrapper around eventfd. The descriptor should be registered in the loop as readable.
+ * Any number of notify() calls made before the loop wakes up result in a single event.
+ */
+class EventNotifier {
+	int m_fd = -1;
+
+public:
+	/**
+	 * @throws std::runtime_error If eventfd could not be created
+	 */
+	EventNotifier();
+
+	EventNotifier(const EventNotifier &other) = delete;
+	EventNotifier &operator=(const EventNotifier &other) = delete;
+	EventNotifier(EventNotifier &&other) = delete;
+	EventNotifier &operator=(EventNotifier &&other) = delete;
+
+	/**
+	 * @brief Makes the descriptor readable. Can be called from any thread
+	 */
+	void notify() const;
+	/**
+	 * @brief Resets the descriptor. Must be called by the loop thread after every event
+	 */
+	void drain() const;
+
+	[[nodiscard]] int get_fd() const;
+
+	~EventNotifier();
+};
+
+/**
+ * @brief Delivers termination signals to an EventLoop
+ *
+ * RAII wrapper around signalfd for SIGINT and SIGTERM. The signals are blocked in the thread
+ * that creates the object, and the threads started by it afterwards inherit the mask, so it
+ * must be created before any other thread. The descriptor should be registered in the loop
+ * as readable.
+ */
+class ShutdownSignal {
+	int m_fd = -1;
+
+public:
+	/**
+	 * @throws std::runtime_error If signalfd could not be created
+	 */
+	ShutdownSignal();
+
+	ShutdownSignal(const ShutdownSignal &other) = delete;
+	ShutdownSignal &operator=(const ShutdownSignal &other) = delete;
+	ShutdownSignal(ShutdownSignal &&other) = delete;
+	ShutdownSignal &operator=(ShutdownSignal &&other) = delete;
+
+	/**
+	 * @brief Reads the pending signals
+	 *
+	 * @return true if a signal was received
+	 */
+	[[nodiscard]] bool drain() const;
+
+	[[nodiscard]] int get_fd() const;
+
+	~ShutdownSignal();
+};
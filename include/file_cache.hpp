@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Descriptor of a file opened for reading and writing
+ *
+ * The descriptor is closed on destruction.
+ */
+class OpenFile {
+	int m_fd = -1;
+
+public:
+	/**
+	 * @brief Opens the file, creating it if it doesn't exist
+	 *
+	 * @param flags Added to the flags of open(), such as O_DIRECT
+	 * @throws std::system_error If the file could not be opened
+	 */
+	explicit OpenFile(const std::filesystem::path &path, int flags = 0);
+
+	OpenFile(const OpenFile &other) = delete;
+	OpenFile &operator=(const OpenFile &other) = delete;
+	OpenFile(OpenFile &&other) = delete;
+	OpenFile &operator=(OpenFile &&other) = delete;
+
+	[[nodiscard]] int get_fd() const;
+
+	~OpenFile();
+};
+
+/**
+ * @brief Keeps the recently used files open
+ *
+ * Files are looked up by path and the least recently used one is closed once there are
+ * more than capacity of them. A file handed out stays open until its last user releases
+ * it, even if the cache has already dropped it, so files can be used from several threads.
+ *
+ * All the methods are thread-safe.
+ */
+class FileCache {
+	using Entry = std::pair<std::string, std::shared_ptr<OpenFile>>;
+
+	size_t m_capacity;
+	int m_flags;
+
+	std::mutex m_mutex;
+	// the most recently used file is at the front
+	std::list<Entry> m_lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+
+public:
+	/**
+	 * @param capacity The maximum number of files kept open
+	 * @param flags Added to the flags every file is opened with
+	 */
+	explicit FileCache(size_t capacity, int flags = 0);
+
+	FileCache(const FileCache &other) = delete;
+	FileCache &operator=(const FileCache &other) = delete;
+	FileCache(FileCache &&other) = delete;
+	FileCache &operator=(FileCache &&other) = delete;
+
+	/**
+	 * @brief Returns the open file, opening it if it is not in the cache
+	 *
+	 * @throws std::system_error If the file could not be opened
+	 */
+	[[nodiscard]] std::shared_ptr<OpenFile> open(const std::filesystem::path &path);
+	/**
+	 * @brief Closes every file that is not in use
+	 */
+	void clear();
+};
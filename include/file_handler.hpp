@@ -1,9 +1,8 @@
 #pragma once
 
 #include "metainfo_file.hpp"
-#include "piece.hpp"
 
-#include <set>
+#include <filesystem>
 
 /**
  * @brief Class for doing file i/o
@@ -13,27 +12,29 @@
 class FileHandler {
 private:
 	FileInfo m_fileinfo;
-	std::set<size_t> m_pieces;
-	long long m_left_offset;
-	long long m_right_offset;
 
 public:
-	FileHandler(FileInfo fileinfo, std::set<size_t> pieces, long long left_offset,
-		    long long right_offset);
+	enum class Preallocation {
+		// the file is created by the first write
+		NONE,
+		// the file gets its final size without any disk space
+		SPARSE,
+		// all the disk space of the file is reserved up front
+		FULL,
+	};
 
-	void mark_as_last_file();
+	explicit FileHandler(FileInfo fileinfo);
 
+	[[nodiscard]] const FileInfo &get_fileinfo() const;
 	/**
-	 * @return -1 if given piece is to the left to the file, 
-	 * 0 if piece is part of the file, 
-	 * 1 if piece is to the right to the file
+	 * @brief Creates the file and the directories it is in
+	 *
+	 * In FULL mode the space is also reserved for a file that already exists, its data is
+	 * kept.
+	 *
+	 * @return false if FULL was asked for, but the filesystem can't reserve space,
+	 * so the file is left sparse
+	 * @throws std::system_error If there is not enough space for the file
 	 */
-	[[nodiscard]] int is_piece_part_of_file(size_t index) const;
-	void preallocate_file(const std::filesystem::path &fdir_path) const;
-	std::tuple<bool, size_t> read_piece(size_t index, std::vector<uint8_t> &piece,
-					    const std::filesystem::path &fdir_path,
-					    size_t piece_length) const;
-
-	void write_piece(const ReceivedPiece &piece, const std::filesystem::path &fdir_path,
-			 size_t piece_length) const;
+	bool preallocate_file(const std::filesystem::path &fdir_path, Preallocation mode) const;
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Places the files of the torrent in its contiguous range of bytes
+ *
+ * The torrent is seen as one range of bytes that is split between the files in their order.
+ * Since the files are ordered by their offsets, the files of any range are found in
+ * O(log files).
+ */
+class FileLayout {
+public:
+	struct File {
+		std::filesystem::path path;
+		// offset of the first byte of the file in the whole torrent
+		size_t offset = 0;
+		size_t length = 0;
+	};
+
+	/**
+	 * @brief A part of a range of the torrent that lies within a single file
+	 */
+	struct Extent {
+		size_t file = 0;
+		// offset in the file
+		size_t offset = 0;
+		size_t length = 0;
+	};
+
+private:
+	std::vector<File> m_files;
+	size_t m_piece_length = 0;
+	size_t m_length = 0;
+
+public:
+	FileLayout() = default;
+	/**
+	 * @param files The files in the order of the torrent, each starts where the previous ends
+	 */
+	FileLayout(std::vector<File> files, size_t piece_length);
+
+	[[nodiscard]] const std::vector<File> &files() const;
+	[[nodiscard]] size_t piece_length() const;
+	/**
+	 * @brief Returns the length of the whole torrent
+	 */
+	[[nodiscard]] size_t length() const;
+
+	/**
+	 * @brief Returns the files [first, last) that overlap the range [begin, end)
+	 *
+	 * Empty files are only included if they lie between two files of the range.
+	 */
+	[[nodiscard]] std::pair<size_t, size_t> files_of(size_t begin, size_t end) const;
+	/**
+	 * @brief Splits the range of the torrent between the files it spans, skipping empty files
+	 */
+	[[nodiscard]] std::vector<Extent> extents_of(size_t offset, size_t length) const;
+	/**
+	 * @brief Returns the first and the last piece the file overlaps
+	 *
+	 * An empty file is in the piece it would start in.
+	 */
+	[[nodiscard]] std::pair<size_t, size_t> pieces_of(size_t file) const;
+};
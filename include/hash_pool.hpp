@@ -0,0 +1,133 @@
+#pragma once
+
+#include "completion_queue.hpp"
+#include "piece.hpp"
+#include "piece_arena.hpp"
+#include "sha1.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Hashes the pieces off the event loop threads
+ *
+ * Every block of a piece is queued for hashing as soon as it joins the hashed part, so
+ * the reactors never run SHA1. All the parts of a piece go to the same worker, which
+ * hashes them in order with a context it keeps for the piece. The contexts are reused
+ * for the next pieces, so none are created once every worker has as many as it has
+ * pieces in flight.
+ *
+ * Once a piece is complete the worker hashes what is left and finishes the digest. Each
+ * reactor collects the results of the pieces it submitted from its own CompletionQueue,
+ * whose descriptor should be registered in the loop as readable.
+ */
+class HashPool {
+public:
+	struct Result {
+		ReceivedPiece piece;
+		std::string sha1;
+		// the value given to submit(), identifies the peer the piece came from
+		uint64_t token = 0;
+	};
+
+	// results of the pieces submitted by a single reactor
+	using CompletionQueue = ::CompletionQueue<Result>;
+
+private:
+	struct Job {
+		uint64_t stream = 0;
+		// keeps the buffer of the part alive, is only set for the parts
+		std::shared_ptr<const PieceBuffer> buffer;
+		std::span<const uint8_t> part;
+		// the completed piece, is only set for the last job of the piece
+		ReceivedPiece piece;
+		uint64_t token = 0;
+		CompletionQueue *queue = nullptr;
+	};
+
+	struct Stream {
+		sha1::Context context;
+		// the piece is discarded once it expires, unless it was submitted
+		std::weak_ptr<const PieceBuffer> buffer;
+	};
+
+	struct Worker {
+		std::mutex mutex;
+		std::condition_variable_any cv;
+		std::deque<Job> jobs;
+
+		// are only touched by the thread of the worker
+		std::map<uint64_t, Stream> streams;
+		std::vector<sha1::Context> spare_contexts;
+
+		// must be the last member, so the thread is stopped before the state is destroyed
+		std::jthread thread;
+	};
+
+	// 0 is left for the pieces that are not hashed as their blocks arrive
+	std::atomic<uint64_t> m_next_stream = 1;
+	// the pieces without a stream are spread over the workers one by one
+	std::atomic<size_t> m_next_worker = 0;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	[[nodiscard]] Worker &worker_of(uint64_t stream);
+	static void push(Worker &worker, Job &&job);
+	/**
+	 * @brief Waits for a job of the worker
+	 *
+	 * The contexts of the pieces that were discarded are taken back before waiting.
+	 *
+	 * @return The job or nothing if the pool is being stopped
+	 */
+	[[nodiscard]] static std::optional<Job> take_job(Worker &worker, std::stop_token stop);
+	/**
+	 * @brief Returns the context of the piece, a spare one is taken for a new piece
+	 */
+	[[nodiscard]] static Stream &stream_of(Worker &worker, uint64_t stream);
+	/**
+	 * @brief Makes the context of the piece spare
+	 */
+	static void close_stream(Worker &worker, uint64_t stream);
+	static void work(Worker &worker, std::stop_token stop);
+
+public:
+	/**
+	 * @param threads The number of worker threads
+	 */
+	explicit HashPool(size_t threads);
+
+	HashPool(const HashPool &other) = delete;
+	HashPool &operator=(const HashPool &other) = delete;
+	HashPool(HashPool &&other) = delete;
+	HashPool &operator=(HashPool &&other) = delete;
+
+	/**
+	 * @brief Returns the identifier of a new piece, is called by ReceivedPiece
+	 */
+	[[nodiscard]] uint64_t open_stream();
+	/**
+	 * @brief Queues the part of the piece for hashing, is called by ReceivedPiece
+	 *
+	 * The parts of a piece are hashed in the order they are queued.
+	 */
+	void update(const ReceivedPiece &piece, size_t begin, size_t length);
+	/**
+	 * @brief Queues the completed piece, so its digest is finished
+	 *
+	 * @param queue The queue the result will be delivered to. Must outlive the pool
+	 * @param token The value the result will be reported with
+	 */
+	void submit(CompletionQueue &queue, ReceivedPiece piece, uint64_t token);
+};
@@ -1,16 +1,23 @@
 #pragma once
 
+#include "byte_buffer.hpp"
+#include "event_loop.hpp"
 #include "peer_message.hpp"
 #include "piece.hpp"
 #include "socket.hpp"
+#include "storage.hpp"
 
-#include <chrono>
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <deque>
 #include <memory>
+#include <optional>
 #include <set>
 #include <span>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 class RequestQueue {
@@ -28,7 +35,11 @@ public:
 	void reset();
 	void create_requests_for_piece(size_t index, size_t size);
 	[[nodiscard]] int send_request(class PeerConnection *parent);
-	[[nodiscard]] int validate_block(const message::Piece &block);
+	/**
+	 * @brief Checks whether the block is the one that should come next
+	 */
+	[[nodiscard]] bool is_expected(const message::PieceHeader &block) const;
+	[[nodiscard]] int validate_block(const message::PieceHeader &block);
 	[[nodiscard]] std::set<std::size_t> assigned_pieces() const;
 	[[nodiscard]] bool empty() const;
 };
@@ -38,38 +49,152 @@ class PeerConnection {
 
 public:
 	static constexpr size_t max_block_size = RequestQueue::max_block_size;
-	static constexpr size_t recv_buffer_size = 4 + 1 + 4 + 4 + max_block_size;
+	// the biggest message we expect, apart from Bitfield
+	static constexpr size_t max_message_size = 4 + 1 + 4 + 4 + max_block_size;
+	// fits several blocks, so a single recv() may bring a lot of messages
+	static constexpr size_t recv_buffer_size = 4 * max_message_size;
+	// fits a lot of small messages, only Bitfield may need more
+	static constexpr size_t send_buffer_size = 4096;
 	static constexpr int keepalive_timeout = 115; // in seconds
+	static constexpr int connect_timeout = 10; // in seconds
+	static constexpr int request_timeout = 30; // in seconds
+	// requests the peer may have queued with us, more is a protocol violation
+	static constexpr size_t max_upload_queue = 256;
+	// uploads are only read into the send buffer while it holds less than this, so
+	// requests stay cancellable until the socket is ready to take them
+	static constexpr size_t upload_watermark = 4 * max_message_size;
 
 private:
 	enum class States {
 		HANDSHAKE,
-		LENGTH,
 		MESSAGE,
+		// in the middle of a block that is received straight into its piece
+		BLOCK,
 	};
 
 	TCPClient m_socket;
+	EventRegistration m_registration;
 
 	States m_state = States::HANDSHAKE;
 
-	std::vector<uint8_t> m_recv_buffer = std::vector<uint8_t>(recv_buffer_size);
-	size_t m_recv_offset = 0;
-	uint32_t m_message_length = 0;
+	ByteBuffer m_recv_buffer{ recv_buffer_size };
+	// Bitfield may be bigger than any other message on large torrents
+	size_t m_max_message_size = max_message_size;
 
-	std::deque<std::unique_ptr<message::Message>> m_send_queue;
-	size_t m_send_offset = 0;
+	// messages are serialized into it as soon as they are queued
+	ByteBuffer m_send_buffer{ send_buffer_size };
 
-	std::chrono::steady_clock::time_point m_tp = std::chrono::steady_clock::now();
+	// the loop receives and sends for the connection, see EventLoop::performs_io()
+	bool m_loop_io = false;
+	// the data the loop received that is not taken by recv() yet, is valid until the next wait
+	std::span<const uint8_t> m_received;
+	// the bytes of the send buffer the loop is sending, are swapped in once it is empty.
+	// Is shared with the loop, which keeps it alive until the send is completed
+	std::shared_ptr<ByteBuffer> m_sending = std::make_shared<ByteBuffer>(send_buffer_size);
+	bool m_send_in_flight = false;
 
 	RequestQueue m_request_queue;
 	static constexpr size_t m_allowed_failures = 4;
 	size_t m_failures = 0;
-	ReceivedPiece m_assigned_piece;
+	size_t m_blocks_received = 0;
+	size_t m_blocks_at_last_check = 0;
+	// there are two pieces when requests for the next one are sent before the current one is done
+	std::deque<ReceivedPiece> m_assigned_pieces;
+	// the header of the block being received and the part of the piece it still has to fill
+	message::PieceHeader m_block_header;
+	std::span<uint8_t> m_block;
 
+	bool m_handshake_sent = false;
 	bool m_am_interested = false;
 	bool m_peer_choking = true;
 
-	void add_message_to_queue(std::unique_ptr<message::Message> message);
+	// requests of the peer in the order they came, are served by send_block()
+	std::deque<message::Request> m_upload_queue;
+	size_t m_bytes_uploaded = 0;
+
+	/**
+	 * @brief A block that is sent from outside the send buffer, after the bytes queued
+	 * before it
+	 */
+	struct Payload {
+		// the number of send buffer bytes that go before it, counted since the connect
+		size_t position = 0;
+		// the block is sent from the file with sendfile() if it is set
+		std::shared_ptr<OpenFile> file;
+		// and from this memory with MSG_ZEROCOPY otherwise
+		std::shared_ptr<const std::vector<uint8_t>> memory;
+		size_t offset = 0;
+		size_t length = 0;
+	};
+	std::deque<Payload> m_payloads;
+	size_t m_payload_bytes = 0;
+	// the number of send buffer bytes sent since the connect
+	size_t m_buffer_sent = 0;
+
+	bool m_zerocopy = false;
+	// the id the kernel gives to the next send with MSG_ZEROCOPY
+	uint32_t m_zerocopy_next = 0;
+	// the memory of the sends the kernel may still read from, by their ids
+	std::deque<std::pair<uint32_t, std::shared_ptr<const std::vector<uint8_t>>>>
+		m_zerocopy_pins;
+
+	/**
+	 * @brief Appends the serialized message to the send buffer
+	 *
+	 * Messages are final types, so serialized() is not called virtually
+	 */
+	template <typename T>
+	void add_message_to_queue(const T &message)
+	{
+		m_send_buffer.append(message.serialized());
+	}
+
+	/**
+	 * @brief Starts receiving the block straight into its piece
+	 *
+	 * Copies the part of the block that is already buffered and switches to BLOCK state
+	 *
+	 * @param data The buffered data, starting with the Piece message
+	 * @return false if the block was not requested, it is buffered as any other message then
+	 */
+	bool receive_block_in_place(std::span<const uint8_t> data);
+	[[nodiscard]] std::deque<ReceivedPiece>::iterator find_assigned_piece(size_t index);
+	/**
+	 * @brief Returns the space for the next part of the data, the message we are in the
+	 * middle of always fits
+	 *
+	 * @throw std::runtime_error if the peer sent a message that is too big
+	 */
+	[[nodiscard]] std::span<uint8_t> prepare_recv_space();
+	int recv_block();
+	/**
+	 * @brief Takes the data the loop received, as recv() does with the socket
+	 */
+	int take_received();
+	/**
+	 * @brief Queues the send of the buffered bytes in the loop, as send() does with the socket
+	 */
+	int send_through_loop();
+	/**
+	 * @brief Returns the number of send buffer bytes queued since the connect
+	 */
+	[[nodiscard]] size_t buffer_position() const;
+	/**
+	 * @brief Forgets everything about the previous connection
+	 *
+	 * @param pieces The number of pieces in the torrent
+	 */
+	void reset(size_t pieces);
+	/**
+	 * @brief Appends the header of the Piece message for the block to the send buffer
+	 */
+	void add_block_header(const message::Request &request);
+	/**
+	 * @brief Sends what is left of the payload at the front of the queue
+	 *
+	 * @return The same as TCPClient::send()
+	 */
+	long send_payload(Payload &payload);
 
 public:
 	message::Bitfield peer_bitfield;
@@ -77,18 +202,135 @@ public:
 	bool peer_interested = false;
 
 	PeerConnection() = default;
-	PeerConnection(const std::string &ip, const std::string &port,
-		       const message::Handshake &handshake, const message::Bitfield &bitfield);
+	PeerConnection(EventLoop &loop, uint64_t token, const std::string &ip,
+		       const std::string &port, const message::Handshake &handshake,
+		       const message::Bitfield &bitfield);
 
-	void connect(const std::string &ip, const std::string &port,
-		     const message::Handshake &handshake, const message::Bitfield &bitfield);
+	/**
+	 * @brief Connects to the peer and registers the socket in the event loop
+	 * 
+	 * @param loop The event loop that will watch the socket
+	 * @param token The token the loop will report events of this connection with
+	 * @throws std::runtime_error If failed to connect
+	 */
+	void connect(EventLoop &loop, uint64_t token, const std::string &ip,
+		     const std::string &port, const message::Handshake &handshake,
+		     const message::Bitfield &bitfield);
+	/**
+	 * @brief Takes over the connection the peer opened and registers it in the event loop
+	 *
+	 * Nothing is sent until the handshake of the peer is answered with send_handshake()
+	 *
+	 * @param socket The accepted socket
+	 * @param pieces The number of pieces in the torrent
+	 * @param received The bytes already read from the socket, such as the handshake read by
+	 * PeerListener. They are returned by next_message() before anything else
+	 */
+	void accept(EventLoop &loop, uint64_t token, TCPClient socket, size_t pieces,
+		    std::span<const uint8_t> received = {});
 	void disconnect();
 
+	/**
+	 * @brief Queues our handshake and bitfield, which start every connection
+	 */
+	void send_handshake(const message::Handshake &handshake, const message::Bitfield &bitfield);
+	/**
+	 * @brief Checks whether our handshake is queued, it isn't until an inbound peer sends its own
+	 */
+	[[nodiscard]] bool handshake_sent() const;
+	/**
+	 * @brief Returns the IP address and the port of the peer on the other end of the socket
+	 */
+	[[nodiscard]] std::tuple<std::string, std::string> peer_ip_and_port() const;
+
 	void send_keepalive();
 	void send_choke();
 	void send_unchoke();
 	void send_notinterested();
 	void send_interested();
+	void send_have(size_t index);
+	/**
+	 * @brief Checks whether we are choking the peer, the peer is not served then
+	 */
+	[[nodiscard]] bool is_choking_peer() const;
+
+	/**
+	 * @brief Queues the request of the peer until the socket is ready for the block
+	 *
+	 * @return false if the peer has too many requests queued
+	 */
+	[[nodiscard]] bool queue_upload(const message::Request &request);
+	/**
+	 * @brief Drops the request if its block is not in the send buffer yet
+	 */
+	void cancel_upload(const message::Cancel &cancel);
+	/**
+	 * @brief Takes the request that should be served next
+	 *
+	 * @return std::nullopt if nothing is requested or the send buffer already has enough
+	 */
+	[[nodiscard]] std::optional<message::Request> next_upload();
+	/**
+	 * @brief Puts the request taken with next_upload() back, so it is served first
+	 */
+	void requeue_upload(const message::Request &request);
+	/**
+	 * @brief Queues the Piece message with the requested block
+	 *
+	 * The block is read straight into the send buffer
+	 *
+	 * @param read Called with the span the block should be read into, may throw
+	 */
+	template <typename Read>
+	void send_block(const message::Request &request, Read &&read)
+	{
+		const size_t length = request.get_length();
+		const size_t size = message::PieceHeader::size + length;
+		const std::span<uint8_t> space = m_send_buffer.prepare(size);
+		const message::PieceHeader header(request.get_index(), request.get_begin(),
+						  static_cast<uint32_t>(length));
+		std::copy_n(header.serialized().begin(), message::PieceHeader::size, space.begin());
+		read(space.subspan(message::PieceHeader::size, length));
+		m_send_buffer.commit(size);
+		m_bytes_uploaded += length;
+	}
+	/**
+	 * @brief Queues the Piece message with the block sent from the files with sendfile()
+	 *
+	 * @param ranges The parts of the files that hold the block, in order
+	 */
+	void send_file_block(const message::Request &request,
+			     std::span<const Storage::FileRange> ranges);
+	/**
+	 * @brief Queues the Piece message with the block that is a part of the piece
+	 *
+	 * With zerocopy the block is sent from the piece, which is kept alive until the kernel
+	 * is done with it. Otherwise it is copied into the send buffer
+	 *
+	 * @param piece The data of the piece, which must not be changed anymore
+	 */
+	void send_cached_block(const message::Request &request,
+			       std::shared_ptr<const std::vector<uint8_t>> piece);
+	/**
+	 * @brief Sends the blocks from memory with MSG_ZEROCOPY from now on, if supported
+	 *
+	 * Is turned off again on its own if the kernel ends up copying the data anyway.
+	 *
+	 * @return false if the kernel doesn't support it
+	 */
+	bool enable_zerocopy();
+	/**
+	 * @brief Releases the blocks that the kernel reported as sent with MSG_ZEROCOPY
+	 *
+	 * The reports come through the error queue and wake the loop with an error event
+	 *
+	 * @return true if there was any report, so the error event was not a failure
+	 */
+	bool release_zerocopy_blocks();
+	/**
+	 * @brief Returns the number of block bytes queued for the peer so far
+	 */
+	[[nodiscard]] size_t bytes_uploaded() const;
 
 	/**
 	 * @brief Sends requests
@@ -104,19 +346,24 @@ public:
 	 * 
 	 * @param index The index of the piece
 	 * @param size The size of the piece
+	 * @param buffer The storage the piece is received into
+	 * @param hash_pool The pool that hashes the blocks as they arrive, if any
 	 */
-	void create_requests_for_piece(size_t index, size_t size);
+	void create_requests_for_piece(size_t index, size_t size, PieceBuffer buffer,
+				       HashPool *hash_pool = nullptr);
 	/**
-	 * @brief Validates and adds the block to an assigned piece
+	 * @brief Validates the block that was added to the assigned piece
 	 * 
+	 * @param message The Piece message as returned by next_message(). Blocks that were
+	 * received in place are returned as the header only, anything else is rejected
 	 * @return -1 on failure
 	 * @return 0 on sucess
 	 * @return 1 on sucess and that block was the last block of the piece
 	 */
-	[[nodiscard]] int add_block();
+	[[nodiscard]] int add_block(std::span<const uint8_t> message);
 
 	/**
-	 * @brief Resets request queue
+	 * @brief Resets request queue and releases the pieces that are not finished
 	 */
 	void reset_request_queue();
 	/**
@@ -128,14 +375,69 @@ public:
 
 	[[nodiscard]] bool is_downloading() const;
 
+	/**
+	 * @brief Sends queued messages until the queue is empty or the socket would block
+	 * 
+	 * Interest in writability is updated in the event loop accordingly
+	 * 
+	 * @return 0 if the whole queue was sent
+	 * @return 1 if the socket would block and caller should wait for writable event
+	 */
 	[[nodiscard]] int send();
+	/**
+	 * @brief Receives as much data as the socket has or the buffer can fit
+	 * 
+	 * The rest of a block that is being received goes straight into its piece
+	 * 
+	 * The received messages should be taken with next_message() before calling again
+	 * 
+	 * @return 0 if the buffer was filled and the socket may have more data
+	 * @return 1 if the socket was drained
+	 * @throw std::runtime_error on socket failure, if the connection was closed
+	 * or if the peer sent a message that is too big
+	 */
 	[[nodiscard]] int recv();
+	/**
+	 * @brief Takes the result of the I/O the loop performed for the connection
+	 *
+	 * Must be called with every event of the connection before recv() and send(). The
+	 * received data is returned by the following recv() calls
+	 */
+	void complete_io(const EventLoop::Event &event);
+	/**
+	 * @brief Checks whether the loop receives and sends for the connection
+	 *
+	 * A failed connection is only reported with an error event then.
+	 */
+	[[nodiscard]] bool loop_performs_io() const;
+	/**
+	 * @brief Takes the next complete message from the receive buffer
+	 * 
+	 * The first message is always the handshake, all the following ones include
+	 * the length prefix. KeepAlive is returned as a message of 4 bytes.
+	 * Piece message is returned as the header only, once the block is in the assigned piece.
+	 * 
+	 * @return The view of the message that is valid until the next recv() call
+	 * or std::nullopt if there is no complete message
+	 */
+	[[nodiscard]] std::optional<std::span<const uint8_t>> next_message();
 	[[nodiscard]] int get_socket_fd() const;
 	[[nodiscard]] bool should_wait_for_send() const;
 
-	[[nodiscard]] ReceivedPiece &&get_received_piece();
-
-	[[nodiscard]] std::span<const uint8_t> view_recv_message() const;
+	/**
+	 * @brief Takes the piece that add_block() reported as finished
+	 */
+	[[nodiscard]] ReceivedPiece get_received_piece();
 
-	bool update_time();
+	/**
+	 * @brief Checks whether the handshake was received from the peer
+	 */
+	[[nodiscard]] bool handshake_received() const;
+	/**
+	 * @brief Checks whether the peer sent anything we requested since the last call
+	 *
+	 * @return true if a block was received or there are no pending requests
+	 * @return false if the peer doesn't respond to our requests
+	 */
+	[[nodiscard]] bool made_progress();
 };
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "connection_table.hpp"
+#include "event_loop.hpp"
+#include "peer_message.hpp"
+#include "socket.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Accepts the incoming peers of every download in the process
+ *
+ * The port is owned by the process rather than by a download, since the kernel would
+ * spread the connections over the SO_REUSEPORT sockets of several downloads without
+ * looking at the torrent they are for. The listener reads the handshake of every accepted
+ * peer on its own thread and hands the socket to the download of the info_hash, together
+ * with the handshake, which the download then processes as if it received it itself.
+ *
+ * Peers that don't send the handshake in time or ask for a torrent nobody has are closed.
+ */
+class PeerListener {
+public:
+	static constexpr long long default_port = 8765;
+
+	/**
+	 * @brief Takes an incoming peer, is called on the thread of the listener
+	 *
+	 * @param socket The socket of the peer, the handshake is already read from it. Is closed
+	 * if the handler doesn't keep it
+	 * @param handshake The handshake the peer sent
+	 */
+	using Handler = std::function<void(TCPClient socket, std::span<const uint8_t> handshake)>;
+
+private:
+	/**
+	 * @brief Accepted peer that hasn't sent the whole handshake yet
+	 */
+	struct Pending {
+		TCPClient socket;
+		// must be detached before the socket is closed or handed over
+		EventRegistration registration;
+		std::array<uint8_t, message::Handshake::size> handshake{};
+		size_t received = 0;
+	};
+
+	static constexpr uint64_t m_listen_token = std::numeric_limits<uint64_t>::max();
+	static constexpr uint64_t m_wakeup_token = std::numeric_limits<uint64_t>::max() - 1;
+	static constexpr size_t m_max_pending = 256;
+	static constexpr std::chrono::seconds m_handshake_timeout{ 10 };
+	static constexpr std::chrono::seconds m_accept_retry_delay{ 1 };
+
+	TCPListener m_listener;
+	uint16_t m_port = 0;
+	std::unique_ptr<EventLoop> m_loop = make_event_loop();
+	EventNotifier m_notifier;
+
+	// are only touched by the thread of the listener
+	ConnectionTable<Pending> m_pending{ m_max_pending };
+	// the pending peers in the order they were accepted, so ordered by their deadlines
+	std::deque<std::pair<std::chrono::steady_clock::time_point, ConnectionHandle>> m_deadlines;
+	// set while accept() fails, the edge-triggered loop doesn't report the waiting peers again
+	std::optional<std::chrono::steady_clock::time_point> m_accept_retry;
+
+	std::mutex m_handlers_mutex;
+	// by info_hash
+	std::map<std::string, Handler> m_handlers;
+
+	// must be the last member, so the thread is stopped before anything else is destroyed
+	std::jthread m_thread;
+
+	/**
+	 * @brief Accepts the waiting peers, schedules a retry if it runs out of descriptors
+	 */
+	void accept_peers();
+	/**
+	 * @brief Reads the handshake of the peer and routes the peer once it is complete
+	 */
+	void receive_handshake(ConnectionHandle handle);
+	void route(Pending &pending);
+	/**
+	 * @brief Closes the peers whose handshake is late
+	 *
+	 * @return The time until the next deadline, in milliseconds, -1 if there are none
+	 */
+	[[nodiscard]] int expire(std::chrono::steady_clock::time_point now);
+	/**
+	 * @brief Accepts again if the retry is due
+	 *
+	 * @return The time until the retry, in milliseconds, -1 if there is none
+	 */
+	[[nodiscard]] int retry_accept(std::chrono::steady_clock::time_point now);
+	void run(std::stop_token stop);
+
+public:
+	/**
+	 * @param port The port to listen on, 0 picks a free one
+	 * @throws std::runtime_error If the socket could not be opened or bound
+	 */
+	explicit PeerListener(uint16_t port);
+
+	PeerListener(const PeerListener &other) = delete;
+	PeerListener &operator=(const PeerListener &other) = delete;
+	PeerListener(PeerListener &&other) = delete;
+	PeerListener &operator=(PeerListener &&other) = delete;
+
+	/**
+	 * @brief Returns the port the peers are accepted on
+	 */
+	[[nodiscard]] uint16_t get_port() const;
+
+	/**
+	 * @brief Routes the peers that ask for the torrent to the handler. Can be called from
+	 * any thread
+	 */
+	void add(std::span<const uint8_t> info_hash, Handler handler);
+	/**
+	 * @brief Stops routing the peers of the torrent. Can be called from any thread
+	 *
+	 * Once it returns, the handler is not running and will not be called again.
+	 */
+	void remove(std::span<const uint8_t> info_hash);
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <span>
@@ -17,16 +18,17 @@ public:
 };
 
 struct Handshake final : public Message {
+	static constexpr size_t size = 49 + 19;
+
 private:
-	std::array<uint8_t, 49 + 19> m_data{ "\x13"
-					     "BitTorrent protocol" };
+	std::array<uint8_t, size> m_data{ "\x13"
+					  "BitTorrent protocol" };
 
 	[[nodiscard]] std::span<const uint8_t> get_pstrlen() const;
 	[[nodiscard]] std::span<const uint8_t> get_pstr() const;
 	[[nodiscard]] std::span<const uint8_t> get_reserved() const;
 
 	void set_info_hash(std::span<const uint8_t> info_hash);
-	[[nodiscard]] std::span<const uint8_t> get_info_hash() const;
 
 	void set_peer_id(std::span<const uint8_t> peer_id);
 	[[nodiscard]] std::span<const uint8_t> get_peer_id() const;
@@ -37,6 +39,7 @@ public:
 	explicit Handshake(std::span<const uint8_t> handshake);
 
 	[[nodiscard]] std::span<const uint8_t> serialized() const & override;
+	[[nodiscard]] std::span<const uint8_t> get_info_hash() const;
 	[[nodiscard]] bool is_valid(std::span<const uint8_t> info_hash);
 };
 
@@ -190,6 +193,39 @@ public:
 	[[nodiscard]] std::span<const uint8_t> serialized() const & override;
 };
 
+/**
+ * @brief The part of Piece message that precedes the block
+ *
+ * The block itself is received straight into its place in ReceivedPiece,
+ * so the header is all that is kept of the message.
+ */
+struct PieceHeader final : public Message {
+	static constexpr size_t size = 4 + 1 + 4 + 4;
+
+private:
+	std::array<uint8_t, size> m_data{ 0, 0, 0, 9, 7 };
+
+public:
+	PieceHeader() = default;
+	PieceHeader(uint32_t index, uint32_t begin, uint32_t length);
+	/**
+	 * @param piece The Piece message, only the first size bytes are read
+	 */
+	explicit PieceHeader(std::span<const uint8_t> piece);
+
+	void set_index(uint32_t index);
+	[[nodiscard]] uint32_t get_index() const;
+	void set_begin(uint32_t begin);
+	[[nodiscard]] uint32_t get_begin() const;
+	void set_length(uint32_t length);
+	/**
+	 * @brief Returns the length of the block that follows the header
+	 */
+	[[nodiscard]] uint32_t get_length() const;
+
+	[[nodiscard]] std::span<const uint8_t> serialized() const & override;
+};
+
 struct Cancel final : public Message {
 private:
 	std::array<uint8_t, 17> m_data{ 0, 0, 0, 13, 8 };
@@ -1,19 +1,55 @@
 #pragma once
 
-#include "peer_message.hpp"
+#include "piece_arena.hpp"
 
 #include <cstddef>
-#include <string>
-#include <vector>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <span>
 
-struct ReceivedPiece {
-	friend class FileHandler;
+class HashPool;
 
+/**
+ * @brief Piece being downloaded from a peer
+ *
+ * The piece is stored contiguously in a buffer leased from PieceArena, and every block
+ * is received straight into its place, so the piece can be hashed and written as a single
+ * span once it is complete.
+ *
+ * The piece is hashed on HashPool as the blocks arrive, so only the final step of SHA1 is
+ * left once the last block is in place. Blocks that arrive ahead of the ones preceding
+ * them wait in place until the gap is filled.
+ */
+struct ReceivedPiece {
 private:
-	std::vector<message::Piece> m_pieces;
+	friend HashPool;
+
+	size_t m_index = 0;
+	size_t m_length = 0;
+	// is shared with the parts queued for hashing, so a discarded piece stays in memory
+	// until the pool is done with them
+	std::shared_ptr<PieceBuffer> m_buffer;
+
+	HashPool *m_hash_pool = nullptr;
+	// identifies the piece on the pool, 0 if it is not hashed as the blocks arrive
+	uint64_t m_stream = 0;
+	// the piece is queued for hashing up to this offset
+	size_t m_hashed = 0;
+	// lengths of the blocks that are received but not hashed yet, by their offsets
+	std::map<size_t, size_t> m_pending_blocks;
+
+	void hash(size_t begin, size_t length);
 
 public:
 	ReceivedPiece() = default;
+	/**
+	 * @param buffer The storage of the piece, must be at least length bytes
+	 * @param hash_pool The pool that hashes the blocks as they are added, nothing is hashed
+	 * before the piece is submitted without it. Must outlive add_block() calls
+	 */
+	ReceivedPiece(size_t index, size_t length, PieceBuffer buffer,
+		      HashPool *hash_pool = nullptr);
 	~ReceivedPiece() = default;
 	ReceivedPiece(ReceivedPiece &&) = default;
 	ReceivedPiece &operator=(ReceivedPiece &&) = default;
@@ -21,9 +57,16 @@ public:
 	ReceivedPiece(const ReceivedPiece &) = delete;
 	ReceivedPiece &operator=(const ReceivedPiece &) = delete;
 
-	void add_block(message::Piece &&block);
-	void clear();
+	/**
+	 * @brief Returns the place of the block in the piece
+	 *
+	 * @throws std::out_of_range If the block doesn't fit into the piece
+	 */
+	[[nodiscard]] std::span<uint8_t> get_block(size_t begin, size_t length);
+	/**
+	 * @brief Tells that the block returned by get_block() is filled, so it can be hashed
+	 */
+	void add_block(size_t begin, size_t length);
 	[[nodiscard]] size_t get_index() const;
-
-	[[nodiscard]] std::string compute_sha1() const;
+	[[nodiscard]] std::span<const uint8_t> get_data() const;
 };
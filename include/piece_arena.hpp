@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <span>
+#include <vector>
+
+class PieceArena;
+
+/**
+ * @brief Piece sized buffer leased from PieceArena
+ *
+ * The buffer is returned to the arena on destruction. An empty buffer means the arena
+ * had no memory left.
+ */
+class PieceBuffer {
+	friend PieceArena;
+
+	PieceArena *m_arena = nullptr;
+	uint8_t *m_data = nullptr;
+	size_t m_size = 0;
+
+	PieceBuffer(PieceArena *arena, uint8_t *data, size_t size);
+
+public:
+	PieceBuffer() = default;
+
+	PieceBuffer(const PieceBuffer &other) = delete;
+	PieceBuffer &operator=(const PieceBuffer &other) = delete;
+
+	PieceBuffer(PieceBuffer &&other) noexcept;
+	PieceBuffer &operator=(PieceBuffer &&other) noexcept;
+
+	/**
+	 * @brief Returns the whole buffer, which may be bigger than requested
+	 */
+	[[nodiscard]] std::span<uint8_t> get() const;
+	[[nodiscard]] bool empty() const;
+
+	/**
+	 * @brief Returns the buffer to the arena
+	 */
+	void reset();
+
+	~PieceBuffer();
+};
+
+/**
+ * @brief Pool of piece buffers with a limit on the memory in use
+ *
+ * Buffers are carved out of slabs mapped straight from the kernel. Slabs are kept
+ * in free lists keyed by their size, so pieces of the same length reuse them without
+ * touching the allocator. With huge pages enabled, slabs of at least 2 MiB are rounded
+ * up to the huge page size and backed by huge pages if the system has any.
+ *
+ * The budget limits the memory of slabs, both leased and free. Once it is exhausted
+ * acquire() fails, which is the signal to stop assigning new pieces until some are
+ * finished. The owner is told about it through the callback.
+ *
+ * All the methods are thread-safe.
+ */
+class PieceArena {
+	friend PieceBuffer;
+
+public:
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+private:
+	size_t m_budget;
+	bool m_huge_pages;
+
+	std::mutex m_mutex;
+	std::map<size_t, std::vector<uint8_t *>> m_free_slabs;
+	size_t m_in_use = 0;
+	size_t m_free = 0;
+	// acquire() has failed since the last buffer was returned
+	bool m_exhausted = false;
+
+	std::function<void()> m_on_available;
+
+	[[nodiscard]] size_t slab_size(size_t size) const;
+	[[nodiscard]] uint8_t *map_slab(size_t size) const;
+	static void unmap_slab(uint8_t *data, size_t size);
+	void release(uint8_t *data, size_t size);
+	void trim(size_t needed);
+
+public:
+	/**
+	 * @param budget The maximum amount of memory held by the arena, in bytes
+	 * @param huge_pages Whether big slabs should be backed by huge pages
+	 */
+	PieceArena(size_t budget, bool huge_pages);
+
+	PieceArena(const PieceArena &other) = delete;
+	PieceArena &operator=(const PieceArena &other) = delete;
+	PieceArena(PieceArena &&other) = delete;
+	PieceArena &operator=(PieceArena &&other) = delete;
+
+	/**
+	 * @brief Leases a buffer of at least the given size
+	 *
+	 * @return The buffer or an empty one if the budget is exhausted
+	 * @throws std::runtime_error If the memory could not be mapped
+	 */
+	[[nodiscard]] PieceBuffer acquire(size_t size);
+	/**
+	 * @brief Sets the function called once a buffer is returned after acquire() failed
+	 *
+	 * @note The function is called from the thread that returned the buffer. Can be reset
+	 * with an empty function from any thread
+	 */
+	void set_on_available(std::function<void()> on_available);
+
+	/**
+	 * @brief Returns the memory of leased buffers, in bytes
+	 */
+	[[nodiscard]] size_t in_use();
+
+	~PieceArena();
+};
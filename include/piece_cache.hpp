@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Keeps whole verified pieces in memory for the upload path
+ *
+ * Follows the 2Q policy, so a burst of pieces that are requested once doesn't push
+ * the pieces many peers ask for out of the cache. New pieces enter a FIFO that takes at
+ * most a quarter of the budget. The pieces that fall out of it are remembered without
+ * their data, and if one of them is inserted again it goes to the main LRU queue.
+ *
+ * All the methods are thread-safe.
+ */
+class PieceCache {
+public:
+	using Data = std::shared_ptr<const std::vector<uint8_t>>;
+
+	struct Stats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t insertions = 0;
+		size_t evictions = 0;
+		// the memory taken by the data of the pieces in the cache
+		size_t bytes = 0;
+		size_t pieces = 0;
+	};
+
+private:
+	enum class Queue {
+		// seen once recently
+		IN,
+		// seen again after falling out of IN
+		MAIN,
+	};
+
+	struct Entry {
+		size_t index = 0;
+		Data data;
+		Queue queue = Queue::IN;
+	};
+
+	size_t m_budget;
+	// the part of the budget IN may take before its pieces are evicted first
+	size_t m_in_budget;
+
+	std::mutex m_mutex;
+	// the most recently inserted or used pieces are at the front
+	std::list<Entry> m_in;
+	std::list<Entry> m_main;
+	std::unordered_map<size_t, std::list<Entry>::iterator> m_entries;
+	size_t m_in_bytes = 0;
+	// the pieces evicted from IN, the most recent at the front
+	std::list<size_t> m_ghosts;
+	std::unordered_map<size_t, std::list<size_t>::iterator> m_ghost_index;
+	size_t m_max_ghosts = 0;
+
+	Stats m_stats;
+
+	/**
+	 * @brief Evicts pieces until the cache fits into the budget
+	 */
+	void reclaim();
+
+public:
+	/**
+	 * @param budget The memory for the data of the pieces, in bytes. The cache is
+	 * disabled if it is 0
+	 */
+	explicit PieceCache(size_t budget);
+
+	PieceCache(const PieceCache &other) = delete;
+	PieceCache &operator=(const PieceCache &other) = delete;
+	PieceCache(PieceCache &&other) = delete;
+	PieceCache &operator=(PieceCache &&other) = delete;
+
+	/**
+	 * @brief Returns the piece and marks it as used
+	 *
+	 * @return nullptr if the piece is not in the cache
+	 */
+	[[nodiscard]] Data find(size_t index);
+	/**
+	 * @brief Adds the piece, evicting others if the budget is exceeded
+	 *
+	 * A piece bigger than the budget is not added.
+	 */
+	void insert(size_t index, Data data);
+	[[nodiscard]] bool enabled() const;
+	[[nodiscard]] Stats get_stats();
+};
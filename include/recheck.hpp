@@ -0,0 +1,83 @@
+#pragma once
+
+#include "file_layout.hpp"
+#include "peer_message.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Verifies the data that is already on disk
+ *
+ * Every file is mapped read-only and the pieces are spread over worker threads in chunks
+ * of consecutive pieces, so every worker reads sequentially. The next chunk is announced
+ * to the kernel with MADV_WILLNEED before it is hashed. Pieces that lie within a single
+ * file are hashed straight from the mapping, only the pieces on file boundaries are copied.
+ *
+ * Missing or short files are not an error, the pieces they hold are reported as missing.
+ * Pieces that fall entirely into holes of sparse files are skipped without being read.
+ */
+class Recheck {
+	class Mapping;
+
+	FileLayout m_layout;
+	std::string_view m_hashes;
+	size_t m_pieces;
+
+	std::vector<Mapping> m_mappings;
+	message::Bitfield m_wanted;
+	std::vector<uint8_t> m_verified;
+
+	std::atomic<size_t> m_next_chunk = 0;
+	std::atomic<size_t> m_checked = 0;
+	std::atomic<size_t> m_bytes_hashed = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	size_t m_running = 0;
+
+	/**
+	 * @brief Returns the data of the piece, copied into a buffer if it spans several files
+	 *
+	 * @param copy_buffer Returns a buffer of a piece length, is only called for the pieces
+	 * that have to be copied
+	 * @return An empty span if the piece is not on disk or there is nothing but holes
+	 */
+	[[nodiscard]] std::span<const uint8_t>
+	piece_data(size_t index, const std::function<std::span<uint8_t>()> &copy_buffer);
+	void advise_chunk(size_t first, size_t last);
+	void work();
+	void report(double seconds);
+
+public:
+	/**
+	 * @param hashes The concatenated SHA1 of every piece
+	 */
+	Recheck(FileLayout layout, std::string_view hashes);
+
+	Recheck(const Recheck &other) = delete;
+	Recheck &operator=(const Recheck &other) = delete;
+	Recheck(Recheck &&other) = delete;
+	Recheck &operator=(Recheck &&other) = delete;
+
+	/**
+	 * @brief Hashes every piece that is on disk, reporting the progress every second
+	 *
+	 * @param threads The number of threads that hash the pieces
+	 * @return The pieces that match their hashes
+	 */
+	[[nodiscard]] message::Bitfield run(size_t threads);
+	/**
+	 * @brief Hashes only the given pieces, the others are reported as missing
+	 */
+	[[nodiscard]] message::Bitfield run(size_t threads, message::Bitfield pieces);
+
+	~Recheck();
+};
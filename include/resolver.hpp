@@ -0,0 +1,101 @@
+#pragma once
+
+#include "event_loop.hpp"
+#include "socket.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Resolves domain names off the event loop thread
+ *
+ * getaddrinfo() is blocking, so lookups are performed by a small pool of worker threads.
+ * Finished lookups are collected in a queue and the loop is woken up through the notifier,
+ * whose descriptor should be registered in the loop as readable.
+ *
+ * IP literals are converted without a lookup, and successful lookups are cached for
+ * a limited time, so the trackers are not resolved again on every announce.
+ */
+class Resolver {
+public:
+	struct Result {
+		uint64_t id = 0;
+		std::string hostname;
+		std::string port;
+		// empty if the name could not be resolved
+		std::vector<Endpoint> endpoints;
+	};
+
+private:
+	struct Request {
+		uint64_t id = 0;
+		std::string hostname;
+		std::string port;
+	};
+
+	struct CacheEntry {
+		std::vector<Endpoint> endpoints;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	std::chrono::seconds m_ttl;
+
+	std::mutex m_mutex;
+	std::condition_variable_any m_cv;
+	std::deque<Request> m_requests;
+	std::vector<Result> m_results;
+	std::map<std::pair<std::string, std::string>, CacheEntry> m_cache;
+
+	EventNotifier m_notifier;
+	// must be the last member, so the workers are stopped before anything else is destroyed
+	std::vector<std::jthread> m_workers;
+
+	void work(std::stop_token stop);
+	[[nodiscard]] std::optional<std::vector<Endpoint>> lookup_cache(const std::string &hostname,
+									const std::string &port);
+
+public:
+	/**
+	 * @param threads The number of worker threads
+	 * @param ttl For how long the resolved names are cached
+	 */
+	Resolver(size_t threads, std::chrono::seconds ttl);
+
+	Resolver(const Resolver &other) = delete;
+	Resolver &operator=(const Resolver &other) = delete;
+	Resolver(Resolver &&other) = delete;
+	Resolver &operator=(Resolver &&other) = delete;
+
+	/**
+	 * @brief Starts resolving the hostname
+	 *
+	 * If the hostname is an IP address or is cached, the endpoints are returned right away
+	 * and no result is queued. Otherwise the lookup is queued and the caller is notified
+	 * once it is finished.
+	 *
+	 * @param id The identifier the result will be reported with
+	 * @return The endpoints or std::nullopt if the lookup was queued
+	 */
+	[[nodiscard]] std::optional<std::vector<Endpoint>>
+	resolve(uint64_t id, const std::string &hostname, const std::string &port);
+	/**
+	 * @brief Takes the finished lookups. Must be called after every event on the descriptor
+	 */
+	[[nodiscard]] std::vector<Result> take_results();
+
+	/**
+	 * @brief Returns the descriptor that becomes readable when there are finished lookups
+	 */
+	[[nodiscard]] int get_fd() const;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "peer_message.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Fast-resume record of a download
+ *
+ * It holds the pieces that were verified and written to disk, and the size and mtime
+ * of every file at the moment the record was made. On restart only the pieces of files
+ * whose size or mtime changed since then have to be hashed again.
+ *
+ * The record is a bencoded dictionary, the pieces are packed into a string one bit each.
+ * It is written to a temporary file which then replaces the old one, so a crash
+ * in the middle leaves the previous record intact.
+ */
+struct ResumeData {
+	struct FileState {
+		long long length = -1;
+		// nanoseconds since the epoch
+		long long mtime = 0;
+
+		bool operator==(const FileState &other) const = default;
+	};
+
+	std::string info_hash;
+	long long piece_length = 0;
+	message::Bitfield pieces;
+	std::vector<FileState> files;
+
+	/**
+	 * @brief Returns the state of the file on disk, the length is -1 if it doesn't exist
+	 */
+	[[nodiscard]] static FileState stat_file(const std::filesystem::path &path);
+
+	/**
+	 * @return std::nullopt if there is no record or it is malformed
+	 */
+	[[nodiscard]] static std::optional<ResumeData> load(const std::filesystem::path &path,
+							    size_t number_of_pieces);
+	/**
+	 * @throws std::runtime_error If the record could not be written
+	 */
+	void save(const std::filesystem::path &path) const;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <openssl/evp.h>
+#include <span>
+
+/**
+ * @brief SHA1 hashing engine for piece verification
+ *
+ * The engine picks the fastest kernel the CPU supports at runtime. SHA-NI hashes a single
+ * buffer with the dedicated instructions. AVX2 runs several buffers side by side, one
+ * in every 32-bit lane of a vector register, so it pays off only when there are a few
+ * pieces of the same length to hash at once. EVP is OpenSSL and works everywhere.
+ */
+namespace sha1
+{
+
+using Digest = std::array<uint8_t, utils::sha1_length>;
+
+enum class Kernel {
+	EVP,
+	SHA_NI,
+	AVX2,
+};
+
+// the number of buffers hashed at once by the AVX2 kernel
+inline constexpr size_t max_lanes = 8;
+
+/**
+ * @brief Returns the kernel used by default
+ *
+ * The supported kernels are timed on the first call and the fastest one is remembered.
+ */
+[[nodiscard]] Kernel best_kernel();
+/**
+ * @brief Returns whether the CPU and the OS support the kernel
+ */
+[[nodiscard]] bool is_supported(Kernel kernel);
+[[nodiscard]] const char *kernel_name(Kernel kernel);
+/**
+ * @brief Returns how many buffers the kernel should be given at once to run at full speed
+ */
+[[nodiscard]] size_t preferred_batch(Kernel kernel);
+
+/**
+ * @brief Hashes every input into the output with the same index
+ *
+ * @param outputs Must be at least as long as inputs
+ * @throws std::runtime_error If OpenSSL fails
+ */
+void hash(std::span<const std::span<const uint8_t>> inputs, std::span<Digest> outputs,
+	  Kernel kernel = best_kernel());
+[[nodiscard]] Digest hash(std::span<const uint8_t> input, Kernel kernel = best_kernel());
+
+/**
+ * @brief Hashes a message that is fed in parts
+ *
+ * Runs SHA-NI if the CPU supports it and OpenSSL otherwise, since the lanes of AVX2 need
+ * several whole messages at once. Only the incomplete block at the end of a part is copied.
+ */
+class Context {
+	std::array<uint32_t, 5> m_state;
+	std::array<uint8_t, 64> m_buffer{};
+	size_t m_buffered = 0;
+	uint64_t m_length = 0;
+	// is only created on the CPUs without SHA-NI
+	std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> m_evp;
+
+public:
+	/**
+	 * @throws std::runtime_error If OpenSSL fails
+	 */
+	Context();
+
+	/**
+	 * @throws std::runtime_error If OpenSSL fails
+	 */
+	void update(std::span<const uint8_t> input);
+	/**
+	 * @brief Returns the digest of everything fed so far
+	 *
+	 * @note Must be called only once
+	 * @throws std::runtime_error If OpenSSL fails
+	 */
+	[[nodiscard]] Digest finish();
+	/**
+	 * @brief Starts a new message, so the context can be reused
+	 *
+	 * @throws std::runtime_error If OpenSSL fails
+	 */
+	void reset();
+};
+
+} // namespace sha1
@@ -1,9 +1,22 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <optional>
 #include <span>
 #include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <tuple>
+#include <vector>
+
+/**
+ * @brief Resolved address of a TCP server
+ */
+struct Endpoint {
+	sockaddr_storage addr{};
+	socklen_t addr_len = 0;
+};
 
 /**
  * @brief RAII wrapper for non-blocking TCP client socket
@@ -24,6 +37,10 @@ public:
 	 * @throws std::runtime_error If opening or connection failed
 	 */
 	TCPClient(const std::string &hostname, const std::string &port);
+	/**
+	 * @brief Takes over the connected non-blocking socket
+	 */
+	explicit TCPClient(int fd);
 
 	TCPClient(const TCPClient &other) = delete;
 	TCPClient &operator=(const TCPClient &other) = delete;
@@ -33,11 +50,22 @@ public:
 	/**
 	 * @brief Opens a new socket and connects it to the endpoint
 	 * 
+	 * IP addresses are connected to directly. Domain names are resolved with a blocking
+	 * getaddrinfo() call, so the callers that can't afford to block should resolve them
+	 * with Resolver beforehand.
+	 *
 	 * @param hostname The hostname (IPv4 or IPv6 address, or domain name) of the server
 	 * @param port The port on the server
 	 * @throws std::runtime_error If opening or connection failed
 	 */
 	void connect(const std::string &hostname, const std::string &port);
+	/**
+	 * @brief Opens a new socket and connects it to the first reachable endpoint
+	 *
+	 * @param endpoints The addresses of the server in order of preference
+	 * @throws std::runtime_error If opening or connection failed for every endpoint
+	 */
+	void connect(std::span<const Endpoint> endpoints);
 	/**
 	 * @brief Checks whether the socket successfully connected to the endpoint
 	 * 
@@ -59,6 +87,56 @@ public:
 	 * @throws std::runtime_error If send() returned an error
 	 */
 	[[nodiscard]] long send(std::span<const uint8_t> buffer) const;
+	/**
+	 * @brief Sends a range of the file straight from the page cache with sendfile()
+	 *
+	 * Just like send(), this function may send the range partially. SIGPIPE can't be
+	 * suppressed for this call, so the process should ignore it.
+	 * @param fd The descriptor of a regular file
+	 * @param offset The offset of the range in the file
+	 * @param length The size of the range
+	 * @return The non-negative value indicating the number of bytes successfully sent
+	 * @return -1 indicating that the call would normally block and no data was sent
+	 * @throws std::runtime_error If sendfile() returned an error
+	 */
+	[[nodiscard]] long sendfile(int fd, size_t offset, size_t length) const;
+	/**
+	 * @brief Asks the kernel to let send_zerocopy() transmit from user memory
+	 *
+	 * @return false if the kernel doesn't support MSG_ZEROCOPY
+	 */
+	[[nodiscard]] bool enable_zerocopy() const;
+	/**
+	 * @brief Sends data with MSG_ZEROCOPY, without copying it into the socket buffer
+	 *
+	 * Just like send(), this function may send the data partially. Every call that sends
+	 * anything with the flag gets the next id, counting from 0. The memory must not be
+	 * changed or freed until next_zerocopy_completion() reports its id.
+	 * @param pinned Is set to false if the data was sent with a copy, because the kernel could
+	 * not pin more memory. No id is used then
+	 * @return The non-negative value indicating the number of bytes successfully sent
+	 * @return -1 indicating that the call would normally block and no data was sent
+	 * @throws std::runtime_error If sendmsg() returned an error
+	 */
+	[[nodiscard]] long send_zerocopy(std::span<const uint8_t> buffer, bool &pinned) const;
+	/**
+	 * @brief Sends with MSG_ZEROCOPY that the kernel no longer needs the memory of
+	 */
+	struct ZerocopyCompletion {
+		// the ids of the first and the last completed send, both inclusive
+		uint32_t first = 0;
+		uint32_t last = 0;
+		// the kernel copied the data anyway, as it does on loopback
+		bool copied = false;
+	};
+	/**
+	 * @brief Takes the next notification from the error queue of the socket
+	 *
+	 * The notifications make the socket report an error event.
+	 * @return std::nullopt if there are no more notifications
+	 * @throws std::runtime_error If recvmsg() returned an error
+	 */
+	[[nodiscard]] std::optional<ZerocopyCompletion> next_zerocopy_completion() const;
 	/**
 	 * @brief Receives data from the peer
 	 * 
@@ -88,6 +166,17 @@ public:
 	 * @note Passing the span of size 0 may result in std::runtime_error thrown, so don't do it
 	 */
 	[[nodiscard]] long recv2(std::span<uint8_t> buffer) const;
+	/**
+	 * @brief Receives data from the peer, scattering it over several buffers with a single syscall
+	 *
+	 * The buffers are filled in order, just like recv2() fills a single one.
+	 * @param buffers The buffers to fill. There must be no more than IOV_MAX, and the total
+	 * size must not be 0
+	 * @return The positive value indicating the total number of bytes successfully recved
+	 * @return -1 indicating that the call would normally block and no data was recved
+	 * @throws std::runtime_error If recvmsg() returned an error or connection was terminated by the peer
+	 */
+	[[nodiscard]] long recv2(std::span<const iovec> buffers) const;
 
 	/**
 	 * @brief Terminates the connection if it was open
@@ -107,6 +196,77 @@ public:
 	[[nodiscard]] std::tuple<std::string, std::string> get_peer_ip_and_port() const;
 
 	static std::string ntop(uint32_t ip);
+	static std::string ntop(const Endpoint &endpoint);
+
+	/**
+	 * @brief Converts the IP address literal to an endpoint without any DNS lookup
+	 *
+	 * @return The endpoint or std::nullopt if the hostname is not an IP address
+	 */
+	[[nodiscard]] static std::optional<Endpoint> parse_numeric(const std::string &hostname,
+								   const std::string &port);
+	/**
+	 * @brief Resolves the hostname with getaddrinfo(). Blocks the calling thread
+	 *
+	 * @return The endpoints of the server
+	 * @throws std::runtime_error If the name could not be resolved
+	 */
+	[[nodiscard]] static std::vector<Endpoint> resolve(const std::string &hostname,
+							   const std::string &port);
 
 	~TCPClient();
 };
+
+/**
+ * @brief RAII wrapper for non-blocking TCP listening socket
+ *
+ * Listens on all the interfaces, IPv6 ones as well if the system has them.
+ */
+class TCPListener {
+	int m_socket = -1;
+
+public:
+	/**
+	 * @brief Construct a new TCPListener object without opening a socket
+	 */
+	TCPListener() = default;
+	/**
+	 * @brief Opens a new socket listening on the port
+	 *
+	 * @param reuse_port Lets several sockets listen on the same port, the kernel spreads
+	 * the incoming connections between them
+	 * @throws std::runtime_error If the socket could not be opened or bound
+	 */
+	TCPListener(uint16_t port, bool reuse_port);
+
+	TCPListener(const TCPListener &other) = delete;
+	TCPListener &operator=(const TCPListener &other) = delete;
+
+	TCPListener(TCPListener &&other) noexcept;
+	TCPListener &operator=(TCPListener &&other) noexcept;
+
+	/**
+	 * @brief Takes the next connection from the backlog
+	 *
+	 * @return The non-blocking socket of the connection or std::nullopt if the backlog is empty
+	 * @throws std::runtime_error If accept4() returned an error, such as running out
+	 * of descriptors
+	 */
+	[[nodiscard]] std::optional<TCPClient> accept() const;
+	/**
+	 * @brief Returns the port the socket is bound to, which is picked by the kernel for 0
+	 *
+	 * @throws std::runtime_error If getsockname() returned an error
+	 */
+	[[nodiscard]] uint16_t get_port() const;
+
+	/**
+	 * @brief Returns the underlying file descriptor
+	 *
+	 * @return The file descriptor integer or -1 if socket is not open
+	 * @note The caller should not close the descriptor manually
+	 */
+	[[nodiscard]] int get_fd() const;
+
+	~TCPListener();
+};
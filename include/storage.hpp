@@ -0,0 +1,175 @@
+#pragma once
+
+#include "file_cache.hpp"
+#include "file_layout.hpp"
+#include "piece.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Keeps the data of the torrent in its files
+ *
+ * The torrent is seen as one contiguous range of bytes that is split between the files.
+ * All the methods are thread-safe.
+ */
+class Storage {
+public:
+	/**
+	 * @brief A part of a range of the torrent, with the file that holds it kept open
+	 */
+	struct FileRange {
+		std::shared_ptr<OpenFile> file;
+		// offset in the file
+		size_t offset = 0;
+		size_t length = 0;
+	};
+
+protected:
+	FileLayout m_layout;
+
+public:
+	explicit Storage(FileLayout layout);
+
+	Storage(const Storage &other) = delete;
+	Storage &operator=(const Storage &other) = delete;
+	Storage(Storage &&other) = delete;
+	Storage &operator=(Storage &&other) = delete;
+
+	/**
+	 * @brief Writes the verified piece
+	 *
+	 * @throws std::system_error If the piece could not be written
+	 */
+	virtual void write_piece(const ReceivedPiece &piece) = 0;
+	/**
+	 * @brief Reads the bytes of the torrent starting at the offset
+	 *
+	 * @throws std::system_error If the bytes could not be read
+	 */
+	virtual void read(size_t offset, std::span<uint8_t> data) = 0;
+	/**
+	 * @brief Returns the open files that hold the bytes of the torrent starting at the offset
+	 *
+	 * Lets the bytes be sent with sendfile() instead of being read into memory
+	 *
+	 * @throws std::system_error If a file could not be opened
+	 */
+	[[nodiscard]] virtual std::vector<FileRange> file_ranges(size_t offset, size_t length) = 0;
+	/**
+	 * @brief Waits until everything written so far reaches the disk
+	 */
+	virtual void sync() = 0;
+
+	virtual ~Storage() = default;
+};
+
+/**
+ * @brief Writes and reads the files with pwrite() and pread() through a FileCache
+ *
+ * With direct I/O the pieces bypass the page cache: the part of a piece that covers whole
+ * blocks of the file is written through an O_DIRECT descriptor, from an aligned copy if
+ * the piece itself is not aligned. The unaligned head and tail are shared with the
+ * neighbouring pieces, which may be written at the same time, so they go through the page
+ * cache. Reads always do.
+ */
+class PwriteStorage : public Storage {
+	static constexpr size_t m_direct_alignment = 4096;
+
+	FileCache m_file_cache;
+	// is only created for direct I/O
+	std::unique_ptr<FileCache> m_direct_cache;
+	// is turned off if the filesystem doesn't support O_DIRECT
+	std::atomic<bool> m_direct = false;
+
+	void write_direct(const FileLayout::Extent &extent, const uint8_t *src);
+
+public:
+	/**
+	 * @param max_open_files The number of files kept open between the writes
+	 * @param direct_io Whether the pieces should bypass the page cache
+	 */
+	PwriteStorage(FileLayout layout, size_t max_open_files, bool direct_io = false);
+
+	void write_piece(const ReceivedPiece &piece) override;
+	void read(size_t offset, std::span<uint8_t> data) override;
+	[[nodiscard]] std::vector<FileRange> file_ranges(size_t offset, size_t length) override;
+	void sync() override;
+};
+
+/**
+ * @brief Copies the pieces into shared mappings of the files
+ *
+ * Files are mapped in windows aligned to their size, so large files don't have to fit
+ * into the address space at once. The least recently used windows are unmapped once there
+ * are more of them than the limit, their dirty pages are written back by the kernel.
+ *
+ * The files are opened through a FileCache when a window is mapped, and the mappings stay
+ * valid after the cache closes them. The storage never sizes the files up front, that is
+ * left to the preallocation mode. The disk space of a piece is allocated before it is copied
+ * in, which also extends a file that is shorter, so a full disk is reported as an error
+ * instead of SIGBUS.
+ */
+class MmapStorage : public Storage {
+public:
+	enum class SyncPolicy {
+		// the kernel writes the pages back whenever it wants, sync() flushes them
+		NONE,
+		// the write back of every piece is started right after it is copied
+		ASYNC,
+		// every piece is on disk once write_piece() returns
+		SYNC,
+	};
+
+private:
+	class Window;
+
+	size_t m_window_size;
+	size_t m_max_windows;
+	SyncPolicy m_policy;
+
+	FileCache m_file_cache;
+	std::mutex m_mutex;
+	// keyed by the file and the index of the window in it, the most recently used is in front
+	std::list<std::pair<std::pair<size_t, size_t>, std::shared_ptr<Window>>> m_lru;
+	std::map<std::pair<size_t, size_t>, decltype(m_lru)::iterator> m_windows;
+	// files are only extended by hand where fallocate() is not supported
+	std::mutex m_resize_mutex;
+
+	/**
+	 * @brief Returns the window that holds the byte of the file, mapping it if needed
+	 */
+	[[nodiscard]] std::shared_ptr<Window> window_of(size_t file, size_t offset);
+	/**
+	 * @brief Allocates the disk space of the part of the file, extending it if needed
+	 */
+	void reserve(size_t file, size_t offset, size_t length);
+
+public:
+	/**
+	 * @param max_open_files The number of files kept open between the writes
+	 * @param window_size The size of a mapped window, rounded up to the page size
+	 * @param max_windows The number of windows kept mapped at once
+	 */
+	MmapStorage(FileLayout layout, size_t max_open_files, size_t window_size,
+		    size_t max_windows, SyncPolicy policy);
+
+	void write_piece(const ReceivedPiece &piece) override;
+	void read(size_t offset, std::span<uint8_t> data) override;
+	[[nodiscard]] std::vector<FileRange> file_ranges(size_t offset, size_t length) override;
+	void sync() override;
+};
+
+/**
+ * @brief Creates the storage selected by the config
+ */
+[[nodiscard]] std::unique_ptr<Storage> make_storage(FileLayout layout);
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+/**
+ * @brief Reference to a timer scheduled in TimerWheel
+ *
+ * Just like ConnectionHandle, it stores the generation of the slot, so a handle of a timer
+ * that already expired never refers to a timer that reused the slot later.
+ */
+struct TimerHandle {
+	uint32_t index = std::numeric_limits<uint32_t>::max();
+	uint32_t generation = 0;
+};
+
+/**
+ * @brief Hierarchical timer wheel with millisecond resolution
+ *
+ * Every level has 64 slots, each covering 64 times more time than a slot of the level
+ * below, so 4 levels cover about 4.6 hours. Timers that are further away are parked in
+ * the last level and moved down as the time goes.
+ * Scheduling and cancelling take constant time, and advancing the time only touches the
+ * slots that have timers in them, so the cost doesn't depend on the number of timers.
+ *
+ * Timers are reported the same way the EventLoop reports events: by a token and a type
+ * given by the owner.
+ */
+class TimerWheel {
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct Timer {
+		uint64_t token = 0;
+		uint32_t type = 0;
+	};
+
+private:
+	static constexpr size_t slot_bits = 6;
+	static constexpr size_t slots = 1 << slot_bits;
+	static constexpr size_t levels = 4;
+	static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+	struct Entry {
+		uint64_t expiry = 0;
+		Timer timer;
+		uint32_t prev = none;
+		uint32_t next = none;
+		uint32_t generation = 0;
+		uint8_t level = 0;
+		uint8_t slot = 0;
+		bool active = false;
+	};
+
+	std::vector<Entry> m_entries;
+	std::vector<uint32_t> m_free_entries;
+	// heads of intrusive lists of entries in every slot
+	std::array<std::array<uint32_t, slots>, levels> m_slots;
+	// bit i is set if slot i of the level is not empty
+	std::array<uint64_t, levels> m_occupied{};
+
+	clock::time_point m_start;
+	// in milliseconds since m_start
+	uint64_t m_now = 0;
+	size_t m_size = 0;
+
+	std::vector<Timer> m_expired;
+
+	[[nodiscard]] uint64_t to_ticks(clock::time_point tp, bool round_up) const;
+	[[nodiscard]] uint64_t next_boundary() const;
+	void place(uint32_t index);
+	void link(uint32_t index, size_t level, size_t slot);
+	void unlink(uint32_t index);
+	void release(uint32_t index);
+	void process_tick();
+
+public:
+	/**
+	 * @param now The time the wheel starts counting from
+	 */
+	explicit TimerWheel(clock::time_point now = clock::now());
+
+	/**
+	 * @brief Schedules a one-shot timer
+	 *
+	 * Deadlines in the past expire on the next advance()
+	 *
+	 * @return The handle that can be used to cancel the timer
+	 */
+	TimerHandle schedule(clock::time_point deadline, Timer timer);
+	/**
+	 * @brief Cancels the timer
+	 *
+	 * @return true if the timer was cancelled
+	 * @return false if the timer has already expired or was cancelled
+	 */
+	bool cancel(TimerHandle handle);
+	/**
+	 * @brief Moves the time forward
+	 *
+	 * @return The timers that expired, valid until the next call
+	 */
+	[[nodiscard]] std::span<const Timer> advance(clock::time_point now);
+	/**
+	 * @brief Returns how long the event loop may sleep
+	 *
+	 * @return The number of milliseconds until the wheel has to be advanced,
+	 * or -1 if there are no timers
+	 */
+	[[nodiscard]] int timeout_ms(clock::time_point now) const;
+
+	[[nodiscard]] size_t size() const;
+	[[nodiscard]] bool empty() const;
+};
@@ -1,8 +1,8 @@
 #pragma once
 
+#include "event_loop.hpp"
 #include "socket.hpp"
 
-#include <chrono>
 #include <cstdint>
 #include <span>
 #include <string>
@@ -17,7 +17,7 @@
 struct TrackerRequestParams {
 	std::string info_hash; // must be present
 	std::span<const std::uint8_t> peer_id; // must be present
-	std::string port = "8765"; // must be present, but unused
+	std::string port = "8765"; // must be present, the port peers can connect to
 	std::string uploaded; // total amount of bytes uploaded, unused
 	std::string downloaded; // total amount of bytes downloaded, unused
 	std::string left; // number of bytes that are missing, unused
@@ -34,6 +34,7 @@ class TrackerConnection {
 	static constexpr int recv_buffer_size = 4096;
 
 	TCPClient m_socket;
+	EventRegistration m_registration;
 
 	std::vector<std::uint8_t> m_send_buffer;
 	size_t m_send_offset = 0;
@@ -43,31 +44,32 @@ class TrackerConnection {
 
 	bool m_request_sent = false;
 
-	std::chrono::steady_clock::time_point m_tp = std::chrono::steady_clock::now();
-	long long m_timeout = 0;
-
 public:
 	TrackerConnection() = default;
 	/**
 	 * @brief Starts a connection with the HTTP tracker and generates request to send
 	 * 
-	 * @param hostname The domain name of the server
-	 * @param port The port on the server
+	 * @param loop The event loop that will watch the socket
+	 * @param token The token the loop will report events of this connection with
+	 * @param endpoints The resolved addresses of the server
+	 * @param hostname The domain name of the server, sent in the Host header
 	 * @param param The struct that contains data needed to generate request
 	 * @throws std::runtime_error If failed to connect
 	 */
-	TrackerConnection(const std::string &hostname, const std::string &port,
-			  const TrackerRequestParams &param);
+	TrackerConnection(EventLoop &loop, uint64_t token, std::span<const Endpoint> endpoints,
+			  const std::string &hostname, const TrackerRequestParams &param);
 	/**
 	 * @brief Starts a connection with the HTTP tracker and generates request to send
 	 * 
-	 * @param hostname The domain name of the server
-	 * @param port The port on the server
+	 * @param loop The event loop that will watch the socket
+	 * @param token The token the loop will report events of this connection with
+	 * @param endpoints The resolved addresses of the server
+	 * @param hostname The domain name of the server, sent in the Host header
 	 * @param param The struct that contains data needed to generate request
 	 * @throws std::runtime_error If failed to connect
 	 */
-	void connect(const std::string &hostname, const std::string &port,
-		     const TrackerRequestParams &param);
+	void connect(EventLoop &loop, uint64_t token, std::span<const Endpoint> endpoints,
+		     const std::string &hostname, const TrackerRequestParams &param);
 	/**
 	 * @brief Terminates the connection if it was open
 	 */
@@ -101,6 +103,9 @@ public:
 	/**
 	 * @brief Sends the HTTP request to the server
 	 * 
+	 * Sends until the whole request is sent or the socket would block. After the request
+	 * is sent, the connection switches its interest in the event loop to reading
+	 * 
 	 * @return 0 on successful send
 	 * @return 1 on partial send
 	 * @throw std::runtime_error on socket failure
@@ -109,24 +114,11 @@ public:
 	/**
 	 * @brief Receives the HTTP response from the server
 	 * 
+	 * Receives until the server closes the connection or the socket would block
+	 * 
 	 * @return 0 on successful recv
 	 * @return 1 on partial recv
 	 * @throw std::runtime_error on socket failure or if response is too big
 	 */
 	[[nodiscard]] int recv();
-	/**
-	 * @brief Sets the timeout. After the timeout update_time() will return true
-	 * and reset the timer.
-	 * 
-	 * @param seconds The amount of seconds to wait until update_time will return true
-	 */
-	void set_timeout(long long seconds);
-	/**
-	 * @brief Checks whether timeout expired (if such was set)
-	 * @note This function returns true only once, after which it starts to act
-	 * as if timer was not set
-	 * @return true if timeout has expired
-	 * @return false if timeout was not set or has not yet expired
-	 */
-	[[nodiscard]] bool update_time();
 };
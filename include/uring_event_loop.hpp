@@ -0,0 +1,156 @@
+#pragma once
+
+#include "event_loop.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+/**
+ * @brief EventLoop implemented with io_uring
+ *
+ * Readiness is watched with multishot poll requests, which are edge-triggered just like
+ * the epoll backend. The difference is that registering, changing and removing interest
+ * does not cost a syscall each: all the requests are placed into the submission queue
+ * and submitted in a batch by the same io_uring_enter() call that waits for completions.
+ *
+ * The loop also performs the I/O of the sockets that ask for it. Such a socket is read
+ * by a multishot receive that picks one of the buffers provided to the kernel, so the
+ * data arrives with the completions and the owner makes no recv() calls. The buffers are
+ * lent to the owners until the next wait(), which provides them again. Sends are queued
+ * as requests too and go out with the next wait(), so a single io_uring_enter() covers
+ * the sends, receives and readiness of all the sockets.
+ *
+ * The buffers are provided with PROVIDE_BUFFERS requests rather than a registered buffer
+ * ring: some kernels accept the ring, yet never select a buffer from it and write the
+ * entries into memory that isn't theirs. The requests are batched like any other.
+ *
+ * The ring is set up with raw syscalls, so there is no dependency on liburing.
+ * Requires Linux 5.13 or newer, and 6.0 for the sockets the loop receives from, which is
+ * checked once by receiving a byte over a socket pair. The loop only watches readiness
+ * if that fails.
+ */
+class UringEventLoop final : public EventLoop {
+	struct Send {
+		// keeps the data alive until the send is completed, even if it is cancelled
+		std::shared_ptr<const void> owner;
+		std::span<const uint8_t> data;
+	};
+
+	struct Registration {
+		uint64_t token = 0;
+		uint32_t events = 0;
+		// distinguishes completions of the current poll request from the stale ones
+		uint32_t generation = 0;
+		// distinguishes the receives and sends of the descriptor from the ones of the
+		// descriptor that was removed before
+		uint32_t epoch = 0;
+		bool active = false;
+		// the data is received by the loop, so the poll request doesn't watch readability
+		bool receiving = false;
+		// only one send of a descriptor is in progress at a time
+		std::optional<Send> send;
+	};
+
+	int m_ring_fd = -1;
+
+	void *m_sq_ring = nullptr;
+	size_t m_sq_ring_size = 0;
+	void *m_cq_ring = nullptr;
+	size_t m_cq_ring_size = 0;
+	struct io_uring_sqe *m_sqes = nullptr;
+	size_t m_sqes_size = 0;
+
+	unsigned *m_sq_head = nullptr;
+	unsigned *m_sq_tail = nullptr;
+	unsigned m_sq_mask = 0;
+	unsigned m_sq_entries = 0;
+	unsigned *m_cq_head = nullptr;
+	unsigned *m_cq_tail = nullptr;
+	unsigned m_cq_mask = 0;
+	struct io_uring_cqe *m_cqes = nullptr;
+
+	unsigned m_to_submit = 0;
+
+	static constexpr uint16_t m_buffer_group = 0;
+	uint8_t *m_buffers = nullptr;
+	size_t m_buffers_size = 0;
+	size_t m_buffer_size = 0;
+	bool m_performs_io = false;
+	// the buffers handed out with the events of the last wait()
+	std::vector<uint16_t> m_lent;
+
+	// the data of the sends of removed descriptors, by user_data of the request, is kept
+	// until they complete
+	std::map<uint64_t, std::shared_ptr<const void>> m_cancelled_sends;
+	// the sends reported by the last wait(), their data must be valid until the next one
+	std::vector<std::shared_ptr<const void>> m_sent;
+
+	// indexed by file descriptor
+	std::vector<Registration> m_registrations;
+	std::vector<Event> m_ready;
+
+	[[nodiscard]] struct io_uring_sqe *get_sqe();
+	void enter(unsigned wait_nr, int timeout_ms);
+	void arm(int fd);
+	void disarm(int fd);
+	void arm_receive(int fd);
+	void cancel(uint64_t user_data);
+	/**
+	 * @brief Provides the buffers the receives pick from to the kernel
+	 *
+	 * @return false if the kernel can't receive into them
+	 */
+	bool setup_buffers(unsigned count, size_t size);
+	/**
+	 * @brief Receives a byte over a socket pair into one of the buffers
+	 *
+	 * @return false if the kernel didn't select a buffer for it
+	 */
+	bool probe_receive();
+	/**
+	 * @brief Queues the requests that provide the buffers to the kernel again
+	 *
+	 * @param buffers The ids in ascending order, adjacent buffers share a request
+	 */
+	void give_back(std::span<const uint16_t> buffers);
+	void reap_receive(const struct io_uring_cqe &cqe);
+	void reap_send(const struct io_uring_cqe &cqe);
+	void reap();
+	void release();
+
+public:
+	/**
+	 * @brief Sets up a new ring
+	 *
+	 * @param entries The size of the submission queue
+	 * @param buffers The number of buffers the sockets are received into, at most 65536.
+	 * The memory is only taken once the kernel fills the buffers
+	 * @param buffer_size The size of a single buffer
+	 * @throws std::runtime_error If io_uring is not supported or disabled on this host
+	 */
+	explicit UringEventLoop(unsigned entries = 256, unsigned buffers = 256,
+				size_t buffer_size = 16384);
+
+	UringEventLoop(const UringEventLoop &other) = delete;
+	UringEventLoop &operator=(const UringEventLoop &other) = delete;
+	UringEventLoop(UringEventLoop &&other) = delete;
+	UringEventLoop &operator=(UringEventLoop &&other) = delete;
+
+	void add(int fd, uint64_t token, uint32_t events) override;
+	void modify(int fd, uint64_t token, uint32_t events) override;
+	void remove(int fd) override;
+	[[nodiscard]] std::span<const Event> wait(int timeout_ms) override;
+
+	[[nodiscard]] bool performs_io() const override;
+	void receive(int fd) override;
+	void send(int fd, std::shared_ptr<const void> owner,
+		  std::span<const uint8_t> data) override;
+
+	~UringEventLoop() override;
+};
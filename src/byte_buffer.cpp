@@ -0,0 +1,90 @@
+#include "byte_buffer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+ByteBuffer::ByteBuffer(const size_t capacity)
+	: m_capacity(capacity)
+	, m_data(capacity)
+{
+}
+
+std::span<uint8_t> ByteBuffer::prepare(const size_t min_size)
+{
+	if (m_begin == m_end && m_data.size() > m_capacity && min_size <= m_capacity)
+	{
+		// give back the memory taken by an oversized message
+		clear();
+	}
+	if (m_data.size() - m_end < min_size)
+	{
+		// move the incomplete message to the front
+		const size_t size = m_end - m_begin;
+		std::memmove(m_data.data(), m_data.data() + m_begin, size);
+		m_begin = 0;
+		m_end = size;
+	}
+	if (m_data.size() - m_end < min_size)
+	{
+		m_data.resize(m_end + min_size);
+	}
+	return { m_data.data() + m_end, m_data.size() - m_end };
+}
+
+void ByteBuffer::commit(const size_t size)
+{
+	assert(m_end + size <= m_data.size());
+	m_end += size;
+}
+
+void ByteBuffer::append(const std::span<const uint8_t> bytes)
+{
+	const std::span<uint8_t> space = prepare(bytes.size());
+	std::memcpy(space.data(), bytes.data(), bytes.size());
+	commit(bytes.size());
+}
+
+std::span<const uint8_t> ByteBuffer::data() const
+{
+	return { m_data.data() + m_begin, m_end - m_begin };
+}
+
+void ByteBuffer::consume(const size_t size)
+{
+	assert(m_begin + size <= m_end);
+	m_begin += size;
+	if (m_begin == m_end)
+	{
+		// nothing to move on the next prepare(), the consumed data stays readable till then
+		m_begin = m_end = 0;
+	}
+}
+
+size_t ByteBuffer::size() const
+{
+	return m_end - m_begin;
+}
+
+bool ByteBuffer::empty() const
+{
+	return m_begin == m_end;
+}
+
+size_t ByteBuffer::capacity() const
+{
+	return m_data.size();
+}
+
+void ByteBuffer::clear()
+{
+	m_begin = m_end = 0;
+	if (m_data.size() > m_capacity)
+	{
+		m_data.resize(m_capacity);
+		m_data.shrink_to_fit();
+	}
+}
@@ -4,6 +4,8 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
 #include <sstream>
 #include <string>
 
@@ -15,6 +17,8 @@ static std::filesystem::path g_path_to_app_root;
 static std::filesystem::path g_path_to_cache_dir;
 static std::filesystem::path g_path_to_downloads_dir;
 
+static std::map<std::string, std::string> g_values;
+
 void load_configs()
 {
 	g_path_to_app_root = std::filesystem::canonical("/proc/self/exe");
@@ -49,6 +53,7 @@ void load_configs()
 		line_stream >> value;
 
 		std::cout << key << ch << value << '\n';
+		g_values[key] = value;
 	}
 }
 
@@ -74,4 +79,36 @@ std::filesystem::path get_path_to_downloads_dir()
 	return g_path_to_downloads_dir;
 }
 
+std::optional<std::string> get_value(const std::string &key)
+{
+	const auto it = g_values.find(key);
+	if (it == g_values.end())
+	{
+		return std::nullopt;
+	}
+	return it->second;
+}
+
+long long get_int(const std::string &key, const long long default_value)
+{
+	const auto value = get_value(key);
+	if (!value.has_value())
+	{
+		return default_value;
+	}
+	try
+	{
+		return std::stoll(value.value());
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Config value of " << key << " is not a number" << '\n';
+		return default_value;
+	}
+}
+
+void set_value(const std::string &key, const std::string &value)
+{
+	g_values[key] = value;
+}
+
 } // namespace config
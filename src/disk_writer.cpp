@@ -0,0 +1,166 @@
+#include "disk_writer.hpp"
+
+#include "piece.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+// DiskWriter --------------------------------------------------------------------------
+
+DiskWriter::DiskWriter(const size_t threads, const size_t capacity, WriteFunction write,
+		       ReadFunction read)
+	: m_write(std::move(write))
+	, m_read(std::move(read))
+	, m_capacity(std::max<size_t>(capacity, 1))
+{
+	for (size_t i = 0; i < threads; ++i)
+	{
+		m_workers.emplace_back([this](std::stop_token stop) { work(stop); });
+	}
+}
+
+void DiskWriter::submit(CompletionQueue &queue, ReceivedPiece piece)
+{
+	{
+		const std::lock_guard lock(m_mutex);
+		m_jobs.push_back({ std::move(piece), &queue, std::chrono::steady_clock::now() });
+		++m_stats.depth;
+		m_stats.max_depth = std::max(m_stats.max_depth, m_stats.depth);
+	}
+	m_cv.notify_one();
+}
+
+void DiskWriter::submit_read(ReadQueue &queue, const size_t index)
+{
+	{
+		const std::lock_guard lock(m_mutex);
+		m_reads.push_back({ index, &queue });
+	}
+	m_cv.notify_one();
+}
+
+bool DiskWriter::full()
+{
+	const std::lock_guard lock(m_mutex);
+	if (m_stats.depth < m_capacity)
+	{
+		return false;
+	}
+	m_reported_full = true;
+	return true;
+}
+
+void DiskWriter::set_on_available(std::function<void()> on_available)
+{
+	const std::lock_guard lock(m_mutex);
+	m_on_available = std::move(on_available);
+}
+
+DiskWriter::Stats DiskWriter::get_stats()
+{
+	const std::lock_guard lock(m_mutex);
+	return m_stats;
+}
+
+void DiskWriter::work(const std::stop_token stop)
+{
+	while (true)
+	{
+		std::optional<ReadJob> read_job;
+		Job job;
+		{
+			std::unique_lock lock(m_mutex);
+			if (!m_cv.wait(lock, stop,
+				       [this] { return !m_reads.empty() || !m_jobs.empty(); }))
+			{
+				return;
+			}
+			if (!m_reads.empty())
+			{
+				read_job = m_reads.front();
+				m_reads.pop_front();
+			}
+			else
+			{
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+		}
+
+		if (read_job.has_value())
+		{
+			read(read_job.value());
+		}
+		else
+		{
+			write(std::move(job));
+		}
+	}
+}
+
+void DiskWriter::read(const ReadJob &job)
+{
+	ReadResult result{ job.index, nullptr };
+	try
+	{
+		result.data = m_read(job.index);
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Failed to read piece " << job.index << ": " << ex.what() << '\n';
+	}
+	job.queue->push(std::move(result));
+}
+
+void DiskWriter::write(Job job)
+{
+	const auto started = std::chrono::steady_clock::now();
+	bool written = true;
+	try
+	{
+		m_write(job.piece);
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Failed to write piece " << job.piece.get_index() << ": " << ex.what()
+			  << '\n';
+		written = false;
+	}
+	const auto finished = std::chrono::steady_clock::now();
+
+	std::function<void()> on_available;
+	{
+		const std::lock_guard lock(m_mutex);
+		--m_stats.depth;
+		if (written)
+		{
+			++m_stats.pieces_written;
+		}
+		else
+		{
+			++m_stats.write_errors;
+		}
+		const auto latency = finished - job.submitted;
+		m_stats.total_latency += latency;
+		m_stats.max_latency = std::max<std::chrono::nanoseconds>(m_stats.max_latency, latency);
+		m_stats.total_write_time += finished - started;
+		if (m_reported_full && m_stats.depth < m_capacity)
+		{
+			m_reported_full = false;
+			on_available = m_on_available;
+		}
+	}
+
+	job.queue->push({ std::move(job.piece), written });
+	if (on_available)
+	{
+		on_available();
+	}
+}
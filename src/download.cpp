@@ -4,6 +4,7 @@
 #include "bencode.hpp"
 #include "config.hpp"
 #include "download_strategy.hpp"
+#include "event_loop.hpp"
 #include "expected.hpp"
 #include "peer_connection.hpp"
 #include "peer_message.hpp"
@@ -13,6 +14,7 @@
 #include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
@@ -20,13 +22,15 @@
 #include <filesystem>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <optional>
-#include <poll.h>
 #include <span>
 #include <stdexcept>
+#include <stop_token>
 #include <string>
-#include <sys/poll.h>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -99,7 +103,7 @@ std::optional<TrackerResponse> parse_tracker_response(const std::string &respons
 	else if (std::holds_alternative<bencode::string>(resp_data["peers"]))
 	{
 		const std::string peer_string = std::get<bencode::string>(resp_data["peers"]);
-		assert(peer_string.size() % (4 + 2) != 0 && "Malformed peers string received");
+		assert(peer_string.size() % (4 + 2) == 0 && "Malformed peers string received");
 
 		for (size_t i = 0; i < peer_string.size(); i += (4 + 2))
 		{
@@ -118,96 +122,378 @@ std::optional<TrackerResponse> parse_tracker_response(const std::string &respons
 
 // Download ----------------------------------------------------------------------------
 
-Download::Download(const std::string &path_to_torrent)
+Download::Download(const std::string &path_to_torrent, PeerListener *listener)
 	: m_metainfo(path_to_torrent)
 	, m_announce_list(std::move(m_metainfo.announce_list))
-	, m_dl_strategy(std::make_unique<DownloadStrategySequential>(number_of_pieces()))
+	, m_dl_strategy(std::make_unique<DownloadStrategySynchronized>(
+		  std::make_unique<DownloadStrategySequential>(number_of_pieces())))
 	, m_handshake(m_metainfo.info.get_sha1(), m_connection_id)
 	, m_bitfield(number_of_pieces())
+	, m_piece_cache(static_cast<size_t>(std::max(
+				config::get_int("upload_cache", m_default_upload_cache), 0LL)) *
+			1024 * 1024)
+	, m_zerocopy(config::get_int("zerocopy", 0) != 0)
+	// there is always room for at least one piece
+	, m_piece_arena(std::max(static_cast<size_t>(std::max(config::get_int("piece_memory",
+									       m_default_piece_memory),
+							      0LL)) *
+					 1024 * 1024,
+				 static_cast<size_t>(m_metainfo.info.piece_length)),
+			config::get_int("huge_pages", 0) != 0)
+	, m_listener(listener)
+	, m_resolver(static_cast<size_t>(std::max(config::get_int("resolver_threads", 2), 1LL)),
+		     std::chrono::seconds(config::get_int("dns_cache_ttl", 300)))
+	, m_hash_pool(static_cast<size_t>(std::max(config::get_int("hash_threads", 2), 1LL)))
+	, m_disk_writer(static_cast<size_t>(std::max(config::get_int("disk_threads", 1), 1LL)),
+			static_cast<size_t>(std::max(
+				config::get_int("disk_queue", m_default_disk_queue), 1LL)),
+			[this](const ReceivedPiece &piece) { m_storage->write_piece(piece); },
+			[this](const size_t index) {
+				const size_t length = index == number_of_pieces() - 1 ?
+							      static_cast<size_t>(m_last_piece_size) :
+							      m_metainfo.info.piece_length;
+				auto piece = std::make_shared<std::vector<uint8_t>>(length);
+				m_storage->read(index * m_metainfo.info.piece_length, *piece);
+				return piece;
+			})
 {
 	create_download_layout();
+	// before the files are created, so that a new download isn't read back
+	check_layout();
 	preallocate_files();
-	// check_layout();
+	create_storage();
+	create_shards();
+	m_piece_arena.set_on_available([this] {
+		for (const auto &shard : m_shards)
+		{
+			shard->notifier.notify();
+		}
+	});
+	m_disk_writer.set_on_available([this] {
+		for (const auto &shard : m_shards)
+		{
+			shard->notifier.notify();
+		}
+	});
+	if (m_listener != nullptr)
+	{
+		m_listen_port = m_listener->get_port();
+		m_listener->add(m_metainfo.info.get_sha1(),
+				[this](TCPClient socket, const std::span<const uint8_t> handshake) {
+					route_incoming_peer(std::move(socket), handshake);
+				});
+	}
 }
 
-void Download::create_download_layout()
+Download::~Download()
 {
-	size_t index = 0;
-	long long left_offset = 0;
-	long long right_offset = 0;
-	for (auto &fileinfo : m_metainfo.info.files)
+	// no more peers are routed to the shards once it returns
+	if (m_listener != nullptr)
 	{
-		std::set<size_t> needed_pieces;
+		m_listener->remove(m_metainfo.info.get_sha1());
+	}
+	// the arena outlives the shards, and the buffers they hold are returned to it while
+	// they are destroyed one by one
+	m_piece_arena.set_on_available({});
+	m_disk_writer.set_on_available({});
+}
+
+Download::Shard::Shard(const size_t max_peers)
+	: peer_connections(max_peers)
+	, max_peers(max_peers)
+{
+	loop->add(notifier.get_fd(), m_wakeup_token, EventLoop::readable);
+	loop->add(hashed_pieces.get_fd(), m_hash_token, EventLoop::readable);
+	loop->add(written_pieces.get_fd(), m_write_token, EventLoop::readable);
+	loop->add(read_pieces.get_fd(), m_read_token, EventLoop::readable);
+	loop->add(incoming_peers.get_fd(), m_incoming_token, EventLoop::readable);
+}
 
-		long long len = fileinfo.length + left_offset;
-		while (len > 0)
+void Download::create_shards()
+{
+	const auto max_peers = static_cast<size_t>(
+		std::max(config::get_int("max_peers", m_default_max_peers), 1LL));
+	const auto cores = static_cast<long long>(std::thread::hardware_concurrency());
+	auto threads = static_cast<size_t>(std::max(config::get_int("threads", cores), 1LL));
+	// there is no point in a shard that can't have a single connection
+	threads = std::min(threads, max_peers);
+
+	for (size_t i = 0; i < threads; ++i)
+	{
+		// spread the remainder over the first shards
+		const size_t shard_peers = max_peers / threads + (i < max_peers % threads ? 1 : 0);
+		m_shards.emplace_back(std::make_unique<Shard>(shard_peers));
+	}
+	// the tracker lives in the first shard, so do the lookups for it
+	m_resolver_registration.attach(*m_shards.front()->loop, m_resolver.get_fd(),
+				       m_resolver_token, EventLoop::readable);
+	m_shards.front()->loop->add(m_shutdown_signal.get_fd(), m_signal_token,
+				    EventLoop::readable);
+	std::clog << "Running " << threads << " reactor thread(s)" << '\n';
+}
+
+bool Download::reserve_slot(Shard &shard)
+{
+	size_t peers = shard.peers;
+	while (peers < shard.max_peers)
+	{
+		if (shard.peers.compare_exchange_weak(peers, peers + 1))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void Download::route_incoming_peer(TCPClient socket, const std::span<const uint8_t> handshake)
+{
+	while (true)
+	{
+		Shard *best = nullptr;
+		for (const auto &shard : m_shards)
+		{
+			if (shard->peers < shard->max_peers &&
+			    (best == nullptr || shard->peers < best->peers))
+			{
+				best = shard.get();
+			}
+		}
+		if (best == nullptr)
 		{
-			needed_pieces.insert(index);
-			len -= m_metainfo.info.piece_length;
-			++index;
+			// the socket is closed, so the peer knows it should try later
+			std::clog << "Incoming peer rejected, too many connections" << '\n';
+			return;
 		}
-		if (len < 0)
+		// the shard may have been filled since it was picked
+		if (reserve_slot(*best))
 		{
-			--index;
+			IncomingPeer peer{ std::move(socket), {} };
+			std::copy(handshake.begin(), handshake.end(), peer.handshake.begin());
+			best->incoming_peers.push(std::move(peer));
+			return;
 		}
-		right_offset = -len;
+	}
+}
 
-		m_dl_layout.emplace_back(std::move(fileinfo), std::move(needed_pieces), left_offset,
-					 right_offset);
+message::Bitfield Download::copy_bitfield()
+{
+	const std::lock_guard lock(m_bitfield_mutex);
+	return m_bitfield;
+}
 
-		left_offset = m_metainfo.info.piece_length - right_offset;
+bool Download::set_piece_as_have(const size_t index)
+{
+	const std::lock_guard lock(m_bitfield_mutex);
+	if (m_bitfield.get_index(index))
+	{
+		return false;
 	}
+	m_bitfield.set_index(index, true);
+	++m_pieces_have;
+	return true;
+}
 
-	m_last_piece_size = m_metainfo.info.piece_length - right_offset;
+bool Download::has_piece(const size_t index)
+{
+	const std::lock_guard lock(m_bitfield_mutex);
+	return m_bitfield.get_index(index);
+}
 
-	m_dl_layout.back().mark_as_last_file();
+void Download::create_download_layout()
+{
+	const auto piece_len = static_cast<size_t>(m_metainfo.info.piece_length);
+	const std::filesystem::path fdir_path =
+		config::get_path_to_downloads_dir() / m_metainfo.info.name;
+	std::vector<FileLayout::File> files;
+	size_t offset = 0;
+	m_dl_layout.reserve(m_metainfo.info.files.size());
+	for (auto &fileinfo : m_metainfo.info.files)
+	{
+		const auto length = static_cast<size_t>(fileinfo.length);
+		files.push_back({ fdir_path / fileinfo.path, offset, length });
+		m_dl_layout.emplace_back(std::move(fileinfo));
+		offset += length;
+	}
+	m_layout = FileLayout(std::move(files), piece_len);
+
+	// the last piece is short unless the torrent ends exactly on a piece boundary
+	m_last_piece_size = static_cast<long long>(offset % piece_len == 0 ? piece_len :
+									      offset % piece_len);
 }
 
 void Download::check_layout()
 {
-	size_t i = 0;
-	size_t j = 0;
-	const auto piece_len = static_cast<size_t>(m_metainfo.info.piece_length);
-	const std::filesystem::path fdir_path = m_metainfo.info.name;
-	std::vector<uint8_t> piece(piece_len);
-	while (j < m_dl_layout.size())
+	const auto &files = m_layout.files();
+	const std::string info_hash(m_metainfo.info.get_sha1().begin(),
+				    m_metainfo.info.get_sha1().end());
+
+	message::Bitfield verified(number_of_pieces());
+	message::Bitfield to_check(number_of_pieces());
+	const auto resume = ResumeData::load(resume_data_path(), number_of_pieces());
+	const bool resume_valid = resume.has_value() && resume->info_hash == info_hash &&
+				  resume->piece_length == m_metainfo.info.piece_length &&
+				  resume->files.size() == files.size();
+	if (resume_valid)
 	{
-		auto [is_full_piece, bytes_read] =
-			m_dl_layout[j].read_piece(i, piece, fdir_path, piece_len);
+		verified = resume->pieces;
+	}
 
-		if (is_full_piece)
+	size_t changed_files = 0;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (files[i].length == 0 ||
+		    (resume_valid && ResumeData::stat_file(files[i].path) == resume->files[i]))
 		{
-			// we got the piece
-			auto sha1 = utils::compute_sha1(piece);
-			std::span<const uint8_t> supposed_sha1(
-				reinterpret_cast<const uint8_t *>(m_metainfo.info.pieces.data()) +
-					20 * i,
-				20);
-
-			std::cout << "Piece " << i << "/" << m_metainfo.info.pieces.size() / 20
-				  << " is ";
-			if (std::equal(sha1.begin(), sha1.end(), supposed_sha1.begin()))
-			{
-				std::cout << "already downloaded";
-				m_bitfield.set_index(i, true);
-			}
-			else
-			{
-				std::cout << "not yet downloaded";
-			}
-			std::cout << '\n';
+			continue;
+		}
+		++changed_files;
+		const auto [first, last] = m_layout.pieces_of(i);
+		for (size_t ind = first; ind <= last; ++ind)
+		{
+			to_check.set_index(ind, true);
+		}
+	}
+	std::clog << (resume_valid ? "Fast-resume record found, " : "No fast-resume record, ")
+		  << changed_files << " file(s) to verify" << '\n';
 
-			++i;
-			if (m_dl_layout[j].is_piece_part_of_file(i) == 1)
+	if (changed_files != 0)
+	{
+		const auto cores = static_cast<long long>(std::thread::hardware_concurrency());
+		const auto threads = static_cast<size_t>(
+			std::max(config::get_int("recheck_threads", cores), 1LL));
+		Recheck recheck(m_layout, m_metainfo.info.pieces);
+		const message::Bitfield rechecked = recheck.run(threads, to_check);
+		for (size_t i = 0; i < number_of_pieces(); ++i)
+		{
+			if (to_check.get_index(i))
 			{
-				++j;
+				verified.set_index(i, rechecked.get_index(i));
 			}
 		}
-		else
+	}
+
+	for (size_t i = 0; i < number_of_pieces(); ++i)
+	{
+		if (verified.get_index(i))
 		{
-			++j;
+			m_bitfield.set_index(i, true);
+			m_dl_strategy->mark_as_downloaded(i);
+			++m_pieces_have;
 		}
 	}
+	// nothing new to save until a piece is downloaded, unless the record was stale
+	m_pieces_saved = changed_files == 0 ? m_pieces_have : 0;
+	std::clog << m_pieces_have << "/" << number_of_pieces() << " pieces are already downloaded"
+		  << '\n';
+}
+
+std::vector<std::filesystem::path> Download::file_paths() const
+{
+	std::vector<std::filesystem::path> ret;
+	for (const auto &file : m_layout.files())
+	{
+		ret.push_back(file.path);
+	}
+	return ret;
+}
+
+std::filesystem::path Download::resume_data_path() const
+{
+	std::string name;
+	for (const uint8_t byte : m_metainfo.info.get_sha1())
+	{
+		static constexpr std::string_view digits = "0123456789abcdef";
+		name += digits[byte >> 4];
+		name += digits[byte & 0xF];
+	}
+	return config::get_path_to_cache_dir() / (name + ".resume");
+}
+
+void Download::save_resume_data()
+{
+	const std::lock_guard lock(m_resume_mutex);
+
+	ResumeData data;
+	size_t pieces_have = 0;
+	{
+		const std::lock_guard bitfield_lock(m_bitfield_mutex);
+		data.pieces = m_bitfield;
+		pieces_have = m_pieces_have;
+	}
+	if (pieces_have == m_pieces_saved)
+	{
+		return;
+	}
+	data.info_hash.assign(m_metainfo.info.get_sha1().begin(), m_metainfo.info.get_sha1().end());
+	data.piece_length = m_metainfo.info.piece_length;
+	// after the bitfield is copied, so every piece in it is already written when the files
+	// are examined. Pieces written later change the mtime and get verified on restart
+	for (const auto &path : file_paths())
+	{
+		data.files.push_back(ResumeData::stat_file(path));
+	}
+
+	try
+	{
+		data.save(resume_data_path());
+		m_pieces_saved = pieces_have;
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Failed to save fast-resume record: " << ex.what() << '\n';
+	}
+}
+
+void Download::report_stats()
+{
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+
+	// the upload rate is averaged since the last report
+	const auto now = std::chrono::steady_clock::now();
+	const size_t uploaded = m_bytes_uploaded;
+	const std::chrono::duration<double> elapsed = now - m_last_report;
+	if (uploaded != m_uploaded_at_last_report && elapsed.count() > 0)
+	{
+		static constexpr double mib = 1024.0 * 1024.0;
+		std::clog << "Upload: " << static_cast<double>(uploaded) / mib << " MiB total, "
+			  << static_cast<double>(uploaded - m_uploaded_at_last_report) / mib /
+				     elapsed.count()
+			  << " MiB/s" << '\n';
+	}
+	m_last_report = now;
+	m_uploaded_at_last_report = uploaded;
+
+	const PieceCache::Stats cache = m_piece_cache.get_stats();
+	if (cache.hits + cache.misses != 0)
+	{
+		std::clog << "Upload cache: hit ratio "
+			  << 100.0 * static_cast<double>(cache.hits) /
+				     static_cast<double>(cache.hits + cache.misses)
+			  << "%, " << cache.pieces << " pieces (" << cache.bytes / (1024 * 1024)
+			  << " MiB), " << cache.evictions << " evicted" << '\n';
+	}
+
+	const DiskWriter::Stats stats = m_disk_writer.get_stats();
+	const size_t finished = stats.pieces_written + stats.write_errors;
+	if (finished == 0)
+	{
+		return;
+	}
+	std::clog << "Disk: " << stats.pieces_written << " pieces written, " << stats.write_errors
+		  << " failed, queue depth " << stats.depth << " (max " << stats.max_depth
+		  << "), latency avg "
+		  << duration_cast<microseconds>(stats.total_latency).count() /
+			     static_cast<long long>(finished)
+		  << " us (max " << duration_cast<microseconds>(stats.max_latency).count()
+		  << " us), write avg "
+		  << duration_cast<microseconds>(stats.total_write_time).count() /
+			     static_cast<long long>(finished)
+		  << " us" << '\n';
+}
+
+void Download::create_storage()
+{
+	m_storage = make_storage(m_layout);
 }
 
 void Download::preallocate_files()
@@ -216,9 +502,30 @@ void Download::preallocate_files()
 	const fs::path dl_root = config::get_path_to_downloads_dir() / m_metainfo.info.name;
 	fs::create_directory(dl_root);
 	const fs::path fdir_path = m_metainfo.info.name;
+
+	const std::string name = config::get_value("preallocate").value_or("sparse");
+	auto mode = FileHandler::Preallocation::SPARSE;
+	if (name == "full")
+	{
+		mode = FileHandler::Preallocation::FULL;
+	}
+	else if (name == "none")
+	{
+		mode = FileHandler::Preallocation::NONE;
+	}
+	else if (name != "sparse")
+	{
+		std::cerr << "Unknown preallocation mode " << name << ", using sparse" << '\n';
+	}
+
+	bool reserved = true;
 	for (const auto &file : m_dl_layout)
 	{
-		file.preallocate_file(fdir_path);
+		reserved = file.preallocate_file(fdir_path, mode) && reserved;
+	}
+	if (!reserved)
+	{
+		std::cerr << "The filesystem can't reserve space, the files are sparse" << '\n';
 	}
 }
 
@@ -228,7 +535,7 @@ size_t Download::number_of_pieces() const
 	return m_metainfo.info.pieces.size() / 20;
 }
 
-void Download::handshake_cb(size_t /*index*/, std::span<const uint8_t> view)
+void Download::handshake_cb(PeerConnection &conn, std::span<const uint8_t> view)
 {
 	message::Handshake peer_hs(view);
 
@@ -239,68 +546,136 @@ void Download::handshake_cb(size_t /*index*/, std::span<const uint8_t> view)
 	}
 	else
 	{
+		// an incoming peer may be asking for a torrent we don't have
 		std::cerr << "Invalid handshake" << '\n';
 		throw std::runtime_error("Connection terminated");
 	}
+	if (!conn.handshake_sent())
+	{
+		// the peer connected to us, so the tracker path must not connect to it again
+		auto [ip, port] = conn.peer_ip_and_port();
+		{
+			const std::lock_guard lock(m_backlog_mutex);
+			Peer peer{ "", std::move(ip), std::move(port) };
+			m_peer_backlog.erase(peer);
+			m_peers_in_use_or_banned.insert(std::move(peer));
+		}
+		conn.send_handshake(m_handshake, copy_bitfield());
+	}
 }
 
-void Download::keepalive_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+void Download::keepalive_cb(PeerConnection & /*conn*/, std::span<const uint8_t> /*view*/)
 {
 	// not implemented
 }
 
-void Download::choke_cb(size_t index, std::span<const uint8_t> /*view*/)
+void Download::choke_cb(PeerConnection &conn, std::span<const uint8_t> /*view*/)
 {
-	auto &conn = m_peer_connections[index];
 	conn.am_choking = true;
-	conn.reset_request_queue();
 	const auto ap = conn.assigned_pieces();
 	for (auto index : ap)
 	{
 		m_dl_strategy->mark_as_discarded(index);
 	}
+	conn.reset_request_queue();
 }
 
-void Download::unchoke_cb(size_t index, std::span<const uint8_t> /*view*/)
+void Download::unchoke_cb(PeerConnection &conn, std::span<const uint8_t> /*view*/)
 {
-	auto &conn = m_peer_connections[index];
 	conn.am_choking = false;
 
+	conn.send_interested();
+	if (assign_next_piece(conn))
+	{
+		std::cerr << "Unchoke: placed requests into queue" << '\n';
+	}
+}
+
+bool Download::assign_next_piece(PeerConnection &conn)
+{
+	// the strategy is not even asked while there is no memory for another piece or the
+	// disk is behind, the peer is resumed once some piece is finished or written
+	if (m_disk_writer.full())
+	{
+		return false;
+	}
+	PieceBuffer buffer = m_piece_arena.acquire(m_metainfo.info.piece_length);
+	if (buffer.empty())
+	{
+		return false;
+	}
+
 	const auto ind = m_dl_strategy->next_piece_to_dl(conn.peer_bitfield);
 	if (!ind)
 	{
-		const auto err = ind.error();
-		switch (err)
+		switch (ind.error())
 		{
 		case DownloadStrategy::ReturnStatus::NO_PIECE_FOUND:
-			std::cerr << "Unchoke: no pieces to found to download" << '\n';
-			conn.send_notinterested();
-			return;
+			// every missing piece it has is assigned to other peers for now, it stays idle
+			// and interested until resume_idle_peers() finds something for it
+			return false;
 		case DownloadStrategy::ReturnStatus::DOWNLOAD_COMPLETED:
-			throw std::runtime_error("Download completed");
+			// the peer is kept, since it may still download from us
+			conn.send_notinterested();
+			return false;
 		}
 	}
-	conn.send_interested();
+
+	if (conn.assigned_pieces().contains(ind.value()))
+	{
+		// in endgame the strategy may pick the piece this peer is already downloading
+		return false;
+	}
+
 	const size_t piece_length = ind == number_of_pieces() - 1 ? m_last_piece_size :
 								    m_metainfo.info.piece_length;
-	conn.create_requests_for_piece(ind.value(), piece_length);
-
+	// requests may only follow Interested
+	conn.send_interested();
+	conn.create_requests_for_piece(ind.value(), piece_length, std::move(buffer), &m_hash_pool);
 	(void)conn.send_request();
-	std::cerr << "Unchoke: placed requests into queue" << '\n';
+	return true;
 }
 
-void Download::interested_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+void Download::resume_idle_peers(Shard &shard)
 {
-	// not implemented
+	std::vector<ConnectionHandle> idle;
+	shard.peer_connections.for_each([&idle](const ConnectionHandle handle, PeerConnection &conn) {
+		if (conn.handshake_received() && !conn.am_choking && !conn.is_downloading())
+		{
+			idle.push_back(handle);
+		}
+	});
+
+	for (const auto handle : idle)
+	{
+		PeerConnection *conn = shard.peer_connections.get(handle);
+		try
+		{
+			(void)assign_next_piece(*conn);
+		} catch (const std::exception &ex)
+		{
+			std::cerr << "Peer " << handle.index << " disconected due to: " << ex.what()
+				  << '\n';
+			disconnect_peer(shard, handle);
+		}
+	}
 }
-void Download::notinterested_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+
+void Download::interested_cb(PeerConnection &conn, std::span<const uint8_t> /*view*/)
 {
-	// not implemented
+	conn.peer_interested = true;
+	// every interested peer is served, there is no choking algorithm
+	conn.send_unchoke();
+}
+
+void Download::notinterested_cb(PeerConnection &conn, std::span<const uint8_t> /*view*/)
+{
+	conn.peer_interested = false;
+	conn.send_choke();
 }
 
-void Download::have_cb(size_t index, std::span<const uint8_t> view)
+void Download::have_cb(PeerConnection &conn, std::span<const uint8_t> view)
 {
-	auto &conn = m_peer_connections[index];
 	const message::Have have(view);
 	conn.peer_bitfield.set_index(have.get_index(), true);
 
@@ -318,33 +693,13 @@ void Download::have_cb(size_t index, std::span<const uint8_t> view)
 				// wait for unchoke
 				return;
 			}
-			const auto ind = m_dl_strategy->next_piece_to_dl(conn.peer_bitfield);
-			if (!ind)
-			{
-				const auto err = ind.error();
-				switch (err)
-				{
-				case DownloadStrategy::ReturnStatus::NO_PIECE_FOUND:
-					conn.send_notinterested();
-					return;
-				case DownloadStrategy::ReturnStatus::DOWNLOAD_COMPLETED:
-					throw std::runtime_error("Download completed");
-				}
-			}
-
-			const size_t piece_length = ind == number_of_pieces() - 1 ?
-							    m_last_piece_size :
-							    m_metainfo.info.piece_length;
-			conn.create_requests_for_piece(ind.value(), piece_length);
-
-			(void)conn.send_request();
+			(void)assign_next_piece(conn);
 		}
 	}
 }
 
-void Download::bitfield_cb(size_t index, std::span<const uint8_t> view)
+void Download::bitfield_cb(PeerConnection &conn, std::span<const uint8_t> view)
 {
-	auto &conn = m_peer_connections[index];
 	conn.peer_bitfield = message::Bitfield(view, m_bitfield.get_bf_size());
 
 	if (!m_dl_strategy->have_missing_pieces(conn.peer_bitfield))
@@ -355,16 +710,87 @@ void Download::bitfield_cb(size_t index, std::span<const uint8_t> view)
 	conn.send_interested();
 }
 
-void Download::request_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+void Download::request_cb(Shard &shard, const ConnectionHandle handle, PeerConnection &conn,
+			  std::span<const uint8_t> view)
 {
-	// not implemented
+	const message::Request request(view);
+	if (conn.is_choking_peer())
+	{
+		// the peer may not know it is choked yet, so the request is just dropped
+		return;
+	}
+
+	const size_t index = request.get_index();
+	if (index >= number_of_pieces() || !has_piece(index))
+	{
+		std::cerr << "Request for piece " << index << " that we don't have" << '\n';
+		throw std::runtime_error("Connection terminated");
+	}
+	const size_t piece_size = index == number_of_pieces() - 1 ?
+					  static_cast<size_t>(m_last_piece_size) :
+					  static_cast<size_t>(m_metainfo.info.piece_length);
+	const size_t begin = request.get_begin();
+	const size_t length = request.get_length();
+	if (length == 0 || length > PeerConnection::max_block_size || begin >= piece_size ||
+	    length > piece_size - begin)
+	{
+		std::cerr << "Invalid request" << '\n';
+		throw std::runtime_error("Connection terminated");
+	}
+	if (!conn.queue_upload(request))
+	{
+		std::cerr << "Too many requests" << '\n';
+		throw std::runtime_error("Connection terminated");
+	}
+	serve_uploads(shard, handle, conn);
 }
 
-void Download::block_cb(size_t index, std::span<const uint8_t> /*view*/)
+bool Download::serve_uploads(Shard &shard, const ConnectionHandle handle, PeerConnection &conn)
 {
-	auto &conn = m_peer_connections[index];
+	bool ret = false;
+	while (const auto request = conn.next_upload())
+	{
+		const size_t index = request->get_index();
+		if (m_piece_cache.enabled())
+		{
+			// a piece that was just read is served from the read, so that it doesn't have
+			// to fit into the cache
+			const auto pending = shard.pending_reads.find(index);
+			PieceCache::Data piece = pending != shard.pending_reads.end() ?
+							 pending->second.data :
+							 m_piece_cache.find(index);
+			if (piece == nullptr)
+			{
+				// the peer waits for the read, the other peers go on
+				conn.requeue_upload(request.value());
+				auto &read = shard.pending_reads[index];
+				if (read.peers.empty())
+				{
+					m_disk_writer.submit_read(shard.read_pieces, index);
+				}
+				read.peers.insert(handle.token());
+				return ret;
+			}
+			conn.send_cached_block(request.value(), std::move(piece));
+		}
+		else
+		{
+			// the block goes from the page cache to the socket with sendfile()
+			const size_t offset =
+				index * m_metainfo.info.piece_length + request->get_begin();
+			conn.send_file_block(request.value(),
+					     m_storage->file_ranges(offset, request->get_length()));
+		}
+		m_bytes_uploaded += request->get_length();
+		ret = true;
+	}
+	return ret;
+}
 
-	int rc = conn.add_block();
+void Download::block_cb(Shard &shard, const ConnectionHandle handle, PeerConnection &conn,
+			std::span<const uint8_t> view)
+{
+	int rc = conn.add_block(view);
 	if (rc == -1)
 	{
 		std::cerr << "Block validation failed" << '\n';
@@ -372,86 +798,170 @@ void Download::block_cb(size_t index, std::span<const uint8_t> /*view*/)
 	}
 	if (rc == 1)
 	{
-		ReceivedPiece piece = conn.get_received_piece();
-		const std::string sha1 = piece.compute_sha1();
-		const size_t ind = piece.get_index();
+		// verified by the pool, the result comes back through hash_callback()
+		m_hash_pool.submit(shard.hashed_pieces, conn.get_received_piece(), handle.token());
+	}
+
+	if (conn.send_request() == 1)
+	{
+		(void)assign_next_piece(conn);
+	}
+}
 
+void Download::hash_callback(Shard &shard)
+{
+	for (auto &result : shard.hashed_pieces.take_results())
+	{
+		const size_t ind = result.piece.get_index();
 		const std::string sha1_expected =
 			m_metainfo.info.pieces.substr(ind * utils::sha1_length, utils::sha1_length);
-		if (sha1 == sha1_expected)
+		if (result.sha1 != sha1_expected)
+		{
+			m_dl_strategy->mark_as_discarded(ind);
+			std::cerr << "Piece validation failed" << '\n';
+			// does nothing if the peer is already gone
+			disconnect_peer(shard, ConnectionHandle::from_token(result.token));
+			continue;
+		}
+
+		if (has_piece(ind))
 		{
-			// on success
-			for (const auto &fh : m_dl_layout)
+			// in endgame the same piece may come from several peers
+			continue;
+		}
+		// the piece is written before it is marked, so the fast-resume record never
+		// has a piece that is not on disk. The result comes back through write_callback()
+		m_disk_writer.submit(shard.written_pieces, std::move(result.piece));
+	}
+}
+
+void Download::write_callback(Shard &shard)
+{
+	for (const auto &result : shard.written_pieces.take_results())
+	{
+		const size_t ind = result.piece.get_index();
+		if (!result.written)
+		{
+			m_dl_strategy->mark_as_discarded(ind);
+			continue;
+		}
+		if (!set_piece_as_have(ind))
+		{
+			// another shard has written it meanwhile
+			continue;
+		}
+		m_dl_strategy->mark_as_downloaded(ind);
+		std::clog << "Piece " << ind << " was received" << '\n';
+
+		for (const auto &other : m_shards)
+		{
+			{
+				const std::lock_guard lock(other->have_mutex);
+				other->have_pieces.push_back(ind);
+			}
+			other->notifier.notify();
+		}
+	}
+}
+
+void Download::read_callback(Shard &shard)
+{
+	for (auto &result : shard.read_pieces.take_results())
+	{
+		auto &read = shard.pending_reads[result.index];
+		read.data = result.data;
+		if (read.data != nullptr)
+		{
+			m_piece_cache.insert(result.index, read.data);
+		}
+
+		for (const uint64_t token : std::exchange(read.peers, {}))
+		{
+			const auto handle = ConnectionHandle::from_token(token);
+			PeerConnection *conn = shard.peer_connections.get(handle);
+			if (conn == nullptr)
+			{
+				continue;
+			}
+			try
 			{
-				int res = fh.is_piece_part_of_file(ind);
-				if (res == 0)
+				if (read.data == nullptr)
 				{
-					fh.write_piece(piece, m_metainfo.info.name,
-						       m_metainfo.info.piece_length);
+					throw std::runtime_error("requested piece could not be read");
 				}
-				if (res == 1)
+				while (serve_uploads(shard, handle, *conn) && conn->send() == 0)
 				{
-					break;
 				}
+			} catch (const std::exception &ex)
+			{
+				std::cerr << "Peer " << handle.index << " disconected due to: " << ex.what()
+					  << '\n';
+				disconnect_peer(shard, handle);
 			}
-			std::clog << "Piece " << ind << " was received" << '\n';
-		}
-		else
-		{
-			m_dl_strategy->mark_as_discarded(ind);
-			std::cerr << "Piece validation failed" << '\n';
-			throw std::runtime_error("Connection terminated");
 		}
+		shard.pending_reads.erase(result.index);
 	}
+}
 
-	if (conn.send_request() == 1)
+void Download::broadcast_haves(Shard &shard)
+{
+	std::vector<size_t> pieces;
+	{
+		const std::lock_guard lock(shard.have_mutex);
+		pieces.swap(shard.have_pieces);
+	}
+	if (pieces.empty())
 	{
-		auto ind = m_dl_strategy->next_piece_to_dl(conn.peer_bitfield);
-		if (!ind)
+		return;
+	}
+
+	std::vector<ConnectionHandle> failed;
+	shard.peer_connections.for_each([&](const ConnectionHandle handle, PeerConnection &conn) {
+		if (!conn.handshake_received())
 		{
-			std::cerr << "Piece_cb: error during send_request()" << '\n';
-			const auto err = ind.error();
-			switch (err)
-			{
-			case DownloadStrategy::ReturnStatus::NO_PIECE_FOUND:
-				conn.send_notinterested();
-				return;
-			case DownloadStrategy::ReturnStatus::DOWNLOAD_COMPLETED:
-				throw std::runtime_error("Download completed");
-			}
+			return;
 		}
-		else
+		for (const size_t ind : pieces)
 		{
-			const size_t piece_length = ind == number_of_pieces() - 1 ?
-							    m_last_piece_size :
-							    m_metainfo.info.piece_length;
-			conn.create_requests_for_piece(ind.value(), piece_length);
-			(void)conn.send_request();
+			conn.send_have(ind);
 		}
+		try
+		{
+			(void)conn.send();
+		} catch (const std::exception &ex)
+		{
+			failed.push_back(handle);
+		}
+	});
+
+	for (const auto handle : failed)
+	{
+		std::cerr << "Peer " << handle.index << " disconected due to failed send" << '\n';
+		disconnect_peer(shard, handle);
 	}
 }
 
-void Download::cancel_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+void Download::cancel_cb(PeerConnection &conn, std::span<const uint8_t> view)
 {
-	// not implemented
+	conn.cancel_upload(message::Cancel(view));
 }
-void Download::port_cb(size_t /*index*/, std::span<const uint8_t> /*view*/)
+void Download::port_cb(PeerConnection & /*conn*/, std::span<const uint8_t> /*view*/)
 {
 	// not implemented
 }
 
-void Download::peer_callback(const size_t index)
+void Download::peer_callback(Shard &shard, const ConnectionHandle handle, PeerConnection &conn,
+			     const std::span<const uint8_t> view)
 {
-	const auto view = m_peer_connections[index].view_recv_message();
 	if (view.size() <= 4)
 	{
 		std::clog << "Received KeepAlive from peer" << '\n';
-		keepalive_cb(index, view);
+		keepalive_cb(conn, view);
 	}
 	else if (view.size() == 68 && view[0] == 19)
 	{
 		std::clog << "Received Handshake from peer" << '\n';
-		handshake_cb(index, view);
+		handshake_cb(conn, view);
 	}
 	else
 	{
@@ -460,62 +970,62 @@ void Download::peer_callback(const size_t index)
 		case 0:
 
 			std::clog << "Received Choke from peer" << '\n';
-			choke_cb(index, view);
+			choke_cb(conn, view);
 			break;
 
 		case 1:
 			// Unchoke
 
 			std::clog << "Received Unchoke from peer" << '\n';
-			unchoke_cb(index, view);
+			unchoke_cb(conn, view);
 			break;
 
 		case 2:
 			// Interested
 			std::clog << "Received Interested from peer" << '\n';
-			interested_cb(index, view);
+			interested_cb(conn, view);
 			break;
 
 		case 3:
 			// NotInterested
 			std::clog << "Received NotInterested from peer" << '\n';
-			notinterested_cb(index, view);
+			notinterested_cb(conn, view);
 			break;
 		case 4:
 			// Have
 
 			std::clog << "Received Have from peer" << '\n';
-			have_cb(index, view);
+			have_cb(conn, view);
 			break;
 
 		case 5:
 			// Bitfield
 
 			std::clog << "Received Bitfield from peer" << '\n';
-			bitfield_cb(index, view);
+			bitfield_cb(conn, view);
 			break;
 
 		case 6:
 			// Request
 			std::clog << "Received Request from peer" << '\n';
-			request_cb(index, view);
+			request_cb(shard, handle, conn, view);
 			break;
 
 		case 7:
 			// Piece
 			std::clog << "Received Piece from peer" << '\n';
-			block_cb(index, view);
+			block_cb(shard, handle, conn, view);
 			break;
 
 		case 8:
 			// Cancel
 			std::clog << "Received Cancel from peer" << '\n';
-			cancel_cb(index, view);
+			cancel_cb(conn, view);
 			break;
 		case 9:
 			// Port
 			std::clog << "Received Port from peer" << '\n';
-			port_cb(index, view);
+			port_cb(conn, view);
 			break;
 
 		default:
@@ -526,33 +1036,44 @@ void Download::peer_callback(const size_t index)
 	}
 }
 
-void Download::proceed_peer(const size_t index)
+void Download::proceed_peer(Shard &shard, const ConnectionHandle handle,
+			    PeerConnection &peer_conn, const EventLoop::Event &event)
 {
-	PeerConnection &peer_conn = m_peer_connections[index];
-	struct pollfd &peer_pollfd = m_fds[index];
-
-	if ((peer_pollfd.revents & POLLIN) != 0)
+	peer_conn.complete_io(event);
+	if ((event.events & (EventLoop::readable | EventLoop::received)) != 0)
 	{
-		const int rc = peer_conn.recv();
-		if (rc == 0)
+		// the loop is edge-triggered, so the socket has to be drained
+		int rc = 0;
+		do
 		{
-			peer_callback(index);
-			if (peer_conn.should_wait_for_send())
+			rc = peer_conn.recv();
+			// dispatch everything we have before the next syscall
+			while (const auto message = peer_conn.next_message())
 			{
-				peer_pollfd.events |= POLLOUT;
+				peer_callback(shard, handle, peer_conn, message.value());
 			}
-		}
+		} while (rc == 0);
 	}
 
-	if ((peer_pollfd.revents & POLLOUT) != 0)
+	// the kernel reports blocks sent with MSG_ZEROCOPY through the error queue
+	const bool failed =
+		(event.events & EventLoop::error) != 0 && !peer_conn.release_zerocopy_blocks();
+	if (failed && peer_conn.loop_performs_io())
 	{
-		assert(peer_conn.should_wait_for_send() == true);
-		if (peer_conn.send() == 0)
+		// no send would fail, since the loop performs them
+		throw std::runtime_error("Connection closed");
+	}
+
+	// callbacks may have queued messages, so try to send them without waiting for the loop
+	if ((event.events & (EventLoop::writable | EventLoop::sent)) != 0 ||
+	    peer_conn.should_wait_for_send())
+	{
+		// blocks are read only as fast as the socket takes them
+		while (peer_conn.send() == 0 && serve_uploads(shard, handle, peer_conn))
 		{
-			peer_pollfd.events &= ~POLLOUT;
 		}
 	}
-	else if ((peer_pollfd.revents & (POLLERR | POLLHUP)) != 0)
+	else if (failed)
 	{
 		throw std::runtime_error("Connection reset");
 	}
@@ -560,43 +1081,161 @@ void Download::proceed_peer(const size_t index)
 
 void Download::add_peers_to_backlog(std::vector<Peer> &peer_addrs)
 {
-	for (Peer &peer : peer_addrs)
 	{
-		if (m_peers_in_use_or_banned.find(peer) == m_peers_in_use_or_banned.end())
+		const std::lock_guard lock(m_backlog_mutex);
+		for (Peer &peer : peer_addrs)
 		{
-			m_peer_backlog.emplace(std::move(peer));
+			if (m_peers_in_use_or_banned.find(peer) == m_peers_in_use_or_banned.end())
+			{
+				m_peer_backlog.emplace(std::move(peer));
+			}
 		}
 	}
+	// every shard takes as many peers as it has free slots
+	for (const auto &shard : m_shards)
+	{
+		shard->notifier.notify();
+	}
+}
+
+std::optional<Peer> Download::take_peer_from_backlog()
+{
+	const std::lock_guard lock(m_backlog_mutex);
+	if (m_peer_backlog.empty())
+	{
+		return std::nullopt;
+	}
+	// it is either in use or banned if we fail to connect
+	Peer peer = m_peer_backlog.extract(m_peer_backlog.begin()).value();
+	m_peers_in_use_or_banned.insert(peer);
+	return peer;
 }
 
-void Download::connect_to_peer(size_t index)
+bool Download::connect_to_peer(Shard &shard)
 {
-	while (!m_peer_backlog.empty())
+	if (!reserve_slot(shard))
+	{
+		return false;
+	}
+	const auto handle = shard.peer_connections.insert();
+	if (!handle.has_value())
+	{
+		--shard.peers;
+		return false;
+	}
+	PeerConnection &conn = *shard.peer_connections.get(handle.value());
+	const message::Bitfield bitfield = copy_bitfield();
+
+	// try again until backlog empty
+	while (const auto peer = take_peer_from_backlog())
 	{
-		auto it = m_peer_backlog.begin();
 		try
 		{
-			m_peer_connections[index].connect(it->ip, it->port, m_handshake,
-							  m_bitfield);
+			conn.connect(*shard.loop, handle->token(), peer->ip, peer->port, m_handshake,
+				     bitfield);
 		} catch (const std::exception &ex)
 		{
-			// banned because failed to connect
-			m_peers_in_use_or_banned.insert(*it);
-			m_peer_backlog.extract(it);
-			// try again until backlog empty
 			continue;
 		}
-		// in use because we already connected
-		m_peers_in_use_or_banned.insert(*it);
-		m_peer_backlog.extract(it);
-		m_fds[index] = { m_peer_connections[index].get_socket_fd(), (POLLIN | POLLOUT), 0 };
-		break;
+		++m_connected_peers;
+		if (m_zerocopy)
+		{
+			(void)conn.enable_zerocopy();
+		}
+		schedule_peer_timers(shard, handle->token());
+		return true;
 	}
+
+	// there was no one to connect to
+	shard.peer_connections.erase(handle.value());
+	--shard.peers;
+	return false;
+}
+
+void Download::connect_to_free_slots(Shard &shard)
+{
+	while (connect_to_peer(shard))
+	{
+	}
+}
+
+void Download::accept_peers(Shard &shard)
+{
+	for (IncomingPeer &peer : shard.incoming_peers.take_results())
+	{
+		// the slot is already reserved by route_incoming_peer()
+		const auto handle = shard.peer_connections.insert();
+		if (!handle.has_value())
+		{
+			std::clog << "Incoming peer rejected, too many connections" << '\n';
+			--shard.peers;
+			continue;
+		}
+		PeerConnection &conn = *shard.peer_connections.get(handle.value());
+		try
+		{
+			conn.accept(*shard.loop, handle->token(), std::move(peer.socket),
+				    number_of_pieces(), peer.handshake);
+		} catch (const std::exception &ex)
+		{
+			std::cerr << ex.what() << '\n';
+			shard.peer_connections.erase(handle.value());
+			--shard.peers;
+			continue;
+		}
+		++m_connected_peers;
+		if (m_zerocopy)
+		{
+			(void)conn.enable_zerocopy();
+		}
+		schedule_peer_timers(shard, handle->token());
+		try
+		{
+			// the handshake was read by the listener, the rest may be in the socket
+			proceed_peer(shard, handle.value(), conn,
+				     { handle->token(), EventLoop::readable });
+		} catch (const std::exception &ex)
+		{
+			std::cerr << "Incoming peer disconnected due to: " << ex.what() << '\n';
+			disconnect_peer(shard, handle.value());
+		}
+	}
+}
+
+void Download::schedule_peer_timers(Shard &shard, const uint64_t token)
+{
+	using std::chrono::seconds;
+	schedule_timer(shard, seconds(PeerConnection::connect_timeout), token, Timers::CONNECT);
+	schedule_timer(shard, seconds(PeerConnection::keepalive_timeout), token,
+		       Timers::KEEPALIVE);
+	schedule_timer(shard, seconds(PeerConnection::request_timeout), token, Timers::REQUEST);
+}
+
+void Download::disconnect_peer(Shard &shard, const ConnectionHandle handle)
+{
+	PeerConnection *conn = shard.peer_connections.get(handle);
+	if (conn == nullptr)
+	{
+		return;
+	}
+
+	std::set<size_t> pieces = conn->assigned_pieces();
+
+	for (auto ind : pieces)
+	{
+		m_dl_strategy->mark_as_discarded(ind);
+	}
+
+	conn->disconnect();
+	shard.peer_connections.erase(handle);
+	--shard.peers;
+	--m_connected_peers;
 }
 
 void Download::tracker_callback()
 {
 	std::clog << "successfully reached tracker_callback()" << '\n';
+	m_shards.front()->timers.cancel(m_tracker_response_timer);
 	const auto span = m_tracker_connection.view_recv_message();
 	const std::string str(reinterpret_cast<const char *>(span.data()), span.size());
 
@@ -614,21 +1253,74 @@ void Download::tracker_callback()
 		if (m_announce_list.move_index_next() != 0)
 		{
 			m_announce_list.reset_index();
-			m_fds.back() = { -1, 0, 0 };
-			m_tracker_connection.set_timeout(m_timeout_on_failure);
+			m_tracker_connection.disconnect();
+			schedule_announce(m_timeout_on_failure);
 		}
 		throw std::runtime_error("tracker_callback() failed");
 	}
-	m_fds.back() = { -1, 0, 0 };
-	m_tracker_connection.set_timeout(resp->interval);
+	m_tracker_connection.disconnect();
+	schedule_announce(resp->interval);
+	resolve_peer_addresses(resp->peers);
 	add_peers_to_backlog(resp->peers);
 }
 
-void Download::proceed_tracker()
+void Download::resolve_peer_addresses(std::vector<Peer> &peers)
 {
-	struct pollfd &tracker_pollfd = m_fds.back();
+	std::erase_if(peers, [this](Peer &peer) {
+		const uint64_t id = m_next_lookup_id++;
+		const auto endpoints = m_resolver.resolve(id, peer.ip, peer.port);
+		if (!endpoints.has_value())
+		{
+			// will be added to the backlog in resolver_callback()
+			m_resolving_peers.emplace(id, std::move(peer));
+			return true;
+		}
+		peer.ip = TCPClient::ntop(endpoints->front());
+		return false;
+	});
+}
 
-	if ((tracker_pollfd.revents & POLLIN) != 0)
+void Download::resolver_callback()
+{
+	std::vector<Peer> resolved_peers;
+	for (Resolver::Result &result : m_resolver.take_results())
+	{
+		if (result.id == m_tracker_lookup_id)
+		{
+			if (!result.endpoints.empty() && connect_to_current_tracker(result.endpoints))
+			{
+				continue;
+			}
+			std::cerr << "Failed to reach tracker " << result.hostname << '\n';
+			if (m_announce_list.move_index_next() == 0)
+			{
+				connect_to_tracker();
+			}
+			else
+			{
+				tracker_failed();
+			}
+			continue;
+		}
+
+		auto node = m_resolving_peers.extract(result.id);
+		if (node.empty() || result.endpoints.empty())
+		{
+			continue;
+		}
+		node.mapped().ip = TCPClient::ntop(result.endpoints.front());
+		resolved_peers.emplace_back(std::move(node.mapped()));
+	}
+
+	if (!resolved_peers.empty())
+	{
+		add_peers_to_backlog(resolved_peers);
+	}
+}
+
+void Download::proceed_tracker(const uint32_t events)
+{
+	if ((events & EventLoop::readable) != 0)
 	{
 		const int rc = m_tracker_connection.recv();
 
@@ -638,156 +1330,334 @@ void Download::proceed_tracker()
 
 			m_announce_list.move_current_tracker_to_top();
 			m_announce_list.reset_index();
-
-			tracker_pollfd = { -1, 0, 0 };
 			return;
 		}
 	}
 
-	if ((tracker_pollfd.revents & POLLOUT) != 0)
+	if ((events & EventLoop::writable) != 0)
 	{
-		const int rc = m_tracker_connection.send();
-
-		if (rc == 0)
-		{
-			tracker_pollfd.events = POLLIN;
-		}
+		(void)m_tracker_connection.send();
 	}
-	else if ((tracker_pollfd.revents & (POLLERR | POLLHUP)) != 0)
+	else if ((events & EventLoop::error) != 0)
 	{
 		throw std::runtime_error("Connection reset");
 	}
 }
 
-void Download::connect_to_tracker()
+bool Download::connect_to_current_tracker(const std::span<const Endpoint> endpoints)
 {
-	const short ev = POLLOUT;
 	const std::string info_hash = utils::convert_to_url(m_metainfo.info.get_sha1());
 	TrackerRequestParams trp{};
 	trp.info_hash = info_hash;
 	trp.peer_id = m_connection_id;
+	if (m_listen_port != 0)
+	{
+		trp.port = std::to_string(m_listen_port);
+	}
 
+	try
+	{
+		const auto [hostname, port] = m_announce_list.get_current_tracker();
+		Shard &shard = *m_shards.front();
+		m_tracker_connection.connect(*shard.loop, m_tracker_token, endpoints, hostname,
+					     trp);
+		shard.timers.cancel(m_tracker_response_timer);
+		m_tracker_response_timer =
+			schedule_timer(shard, std::chrono::seconds(m_tracker_response_timeout),
+				       m_tracker_token, Timers::TRACKER_RESPONSE);
+		return true;
+	} catch (const std::exception &ex)
+	{
+		return false;
+	}
+}
+
+void Download::connect_to_tracker()
+{
 	do
 	{
-		try
+		const auto [hostname, port] = m_announce_list.get_current_tracker();
+		const auto endpoints = m_resolver.resolve(m_tracker_lookup_id, hostname, port);
+		if (!endpoints.has_value())
 		{
-			const auto [hostname, port] = m_announce_list.get_current_tracker();
-			m_tracker_connection.connect(hostname, port, trp);
-			m_fds.back() = { m_tracker_connection.get_socket_fd(), ev, 0 };
+			// continued in resolver_callback() once the lookup is finished
 			return;
-		} catch (const std::exception &ex)
+		}
+		if (connect_to_current_tracker(endpoints.value()))
 		{
+			return;
 		}
 	} while (m_announce_list.move_index_next() == 0);
 
+	tracker_failed();
+}
+
+void Download::tracker_failed()
+{
 	if (!has_peers_connected())
 	{
 		std::cerr << "Download is stalled due to tracker error" << '\n';
 	}
 
 	m_announce_list.reset_index();
-	m_fds.back() = { -1, 0, 0 };
-	m_tracker_connection.set_timeout(m_timeout_on_failure);
+	m_tracker_connection.disconnect();
+	m_shards.front()->timers.cancel(m_tracker_response_timer);
+	schedule_announce(m_timeout_on_failure);
 }
 
-void Download::update_time_peer(size_t index)
+TimerHandle Download::schedule_timer(Shard &shard, const std::chrono::seconds delay,
+				     const uint64_t token, const Timers type)
 {
-	if (m_fds[index].fd != -1)
-	{
-		m_peer_connections[index].update_time();
-	}
+	return shard.timers.schedule(std::chrono::steady_clock::now() + delay,
+				     { token, static_cast<uint32_t>(type) });
+}
+
+void Download::schedule_announce(const long long seconds)
+{
+	Shard &shard = *m_shards.front();
+	shard.timers.cancel(m_announce_timer);
+	m_announce_timer = schedule_timer(shard, std::chrono::seconds(std::max(seconds, 0LL)),
+					  m_tracker_token, Timers::ANNOUNCE);
 }
 
-void Download::update_time_tracker()
+void Download::schedule_resume_save()
 {
-	if (m_tracker_connection.update_time())
+	const auto interval = std::max(
+		config::get_int("resume_interval", m_default_resume_interval), 1LL);
+	schedule_timer(*m_shards.front(), std::chrono::seconds(interval), m_resume_token,
+		       Timers::SAVE_RESUME);
+}
+
+void Download::tracker_timer_callback(const Timers type)
+{
+	switch (type)
 	{
+	case Timers::ANNOUNCE:
 		connect_to_tracker();
+		break;
+
+	case Timers::TRACKER_RESPONSE:
+		std::cerr << "Tracker did not respond in time" << '\n';
+		m_tracker_connection.disconnect();
+		if (m_announce_list.move_index_next() == 0)
+		{
+			connect_to_tracker();
+		}
+		else
+		{
+			tracker_failed();
+		}
+		break;
+
+	default:
+		break;
 	}
 }
 
-void Download::poll()
+void Download::peer_timer_callback(Shard &shard, PeerConnection &conn, const uint64_t token,
+				   const Timers type)
 {
-	static constexpr int timeout = 1000; // 1 second
-
-	const int rc = ::poll(m_fds.data(), m_fds.size(), timeout);
-	if (rc > 0)
+	using std::chrono::seconds;
+	switch (type)
 	{
-		update_time_tracker();
-		try
-		{
-			proceed_tracker();
-		} catch (const std::exception &ex)
+	case Timers::KEEPALIVE:
+		conn.send_keepalive();
+		(void)conn.send();
+		schedule_timer(shard, seconds(PeerConnection::keepalive_timeout), token, type);
+		break;
+
+	case Timers::CONNECT:
+		if (!conn.handshake_received())
 		{
-			connect_to_tracker();
+			throw std::runtime_error("Handshake timed out");
 		}
+		break;
 
-		for (size_t i = 0; i < m_fds.size() - 1; ++i)
+	case Timers::REQUEST:
+		if (!conn.made_progress())
 		{
-			if (m_fds[i].fd != -1)
-			{
-				try
-				{
-					proceed_peer(i);
-				} catch (const std::exception &ex)
-				{
-					std::cerr << "Peer " << i
-						  << " disconected due to: " << ex.what() << '\n';
-					std::set<size_t> pieces =
-						m_peer_connections[i].assigned_pieces();
-
-					for (auto ind : pieces)
-					{
-						m_dl_strategy->mark_as_discarded(ind);
-					}
-
-					m_peer_connections[i].disconnect();
-					m_fds[i] = { -1, 0, 0 };
-				}
-				update_time_peer(i);
-			}
-			else
-			{
-				connect_to_peer(i);
-			}
+			throw std::runtime_error("Requests timed out");
 		}
+		schedule_timer(shard, seconds(PeerConnection::request_timeout), token, type);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Download::timer_callback(Shard &shard, const TimerWheel::Timer timer)
+{
+	const auto type = static_cast<Timers>(timer.type);
+	if (timer.token == m_tracker_token)
+	{
+		tracker_timer_callback(type);
+		return;
 	}
-	else if (rc == 0) // on timeout
+	if (timer.token == m_resume_token)
+	{
+		save_resume_data();
+		report_stats();
+		schedule_resume_save();
+		return;
+	}
+
+	const auto handle = ConnectionHandle::from_token(timer.token);
+	PeerConnection *conn = shard.peer_connections.get(handle);
+	if (conn == nullptr)
+	{
+		// timers are not cancelled when the connection is closed
+		return;
+	}
+	try
+	{
+		peer_timer_callback(shard, *conn, timer.token, type);
+	} catch (const std::exception &ex)
 	{
-		update_time_tracker();
+		std::cerr << "Peer " << handle.index << " disconected due to: " << ex.what()
+			  << '\n';
+		disconnect_peer(shard, handle);
+	}
+}
+
+void Download::poll(Shard &shard)
+{
+	using std::chrono::steady_clock;
+
+	const size_t connected = shard.peer_connections.size();
+	// sleep exactly until the next timer expires
+	const int timeout = shard.timers.timeout_ms(steady_clock::now());
 
-		for (size_t i = 0; i < m_fds.size() - 1; ++i)
+	// only descriptors that are ready are visited
+	for (const auto &ev : shard.loop->wait(timeout))
+	{
+		if (ev.token == m_wakeup_token)
+		{
+			shard.notifier.drain();
+			broadcast_haves(shard);
+			resume_idle_peers(shard);
+			connect_to_free_slots(shard);
+			continue;
+		}
+		if (ev.token == m_hash_token)
+		{
+			hash_callback(shard);
+			continue;
+		}
+		if (ev.token == m_write_token)
+		{
+			write_callback(shard);
+			continue;
+		}
+		if (ev.token == m_read_token)
 		{
-			if (m_fds[i].fd != -1)
+			read_callback(shard);
+			continue;
+		}
+		if (ev.token == m_incoming_token)
+		{
+			accept_peers(shard);
+			continue;
+		}
+		if (ev.token == m_resolver_token)
+		{
+			resolver_callback();
+			continue;
+		}
+		if (ev.token == m_signal_token)
+		{
+			if (m_shutdown_signal.drain())
 			{
-				update_time_peer(i);
+				std::clog << "Shutting down" << '\n';
+				m_stop_source.request_stop();
 			}
-			else
+			continue;
+		}
+		if (ev.token == m_tracker_token)
+		{
+			try
+			{
+				proceed_tracker(ev.events);
+			} catch (const std::exception &ex)
 			{
-				connect_to_peer(i);
+				connect_to_tracker();
 			}
+			continue;
+		}
+
+		const auto handle = ConnectionHandle::from_token(ev.token);
+		PeerConnection *conn = shard.peer_connections.get(handle);
+		if (conn == nullptr)
+		{
+			// the connection was closed earlier during this iteration
+			continue;
+		}
+		try
+		{
+			proceed_peer(shard, handle, *conn, ev);
+		} catch (const std::exception &ex)
+		{
+			std::cerr << "Peer " << handle.index << " disconected due to: " << ex.what()
+				  << '\n';
+			disconnect_peer(shard, handle);
 		}
 	}
-	else
+
+	for (const auto timer : shard.timers.advance(steady_clock::now()))
+	{
+		timer_callback(shard, timer);
+	}
+
+	if (shard.peer_connections.size() < connected)
+	{
+		// reuse the slots of closed connections
+		connect_to_free_slots(shard);
+	}
+}
+
+void Download::run(Shard &shard, const std::stop_token stop)
+{
+	// the loop may sleep forever if there are no timers
+	const std::stop_callback wake_up(stop, [&shard] { shard.notifier.notify(); });
+	while (!stop.stop_requested())
 	{
-		// on error
-		throw std::runtime_error(std::string("poll(): ") + strerror(errno));
+		poll(shard);
 	}
 }
 
 void Download::start()
 {
-	m_tracker_connection.set_timeout(-1);
-	while (true)
+	schedule_announce(0);
+	schedule_resume_save();
+	for (size_t i = 1; i < m_shards.size(); ++i)
 	{
-		poll();
+		m_threads.emplace_back(
+			[this, &shard = *m_shards[i]](std::stop_token stop) { run(shard, stop); });
 	}
+	run(*m_shards.front(), m_stop_source.get_token());
+
+	// stops and joins the other shards, so no piece is marked while the record is saved
+	m_threads.clear();
+	try
+	{
+		m_storage->sync();
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Failed to flush the files: " << ex.what() << '\n';
+	}
+	save_resume_data();
+	report_stats();
+}
+
+void Download::stop()
+{
+	// the first shard is woken up by its stop_callback and stops the others
+	m_stop_source.request_stop();
 }
 
 bool Download::has_peers_connected() const
 {
-	return std::any_of(m_fds.begin(), m_fds.end(),
-			   [](const pollfd &fd) { return fd.fd != -1; });
+	return m_connected_peers > 0;
 }
 
 void Download::copy_metainfo_file_to_cache(const std::string &path_to_torrent)
@@ -800,4 +1670,4 @@ void Download::copy_metainfo_file_to_cache(const std::string &path_to_torrent)
 	{
 		copy(path_to_torrent, path_to_destination);
 	}
-}
+}
\ No newline at end of file
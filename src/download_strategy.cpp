@@ -2,7 +2,10 @@
 #include "expected.hpp"
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <utility>
 
 DownloadStrategySequential::DownloadStrategySequential(size_t length)
 	: m_bf(length)
@@ -60,18 +63,6 @@ DownloadStrategySequential::next_piece_to_dl(const message::Bitfield &bitfield)
 	if (!m_endgame)
 	{
 		bool found_spare_piece = false;
-		size_t last_index = m_bf.get_bf_size() - 1;
-		if (m_bf.get_index(last_index))
-		{
-			found_spare_piece = true;
-			if (bitfield.get_index(last_index))
-			{
-				m_bf.set_index(last_index, true);
-				std::clog << "Piece " << last_index << " will be downloaded"
-					  << '\n';
-				return last_index;
-			}
-		}
 		for (size_t i = 0; i < m_bf.get_bf_size(); ++i)
 		{
 			if (!m_bf.get_index(i))
@@ -104,6 +95,8 @@ DownloadStrategySequential::next_piece_to_dl(const message::Bitfield &bitfield)
 
 void DownloadStrategySequential::mark_as_downloaded(const size_t index)
 {
+	// the piece may come from disk without ever being assigned
+	m_bf.set_index(index, true);
 	m_endgame_pieces.erase(index);
 }
 
@@ -111,3 +104,42 @@ void DownloadStrategySequential::mark_as_discarded(const size_t index)
 {
 	m_bf.set_index(index, false);
 }
+
+// DownloadStrategySynchronized --------------------------------------------------------
+
+DownloadStrategySynchronized::DownloadStrategySynchronized(
+	std::unique_ptr<DownloadStrategy> strategy)
+	: m_strategy(std::move(strategy))
+{
+}
+
+bool DownloadStrategySynchronized::have_missing_pieces(const message::Bitfield &bitfield)
+{
+	const std::lock_guard lock(m_mutex);
+	return m_strategy->have_missing_pieces(bitfield);
+}
+
+bool DownloadStrategySynchronized::is_piece_missing(const message::Have &have)
+{
+	const std::lock_guard lock(m_mutex);
+	return m_strategy->is_piece_missing(have);
+}
+
+tl::expected<size_t, DownloadStrategy::ReturnStatus>
+DownloadStrategySynchronized::next_piece_to_dl(const message::Bitfield &bitfield)
+{
+	const std::lock_guard lock(m_mutex);
+	return m_strategy->next_piece_to_dl(bitfield);
+}
+
+void DownloadStrategySynchronized::mark_as_downloaded(const size_t index)
+{
+	const std::lock_guard lock(m_mutex);
+	m_strategy->mark_as_downloaded(index);
+}
+
+void DownloadStrategySynchronized::mark_as_discarded(const size_t index)
+{
+	const std::lock_guard lock(m_mutex);
+	m_strategy->mark_as_discarded(index);
+}
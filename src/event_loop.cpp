@@ -0,0 +1,308 @@
+#include "event_loop.hpp"
+
+#include "config.hpp"
+
+#ifdef MYTORRENT_IO_URING
+#include "uring_event_loop.hpp"
+#endif
+
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <utility>
+
+// EventLoop ---------------------------------------------------------------------------
+
+bool EventLoop::performs_io() const
+{
+	return false;
+}
+
+void EventLoop::receive(int /*fd*/)
+{
+	throw std::logic_error("The event loop doesn't receive by itself");
+}
+
+void EventLoop::send(int /*fd*/, std::shared_ptr<const void> /*owner*/,
+		     std::span<const uint8_t> /*data*/)
+{
+	throw std::logic_error("The event loop doesn't send by itself");
+}
+
+// EpollEventLoop ----------------------------------------------------------------------
+
+EpollEventLoop::EpollEventLoop(const size_t max_events)
+	: m_epfd(epoll_create1(EPOLL_CLOEXEC))
+	, m_epoll_events(max_events)
+{
+	if (m_epfd == -1)
+	{
+		throw std::runtime_error(std::string("epoll_create1(): ") + strerror(errno));
+	}
+	m_ready.reserve(max_events);
+}
+
+void EpollEventLoop::add(const int fd, const uint64_t token, const uint32_t events)
+{
+	struct epoll_event ev {};
+	ev.events = events | EPOLLET;
+	ev.data.u64 = token;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		throw std::runtime_error(std::string("epoll_ctl(ADD): ") + strerror(errno));
+	}
+}
+
+void EpollEventLoop::modify(const int fd, const uint64_t token, const uint32_t events)
+{
+	struct epoll_event ev {};
+	ev.events = events | EPOLLET;
+	ev.data.u64 = token;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+	{
+		throw std::runtime_error(std::string("epoll_ctl(MOD): ") + strerror(errno));
+	}
+}
+
+void EpollEventLoop::remove(const int fd)
+{
+	// ENOENT and EBADF only mean that there is nothing to remove
+	(void)epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+std::span<const EventLoop::Event> EpollEventLoop::wait(const int timeout_ms)
+{
+	m_ready.clear();
+
+	const int rc = epoll_wait(m_epfd, m_epoll_events.data(),
+				  static_cast<int>(m_epoll_events.size()), timeout_ms);
+	if (rc == -1)
+	{
+		if (errno == EINTR)
+		{
+			return m_ready;
+		}
+		throw std::runtime_error(std::string("epoll_wait(): ") + strerror(errno));
+	}
+
+	for (int i = 0; i < rc; ++i)
+	{
+		m_ready.push_back({ m_epoll_events[i].data.u64, m_epoll_events[i].events });
+	}
+	return m_ready;
+}
+
+EpollEventLoop::~EpollEventLoop()
+{
+	if (m_epfd >= 0)
+	{
+		close(m_epfd);
+	}
+}
+
+std::unique_ptr<EventLoop> make_event_loop()
+{
+	const std::string backend = config::get_value("event_loop").value_or("epoll");
+	if (backend == "io_uring")
+	{
+#ifdef MYTORRENT_IO_URING
+		try
+		{
+			return std::make_unique<UringEventLoop>();
+		} catch (const std::exception &ex)
+		{
+			std::cerr << "io_uring is unavailable (" << ex.what()
+				  << "), falling back to epoll" << '\n';
+		}
+#else
+		std::cerr << "Built without io_uring support, falling back to epoll" << '\n';
+#endif
+	}
+	else if (backend != "epoll")
+	{
+		std::cerr << "Unknown event loop " << backend << ", falling back to epoll" << '\n';
+	}
+	return std::make_unique<EpollEventLoop>();
+}
+
+// EventRegistration -------------------------------------------------------------------
+
+EventRegistration::EventRegistration(EventRegistration &&other) noexcept
+	: m_loop(std::exchange(other.m_loop, nullptr))
+	, m_fd(std::exchange(other.m_fd, -1))
+	, m_token(other.m_token)
+	, m_events(std::exchange(other.m_events, 0))
+{
+}
+
+EventRegistration &EventRegistration::operator=(EventRegistration &&other) noexcept
+{
+	if (this != &other)
+	{
+		detach();
+		m_loop = std::exchange(other.m_loop, nullptr);
+		m_fd = std::exchange(other.m_fd, -1);
+		m_token = other.m_token;
+		m_events = std::exchange(other.m_events, 0);
+	}
+	return *this;
+}
+
+void EventRegistration::attach(EventLoop &loop, const int fd, const uint64_t token,
+			       const uint32_t events)
+{
+	detach();
+	loop.add(fd, token, events);
+	m_loop = &loop;
+	m_fd = fd;
+	m_token = token;
+	m_events = events;
+}
+
+void EventRegistration::set_events(const uint32_t events)
+{
+	if (m_loop == nullptr || events == m_events)
+	{
+		return;
+	}
+	m_loop->modify(m_fd, m_token, events);
+	m_events = events;
+}
+
+void EventRegistration::detach()
+{
+	if (m_loop != nullptr)
+	{
+		m_loop->remove(m_fd);
+		m_loop = nullptr;
+		m_fd = -1;
+		m_events = 0;
+	}
+}
+
+bool EventRegistration::attached() const
+{
+	return m_loop != nullptr;
+}
+
+bool EventRegistration::performs_io() const
+{
+	return m_loop != nullptr && m_loop->performs_io();
+}
+
+void EventRegistration::receive()
+{
+	if (m_loop != nullptr)
+	{
+		m_loop->receive(m_fd);
+	}
+}
+
+void EventRegistration::send(std::shared_ptr<const void> owner,
+			     const std::span<const uint8_t> data)
+{
+	if (m_loop != nullptr)
+	{
+		m_loop->send(m_fd, std::move(owner), data);
+	}
+}
+
+EventRegistration::~EventRegistration()
+{
+	detach();
+}
+
+// EventNotifier -----------------------------------------------------------------------
+
+EventNotifier::EventNotifier()
+	: m_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+	if (m_fd == -1)
+	{
+		throw std::runtime_error(std::string("eventfd(): ") + strerror(errno));
+	}
+}
+
+void EventNotifier::notify() const
+{
+	const uint64_t one = 1;
+	// the only possible failure is an overflow of the counter, which is still a wakeup
+	(void)write(m_fd, &one, sizeof one);
+}
+
+void EventNotifier::drain() const
+{
+	uint64_t value = 0;
+	(void)read(m_fd, &value, sizeof value);
+}
+
+int EventNotifier::get_fd() const
+{
+	return m_fd;
+}
+
+EventNotifier::~EventNotifier()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+}
+
+// ShutdownSignal ----------------------------------------------------------------------
+
+static sigset_t shutdown_signals()
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	return set;
+}
+
+ShutdownSignal::ShutdownSignal()
+{
+	const sigset_t set = shutdown_signals();
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+	m_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (m_fd == -1)
+	{
+		throw std::runtime_error(std::string("signalfd(): ") + strerror(errno));
+	}
+}
+
+bool ShutdownSignal::drain() const
+{
+	bool received = false;
+	signalfd_siginfo info{};
+	while (read(m_fd, &info, sizeof info) == sizeof info)
+	{
+		received = true;
+	}
+	return received;
+}
+
+int ShutdownSignal::get_fd() const
+{
+	return m_fd;
+}
+
+ShutdownSignal::~ShutdownSignal()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+}
@@ -0,0 +1,89 @@
+#include "file_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+// OpenFile ----------------------------------------------------------------------------
+
+OpenFile::OpenFile(const std::filesystem::path &path, const int flags)
+	: m_fd(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | flags, 0644))
+{
+	if (m_fd == -1)
+	{
+		throw std::system_error(errno, std::generic_category(), "open() " + path.string());
+	}
+}
+
+int OpenFile::get_fd() const
+{
+	return m_fd;
+}
+
+OpenFile::~OpenFile()
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+	}
+}
+
+// FileCache ---------------------------------------------------------------------------
+
+FileCache::FileCache(const size_t capacity, const int flags)
+	: m_capacity(std::max<size_t>(capacity, 1))
+	, m_flags(flags)
+{
+}
+
+std::shared_ptr<OpenFile> FileCache::open(const std::filesystem::path &path)
+{
+	const std::lock_guard lock(m_mutex);
+
+	const auto it = m_index.find(path.native());
+	if (it != m_index.end())
+	{
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return it->second->second;
+	}
+
+	std::shared_ptr<OpenFile> file;
+	try
+	{
+		file = std::make_shared<OpenFile>(path, m_flags);
+	} catch (const std::system_error &ex)
+	{
+		if (ex.code().value() != EMFILE && ex.code().value() != ENFILE)
+		{
+			throw;
+		}
+		// give back every descriptor we can and try once more
+		m_index.clear();
+		m_lru.clear();
+		file = std::make_shared<OpenFile>(path, m_flags);
+	}
+
+	m_lru.emplace_front(path.native(), file);
+	m_index.emplace(path.native(), m_lru.begin());
+	while (m_lru.size() > m_capacity)
+	{
+		m_index.erase(m_lru.back().first);
+		m_lru.pop_back();
+	}
+	return file;
+}
+
+void FileCache::clear()
+{
+	const std::lock_guard lock(m_mutex);
+	m_index.clear();
+	m_lru.clear();
+}
@@ -0,0 +1,79 @@
+#include "file_layout.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// FileLayout --------------------------------------------------------------------------
+
+FileLayout::FileLayout(std::vector<File> files, const size_t piece_length)
+	: m_files(std::move(files))
+	, m_piece_length(piece_length)
+{
+	if (!m_files.empty())
+	{
+		m_length = m_files.back().offset + m_files.back().length;
+	}
+}
+
+const std::vector<FileLayout::File> &FileLayout::files() const
+{
+	return m_files;
+}
+
+size_t FileLayout::piece_length() const
+{
+	return m_piece_length;
+}
+
+size_t FileLayout::length() const
+{
+	return m_length;
+}
+
+std::pair<size_t, size_t> FileLayout::files_of(const size_t begin, const size_t end) const
+{
+	// the first file that ends after the beginning of the range, empty files are skipped
+	// this way
+	const auto first = std::upper_bound(m_files.begin(), m_files.end(), begin,
+					    [](const size_t pos, const File &file) {
+						    return pos < file.offset + file.length;
+					    });
+	const auto last = std::lower_bound(
+		first, m_files.end(), end,
+		[](const File &file, const size_t pos) { return file.offset < pos; });
+	return { static_cast<size_t>(first - m_files.begin()),
+		 static_cast<size_t>(last - m_files.begin()) };
+}
+
+std::vector<FileLayout::Extent> FileLayout::extents_of(const size_t offset,
+						      const size_t length) const
+{
+	std::vector<Extent> ret;
+	const auto [first, last] = files_of(offset, offset + length);
+	for (size_t i = first; i < last; ++i)
+	{
+		const File &file = m_files[i];
+		const size_t begin = std::max(offset, file.offset);
+		const size_t end = std::min(offset + length, file.offset + file.length);
+		if (begin == end)
+		{
+			// empty files hold no data
+			continue;
+		}
+		ret.push_back({ i, begin - file.offset, end - begin });
+	}
+	return ret;
+}
+
+std::pair<size_t, size_t> FileLayout::pieces_of(const size_t file) const
+{
+	const File &f = m_files[file];
+	const size_t first = f.offset / m_piece_length;
+	if (f.length == 0)
+	{
+		return { first, first };
+	}
+	return { first, (f.offset + f.length - 1) / m_piece_length };
+}
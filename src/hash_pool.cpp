@@ -0,0 +1,168 @@
+#include "hash_pool.hpp"
+
+#include "piece.hpp"
+#include "sha1.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+// HashPool ----------------------------------------------------------------------------
+
+HashPool::HashPool(const size_t threads)
+{
+	for (size_t i = 0; i < threads; ++i)
+	{
+		auto &worker = *m_workers.emplace_back(std::make_unique<Worker>());
+		worker.thread = std::jthread([&worker](std::stop_token stop) { work(worker, stop); });
+	}
+}
+
+HashPool::Worker &HashPool::worker_of(const uint64_t stream)
+{
+	if (stream == 0)
+	{
+		return *m_workers[m_next_worker++ % m_workers.size()];
+	}
+	return *m_workers[stream % m_workers.size()];
+}
+
+void HashPool::push(Worker &worker, Job &&job)
+{
+	{
+		const std::lock_guard lock(worker.mutex);
+		worker.jobs.push_back(std::move(job));
+	}
+	worker.cv.notify_one();
+}
+
+uint64_t HashPool::open_stream()
+{
+	return m_next_stream++;
+}
+
+void HashPool::update(const ReceivedPiece &piece, const size_t begin, const size_t length)
+{
+	Job job;
+	job.stream = piece.m_stream;
+	job.buffer = piece.m_buffer;
+	job.part = piece.get_data().subspan(begin, length);
+	push(worker_of(piece.m_stream), std::move(job));
+}
+
+void HashPool::submit(CompletionQueue &queue, ReceivedPiece piece, const uint64_t token)
+{
+	Job job;
+	job.stream = piece.m_stream;
+	job.piece = std::move(piece);
+	job.token = token;
+	job.queue = &queue;
+	push(worker_of(job.stream), std::move(job));
+}
+
+std::optional<HashPool::Job> HashPool::take_job(Worker &worker, const std::stop_token stop)
+{
+	std::unique_lock lock(worker.mutex);
+	if (worker.jobs.empty())
+	{
+		lock.unlock();
+		// no more parts can come for a piece that nobody holds
+		for (auto it = worker.streams.begin(); it != worker.streams.end();)
+		{
+			const uint64_t stream = it->first;
+			const bool expired = it->second.buffer.expired();
+			++it;
+			if (expired)
+			{
+				close_stream(worker, stream);
+			}
+		}
+		lock.lock();
+	}
+	if (!worker.cv.wait(lock, stop, [&worker] { return !worker.jobs.empty(); }))
+	{
+		return std::nullopt;
+	}
+	std::optional<Job> ret(std::move(worker.jobs.front()));
+	worker.jobs.pop_front();
+	return ret;
+}
+
+HashPool::Stream &HashPool::stream_of(Worker &worker, const uint64_t stream)
+{
+	const auto it = worker.streams.find(stream);
+	if (it != worker.streams.end())
+	{
+		return it->second;
+	}
+	if (worker.spare_contexts.empty())
+	{
+		return worker.streams[stream];
+	}
+	Stream spare{ std::move(worker.spare_contexts.back()), {} };
+	worker.spare_contexts.pop_back();
+	return worker.streams.emplace(stream, std::move(spare)).first->second;
+}
+
+void HashPool::close_stream(Worker &worker, const uint64_t stream)
+{
+	const auto it = worker.streams.find(stream);
+	if (it == worker.streams.end())
+	{
+		return;
+	}
+	try
+	{
+		it->second.context.reset();
+		worker.spare_contexts.push_back(std::move(it->second.context));
+	} catch (const std::exception &ex)
+	{
+		std::cerr << ex.what() << '\n';
+	}
+	worker.streams.erase(it);
+}
+
+void HashPool::work(Worker &worker, const std::stop_token stop)
+{
+	while (auto job = take_job(worker, stop))
+	{
+		if (job->queue == nullptr)
+		{
+			try
+			{
+				Stream &stream = stream_of(worker, job->stream);
+				stream.buffer = job->buffer;
+				stream.context.update(job->part);
+			} catch (const std::exception &ex)
+			{
+				// the digest will not match, so the piece is discarded
+				std::cerr << ex.what() << '\n';
+			}
+			continue;
+		}
+
+		Result result{ std::move(job->piece), {}, job->token };
+		try
+		{
+			// the part that was not hashed block by block
+			Stream &stream = stream_of(worker, job->stream);
+			const auto data = result.piece.get_data();
+			stream.context.update(data.subspan(result.piece.m_hashed));
+			const sha1::Digest digest = stream.context.finish();
+			result.sha1.assign(digest.begin(), digest.end());
+		} catch (const std::exception &ex)
+		{
+			// reported as a result without the hash, so the piece is discarded
+			std::cerr << ex.what() << '\n';
+		}
+		close_stream(worker, job->stream);
+		job->queue->push(std::move(result));
+	}
+}
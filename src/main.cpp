@@ -1,12 +1,20 @@
 #include "config.hpp"
 #include "download.hpp"
+#include "peer_listener.hpp"
 
+#include <csignal>
+#include <cstdint>
+#include <exception>
 #include <iostream>
+#include <limits>
 #include <memory>
 
 int main(int argc, char *argv[])
 {
+	// blocks are uploaded with sendfile(), which can't be told not to raise it
+	std::signal(SIGPIPE, SIG_IGN);
 	config::load_configs();
+	config::create_cache_dir();
 	config::create_downloads_dir();
 
 	if (argc != 2)
@@ -15,7 +23,22 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	auto test_dl = std::make_unique<Download>(argv[1]);
+	// is shared by all the downloads of the process, and routes the peers by info_hash
+	std::unique_ptr<PeerListener> listener;
+	const long long port = config::get_int("port", PeerListener::default_port);
+	if (port > 0 && port <= std::numeric_limits<uint16_t>::max())
+	{
+		try
+		{
+			listener = std::make_unique<PeerListener>(static_cast<uint16_t>(port));
+			std::clog << "Listening on port " << listener->get_port() << '\n';
+		} catch (const std::exception &ex)
+		{
+			std::cerr << ex.what() << '\n';
+		}
+	}
+
+	auto test_dl = std::make_unique<Download>(argv[1], listener.get());
 	test_dl->start();
 
 	return 0;
@@ -1,20 +1,25 @@
 #include "peer_connection.hpp"
 
+#include "event_loop.hpp"
 #include "peer_message.hpp"
 #include "socket.hpp"
 
 #include <algorithm>
+#include <array>
 #include <arpa/inet.h>
 #include <cassert>
-#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <netinet/in.h>
+#include <optional>
 #include <span>
+#include <stdexcept>
 #include <string>
+#include <sys/uio.h>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -42,8 +47,7 @@ int RequestQueue::send_request(PeerConnection *parent)
 {
 	while (m_forward_req < m_current_req + max_pending && m_forward_req < m_requests.size())
 	{
-		parent->add_message_to_queue(
-			std::make_unique<message::Request>(m_requests[m_forward_req]));
+		parent->add_message_to_queue(m_requests[m_forward_req]);
 		++m_forward_req;
 	}
 	if (m_forward_req >= m_requests.size())
@@ -55,13 +59,21 @@ int RequestQueue::send_request(PeerConnection *parent)
 	return 0;
 }
 
-int RequestQueue::validate_block(const message::Piece &block)
+bool RequestQueue::is_expected(const message::PieceHeader &block) const
 {
+	if (m_current_req >= m_forward_req)
+	{
+		// nothing was requested
+		return false;
+	}
 	const message::Request &rq = m_requests[m_current_req];
-	const bool res = rq.get_index() == block.get_index() &&
-			 rq.get_begin() == block.get_begin() &&
-			 rq.get_length() == block.get_length();
-	if (!res)
+	return rq.get_index() == block.get_index() && rq.get_begin() == block.get_begin() &&
+	       rq.get_length() == block.get_length();
+}
+
+int RequestQueue::validate_block(const message::PieceHeader &block)
+{
+	if (!is_expected(block))
 	{
 		// block is invalid
 		std::cerr << "Invalid block received" << '\n';
@@ -110,35 +122,94 @@ int PeerConnection::get_socket_fd() const
 	return m_socket.get_fd();
 }
 
-ReceivedPiece &&PeerConnection::get_received_piece()
+ReceivedPiece PeerConnection::get_received_piece()
 {
-	return std::move(m_assigned_piece);
+	// pieces are finished in the order they were requested
+	ReceivedPiece ret = std::move(m_assigned_pieces.front());
+	m_assigned_pieces.pop_front();
+	return ret;
 }
 
-void PeerConnection::add_message_to_queue(std::unique_ptr<message::Message> message)
+PeerConnection::PeerConnection(EventLoop &loop, const uint64_t token, const std::string &ip,
+			       const std::string &port, const message::Handshake &handshake,
+			       const message::Bitfield &bitfield)
 {
-	m_send_queue.emplace_back(std::move(message));
+	connect(loop, token, ip, port, handshake, bitfield);
 }
 
-PeerConnection::PeerConnection(const std::string &ip, const std::string &port,
-			       const message::Handshake &handshake,
-			       const message::Bitfield &bitfield)
+void PeerConnection::connect(EventLoop &loop, const uint64_t token, const std::string &ip,
+			     const std::string &port, const message::Handshake &handshake,
+			     const message::Bitfield &bitfield)
 {
-	connect(ip, port, handshake, bitfield);
+	m_registration.detach();
+	m_socket.connect(ip, port);
+	// handshake is already in the queue, so we wait for connect() to complete as well
+	m_registration.attach(loop, m_socket.get_fd(), token,
+			      EventLoop::readable | EventLoop::writable);
+
+	reset(bitfield.get_bf_size());
+	m_loop_io = m_registration.performs_io();
+	if (m_loop_io)
+	{
+		m_registration.receive();
+	}
+	send_handshake(handshake, bitfield);
 }
 
-void PeerConnection::connect(const std::string &ip, const std::string &port,
-			     const message::Handshake &handshake, const message::Bitfield &bitfield)
+void PeerConnection::accept(EventLoop &loop, const uint64_t token, TCPClient socket,
+			    const size_t pieces, const std::span<const uint8_t> received)
 {
-	m_socket.connect(ip, port);
+	m_registration.detach();
+	m_socket = std::move(socket);
+	// nothing is sent until the peer tells which torrent it wants
+	m_registration.attach(loop, m_socket.get_fd(), token, EventLoop::readable);
+
+	reset(pieces);
+	m_loop_io = m_registration.performs_io();
+	if (m_loop_io)
+	{
+		m_registration.receive();
+	}
+	if (!received.empty())
+	{
+		m_recv_buffer.append(received);
+	}
+}
+
+void PeerConnection::send_handshake(const message::Handshake &handshake,
+				    const message::Bitfield &bitfield)
+{
+	add_message_to_queue(handshake);
+	add_message_to_queue(bitfield);
+	m_handshake_sent = true;
+}
+
+bool PeerConnection::handshake_sent() const
+{
+	return m_handshake_sent;
+}
+
+std::tuple<std::string, std::string> PeerConnection::peer_ip_and_port() const
+{
+	return m_socket.get_peer_ip_and_port();
+}
 
-	peer_bitfield = message::Bitfield(bitfield.get_bf_size());
-	add_message_to_queue(std::make_unique<message::Handshake>(handshake));
-	add_message_to_queue(std::make_unique<message::Bitfield>(bitfield));
+void PeerConnection::reset(const size_t pieces)
+{
+	peer_bitfield = message::Bitfield(pieces);
+	m_send_buffer.clear();
+	m_handshake_sent = false;
+	if (m_send_in_flight)
+	{
+		// the loop still holds the old one until the send is cancelled
+		m_sending = std::make_shared<ByteBuffer>(send_buffer_size);
+		m_send_in_flight = false;
+	}
+	m_sending->clear();
 
-	m_recv_offset = 0;
-	m_send_offset = 0;
-	m_message_length = 0;
+	m_recv_buffer.clear();
+	m_received = {};
+	m_max_message_size = std::max(max_message_size, 4 + 1 + (pieces + 8 - 1) / 8);
 	m_state = States::HANDSHAKE;
 	m_failures = 0;
 	m_am_interested = false;
@@ -146,139 +217,365 @@ void PeerConnection::connect(const std::string &ip, const std::string &port,
 	am_choking = true;
 	peer_interested = false;
 	m_request_queue.reset();
-	m_assigned_piece.clear();
+	m_assigned_pieces.clear();
+	m_block = {};
+	m_upload_queue.clear();
+	m_bytes_uploaded = 0;
+	m_payloads.clear();
+	m_payload_bytes = 0;
+	m_buffer_sent = 0;
+	m_zerocopy = false;
+	m_zerocopy_next = 0;
+	m_zerocopy_pins.clear();
 }
 
 void PeerConnection::disconnect()
 {
+	m_registration.detach();
 	m_socket.disconnect();
 }
 
+int PeerConnection::recv_block()
+{
+	// whatever follows the block is received into the buffer as usual
+	const std::span<uint8_t> space = m_recv_buffer.prepare(1);
+	const std::array<iovec, 2> buffers = { { { m_block.data(), m_block.size() },
+						 { space.data(), space.size() } } };
+	const long rc = m_socket.recv2(buffers);
+	if (rc == -1)
+	{
+		return 1;
+	}
+
+	const auto received = static_cast<size_t>(rc);
+	const size_t block_part = std::min(received, m_block.size());
+	const size_t requested = m_block.size() + space.size();
+	m_block = m_block.subspan(block_part);
+	m_recv_buffer.commit(received - block_part);
+
+	return received < requested ? 1 : 0;
+}
+
+std::span<uint8_t> PeerConnection::prepare_recv_space()
+{
+	static constexpr size_t length_len = 4;
+
+	size_t min_size = 1;
+	const auto data = m_recv_buffer.data();
+	if (m_state == States::MESSAGE && data.size() >= length_len)
+	{
+		uint32_t length = 0;
+		memcpy(&length, data.data(), sizeof length);
+		const size_t message_size = length_len + ntohl(length);
+		if (message_size > m_max_message_size)
+		{
+			throw std::runtime_error("Message is too big");
+		}
+		min_size = std::max<size_t>(message_size - data.size(), 1);
+	}
+	return m_recv_buffer.prepare(min_size);
+}
+
 int PeerConnection::recv()
 {
+	if (m_loop_io)
+	{
+		return take_received();
+	}
+	if (m_state == States::BLOCK)
+	{
+		return recv_block();
+	}
+
+	const std::span<uint8_t> space = prepare_recv_space();
+	const long rc = m_socket.recv2(space);
+	if (rc == -1)
+	{
+		return 1;
+	}
+	m_recv_buffer.commit(static_cast<size_t>(rc));
+
+	// a short read means the socket is drained, so the loop will report new data
+	return static_cast<size_t>(rc) < space.size() ? 1 : 0;
+}
+
+int PeerConnection::take_received()
+{
+	if (m_received.empty())
+	{
+		return 1;
+	}
+	if (m_state == States::BLOCK)
+	{
+		const size_t block_part = std::min(m_received.size(), m_block.size());
+		std::copy_n(m_received.begin(), block_part, m_block.begin());
+		m_block = m_block.subspan(block_part);
+		m_received = m_received.subspan(block_part);
+	}
+
+	// whatever follows the block is taken into the buffer as usual
+	const std::span<uint8_t> space = prepare_recv_space();
+	const size_t copied = std::min(m_received.size(), space.size());
+	std::copy_n(m_received.begin(), copied, space.begin());
+	m_recv_buffer.commit(copied);
+	m_received = m_received.subspan(copied);
+	return m_received.empty() ? 1 : 0;
+}
+
+void PeerConnection::complete_io(const EventLoop::Event &event)
+{
+	if ((event.events & EventLoop::received) != 0)
+	{
+		m_received = event.data;
+	}
+	if ((event.events & EventLoop::sent) != 0)
+	{
+		m_sending->consume(event.data.size());
+		m_buffer_sent += event.data.size();
+		m_send_in_flight = false;
+	}
+}
+
+bool PeerConnection::loop_performs_io() const
+{
+	return m_loop_io;
+}
+
+std::deque<ReceivedPiece>::iterator PeerConnection::find_assigned_piece(const size_t index)
+{
+	const auto ret =
+		std::find_if(m_assigned_pieces.begin(), m_assigned_pieces.end(),
+			     [index](const ReceivedPiece &piece) { return piece.get_index() == index; });
+	assert(ret != m_assigned_pieces.end() && "Requested piece must have a buffer");
+	return ret;
+}
+
+bool PeerConnection::receive_block_in_place(const std::span<const uint8_t> data)
+{
+	const message::PieceHeader header(data);
+	if (!m_request_queue.is_expected(header))
+	{
+		return false;
+	}
+
+	const auto piece = find_assigned_piece(header.get_index());
+
+	m_block_header = header;
+	m_block = piece->get_block(header.get_begin(), header.get_length());
+
+	const auto buffered = data.subspan(message::PieceHeader::size);
+	const size_t copied = std::min(buffered.size(), m_block.size());
+	std::copy_n(buffered.begin(), copied, m_block.begin());
+	m_block = m_block.subspan(copied);
+
+	m_recv_buffer.consume(message::PieceHeader::size + copied);
+	m_state = States::BLOCK;
+	return true;
+}
+
+std::optional<std::span<const uint8_t>> PeerConnection::next_message()
+{
+	static constexpr uint8_t piece_id = 7;
+
 	static constexpr size_t hs_len = 68;
 	static constexpr size_t length_len = 4;
 
-	switch (m_state)
+	const auto data = m_recv_buffer.data();
+	size_t message_size = 0;
+
+	if (m_state == States::MESSAGE && data.size() >= message::PieceHeader::size &&
+	    data[length_len] == piece_id)
 	{
-	case States::HANDSHAKE: {
-		long rc = m_socket.recv2(
-			{ m_recv_buffer.data() + m_recv_offset, hs_len - m_recv_offset });
+		(void)receive_block_in_place(data);
+	}
 
-		if (rc == -1)
+	if (m_state == States::BLOCK)
+	{
+		if (!m_block.empty())
 		{
-			return 1;
+			return std::nullopt;
 		}
+		m_state = States::MESSAGE;
+		return m_block_header.serialized();
+	}
 
-		m_recv_offset += rc;
-
-		if (m_recv_offset == hs_len)
+	if (m_state == States::HANDSHAKE)
+	{
+		message_size = hs_len;
+	}
+	else
+	{
+		if (data.size() < length_len)
 		{
-			m_recv_offset = 0;
-			m_state = States::LENGTH;
-			// setting it like this allows to simplify implementation of view_recv_message()
-			m_message_length = hs_len - length_len;
-			return 0;
+			return std::nullopt;
 		}
-		return 1;
+		uint32_t length = 0;
+		memcpy(&length, data.data(), sizeof length);
+		message_size = length_len + ntohl(length);
+	}
+
+	if (data.size() < message_size)
+	{
+		return std::nullopt;
+	}
+
+	m_state = States::MESSAGE;
+	// the data stays in place until the next recv()
+	m_recv_buffer.consume(message_size);
+	return data.first(message_size);
+}
+
+int PeerConnection::send()
+{
+	if (m_loop_io)
+	{
+		return send_through_loop();
 	}
-	case States::LENGTH: {
-		long rc = m_socket.recv2(
-			{ m_recv_buffer.data() + m_recv_offset, length_len - m_recv_offset });
+	while (should_wait_for_send())
+	{
+		// all the queued messages are stored contiguously, so they are sent at once,
+		// up to the block that is sent from elsewhere
+		std::span<const uint8_t> data = m_send_buffer.data();
+		if (!m_payloads.empty())
+		{
+			data = data.first(m_payloads.front().position - m_buffer_sent);
+		}
+		if (data.empty())
+		{
+			Payload &payload = m_payloads.front();
+			const long rc = send_payload(payload);
+			if (rc == -1)
+			{
+				m_registration.set_events(EventLoop::readable | EventLoop::writable);
+				return 1;
+			}
+			const auto sent = static_cast<size_t>(rc);
+			payload.offset += sent;
+			payload.length -= sent;
+			m_payload_bytes -= sent;
+			if (payload.length != 0)
+			{
+				m_registration.set_events(EventLoop::readable | EventLoop::writable);
+				return 1;
+			}
+			m_payloads.pop_front();
+			continue;
+		}
+
+		const long rc = m_socket.send(data);
 		if (rc == -1)
 		{
+			// the loop is edge-triggered, so we will be notified once there is space
+			m_registration.set_events(EventLoop::readable | EventLoop::writable);
 			return 1;
 		}
 
-		m_recv_offset += rc;
+		m_send_buffer.consume(static_cast<size_t>(rc));
+		m_buffer_sent += static_cast<size_t>(rc);
 
-		if (m_recv_offset != length_len)
+		if (static_cast<size_t>(rc) < data.size())
 		{
+			// the socket buffer is full, no need to make sure with another syscall
+			m_registration.set_events(EventLoop::readable | EventLoop::writable);
 			return 1;
 		}
+	}
+	m_registration.set_events(EventLoop::readable);
+	return 0;
+}
 
-		m_recv_offset = 0;
-		memcpy(&m_message_length, m_recv_buffer.data(), sizeof(m_message_length));
-		m_message_length = ntohl(m_message_length);
-		if (m_message_length == 0)
+int PeerConnection::send_through_loop()
+{
+	while (should_wait_for_send())
+	{
+		if (m_send_in_flight)
 		{
-			// KeepAlive message received
-			return 0;
+			// the loop reports the send with a sent event
+			return 1;
+		}
+		if (m_sending->empty())
+		{
+			std::swap(*m_sending, m_send_buffer);
+		}
+		std::span<const uint8_t> data = m_sending->data();
+		if (!m_payloads.empty())
+		{
+			data = data.first(
+				std::min(data.size(), m_payloads.front().position - m_buffer_sent));
+		}
+		if (!data.empty())
+		{
+			m_registration.send(m_sending, data);
+			m_send_in_flight = true;
+			return 1;
 		}
-		m_state = States::MESSAGE;
-		// this can save a spare call to poll()
-		[[fallthrough]];
-	}
-	case States::MESSAGE: {
-		long rc = m_socket.recv2({ m_recv_buffer.data() + length_len + m_recv_offset,
-					   m_message_length - m_recv_offset });
 
+		// the blocks sent from elsewhere still go out with a syscall
+		Payload &payload = m_payloads.front();
+		const long rc = send_payload(payload);
 		if (rc == -1)
 		{
+			m_registration.set_events(EventLoop::readable | EventLoop::writable);
 			return 1;
 		}
-
-		m_recv_offset += rc;
-
-		if (m_recv_offset == m_message_length)
+		const auto sent = static_cast<size_t>(rc);
+		payload.offset += sent;
+		payload.length -= sent;
+		m_payload_bytes -= sent;
+		if (payload.length != 0)
 		{
-			m_recv_offset = 0;
-			m_state = States::LENGTH;
-			return 0;
+			m_registration.set_events(EventLoop::readable | EventLoop::writable);
+			return 1;
 		}
-		return 1;
-	}
+		m_payloads.pop_front();
 	}
-	return 1;
+	m_registration.set_events(EventLoop::readable);
+	return 0;
 }
 
-int PeerConnection::send()
+long PeerConnection::send_payload(Payload &payload)
 {
-	std::span<const std::uint8_t> curr_mes = m_send_queue.front()->serialized();
-	long rc =
-		m_socket.send({ curr_mes.data() + m_send_offset, curr_mes.size() - m_send_offset });
-	if (rc == -1)
+	if (payload.file)
 	{
-		return 1;
+		return m_socket.sendfile(payload.file->get_fd(), payload.offset, payload.length);
 	}
-
-	m_send_offset += rc;
-
-	if (m_send_offset == curr_mes.size())
+	const std::span<const uint8_t> data(payload.memory->data() + payload.offset,
+					    payload.length);
+	if (!m_zerocopy)
 	{
-		m_send_queue.pop_front();
-		m_send_offset = 0;
-		if (!should_wait_for_send())
-		{
-			return 0;
-		}
+		return m_socket.send(data);
+	}
+	bool pinned = false;
+	const long rc = m_socket.send_zerocopy(data, pinned);
+	if (pinned)
+	{
+		m_zerocopy_pins.emplace_back(m_zerocopy_next++, payload.memory);
 	}
-	return 1;
+	return rc;
 }
 
 bool PeerConnection::should_wait_for_send() const
 {
-	return !m_send_queue.empty();
+	return !m_send_buffer.empty() || !m_sending->empty() || !m_payloads.empty();
 }
 
-std::span<const uint8_t> PeerConnection::view_recv_message() const
+size_t PeerConnection::buffer_position() const
 {
-	return { m_recv_buffer.data(), 4 + m_message_length };
+	return m_buffer_sent + m_sending->size() + m_send_buffer.size();
 }
 
-bool PeerConnection::update_time()
+bool PeerConnection::handshake_received() const
 {
-	using std::chrono::steady_clock;
-	using std::chrono::seconds;
+	return m_state != States::HANDSHAKE;
+}
 
-	auto curr_tp = steady_clock::now();
-	if (duration_cast<seconds>(m_tp - curr_tp).count() > keepalive_timeout)
-	{
-		send_keepalive();
-		m_tp = curr_tp;
-		return true;
-	}
-	return false;
+bool PeerConnection::made_progress()
+{
+	// a choking peer is not expected to respond
+	const bool ret = !is_downloading() || am_choking ||
+			 m_blocks_received != m_blocks_at_last_check;
+	m_blocks_at_last_check = m_blocks_received;
+	return ret;
 }
 
 int PeerConnection::send_request()
@@ -286,33 +583,32 @@ int PeerConnection::send_request()
 	return m_request_queue.send_request(this);
 }
 
-void PeerConnection::create_requests_for_piece(size_t index, size_t size)
+void PeerConnection::create_requests_for_piece(size_t index, size_t size, PieceBuffer buffer,
+					       HashPool *hash_pool)
 {
 	m_request_queue.create_requests_for_piece(index, size);
+	m_assigned_pieces.emplace_back(index, size, std::move(buffer), hash_pool);
 }
 
-int PeerConnection::add_block()
+int PeerConnection::add_block(const std::span<const uint8_t> message)
 {
-	message::Piece block(std::move(m_recv_buffer));
-	m_recv_buffer.resize(recv_buffer_size);
-
-	int rc = m_request_queue.validate_block(block);
+	// requested blocks are already in the piece, anything else is a whole message
+	const int rc = message.size() == message::PieceHeader::size ?
+			       m_request_queue.validate_block(m_block_header) :
+			       -1;
 	if (rc != -1)
 	{
-		m_assigned_piece.add_block(std::move(block));
+		find_assigned_piece(m_block_header.get_index())
+			->add_block(m_block_header.get_begin(), m_block_header.get_length());
 		m_failures = 0;
+		++m_blocks_received;
 		return rc;
 	}
-	if (rc == -1)
+	if (++m_failures >= m_allowed_failures)
 	{
-		if (++m_failures >= m_allowed_failures)
-		{
-			return -1;
-		}
-		return 0;
+		return -1;
 	}
-	// must never be there
-	return -1;
+	return 0;
 }
 
 std::set<std::size_t> PeerConnection::assigned_pieces() const
@@ -323,6 +619,7 @@ std::set<std::size_t> PeerConnection::assigned_pieces() const
 void PeerConnection::reset_request_queue()
 {
 	m_request_queue.reset();
+	m_assigned_pieces.clear();
 }
 
 bool PeerConnection::is_downloading() const
@@ -332,15 +629,17 @@ bool PeerConnection::is_downloading() const
 
 void PeerConnection::send_keepalive()
 {
-	add_message_to_queue(std::make_unique<message::KeepAlive>());
+	add_message_to_queue(message::KeepAlive());
 }
 
 void PeerConnection::send_choke()
 {
 	if (!m_peer_choking)
 	{
-		add_message_to_queue(std::make_unique<message::Choke>());
+		add_message_to_queue(message::Choke());
 		m_peer_choking = true;
+		// the peer knows its pending requests are dropped once it is choked
+		m_upload_queue.clear();
 	}
 }
 
@@ -348,7 +647,7 @@ void PeerConnection::send_unchoke()
 {
 	if (m_peer_choking)
 	{
-		add_message_to_queue(std::make_unique<message::Unchoke>());
+		add_message_to_queue(message::Unchoke());
 		m_peer_choking = false;
 	}
 }
@@ -357,16 +656,130 @@ void PeerConnection::send_interested()
 {
 	if (!m_am_interested)
 	{
-		add_message_to_queue(std::make_unique<message::Interested>());
+		add_message_to_queue(message::Interested());
 		m_am_interested = true;
 	}
 }
 
+void PeerConnection::send_have(const size_t index)
+{
+	add_message_to_queue(message::Have(static_cast<uint32_t>(index)));
+}
+
+bool PeerConnection::is_choking_peer() const
+{
+	return m_peer_choking;
+}
+
+bool PeerConnection::queue_upload(const message::Request &request)
+{
+	if (m_upload_queue.size() >= max_upload_queue)
+	{
+		return false;
+	}
+	m_upload_queue.push_back(request);
+	return true;
+}
+
+void PeerConnection::cancel_upload(const message::Cancel &cancel)
+{
+	std::erase_if(m_upload_queue, [&cancel](const message::Request &rq) {
+		return rq.get_index() == cancel.get_index() && rq.get_begin() == cancel.get_begin() &&
+		       rq.get_length() == cancel.get_length();
+	});
+}
+
+std::optional<message::Request> PeerConnection::next_upload()
+{
+	if (m_upload_queue.empty() ||
+	    m_send_buffer.size() + m_sending->size() + m_payload_bytes >= upload_watermark)
+	{
+		return std::nullopt;
+	}
+	const message::Request ret = m_upload_queue.front();
+	m_upload_queue.pop_front();
+	return ret;
+}
+
+void PeerConnection::requeue_upload(const message::Request &request)
+{
+	m_upload_queue.push_front(request);
+}
+
+void PeerConnection::add_block_header(const message::Request &request)
+{
+	add_message_to_queue(message::PieceHeader(request.get_index(), request.get_begin(),
+						  request.get_length()));
+}
+
+void PeerConnection::send_file_block(const message::Request &request,
+				     const std::span<const Storage::FileRange> ranges)
+{
+	add_block_header(request);
+	for (const auto &range : ranges)
+	{
+		m_payloads.push_back({ buffer_position(), range.file, nullptr,
+				       range.offset, range.length });
+		m_payload_bytes += range.length;
+	}
+	m_bytes_uploaded += request.get_length();
+}
+
+void PeerConnection::send_cached_block(const message::Request &request,
+				       std::shared_ptr<const std::vector<uint8_t>> piece)
+{
+	const size_t begin = request.get_begin();
+	if (!m_zerocopy)
+	{
+		send_block(request, [&piece, begin](const std::span<uint8_t> block) {
+			std::memcpy(block.data(), piece->data() + begin, block.size());
+		});
+		return;
+	}
+	add_block_header(request);
+	m_payloads.push_back({ buffer_position(), nullptr, std::move(piece),
+			       begin, request.get_length() });
+	m_payload_bytes += request.get_length();
+	m_bytes_uploaded += request.get_length();
+}
+
+bool PeerConnection::enable_zerocopy()
+{
+	m_zerocopy = m_socket.enable_zerocopy();
+	return m_zerocopy;
+}
+
+bool PeerConnection::release_zerocopy_blocks()
+{
+	bool ret = false;
+	while (const auto completion = m_socket.next_zerocopy_completion())
+	{
+		ret = true;
+		// TCP completes the sends in order, the ids wrap around
+		while (!m_zerocopy_pins.empty() &&
+		       static_cast<int32_t>(m_zerocopy_pins.front().first - completion->last) <= 0)
+		{
+			m_zerocopy_pins.pop_front();
+		}
+		if (completion->copied)
+		{
+			// pinning the pages is pure overhead then, as on loopback
+			m_zerocopy = false;
+		}
+	}
+	return ret;
+}
+
+size_t PeerConnection::bytes_uploaded() const
+{
+	return m_bytes_uploaded;
+}
+
 void PeerConnection::send_notinterested()
 {
 	if (m_am_interested)
 	{
-		add_message_to_queue(std::make_unique<message::NotInterested>());
+		add_message_to_queue(message::NotInterested());
 		m_am_interested = false;
 	}
 }
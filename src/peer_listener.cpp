@@ -0,0 +1,221 @@
+#include "peer_listener.hpp"
+
+#include "connection_table.hpp"
+#include "event_loop.hpp"
+#include "peer_message.hpp"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+
+// PeerListener ------------------------------------------------------------------------
+
+PeerListener::PeerListener(const uint16_t port)
+	: m_listener(port, false)
+	, m_port(m_listener.get_port())
+{
+	m_loop->add(m_listener.get_fd(), m_listen_token, EventLoop::readable);
+	m_loop->add(m_notifier.get_fd(), m_wakeup_token, EventLoop::readable);
+
+	// the signals are left to the ShutdownSignal of the downloads, whichever thread
+	// creates the listener
+	sigset_t all;
+	sigset_t old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	m_thread = std::jthread([this](std::stop_token stop) { run(stop); });
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+uint16_t PeerListener::get_port() const
+{
+	return m_port;
+}
+
+void PeerListener::add(const std::span<const uint8_t> info_hash, Handler handler)
+{
+	const std::lock_guard lock(m_handlers_mutex);
+	m_handlers[std::string(info_hash.begin(), info_hash.end())] = std::move(handler);
+}
+
+void PeerListener::remove(const std::span<const uint8_t> info_hash)
+{
+	// handlers are called with the lock held
+	const std::lock_guard lock(m_handlers_mutex);
+	m_handlers.erase(std::string(info_hash.begin(), info_hash.end()));
+}
+
+void PeerListener::accept_peers()
+{
+	while (true)
+	{
+		std::optional<TCPClient> socket;
+		try
+		{
+			socket = m_listener.accept();
+		} catch (const std::exception &ex)
+		{
+			// EMFILE and the like, the peers stay in the backlog until a descriptor is
+			// freed
+			std::cerr << ex.what() << '\n';
+			m_accept_retry = std::chrono::steady_clock::now() + m_accept_retry_delay;
+			return;
+		}
+		if (!socket.has_value())
+		{
+			return;
+		}
+
+		const auto handle = m_pending.insert();
+		if (!handle.has_value())
+		{
+			// the socket is closed, so the peer knows it should try later
+			std::clog << "Incoming peer rejected, too many handshakes in progress" << '\n';
+			continue;
+		}
+		Pending &pending = *m_pending.get(handle.value());
+		pending.socket = std::move(socket.value());
+		try
+		{
+			pending.registration.attach(*m_loop, pending.socket.get_fd(), handle->token(),
+						    EventLoop::readable);
+		} catch (const std::exception &ex)
+		{
+			std::cerr << ex.what() << '\n';
+			m_pending.erase(handle.value());
+			continue;
+		}
+		m_deadlines.emplace_back(std::chrono::steady_clock::now() + m_handshake_timeout,
+					 handle.value());
+		// the handshake may have arrived with the connection
+		receive_handshake(handle.value());
+	}
+}
+
+void PeerListener::receive_handshake(const ConnectionHandle handle)
+{
+	Pending *pending = m_pending.get(handle);
+	if (pending == nullptr)
+	{
+		return;
+	}
+	try
+	{
+		while (pending->received < pending->handshake.size())
+		{
+			const long rc = pending->socket.recv2(
+				std::span(pending->handshake).subspan(pending->received));
+			if (rc == -1)
+			{
+				// the loop is edge-triggered, so it reports the rest
+				return;
+			}
+			pending->received += static_cast<size_t>(rc);
+		}
+		route(*pending);
+	} catch (const std::exception &ex)
+	{
+		std::cerr << "Incoming peer closed before the handshake: " << ex.what() << '\n';
+	}
+	pending->registration.detach();
+	m_pending.erase(handle);
+}
+
+void PeerListener::route(Pending &pending)
+{
+	const message::Handshake handshake(pending.handshake);
+	const auto info_hash = handshake.get_info_hash();
+	// the connection belongs to another loop from now on
+	pending.registration.detach();
+
+	const std::lock_guard lock(m_handlers_mutex);
+	const auto it = m_handlers.find(std::string(info_hash.begin(), info_hash.end()));
+	if (it == m_handlers.end())
+	{
+		std::cerr << "Incoming peer asks for an unknown torrent" << '\n';
+		return;
+	}
+	it->second(std::move(pending.socket), pending.handshake);
+}
+
+int PeerListener::expire(const std::chrono::steady_clock::time_point now)
+{
+	while (!m_deadlines.empty())
+	{
+		const auto [deadline, handle] = m_deadlines.front();
+		Pending *pending = m_pending.get(handle);
+		if (pending == nullptr)
+		{
+			// the handshake was received in time
+			m_deadlines.pop_front();
+			continue;
+		}
+		if (deadline > now)
+		{
+			return static_cast<int>(
+				std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count());
+		}
+		std::clog << "Incoming peer didn't send the handshake in time" << '\n';
+		pending->registration.detach();
+		m_pending.erase(handle);
+		m_deadlines.pop_front();
+	}
+	return -1;
+}
+
+int PeerListener::retry_accept(const std::chrono::steady_clock::time_point now)
+{
+	if (m_accept_retry.has_value() && m_accept_retry.value() <= now)
+	{
+		m_accept_retry.reset();
+		accept_peers();
+	}
+	if (!m_accept_retry.has_value())
+	{
+		return -1;
+	}
+	return static_cast<int>(
+		std::chrono::ceil<std::chrono::milliseconds>(m_accept_retry.value() - now).count());
+}
+
+void PeerListener::run(const std::stop_token stop)
+{
+	const std::stop_callback wake_up(stop, [this] { m_notifier.notify(); });
+	while (!stop.stop_requested())
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const int deadline = expire(now);
+		const int retry = retry_accept(now);
+		// the nearer of the two, -1 waits without a timeout
+		const int timeout = deadline == -1 || retry == -1 ? std::max(deadline, retry)
+								   : std::min(deadline, retry);
+		for (const auto &ev : m_loop->wait(timeout))
+		{
+			if (ev.token == m_wakeup_token)
+			{
+				m_notifier.drain();
+			}
+			else if (ev.token == m_listen_token)
+			{
+				accept_peers();
+			}
+			else
+			{
+				receive_handshake(ConnectionHandle::from_token(ev.token));
+			}
+		}
+	}
+}
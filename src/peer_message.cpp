@@ -336,6 +336,60 @@ std::span<const uint8_t> Piece::serialized() const &
 	return m_data;
 }
 
+// PieceHeader
+PieceHeader::PieceHeader(uint32_t index, uint32_t begin, uint32_t length)
+{
+	set_index(index);
+	set_begin(begin);
+	set_length(length);
+}
+
+PieceHeader::PieceHeader(std::span<const uint8_t> piece)
+{
+	assert(piece.size() >= size);
+	std::copy(piece.begin(), piece.begin() + size, m_data.begin());
+}
+
+void PieceHeader::set_index(uint32_t index)
+{
+	index = htonl(index);
+	memcpy(m_data.data() + 4 + 1, &index, sizeof index);
+}
+uint32_t PieceHeader::get_index() const
+{
+	uint32_t index = 0;
+	memcpy(&index, m_data.data() + 4 + 1, sizeof index);
+	return ntohl(index);
+}
+void PieceHeader::set_begin(uint32_t begin)
+{
+	begin = htonl(begin);
+	memcpy(m_data.data() + 4 + 1 + 4, &begin, sizeof begin);
+}
+uint32_t PieceHeader::get_begin() const
+{
+	uint32_t begin = 0;
+	memcpy(&begin, m_data.data() + 4 + 1 + 4, sizeof begin);
+	return ntohl(begin);
+}
+void PieceHeader::set_length(uint32_t length)
+{
+	// the length prefix covers the id, index and begin too
+	length = htonl(length + 1 + 4 + 4);
+	memcpy(m_data.data(), &length, sizeof length);
+}
+uint32_t PieceHeader::get_length() const
+{
+	uint32_t length = 0;
+	memcpy(&length, m_data.data(), sizeof length);
+	return ntohl(length) - 1 - 4 - 4;
+}
+
+std::span<const uint8_t> PieceHeader::serialized() const &
+{
+	return m_data;
+}
+
 // Cancel
 Cancel::Cancel(std::span<const uint8_t> cancel)
 {
@@ -1,57 +1,79 @@
 #include "piece.hpp"
 
+#include "hash_pool.hpp"
+
+#include <cassert>
 #include <cstdint>
+#include <map>
 #include <memory>
-#include <openssl/evp.h>
+#include <span>
+#include <stdexcept>
 #include <utility>
 
 // ReceivedPiece -----------------------------------------------------------------------
 
-void ReceivedPiece::add_block(message::Piece &&block)
-{
-	m_pieces.emplace_back(std::move(block));
-}
-
-void ReceivedPiece::clear()
+ReceivedPiece::ReceivedPiece(const size_t index, const size_t length, PieceBuffer buffer,
+			     HashPool *hash_pool)
+	: m_index(index)
+	, m_length(length)
+	, m_buffer(std::make_shared<PieceBuffer>(std::move(buffer)))
+	, m_hash_pool(hash_pool)
+	, m_stream(hash_pool != nullptr ? hash_pool->open_stream() : 0)
 {
-	m_pieces.clear();
+	assert(m_buffer->get().size() >= m_length);
 }
 
-size_t ReceivedPiece::get_index() const
+void ReceivedPiece::hash(const size_t begin, const size_t length)
 {
-	return m_pieces.at(0).get_index();
+	m_hash_pool->update(*this, begin, length);
+	m_hashed = begin + length;
 }
 
-std::string ReceivedPiece::compute_sha1() const
+void ReceivedPiece::add_block(const size_t begin, const size_t length)
 {
-	static constexpr size_t sha1_length = 20;
-
-	std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
-								    EVP_MD_CTX_free);
-	if (ctx == nullptr)
+	if (m_hash_pool == nullptr)
 	{
-		throw std::runtime_error("EVP_MD_CTX_new() has failed");
+		return;
 	}
-	if (EVP_DigestInit_ex2(ctx.get(), EVP_sha1(), nullptr) == 0)
+	if (begin != m_hashed)
 	{
-		throw std::runtime_error("EVP_DigestInit_ex2() has failed");
+		m_pending_blocks[begin] = length;
+		return;
 	}
+	hash(begin, length);
 
-	for (const auto &piece : m_pieces)
+	// the block may have filled the gap before the blocks that came earlier
+	auto it = m_pending_blocks.begin();
+	while (it != m_pending_blocks.end() && it->first <= m_hashed)
 	{
-		const auto block = piece.get_data();
-		if (EVP_DigestUpdate(ctx.get(), block.data(), block.size()) == 0)
+		const size_t end = it->first + it->second;
+		if (end > m_hashed)
 		{
-			throw std::runtime_error("EVP_DigestUpdate() has failed");
+			hash(m_hashed, end - m_hashed);
 		}
+		it = m_pending_blocks.erase(it);
 	}
-	std::string res;
-	res.resize(sha1_length);
+}
 
-	if (EVP_DigestFinal_ex(ctx.get(), reinterpret_cast<uint8_t *>(res.data()), nullptr) == 0)
+std::span<uint8_t> ReceivedPiece::get_block(const size_t begin, const size_t length)
+{
+	if (begin > m_length || length > m_length - begin)
 	{
-		throw std::runtime_error("EVP_DigestFinal_ex() has failed");
+		throw std::out_of_range("Block doesn't fit into the piece");
 	}
+	return m_buffer->get().subspan(begin, length);
+}
+
+size_t ReceivedPiece::get_index() const
+{
+	return m_index;
+}
 
-	return res;
+std::span<const uint8_t> ReceivedPiece::get_data() const
+{
+	if (m_buffer == nullptr)
+	{
+		return {};
+	}
+	return m_buffer->get().first(m_length);
 }
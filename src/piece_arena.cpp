@@ -0,0 +1,211 @@
+#include "piece_arena.hpp"
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+// PieceBuffer -------------------------------------------------------------------------
+
+PieceBuffer::PieceBuffer(PieceArena *arena, uint8_t *data, const size_t size)
+	: m_arena(arena)
+	, m_data(data)
+	, m_size(size)
+{
+}
+
+PieceBuffer::PieceBuffer(PieceBuffer &&other) noexcept
+	: m_arena(std::exchange(other.m_arena, nullptr))
+	, m_data(std::exchange(other.m_data, nullptr))
+	, m_size(std::exchange(other.m_size, 0))
+{
+}
+
+PieceBuffer &PieceBuffer::operator=(PieceBuffer &&other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		m_arena = std::exchange(other.m_arena, nullptr);
+		m_data = std::exchange(other.m_data, nullptr);
+		m_size = std::exchange(other.m_size, 0);
+	}
+	return *this;
+}
+
+std::span<uint8_t> PieceBuffer::get() const
+{
+	return { m_data, m_size };
+}
+
+bool PieceBuffer::empty() const
+{
+	return m_data == nullptr;
+}
+
+void PieceBuffer::reset()
+{
+	if (m_arena != nullptr)
+	{
+		m_arena->release(m_data, m_size);
+	}
+	m_arena = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+PieceBuffer::~PieceBuffer()
+{
+	reset();
+}
+
+// PieceArena --------------------------------------------------------------------------
+
+PieceArena::PieceArena(const size_t budget, const bool huge_pages)
+	: m_budget(budget)
+	, m_huge_pages(huge_pages)
+{
+}
+
+size_t PieceArena::slab_size(const size_t size) const
+{
+	const size_t alignment = m_huge_pages && size >= huge_page_size ?
+					 huge_page_size :
+					 static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+uint8_t *PieceArena::map_slab(const size_t size) const
+{
+	static constexpr int prot = PROT_READ | PROT_WRITE;
+	static constexpr int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	void *ptr = MAP_FAILED;
+	if (m_huge_pages && size % huge_page_size == 0)
+	{
+		// only succeeds if huge pages were reserved by the administrator
+		ptr = mmap(nullptr, size, prot, flags | MAP_HUGETLB, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			ptr = mmap(nullptr, size, prot, flags, -1, 0);
+			if (ptr != MAP_FAILED)
+			{
+				// transparent huge pages are just a hint
+				(void)madvise(ptr, size, MADV_HUGEPAGE);
+			}
+		}
+	}
+	else
+	{
+		ptr = mmap(nullptr, size, prot, flags, -1, 0);
+	}
+
+	if (ptr == MAP_FAILED)
+	{
+		throw std::runtime_error(std::string("mmap() failed: ") + strerror(errno));
+	}
+	return static_cast<uint8_t *>(ptr);
+}
+
+void PieceArena::unmap_slab(uint8_t *data, const size_t size)
+{
+	munmap(data, size);
+}
+
+void PieceArena::trim(const size_t needed)
+{
+	// free slabs of other sizes are given back to make room for the needed one
+	for (auto it = m_free_slabs.begin(); it != m_free_slabs.end();)
+	{
+		auto &[size, slabs] = *it;
+		while (!slabs.empty() && m_in_use + m_free + needed > m_budget)
+		{
+			unmap_slab(slabs.back(), size);
+			slabs.pop_back();
+			m_free -= size;
+		}
+		it = slabs.empty() ? m_free_slabs.erase(it) : std::next(it);
+	}
+}
+
+PieceBuffer PieceArena::acquire(const size_t size)
+{
+	const size_t slab = slab_size(size);
+	const std::lock_guard lock(m_mutex);
+
+	const auto it = m_free_slabs.find(slab);
+	if (it != m_free_slabs.end() && !it->second.empty())
+	{
+		uint8_t *data = it->second.back();
+		it->second.pop_back();
+		m_free -= slab;
+		m_in_use += slab;
+		return { this, data, slab };
+	}
+
+	if (m_in_use + m_free + slab > m_budget)
+	{
+		trim(slab);
+		if (m_in_use + m_free + slab > m_budget)
+		{
+			m_exhausted = true;
+			return {};
+		}
+	}
+
+	uint8_t *data = map_slab(slab);
+	m_in_use += slab;
+	return { this, data, slab };
+}
+
+void PieceArena::release(uint8_t *data, const size_t size)
+{
+	std::function<void()> on_available;
+	{
+		const std::lock_guard lock(m_mutex);
+		m_free_slabs[size].push_back(data);
+		m_in_use -= size;
+		m_free += size;
+		if (std::exchange(m_exhausted, false))
+		{
+			on_available = m_on_available;
+		}
+	}
+	if (on_available)
+	{
+		on_available();
+	}
+}
+
+void PieceArena::set_on_available(std::function<void()> on_available)
+{
+	const std::lock_guard lock(m_mutex);
+	m_on_available = std::move(on_available);
+}
+
+size_t PieceArena::in_use()
+{
+	const std::lock_guard lock(m_mutex);
+	return m_in_use;
+}
+
+PieceArena::~PieceArena()
+{
+	assert(m_in_use == 0 && "Buffers must not outlive the arena");
+	for (auto &[size, slabs] : m_free_slabs)
+	{
+		for (uint8_t *data : slabs)
+		{
+			unmap_slab(data, size);
+		}
+	}
+}
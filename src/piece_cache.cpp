@@ -0,0 +1,104 @@
+#include "piece_cache.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+PieceCache::PieceCache(const size_t budget)
+	: m_budget(budget)
+	, m_in_budget(budget / 4)
+{
+}
+
+bool PieceCache::enabled() const
+{
+	return m_budget != 0;
+}
+
+PieceCache::Data PieceCache::find(const size_t index)
+{
+	const std::lock_guard lock(m_mutex);
+	const auto it = m_entries.find(index);
+	if (it == m_entries.end())
+	{
+		++m_stats.misses;
+		return nullptr;
+	}
+	++m_stats.hits;
+	// a piece in IN keeps its place, repeated requests right after it came are expected
+	if (it->second->queue == Queue::MAIN)
+	{
+		m_main.splice(m_main.begin(), m_main, it->second);
+	}
+	return it->second->data;
+}
+
+void PieceCache::insert(const size_t index, Data data)
+{
+	const size_t size = data->size();
+	if (size > m_budget)
+	{
+		return;
+	}
+
+	const std::lock_guard lock(m_mutex);
+	if (m_entries.contains(index))
+	{
+		return;
+	}
+	// as many pieces as would fill half of the budget are remembered
+	m_max_ghosts = std::max<size_t>(m_budget / 2 / std::max<size_t>(size, 1), 1);
+
+	const auto ghost = m_ghost_index.find(index);
+	if (ghost != m_ghost_index.end())
+	{
+		m_ghosts.erase(ghost->second);
+		m_ghost_index.erase(ghost);
+		m_main.push_front({ index, std::move(data), Queue::MAIN });
+		m_entries.emplace(index, m_main.begin());
+	}
+	else
+	{
+		m_in.push_front({ index, std::move(data), Queue::IN });
+		m_entries.emplace(index, m_in.begin());
+		m_in_bytes += size;
+	}
+	m_stats.bytes += size;
+	++m_stats.pieces;
+	++m_stats.insertions;
+	reclaim();
+}
+
+void PieceCache::reclaim()
+{
+	while (m_stats.bytes > m_budget)
+	{
+		const bool from_in = !m_in.empty() && (m_in_bytes > m_in_budget || m_main.empty());
+		std::list<Entry> &queue = from_in ? m_in : m_main;
+		const Entry &victim = queue.back();
+		const size_t size = victim.data->size();
+		m_entries.erase(victim.index);
+		if (from_in)
+		{
+			m_in_bytes -= size;
+			m_ghosts.push_front(victim.index);
+			m_ghost_index.emplace(victim.index, m_ghosts.begin());
+			while (m_ghosts.size() > m_max_ghosts)
+			{
+				m_ghost_index.erase(m_ghosts.back());
+				m_ghosts.pop_back();
+			}
+		}
+		queue.pop_back();
+		m_stats.bytes -= size;
+		--m_stats.pieces;
+		++m_stats.evictions;
+	}
+}
+
+PieceCache::Stats PieceCache::get_stats()
+{
+	const std::lock_guard lock(m_mutex);
+	return m_stats;
+}
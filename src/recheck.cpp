@@ -0,0 +1,378 @@
+#include "recheck.hpp"
+
+#include "sha1.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// the chunk a worker takes at once, big enough for read-ahead to matter
+static constexpr size_t chunk_bytes = 16 * 1024 * 1024;
+
+// Mapping -----------------------------------------------------------------------------
+
+/**
+ * @brief Read-only mapping of the part of a file that is on disk
+ */
+class Recheck::Mapping {
+	uint8_t *m_data = nullptr;
+	size_t m_size = 0;
+	// ranges of the file that are not holes, sorted
+	std::vector<std::pair<size_t, size_t>> m_extents;
+
+	void find_extents(int fd)
+	{
+		off_t pos = 0;
+		const auto end = static_cast<off_t>(m_size);
+		while (pos < end)
+		{
+			const off_t data = lseek(fd, pos, SEEK_DATA);
+			if (data == -1)
+			{
+				// ENXIO means there is no data till the end of the file
+				if (errno != ENXIO)
+				{
+					m_extents = { { 0, m_size } };
+				}
+				return;
+			}
+			off_t hole = lseek(fd, data, SEEK_HOLE);
+			if (hole == -1)
+			{
+				hole = end;
+			}
+			m_extents.emplace_back(static_cast<size_t>(data),
+					       static_cast<size_t>(std::min(hole, end)));
+			pos = hole;
+		}
+	}
+
+public:
+	/**
+	 * @param length The length of the file in the torrent, anything after it is ignored
+	 */
+	Mapping(const std::filesystem::path &path, const size_t length)
+	{
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+		{
+			return;
+		}
+		struct stat st {};
+		if (fstat(fd, &st) == 0)
+		{
+			m_size = std::min(static_cast<size_t>(st.st_size), length);
+		}
+		if (m_size != 0)
+		{
+			void *addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (addr == MAP_FAILED)
+			{
+				m_size = 0;
+			}
+			else
+			{
+				m_data = static_cast<uint8_t *>(addr);
+				(void)madvise(m_data, m_size, MADV_SEQUENTIAL);
+				find_extents(fd);
+			}
+		}
+		close(fd);
+	}
+
+	Mapping(const Mapping &other) = delete;
+	Mapping &operator=(const Mapping &other) = delete;
+
+	Mapping(Mapping &&other) noexcept
+		: m_data(std::exchange(other.m_data, nullptr))
+		, m_size(std::exchange(other.m_size, 0))
+		, m_extents(std::move(other.m_extents))
+	{
+	}
+	Mapping &operator=(Mapping &&other) = delete;
+
+	~Mapping()
+	{
+		if (m_data != nullptr)
+		{
+			munmap(m_data, m_size);
+		}
+	}
+
+	/**
+	 * @return An empty span if some of the bytes are not on disk
+	 */
+	[[nodiscard]] std::span<const uint8_t> get(const size_t begin, const size_t end) const
+	{
+		if (end > m_size)
+		{
+			return {};
+		}
+		return { m_data + begin, end - begin };
+	}
+
+	[[nodiscard]] bool has_data(const size_t begin, const size_t end) const
+	{
+		// the first extent that ends after the beginning of the range
+		const auto it = std::upper_bound(
+			m_extents.begin(), m_extents.end(), begin,
+			[](const size_t pos, const auto &extent) { return pos < extent.second; });
+		return it != m_extents.end() && it->first < end;
+	}
+
+	void will_need(const size_t begin, const size_t end) const
+	{
+		if (begin >= std::min(end, m_size))
+		{
+			return;
+		}
+		// madvise() wants the address aligned to the page
+		static const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		const size_t aligned = begin / page * page;
+		(void)madvise(m_data + aligned, std::min(end, m_size) - aligned, MADV_WILLNEED);
+	}
+};
+
+// Recheck -----------------------------------------------------------------------------
+
+Recheck::Recheck(FileLayout layout, const std::string_view hashes)
+	: m_layout(std::move(layout))
+	, m_hashes(hashes)
+	, m_pieces(hashes.size() / utils::sha1_length)
+	, m_verified(m_pieces, 0)
+{
+}
+
+Recheck::~Recheck() = default;
+
+std::span<const uint8_t>
+Recheck::piece_data(const size_t index, const std::function<std::span<uint8_t>()> &copy_buffer)
+{
+	const size_t piece_length = m_layout.piece_length();
+	const size_t begin = index * piece_length;
+	const size_t length = std::min(begin + piece_length, m_layout.length()) - begin;
+	const auto extents = m_layout.extents_of(begin, length);
+
+	std::span<const uint8_t> single;
+	std::span<uint8_t> buffer;
+	bool has_data = false;
+	for (const auto &extent : extents)
+	{
+		const size_t file_end = extent.offset + extent.length;
+		const auto part = m_mappings[extent.file].get(extent.offset, file_end);
+		if (part.empty())
+		{
+			return {};
+		}
+		has_data = has_data || m_mappings[extent.file].has_data(extent.offset, file_end);
+
+		if (extents.size() == 1)
+		{
+			single = part;
+		}
+		else
+		{
+			if (buffer.empty())
+			{
+				buffer = copy_buffer();
+			}
+			const size_t file_offset = m_layout.files()[extent.file].offset;
+			std::memcpy(buffer.data() + (file_offset + extent.offset - begin),
+				    part.data(), part.size());
+		}
+	}
+
+	if (!has_data)
+	{
+		return {};
+	}
+	return extents.size() == 1 ? single : buffer.first(length);
+}
+
+void Recheck::advise_chunk(const size_t first, const size_t last)
+{
+	const size_t begin = first * m_layout.piece_length();
+	const size_t end = std::min(last * m_layout.piece_length(), m_layout.length());
+	for (const auto &extent : m_layout.extents_of(begin, end - begin))
+	{
+		m_mappings[extent.file].will_need(extent.offset, extent.offset + extent.length);
+	}
+}
+
+void Recheck::work()
+{
+	const sha1::Kernel kernel = sha1::best_kernel();
+	const size_t batch = sha1::preferred_batch(kernel);
+	const size_t chunk_pieces = std::max<size_t>(chunk_bytes / m_layout.piece_length(), 1);
+
+	// only the pieces that span several files are copied, one at a time
+	std::unique_ptr<uint8_t[]> buffer;
+	bool buffer_in_batch = false;
+	std::vector<size_t> indices;
+	std::vector<std::span<const uint8_t>> inputs;
+	std::vector<sha1::Digest> digests(batch);
+
+	const auto flush = [&] {
+		try
+		{
+			sha1::hash(inputs, digests, kernel);
+		} catch (const std::exception &ex)
+		{
+			// the pieces stay unverified and will be downloaded again
+			std::cerr << ex.what() << '\n';
+			m_checked += inputs.size();
+			indices.clear();
+			inputs.clear();
+			buffer_in_batch = false;
+			return;
+		}
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			const auto expected = m_hashes.substr(indices[i] * utils::sha1_length,
+							      utils::sha1_length);
+			m_verified[indices[i]] =
+				std::equal(digests[i].begin(), digests[i].end(),
+					   reinterpret_cast<const uint8_t *>(expected.data())) ?
+					1 :
+					0;
+			m_bytes_hashed += inputs[i].size();
+		}
+		m_checked += inputs.size();
+		indices.clear();
+		inputs.clear();
+		buffer_in_batch = false;
+	};
+	const std::function<std::span<uint8_t>()> copy_buffer = [&] {
+		if (buffer_in_batch)
+		{
+			// the previous copy is still waiting to be hashed
+			flush();
+		}
+		if (buffer == nullptr)
+		{
+			buffer = std::make_unique_for_overwrite<uint8_t[]>(m_layout.piece_length());
+		}
+		return std::span(buffer.get(), m_layout.piece_length());
+	};
+
+	for (size_t chunk = m_next_chunk++; chunk * chunk_pieces < m_pieces; chunk = m_next_chunk++)
+	{
+		size_t first = chunk * chunk_pieces;
+		size_t last = std::min(first + chunk_pieces, m_pieces);
+		// only the wanted part of the chunk is read ahead
+		while (first < last && !m_wanted.get_index(first))
+		{
+			++first;
+			++m_checked;
+		}
+		while (last > first && !m_wanted.get_index(last - 1))
+		{
+			--last;
+			++m_checked;
+		}
+		advise_chunk(first, last);
+
+		for (size_t index = first; index < last; ++index)
+		{
+			if (!m_wanted.get_index(index))
+			{
+				++m_checked;
+				continue;
+			}
+			const auto data = piece_data(index, copy_buffer);
+			if (data.empty())
+			{
+				++m_checked;
+				continue;
+			}
+			buffer_in_batch = buffer_in_batch || data.data() == buffer.get();
+			indices.push_back(index);
+			inputs.push_back(data);
+			if (inputs.size() == batch)
+			{
+				flush();
+			}
+		}
+	}
+	if (!inputs.empty())
+	{
+		flush();
+	}
+
+	{
+		const std::lock_guard lock(m_mutex);
+		--m_running;
+	}
+	m_cv.notify_one();
+}
+
+void Recheck::report(const double seconds)
+{
+	const double mib = static_cast<double>(m_bytes_hashed) / (1024.0 * 1024.0);
+	std::clog << "Recheck: " << m_checked << "/" << m_pieces << " pieces, "
+		  << (seconds > 0 ? mib / seconds : 0.0) << " MiB/s" << '\n';
+}
+
+message::Bitfield Recheck::run(const size_t threads)
+{
+	message::Bitfield pieces(m_pieces);
+	for (size_t i = 0; i < m_pieces; ++i)
+	{
+		pieces.set_index(i, true);
+	}
+	return run(threads, std::move(pieces));
+}
+
+message::Bitfield Recheck::run(const size_t threads, message::Bitfield pieces)
+{
+	m_wanted = std::move(pieces);
+	for (const auto &file : m_layout.files())
+	{
+		m_mappings.emplace_back(file.path, file.length);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::jthread> workers;
+	const size_t count = std::max<size_t>(threads, 1);
+	m_running = count;
+	for (size_t i = 0; i < count; ++i)
+	{
+		workers.emplace_back([this] { work(); });
+	}
+
+	{
+		std::unique_lock lock(m_mutex);
+		while (!m_cv.wait_for(lock, std::chrono::seconds(1), [this] { return m_running == 0; }))
+		{
+			report(std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+				       .count());
+		}
+	}
+	workers.clear();
+	report(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	m_mappings.clear();
+
+	message::Bitfield ret(m_pieces);
+	for (size_t i = 0; i < m_pieces; ++i)
+	{
+		ret.set_index(i, m_verified[i] != 0);
+	}
+	return ret;
+}
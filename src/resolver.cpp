@@ -0,0 +1,110 @@
+#include "resolver.hpp"
+
+#include "socket.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <vector>
+
+Resolver::Resolver(const size_t threads, const std::chrono::seconds ttl)
+	: m_ttl(ttl)
+{
+	for (size_t i = 0; i < threads; ++i)
+	{
+		m_workers.emplace_back([this](std::stop_token stop) { work(stop); });
+	}
+}
+
+std::optional<std::vector<Endpoint>> Resolver::lookup_cache(const std::string &hostname,
+							    const std::string &port)
+{
+	const std::lock_guard lock(m_mutex);
+	const auto it = m_cache.find({ hostname, port });
+	if (it == m_cache.end())
+	{
+		return std::nullopt;
+	}
+	if (it->second.expires <= std::chrono::steady_clock::now())
+	{
+		m_cache.erase(it);
+		return std::nullopt;
+	}
+	return it->second.endpoints;
+}
+
+std::optional<std::vector<Endpoint>>
+Resolver::resolve(const uint64_t id, const std::string &hostname, const std::string &port)
+{
+	if (const auto endpoint = TCPClient::parse_numeric(hostname, port))
+	{
+		return std::vector<Endpoint>{ endpoint.value() };
+	}
+	if (auto endpoints = lookup_cache(hostname, port))
+	{
+		return endpoints;
+	}
+
+	{
+		const std::lock_guard lock(m_mutex);
+		m_requests.push_back({ id, hostname, port });
+	}
+	m_cv.notify_one();
+	return std::nullopt;
+}
+
+void Resolver::work(const std::stop_token stop)
+{
+	while (true)
+	{
+		Request request;
+		{
+			std::unique_lock lock(m_mutex);
+			if (!m_cv.wait(lock, stop, [this] { return !m_requests.empty(); }))
+			{
+				return;
+			}
+			request = std::move(m_requests.front());
+			m_requests.pop_front();
+		}
+
+		Result result{ request.id, std::move(request.hostname), std::move(request.port), {} };
+		try
+		{
+			result.endpoints = TCPClient::resolve(result.hostname, result.port);
+		} catch (const std::exception &ex)
+		{
+			// reported as a result without endpoints
+		}
+
+		{
+			const std::lock_guard lock(m_mutex);
+			if (!result.endpoints.empty())
+			{
+				m_cache[{ result.hostname, result.port }] = {
+					result.endpoints, std::chrono::steady_clock::now() + m_ttl
+				};
+			}
+			m_results.push_back(std::move(result));
+		}
+		m_notifier.notify();
+	}
+}
+
+std::vector<Resolver::Result> Resolver::take_results()
+{
+	m_notifier.drain();
+	const std::lock_guard lock(m_mutex);
+	return std::exchange(m_results, {});
+}
+
+int Resolver::get_fd() const
+{
+	return m_notifier.get_fd();
+}
@@ -0,0 +1,117 @@
+#include "resume_data.hpp"
+
+#include "bencode.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <variant>
+
+static constexpr long long g_version = 1;
+
+ResumeData::FileState ResumeData::stat_file(const std::filesystem::path &path)
+{
+	struct stat st {};
+	if (stat(path.c_str(), &st) == -1)
+	{
+		return {};
+	}
+	return { static_cast<long long>(st.st_size),
+		 static_cast<long long>(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec };
+}
+
+std::optional<ResumeData> ResumeData::load(const std::filesystem::path &path,
+					   const size_t number_of_pieces)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+	{
+		return std::nullopt;
+	}
+	const std::string content((std::istreambuf_iterator<char>(in)),
+				  std::istreambuf_iterator<char>());
+
+	try
+	{
+		bencode::data data = bencode::decode(content);
+		if (utils::decode_optional_int(data, "version").value_or(0) != g_version)
+		{
+			return std::nullopt;
+		}
+
+		ResumeData ret;
+		ret.info_hash = std::get<bencode::string>(data["info hash"]);
+		ret.piece_length = std::get<bencode::integer>(data["piece length"]);
+
+		const std::string packed = std::get<bencode::string>(data["pieces"]);
+		if (packed.size() != (number_of_pieces + 7) / 8)
+		{
+			return std::nullopt;
+		}
+		ret.pieces = message::Bitfield(number_of_pieces);
+		for (size_t i = 0; i < number_of_pieces; ++i)
+		{
+			ret.pieces.set_index(i, (static_cast<uint8_t>(packed[i / 8]) &
+						 (0x80 >> (i % 8))) != 0);
+		}
+
+		for (auto &file : std::get<bencode::list>(data["files"]))
+		{
+			ret.files.push_back({ std::get<bencode::integer>(file["length"]),
+					      std::get<bencode::integer>(file["mtime"]) });
+		}
+		return ret;
+	} catch (const std::exception &ex)
+	{
+		return std::nullopt;
+	}
+}
+
+void ResumeData::save(const std::filesystem::path &path) const
+{
+	std::string packed((pieces.get_bf_size() + 7) / 8, '\0');
+	for (size_t i = 0; i < pieces.get_bf_size(); ++i)
+	{
+		if (pieces.get_index(i))
+		{
+			packed[i / 8] = static_cast<char>(static_cast<uint8_t>(packed[i / 8]) |
+							  (0x80 >> (i % 8)));
+		}
+	}
+
+	bencode::list file_list;
+	for (const auto &file : files)
+	{
+		bencode::dict entry;
+		entry["length"] = file.length;
+		entry["mtime"] = file.mtime;
+		file_list.emplace_back(std::move(entry));
+	}
+
+	bencode::dict dict;
+	dict["version"] = g_version;
+	dict["info hash"] = info_hash;
+	dict["piece length"] = piece_length;
+	dict["pieces"] = std::move(packed);
+	dict["files"] = std::move(file_list);
+
+	std::filesystem::path tmp_path = path;
+	tmp_path += ".tmp";
+	{
+		std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+		bencode::encode_to(out, bencode::data(std::move(dict)));
+		if (!out.flush())
+		{
+			throw std::runtime_error("Failed to write " + tmp_path.string());
+		}
+	}
+	std::filesystem::rename(tmp_path, path);
+}
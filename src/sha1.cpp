@@ -0,0 +1,737 @@
+#include "sha1.hpp"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MYTORRENT_SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace sha1
+{
+
+namespace
+{
+
+constexpr size_t block_size = 64;
+constexpr std::array<uint32_t, 5> initial_state = { 0x67452301, 0xEFCDAB89, 0x98BADCFE,
+						    0x10325476, 0xC3D2E1F0 };
+
+using State = std::array<uint32_t, 5>;
+
+uint32_t load_be32(const uint8_t *src)
+{
+	uint32_t value = 0;
+	std::memcpy(&value, src, sizeof value);
+	if constexpr (std::endian::native == std::endian::little)
+	{
+		value = __builtin_bswap32(value);
+	}
+	return value;
+}
+
+void store_digest(const State &state, Digest &digest)
+{
+	for (size_t i = 0; i < state.size(); ++i)
+	{
+		digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+		digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+		digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+		digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+	}
+}
+
+/**
+ * @brief Message split into the blocks the kernels consume
+ *
+ * The full blocks are read straight from the input, only the padded tail is copied.
+ */
+struct Message {
+	const uint8_t *data = nullptr;
+	size_t full_blocks = 0;
+	std::array<uint8_t, 2 * block_size> tail{};
+	size_t tail_blocks = 0;
+
+	explicit Message(std::span<const uint8_t> input)
+		: Message(input, input.size())
+	{
+	}
+
+	/**
+	 * @param length The length of the whole message, input is its end then
+	 */
+	Message(std::span<const uint8_t> input, const uint64_t length)
+		: data(input.data())
+		, full_blocks(input.size() / block_size)
+	{
+		const size_t rest = input.size() % block_size;
+		std::memcpy(tail.data(), data + full_blocks * block_size, rest);
+		tail[rest] = 0x80;
+		// the padding byte and the 64-bit length have to fit
+		tail_blocks = rest + 1 + 8 > block_size ? 2 : 1;
+		const uint64_t bits = length * 8;
+		for (size_t i = 0; i < 8; ++i)
+		{
+			tail[tail_blocks * block_size - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+		}
+	}
+
+	[[nodiscard]] size_t blocks() const
+	{
+		return full_blocks + tail_blocks;
+	}
+
+	[[nodiscard]] const uint8_t *block(size_t index) const
+	{
+		return index < full_blocks ? data + index * block_size :
+					     tail.data() + (index - full_blocks) * block_size;
+	}
+};
+
+// portable kernel ---------------------------------------------------------------------
+
+void compress_generic(State &state, const uint8_t *block)
+{
+	std::array<uint32_t, 16> w{};
+	for (size_t t = 0; t < 16; ++t)
+	{
+		w[t] = load_be32(block + 4 * t);
+	}
+
+	auto [a, b, c, d, e] = state;
+	for (size_t t = 0; t < 80; ++t)
+	{
+		if (t >= 16)
+		{
+			w[t % 16] = std::rotl(w[(t - 3) % 16] ^ w[(t - 8) % 16] ^ w[(t - 14) % 16] ^
+						      w[t % 16],
+					      1);
+		}
+		uint32_t f = 0;
+		uint32_t k = 0;
+		if (t < 20)
+		{
+			f = d ^ (b & (c ^ d));
+			k = 0x5A827999;
+		}
+		else if (t < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (t < 60)
+		{
+			f = (b & c) | (d & (b | c));
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		const uint32_t temp = std::rotl(a, 5) + f + e + k + w[t % 16];
+		e = d;
+		d = c;
+		c = std::rotl(b, 30);
+		b = a;
+		a = temp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+// SHA-NI kernel -----------------------------------------------------------------------
+
+#ifdef MYTORRENT_SHA1_X86
+
+/**
+ * @brief Runs the four rounds of the group G and all the groups after it
+ *
+ * The group G of message words is kept in msg[G % 4]. Recursion keeps every index
+ * a constant, so the whole block is compiled into straight code.
+ */
+template <size_t G>
+__attribute__((target("sha,sse4.1"), always_inline)) inline void
+rounds_shani(__m128i &abcd, __m128i &e, __m128i &abcd_saved, __m128i (&msg)[4])
+{
+	if constexpr (G >= 4)
+	{
+		msg[G % 4] = _mm_sha1msg2_epu32(
+			_mm_xor_si128(_mm_sha1msg1_epu32(msg[G % 4], msg[(G + 1) % 4]),
+				      msg[(G + 2) % 4]),
+			msg[(G + 3) % 4]);
+	}
+	if constexpr (G == 0)
+	{
+		e = _mm_add_epi32(e, msg[0]);
+	}
+	else
+	{
+		e = _mm_sha1nexte_epu32(abcd_saved, msg[G % 4]);
+	}
+	abcd_saved = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e, G / 5);
+	if constexpr (G < 19)
+	{
+		rounds_shani<G + 1>(abcd, e, abcd_saved, msg);
+	}
+}
+
+__attribute__((target("sha,sse4.1"))) void compress_shani(State &state, const uint8_t *blocks,
+							 size_t count)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	__m128i abcd = _mm_shuffle_epi32(
+		_mm_loadu_si128(reinterpret_cast<const __m128i *>(state.data())), 0x1B);
+	__m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+	for (size_t j = 0; j < count; ++j, blocks += block_size)
+	{
+		__m128i msg[4];
+		for (size_t i = 0; i < 4; ++i)
+		{
+			msg[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks + 16 * i)),
+				mask);
+		}
+
+		const __m128i abcd_initial = abcd;
+		const __m128i e_initial = e0;
+		__m128i e = e0;
+		__m128i abcd_saved;
+		rounds_shani<0>(abcd, e, abcd_saved, msg);
+		e0 = _mm_sha1nexte_epu32(abcd_saved, e_initial);
+		abcd = _mm_add_epi32(abcd, abcd_initial);
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(state.data()), _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+#endif // MYTORRENT_SHA1_X86
+
+// AVX2 kernel -------------------------------------------------------------------------
+
+#ifdef MYTORRENT_SHA1_X86
+
+__attribute__((target("avx2"))) __m256i rotl(__m256i x, int bits)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, bits), _mm256_srli_epi32(x, 32 - bits));
+}
+
+/**
+ * @brief Transposes 8 rows of 8 words, so that row i holds the word i of every lane
+ */
+__attribute__((target("avx2"))) void transpose(__m256i (&rows)[8])
+{
+	__m256i t[8];
+	for (size_t i = 0; i < 8; i += 2)
+	{
+		t[i] = _mm256_unpacklo_epi32(rows[i], rows[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(rows[i], rows[i + 1]);
+	}
+	__m256i u[8];
+	for (size_t i = 0; i < 8; i += 4)
+	{
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (size_t i = 0; i < 4; ++i)
+	{
+		rows[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		rows[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/**
+ * @brief Compresses one block of every lane, word i of state[j] belongs to the lane i
+ */
+__attribute__((target("avx2"))) void compress_avx2(__m256i (&state)[5],
+						   const std::array<const uint8_t *, max_lanes> &blocks)
+{
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2,
+					      3, 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1,
+					      2, 3);
+	__m256i w[16];
+	for (size_t half = 0; half < 2; ++half)
+	{
+		__m256i rows[8];
+		for (size_t lane = 0; lane < max_lanes; ++lane)
+		{
+			rows[lane] = _mm256_shuffle_epi8(
+				_mm256_loadu_si256(reinterpret_cast<const __m256i *>(
+					blocks[lane] + 32 * half)),
+				bswap);
+		}
+		transpose(rows);
+		std::copy(std::begin(rows), std::end(rows), w + 8 * half);
+	}
+
+	auto [a, b, c, d, e] = state;
+	for (size_t t = 0; t < 80; ++t)
+	{
+		if (t >= 16)
+		{
+			w[t % 16] = rotl(_mm256_xor_si256(_mm256_xor_si256(w[(t - 3) % 16],
+									   w[(t - 8) % 16]),
+							  _mm256_xor_si256(w[(t - 14) % 16], w[t % 16])),
+					 1);
+		}
+		__m256i f;
+		__m256i k;
+		if (t < 20)
+		{
+			f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+			k = _mm256_set1_epi32(0x5A827999);
+		}
+		else if (t < 40)
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = _mm256_set1_epi32(0x6ED9EBA1);
+		}
+		else if (t < 60)
+		{
+			f = _mm256_or_si256(_mm256_and_si256(b, c),
+					    _mm256_and_si256(d, _mm256_or_si256(b, c)));
+			k = _mm256_set1_epi32(static_cast<int>(0x8F1BBCDC));
+		}
+		else
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = _mm256_set1_epi32(static_cast<int>(0xCA62C1D6));
+		}
+		const __m256i temp = _mm256_add_epi32(
+			_mm256_add_epi32(rotl(a, 5), f),
+			_mm256_add_epi32(_mm256_add_epi32(e, k), w[t % 16]));
+		e = d;
+		d = c;
+		c = rotl(b, 30);
+		b = a;
+		a = temp;
+	}
+	state[0] = _mm256_add_epi32(state[0], a);
+	state[1] = _mm256_add_epi32(state[1], b);
+	state[2] = _mm256_add_epi32(state[2], c);
+	state[3] = _mm256_add_epi32(state[3], d);
+	state[4] = _mm256_add_epi32(state[4], e);
+}
+
+/**
+ * @brief Runs the blocks every message has over all the lanes at once
+ *
+ * @return The state of every message after the common blocks
+ */
+__attribute__((target("avx2"))) std::array<State, max_lanes>
+hash_lanes_avx2(std::span<const Message> messages, size_t common_blocks)
+{
+	__m256i state[5];
+	for (size_t i = 0; i < 5; ++i)
+	{
+		state[i] = _mm256_set1_epi32(static_cast<int>(initial_state[i]));
+	}
+
+	std::array<const uint8_t *, max_lanes> blocks{};
+	for (size_t j = 0; j < common_blocks; ++j)
+	{
+		for (size_t lane = 0; lane < max_lanes; ++lane)
+		{
+			// unused lanes repeat the first message, their result is dropped
+			blocks[lane] = messages[lane < messages.size() ? lane : 0].block(j);
+		}
+		compress_avx2(state, blocks);
+	}
+
+	std::array<State, max_lanes> ret{};
+	for (size_t i = 0; i < 5; ++i)
+	{
+		std::array<uint32_t, max_lanes> words{};
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(words.data()), state[i]);
+		for (size_t lane = 0; lane < max_lanes; ++lane)
+		{
+			ret[lane][i] = words[lane];
+		}
+	}
+	return ret;
+}
+
+#endif // MYTORRENT_SHA1_X86
+
+// drivers -----------------------------------------------------------------------------
+
+struct CpuFeatures {
+	bool sha_ni = false;
+	bool avx2 = false;
+};
+
+CpuFeatures detect_features()
+{
+	CpuFeatures ret;
+#ifdef MYTORRENT_SHA1_X86
+	unsigned int eax = 0;
+	unsigned int ebx = 0;
+	unsigned int ecx = 0;
+	unsigned int edx = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+	{
+		return ret;
+	}
+	const bool ssse3 = (ecx & bit_SSSE3) != 0;
+	const bool sse41 = (ecx & bit_SSE4_1) != 0;
+	bool ymm_enabled = false;
+	if ((ecx & bit_OSXSAVE) != 0 && (ecx & bit_AVX) != 0)
+	{
+		// the OS must save the upper halves of the registers on context switches
+		unsigned int xcr0_lo = 0;
+		unsigned int xcr0_hi = 0;
+		__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		ymm_enabled = (xcr0_lo & 0x6) == 0x6;
+	}
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+	{
+		return ret;
+	}
+	ret.sha_ni = ssse3 && sse41 && (ebx & bit_SHA) != 0;
+	ret.avx2 = ymm_enabled && (ebx & bit_AVX2) != 0;
+#endif
+	return ret;
+}
+
+const CpuFeatures &features()
+{
+	static const CpuFeatures cpu = detect_features();
+	return cpu;
+}
+
+void hash_evp(std::span<const uint8_t> input, Digest &output)
+{
+	// the context is initialized again for every input, but never reallocated
+	thread_local const std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(
+		EVP_MD_CTX_new(), EVP_MD_CTX_free);
+	if (ctx == nullptr)
+	{
+		throw std::runtime_error("EVP_MD_CTX_new() has failed");
+	}
+	if (EVP_DigestInit_ex2(ctx.get(), EVP_sha1(), nullptr) == 0)
+	{
+		throw std::runtime_error("EVP_DigestInit_ex2() has failed");
+	}
+	if (EVP_DigestUpdate(ctx.get(), input.data(), input.size()) == 0)
+	{
+		throw std::runtime_error("EVP_DigestUpdate() has failed");
+	}
+	if (EVP_DigestFinal_ex(ctx.get(), output.data(), nullptr) == 0)
+	{
+		throw std::runtime_error("EVP_DigestFinal_ex() has failed");
+	}
+}
+
+/**
+ * @brief Compresses contiguous blocks with SHA-NI if it is supported
+ */
+void compress(State &state, const uint8_t *blocks, const size_t count)
+{
+#ifdef MYTORRENT_SHA1_X86
+	if (features().sha_ni)
+	{
+		compress_shani(state, blocks, count);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < count; ++i)
+	{
+		compress_generic(state, blocks + i * block_size);
+	}
+}
+
+/**
+ * @brief Compresses the blocks of the message starting with the given one
+ */
+void finish_message(const Message &message, size_t first_block, State &state)
+{
+	// the full blocks and the tail are contiguous on their own
+	const std::array<std::span<const uint8_t>, 2> ranges = {
+		std::span(message.data, message.full_blocks * block_size),
+		std::span<const uint8_t>(message.tail.data(), message.tail_blocks * block_size)
+	};
+	size_t skip = first_block * block_size;
+	for (auto range : ranges)
+	{
+		const size_t skipped = std::min(skip, range.size());
+		range = range.subspan(skipped);
+		skip -= skipped;
+		compress(state, range.data(), range.size() / block_size);
+	}
+}
+
+#ifdef MYTORRENT_SHA1_X86
+void hash_single(std::span<const uint8_t> input, Digest &output)
+{
+	const Message message(input);
+	State state = initial_state;
+	finish_message(message, 0, state);
+	store_digest(state, output);
+}
+
+void hash_multi(std::span<const std::span<const uint8_t>> inputs, std::span<Digest> outputs)
+{
+	// the tails are copied, so a group is kept on the heap
+	std::vector<Message> messages;
+	messages.reserve(max_lanes);
+	for (size_t first = 0; first < inputs.size(); first += max_lanes)
+	{
+		const size_t count = std::min(max_lanes, inputs.size() - first);
+		messages.clear();
+		size_t common_blocks = std::numeric_limits<size_t>::max();
+		for (size_t i = 0; i < count; ++i)
+		{
+			messages.emplace_back(inputs[first + i]);
+			common_blocks = std::min(common_blocks, messages.back().blocks());
+		}
+
+		std::array<State, max_lanes> states = hash_lanes_avx2(messages, common_blocks);
+		for (size_t i = 0; i < count; ++i)
+		{
+			// pieces of a different length, like the last one, are finished one by one
+			finish_message(messages[i], common_blocks, states[i]);
+			store_digest(states[i], outputs[first + i]);
+		}
+	}
+}
+#endif
+
+/**
+ * @brief Picks the fastest of the supported kernels by hashing a small batch with each
+ *
+ * Which one wins depends on the microarchitecture: SHA-NI is latency bound, while AVX2
+ * is limited by the width of the vector units. It takes about a millisecond per kernel.
+ */
+Kernel calibrate()
+{
+	static constexpr size_t sample_size = 64 * 1024;
+
+	std::vector<uint8_t> data(max_lanes * sample_size);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = static_cast<uint8_t>(i);
+	}
+	std::array<std::span<const uint8_t>, max_lanes> inputs{};
+	for (size_t i = 0; i < max_lanes; ++i)
+	{
+		inputs[i] = std::span(data).subspan(i * sample_size, sample_size);
+	}
+	std::array<Digest, max_lanes> outputs{};
+
+	Kernel best = Kernel::EVP;
+	auto best_time = std::chrono::steady_clock::duration::max();
+	for (const auto kernel : { Kernel::EVP, Kernel::SHA_NI, Kernel::AVX2 })
+	{
+		if (!is_supported(kernel))
+		{
+			continue;
+		}
+		// the first run warms up the caches
+		auto time = std::chrono::steady_clock::duration::max();
+		for (size_t run = 0; run < 2; ++run)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			hash(inputs, outputs, kernel);
+			time = std::chrono::steady_clock::now() - start;
+		}
+		if (time < best_time)
+		{
+			best = kernel;
+			best_time = time;
+		}
+	}
+	return best;
+}
+
+} // namespace
+
+Kernel best_kernel()
+{
+	static const Kernel kernel = calibrate();
+	return kernel;
+}
+
+bool is_supported(const Kernel kernel)
+{
+	switch (kernel)
+	{
+	case Kernel::SHA_NI:
+		return features().sha_ni;
+	case Kernel::AVX2:
+		return features().avx2;
+	default:
+		return true;
+	}
+}
+
+const char *kernel_name(const Kernel kernel)
+{
+	switch (kernel)
+	{
+	case Kernel::SHA_NI:
+		return "sha-ni";
+	case Kernel::AVX2:
+		return "avx2";
+	default:
+		return "evp";
+	}
+}
+
+size_t preferred_batch(const Kernel kernel)
+{
+	return kernel == Kernel::AVX2 ? max_lanes : 1;
+}
+
+void hash(std::span<const std::span<const uint8_t>> inputs, std::span<Digest> outputs,
+	  const Kernel kernel)
+{
+	if (outputs.size() < inputs.size())
+	{
+		throw std::invalid_argument("Not enough room for the digests");
+	}
+
+	Kernel selected = is_supported(kernel) ? kernel : Kernel::EVP;
+	if (selected == Kernel::AVX2 && inputs.size() == 1)
+	{
+		// a single lane is slower than either of the others
+		selected = is_supported(Kernel::SHA_NI) ? Kernel::SHA_NI : Kernel::EVP;
+	}
+
+	switch (selected)
+	{
+#ifdef MYTORRENT_SHA1_X86
+	case Kernel::AVX2:
+		hash_multi(inputs, outputs);
+		return;
+	case Kernel::SHA_NI:
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			hash_single(inputs[i], outputs[i]);
+		}
+		return;
+#endif
+	default:
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			hash_evp(inputs[i], outputs[i]);
+		}
+		return;
+	}
+}
+
+Digest hash(std::span<const uint8_t> input, const Kernel kernel)
+{
+	Digest ret{};
+	hash(std::span(&input, 1), std::span(&ret, 1), kernel);
+	return ret;
+}
+
+// Context -----------------------------------------------------------------------------
+
+Context::Context()
+	: m_state(initial_state)
+	, m_evp(nullptr, EVP_MD_CTX_free)
+{
+	if (!is_supported(Kernel::SHA_NI))
+	{
+		m_evp.reset(EVP_MD_CTX_new());
+		if (m_evp == nullptr)
+		{
+			throw std::runtime_error("EVP_MD_CTX_new() has failed");
+		}
+	}
+	reset();
+}
+
+void Context::reset()
+{
+	if (m_evp != nullptr)
+	{
+		if (EVP_DigestInit_ex2(m_evp.get(), EVP_sha1(), nullptr) == 0)
+		{
+			throw std::runtime_error("EVP_DigestInit_ex2() has failed");
+		}
+		return;
+	}
+	m_state = initial_state;
+	m_buffered = 0;
+	m_length = 0;
+}
+
+void Context::update(std::span<const uint8_t> input)
+{
+	if (m_evp != nullptr)
+	{
+		if (EVP_DigestUpdate(m_evp.get(), input.data(), input.size()) == 0)
+		{
+			throw std::runtime_error("EVP_DigestUpdate() has failed");
+		}
+		return;
+	}
+
+	m_length += input.size();
+	if (m_buffered > 0)
+	{
+		const size_t taken = std::min(block_size - m_buffered, input.size());
+		std::memcpy(m_buffer.data() + m_buffered, input.data(), taken);
+		m_buffered += taken;
+		input = input.subspan(taken);
+		if (m_buffered < block_size)
+		{
+			return;
+		}
+		compress(m_state, m_buffer.data(), 1);
+		m_buffered = 0;
+	}
+
+	const size_t full_blocks = input.size() / block_size;
+	compress(m_state, input.data(), full_blocks);
+	m_buffered = input.size() - full_blocks * block_size;
+	std::memcpy(m_buffer.data(), input.data() + full_blocks * block_size, m_buffered);
+}
+
+Digest Context::finish()
+{
+	Digest ret{};
+	if (m_evp != nullptr)
+	{
+		if (EVP_DigestFinal_ex(m_evp.get(), ret.data(), nullptr) == 0)
+		{
+			throw std::runtime_error("EVP_DigestFinal_ex() has failed");
+		}
+		return ret;
+	}
+
+	const auto tail = std::span<const uint8_t>(m_buffer).first(m_buffered);
+	const Message message(tail, m_length);
+	finish_message(message, 0, m_state);
+	store_digest(m_state, ret);
+	return ret;
+}
+
+} // namespace sha1
@@ -1,23 +1,31 @@
 #include "socket.hpp"
 
 #include <arpa/inet.h>
+#include <array>
 #include <cassert>
 #include <cerrno>
+#include <charconv>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
+#include <linux/errqueue.h>
 #include <memory>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <tuple>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
 std::string ntop(const sockaddr *sa)
 {
@@ -64,33 +72,32 @@ TCPClient::TCPClient(const std::string &hostname, const std::string &port)
 	connect(hostname, port);
 }
 
-void TCPClient::connect(const std::string &hostname, const std::string &port)
+TCPClient::TCPClient(const int fd)
+	: m_socket(fd)
 {
-	this->~TCPClient();
-
-	int rc = 0;
-	struct addrinfo hints {};
-	struct addrinfo *res_temp = nullptr;
-
-	std::memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-
-	rc = getaddrinfo(hostname.c_str(), port.c_str(), &hints, &res_temp);
+}
 
-	if (rc != 0)
+void TCPClient::connect(const std::string &hostname, const std::string &port)
+{
+	// peers are almost always given as IP literals, so don't bother the resolver
+	if (const auto endpoint = parse_numeric(hostname, port))
 	{
-		std::cerr << "getaddrinfo(): " << gai_strerror(rc) << '\n';
-		throw std::runtime_error("Failed to connect to server");
+		connect(std::span(&endpoint.value(), 1));
+		return;
 	}
 
-	const std::unique_ptr<struct addrinfo, decltype(&freeaddrinfo)> res(res_temp, freeaddrinfo);
+	const std::vector<Endpoint> endpoints = resolve(hostname, port);
+	connect(endpoints);
+}
 
-	struct addrinfo *curr = nullptr;
-	std::string stored_message;
-	for (curr = res.get(); curr != nullptr; curr = curr->ai_next)
+void TCPClient::connect(const std::span<const Endpoint> endpoints)
+{
+	this->~TCPClient();
+
+	for (const Endpoint &endpoint : endpoints)
 	{
-		m_socket = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+		const auto *sa = reinterpret_cast<const sockaddr *>(&endpoint.addr);
+		m_socket = socket(sa->sa_family, SOCK_STREAM, IPPROTO_TCP);
 
 		if (m_socket == -1)
 		{
@@ -98,34 +105,96 @@ void TCPClient::connect(const std::string &hostname, const std::string &port)
 			continue;
 		}
 
-		rc = fcntl(m_socket, F_SETFL, O_NONBLOCK);
+		int rc = fcntl(m_socket, F_SETFL, O_NONBLOCK);
 		if (rc == -1)
 		{
 			std::cerr << "fcntl(): " << strerror(errno) << '\n';
 			close(m_socket);
+			m_socket = -1;
 			continue;
 		}
 
-		rc = ::connect(m_socket, curr->ai_addr, curr->ai_addrlen);
+		rc = ::connect(m_socket, sa, endpoint.addr_len);
 
 		if (rc == -1 && errno != EINPROGRESS)
 		{
 			std::cerr << "connect(): " << strerror(errno) << '\n';
 			close(m_socket);
+			m_socket = -1;
 			continue;
 		}
 
-		break;
+		return;
 	}
 
-	if (curr == nullptr)
+	throw std::runtime_error("Failed to connect to server");
+}
+
+std::optional<Endpoint> TCPClient::parse_numeric(const std::string &hostname,
+						 const std::string &port)
+{
+	int port_num = 0;
+	const auto [ptr, ec] =
+		std::from_chars(port.data(), port.data() + port.size(), port_num);
+	if (ec != std::errc() || ptr != port.data() + port.size() || port_num < 0 ||
+	    port_num > 65535)
 	{
-		m_socket = -1;
-		throw std::runtime_error("Failed to connect to server");
+		return std::nullopt;
+	}
+
+	Endpoint ret;
+	auto *sin = reinterpret_cast<sockaddr_in *>(&ret.addr);
+	if (inet_pton(AF_INET, hostname.c_str(), &sin->sin_addr) == 1)
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(static_cast<uint16_t>(port_num));
+		ret.addr_len = sizeof(sockaddr_in);
+		return ret;
+	}
+
+	auto *sin6 = reinterpret_cast<sockaddr_in6 *>(&ret.addr);
+	if (inet_pton(AF_INET6, hostname.c_str(), &sin6->sin6_addr) == 1)
+	{
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(static_cast<uint16_t>(port_num));
+		ret.addr_len = sizeof(sockaddr_in6);
+		return ret;
 	}
 
-	// const std::string str = ::ntop(curr->ai_addr);
-	// std::clog << "Connected to " << hostname << " (" << str << ":" << port << ")" << '\n';
+	return std::nullopt;
+}
+
+std::vector<Endpoint> TCPClient::resolve(const std::string &hostname, const std::string &port)
+{
+	struct addrinfo hints {};
+	struct addrinfo *res_temp = nullptr;
+
+	std::memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	const int rc = getaddrinfo(hostname.c_str(), port.c_str(), &hints, &res_temp);
+
+	if (rc != 0)
+	{
+		std::cerr << "getaddrinfo(): " << gai_strerror(rc) << '\n';
+		throw std::runtime_error("Failed to resolve " + hostname);
+	}
+
+	const std::unique_ptr<struct addrinfo, decltype(&freeaddrinfo)> res(res_temp, freeaddrinfo);
+
+	std::vector<Endpoint> ret;
+	for (struct addrinfo *curr = res.get(); curr != nullptr; curr = curr->ai_next)
+	{
+		if (curr->ai_addrlen > sizeof(sockaddr_storage))
+		{
+			continue;
+		}
+		Endpoint &endpoint = ret.emplace_back();
+		std::memcpy(&endpoint.addr, curr->ai_addr, curr->ai_addrlen);
+		endpoint.addr_len = curr->ai_addrlen;
+	}
+	return ret;
 }
 
 TCPClient::TCPClient(TCPClient &&other) noexcept
@@ -166,7 +235,8 @@ bool TCPClient::connect_successful() const
 
 long TCPClient::send(const std::span<const uint8_t> buffer) const
 {
-	ssize_t n = ::send(m_socket, buffer.data(), buffer.size(), 0);
+	// a peer that closed the connection must not kill us with SIGPIPE
+	ssize_t n = ::send(m_socket, buffer.data(), buffer.size(), MSG_NOSIGNAL);
 
 	if (n == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
 	{
@@ -186,6 +256,101 @@ long TCPClient::send(const std::span<const uint8_t> buffer) const
 	return n;
 }
 
+long TCPClient::sendfile(const int fd, const size_t offset, const size_t length) const
+{
+	auto file_offset = static_cast<off_t>(offset);
+	// sendfile() doesn't take MSG_NOSIGNAL, the process must ignore SIGPIPE instead
+	ssize_t n = ::sendfile(m_socket, fd, &file_offset, length);
+
+	if (n == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+	{
+		return -1;
+	}
+
+	if (n == -1)
+	{
+		throw std::runtime_error(std::string("sendfile() failed: ") + strerror(errno));
+	}
+
+	return n;
+}
+
+bool TCPClient::enable_zerocopy() const
+{
+#ifdef SO_ZEROCOPY
+	const int one = 1;
+	return setsockopt(m_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0;
+#else
+	return false;
+#endif
+}
+
+long TCPClient::send_zerocopy(const std::span<const uint8_t> buffer, bool &pinned) const
+{
+	pinned = false;
+#ifdef MSG_ZEROCOPY
+	ssize_t n = ::send(m_socket, buffer.data(), buffer.size(), MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+	if (n == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+	{
+		return -1;
+	}
+
+	if (n == -1 && errno != ENOBUFS)
+	{
+		throw std::runtime_error(std::string("send() failed: ") + strerror(errno));
+	}
+
+	if (n != -1)
+	{
+		pinned = true;
+		return n;
+	}
+	// ENOBUFS means the memory the socket may pin is used up, it isn't a failure
+#endif
+	return send(buffer);
+}
+
+std::optional<TCPClient::ZerocopyCompletion> TCPClient::next_zerocopy_completion() const
+{
+	while (true)
+	{
+		std::array<uint8_t, CMSG_SPACE(sizeof(sock_extended_err)) + 64> control{};
+		msghdr msg{};
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		if (::recvmsg(m_socket, &msg, MSG_ERRQUEUE) == -1)
+		{
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+			{
+				return std::nullopt;
+			}
+			throw std::runtime_error(std::string("recvmsg() failed: ") + strerror(errno));
+		}
+
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+			{
+				continue;
+			}
+			sock_extended_err err{};
+			std::memcpy(&err, CMSG_DATA(cm), sizeof err);
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+			if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY && err.ee_errno == 0)
+			{
+				return ZerocopyCompletion{
+					err.ee_info, err.ee_data,
+					(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0
+				};
+			}
+#endif
+		}
+		// anything else in the queue is of no interest
+	}
+}
+
 long TCPClient::recv(const std::span<uint8_t> buffer) const
 {
 	size_t len = buffer.size();
@@ -228,6 +393,28 @@ long TCPClient::recv2(const std::span<uint8_t> buffer) const
 	return n;
 }
 
+long TCPClient::recv2(const std::span<const iovec> buffers) const
+{
+	msghdr msg{};
+	// recvmsg() doesn't modify the iovecs, only the memory they point to
+	msg.msg_iov = const_cast<iovec *>(buffers.data());
+	msg.msg_iovlen = buffers.size();
+
+	ssize_t n = ::recvmsg(m_socket, &msg, 0);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		return -1;
+	}
+
+	if (n <= 0)
+	{
+		throw std::runtime_error(std::string("recvmsg() failed: ") + strerror(errno));
+	}
+
+	return n;
+}
+
 int TCPClient::get_fd() const
 {
 	return m_socket;
@@ -254,13 +441,24 @@ TCPClient::~TCPClient()
 
 std::tuple<std::string, std::string> TCPClient::get_peer_ip_and_port() const
 {
-	sockaddr_storage sa{};
-	socklen_t s = sizeof sa;
+	Endpoint peer;
+	peer.addr_len = sizeof peer.addr;
 	// this var is for readability only
-	auto *reinterpreted_sa = reinterpret_cast<sockaddr *>(&sa);
+	auto *reinterpreted_sa = reinterpret_cast<sockaddr *>(&peer.addr);
 
-	getpeername(m_socket, reinterpreted_sa, &s);
-	return { ::ntop(reinterpreted_sa), std::to_string(ntohs(::get_port(reinterpreted_sa))) };
+	getpeername(m_socket, reinterpreted_sa, &peer.addr_len);
+	const uint16_t port = ntohs(::get_port(reinterpreted_sa));
+	const auto *sin6 = reinterpret_cast<const sockaddr_in6 *>(&peer.addr);
+	if (peer.addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+	{
+		// IPv4 peers accepted by a dual-stack socket are shown the way trackers send them
+		Endpoint ipv4;
+		auto *sin = reinterpret_cast<sockaddr_in *>(&ipv4.addr);
+		sin->sin_family = AF_INET;
+		std::memcpy(&sin->sin_addr, &sin6->sin6_addr.s6_addr[12], sizeof sin->sin_addr);
+		return { ntop(ipv4), std::to_string(port) };
+	}
+	return { ntop(peer), std::to_string(port) };
 }
 
 std::string TCPClient::ntop(uint32_t ip)
@@ -271,3 +469,136 @@ std::string TCPClient::ntop(uint32_t ip)
 	inet_ntop(AF_INET, &src, ret.data(), ret.size());
 	return ret;
 }
+
+std::string TCPClient::ntop(const Endpoint &endpoint)
+{
+	std::string ret = ::ntop(reinterpret_cast<const sockaddr *>(&endpoint.addr));
+	// inet_ntop() leaves the rest of the buffer zeroed
+	ret.resize(std::strlen(ret.c_str()));
+	return ret;
+}
+
+TCPListener::TCPListener(const uint16_t port, const bool reuse_port)
+{
+	// a dual-stack socket takes IPv4 connections as well
+	for (const int family : { AF_INET6, AF_INET })
+	{
+		m_socket = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		if (m_socket == -1)
+		{
+			continue;
+		}
+
+		const int one = 1;
+		const int zero = 0;
+		setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if (reuse_port &&
+		    setsockopt(m_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == -1)
+		{
+			std::cerr << "setsockopt(SO_REUSEPORT): " << strerror(errno) << '\n';
+		}
+
+		sockaddr_storage addr{};
+		socklen_t addr_len = 0;
+		if (family == AF_INET6)
+		{
+			setsockopt(m_socket, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+			auto *sa = reinterpret_cast<sockaddr_in6 *>(&addr);
+			sa->sin6_family = AF_INET6;
+			sa->sin6_addr = in6addr_any;
+			sa->sin6_port = htons(port);
+			addr_len = sizeof(sockaddr_in6);
+		}
+		else
+		{
+			auto *sa = reinterpret_cast<sockaddr_in *>(&addr);
+			sa->sin_family = AF_INET;
+			sa->sin_addr.s_addr = htonl(INADDR_ANY);
+			sa->sin_port = htons(port);
+			addr_len = sizeof(sockaddr_in);
+		}
+
+		if (bind(m_socket, reinterpret_cast<sockaddr *>(&addr), addr_len) == 0 &&
+		    listen(m_socket, SOMAXCONN) == 0)
+		{
+			return;
+		}
+		const int error = errno;
+		close(m_socket);
+		m_socket = -1;
+		// IPv4 would fail the same way
+		if (family == AF_INET || error == EADDRINUSE || error == EACCES)
+		{
+			throw std::runtime_error("Failed to listen on port " + std::to_string(port) +
+						 ": " + strerror(error));
+		}
+	}
+	throw std::runtime_error("socket() failed");
+}
+
+TCPListener::TCPListener(TCPListener &&other) noexcept
+	: m_socket(std::exchange(other.m_socket, -1))
+{
+}
+
+TCPListener &TCPListener::operator=(TCPListener &&other) noexcept
+{
+	if (this != &other)
+	{
+		this->~TCPListener();
+		m_socket = std::exchange(other.m_socket, -1);
+	}
+
+	return *this;
+}
+
+std::optional<TCPClient> TCPListener::accept() const
+{
+	while (true)
+	{
+		const int fd = ::accept4(m_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd != -1)
+		{
+			return TCPClient(fd);
+		}
+		if (errno == EWOULDBLOCK || errno == EAGAIN)
+		{
+			return std::nullopt;
+		}
+		// the connection was reset while waiting in the backlog
+		if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO)
+		{
+			continue;
+		}
+		throw std::runtime_error(std::string("accept4() failed: ") + strerror(errno));
+	}
+}
+
+uint16_t TCPListener::get_port() const
+{
+	sockaddr_storage addr{};
+	socklen_t addr_len = sizeof addr;
+	if (getsockname(m_socket, reinterpret_cast<sockaddr *>(&addr), &addr_len) == -1)
+	{
+		throw std::runtime_error(std::string("getsockname() failed: ") + strerror(errno));
+	}
+	if (addr.ss_family == AF_INET6)
+	{
+		return ntohs(reinterpret_cast<const sockaddr_in6 *>(&addr)->sin6_port);
+	}
+	return ntohs(reinterpret_cast<const sockaddr_in *>(&addr)->sin_port);
+}
+
+int TCPListener::get_fd() const
+{
+	return m_socket;
+}
+
+TCPListener::~TCPListener()
+{
+	if (m_socket >= 0)
+	{
+		close(m_socket);
+		m_socket = -1;
+	}
+}
@@ -0,0 +1,481 @@
+#include "storage.hpp"
+
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "piece.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+[[noreturn]] static void throw_errno(const std::string &what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/**
+ * @brief Writes the whole buffer, retrying short writes
+ */
+static void write_all(const int fd, const uint8_t *src, size_t length, off_t offset)
+{
+	while (length > 0)
+	{
+		const ssize_t written = pwrite(fd, src, length, offset);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			throw_errno("pwrite()");
+		}
+		src += written;
+		length -= static_cast<size_t>(written);
+		offset += written;
+	}
+}
+
+static size_t page_size()
+{
+	static const auto size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	return size;
+}
+
+// Storage -----------------------------------------------------------------------------
+
+Storage::Storage(FileLayout layout)
+	: m_layout(std::move(layout))
+{
+}
+
+// PwriteStorage -----------------------------------------------------------------------
+
+PwriteStorage::PwriteStorage(FileLayout layout, const size_t max_open_files,
+			     const bool direct_io)
+	: Storage(std::move(layout))
+	, m_file_cache(max_open_files)
+	, m_direct(direct_io)
+{
+	if (direct_io)
+	{
+		m_direct_cache = std::make_unique<FileCache>(max_open_files, O_DIRECT);
+	}
+}
+
+void PwriteStorage::write_piece(const ReceivedPiece &piece)
+{
+	const auto data = piece.get_data();
+	const uint8_t *src = data.data();
+	const size_t offset = piece.get_index() * m_layout.piece_length();
+	for (const auto &extent : m_layout.extents_of(offset, data.size()))
+	{
+		if (m_direct)
+		{
+			write_direct(extent, src);
+		}
+		else
+		{
+			write_all(m_file_cache.open(m_layout.files()[extent.file].path)->get_fd(), src,
+				  extent.length, static_cast<off_t>(extent.offset));
+		}
+		src += extent.length;
+	}
+}
+
+void PwriteStorage::write_direct(const FileLayout::Extent &extent, const uint8_t *src)
+{
+	constexpr size_t align = m_direct_alignment;
+	const size_t head =
+		std::min(extent.length, (align - extent.offset % align) % align);
+	const size_t body = (extent.length - head) & ~(align - 1);
+	const size_t tail = extent.length - head - body;
+
+	const auto &path = m_layout.files()[extent.file].path;
+	std::shared_ptr<OpenFile> direct;
+	if (body != 0)
+	{
+		try
+		{
+			direct = m_direct_cache->open(path);
+		} catch (const std::system_error &ex)
+		{
+			if (ex.code().value() != EINVAL)
+			{
+				throw;
+			}
+			if (m_direct.exchange(false))
+			{
+				std::cerr << "The filesystem doesn't support direct I/O, "
+					  << "writing through the page cache" << '\n';
+			}
+		}
+	}
+	if (direct == nullptr)
+	{
+		write_all(m_file_cache.open(path)->get_fd(), src, extent.length,
+			  static_cast<off_t>(extent.offset));
+		return;
+	}
+
+	if (head != 0 || tail != 0)
+	{
+		const int fd = m_file_cache.open(path)->get_fd();
+		write_all(fd, src, head, static_cast<off_t>(extent.offset));
+		write_all(fd, src + head + body, tail, static_cast<off_t>(extent.offset + head + body));
+	}
+
+	const uint8_t *body_src = src + head;
+	const auto body_offset = static_cast<off_t>(extent.offset + head);
+	if (reinterpret_cast<uintptr_t>(body_src) % align == 0)
+	{
+		write_all(direct->get_fd(), body_src, body, body_offset);
+		return;
+	}
+	// the piece is not aligned in memory, the kernel only takes aligned buffers
+	static constexpr size_t bounce_size = 1024 * 1024;
+	thread_local const std::unique_ptr<uint8_t, decltype(&std::free)> bounce(
+		static_cast<uint8_t *>(std::aligned_alloc(align, bounce_size)), &std::free);
+	if (bounce == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	for (size_t done = 0; done < body; done += bounce_size)
+	{
+		const size_t part = std::min(bounce_size, body - done);
+		std::memcpy(bounce.get(), body_src + done, part);
+		write_all(direct->get_fd(), bounce.get(), part,
+			  body_offset + static_cast<off_t>(done));
+	}
+}
+
+void PwriteStorage::read(const size_t offset, std::span<uint8_t> data)
+{
+	uint8_t *dst = data.data();
+	for (const auto &extent : m_layout.extents_of(offset, data.size()))
+	{
+		const auto file = m_file_cache.open(m_layout.files()[extent.file].path);
+		size_t left = extent.length;
+		auto file_offset = static_cast<off_t>(extent.offset);
+		while (left > 0)
+		{
+			const ssize_t got = pread(file->get_fd(), dst, left, file_offset);
+			if (got == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				throw_errno("pread()");
+			}
+			if (got == 0)
+			{
+				throw std::system_error(EIO, std::generic_category(),
+							"Unexpected end of " +
+								m_layout.files()[extent.file].path.string());
+			}
+			dst += got;
+			left -= static_cast<size_t>(got);
+			file_offset += got;
+		}
+	}
+}
+
+std::vector<Storage::FileRange> PwriteStorage::file_ranges(const size_t offset,
+							   const size_t length)
+{
+	std::vector<FileRange> ret;
+	for (const auto &extent : m_layout.extents_of(offset, length))
+	{
+		ret.push_back({ m_file_cache.open(m_layout.files()[extent.file].path), extent.offset,
+				extent.length });
+	}
+	return ret;
+}
+
+void PwriteStorage::sync()
+{
+	for (const auto &file : m_layout.files())
+	{
+		if (file.length != 0 && fdatasync(m_file_cache.open(file.path)->get_fd()) == -1)
+		{
+			throw_errno("fdatasync()");
+		}
+	}
+}
+
+// MmapStorage -------------------------------------------------------------------------
+
+/**
+ * @brief A shared mapping of a part of a file, unmapped on destruction
+ */
+class MmapStorage::Window {
+	uint8_t *m_data = nullptr;
+	size_t m_length = 0;
+
+public:
+	Window(const int fd, const size_t offset, const size_t length)
+		: m_length(length)
+	{
+		void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				  static_cast<off_t>(offset));
+		if (addr == MAP_FAILED)
+		{
+			throw_errno("mmap()");
+		}
+		m_data = static_cast<uint8_t *>(addr);
+		// the sequential strategy fetches the pieces in order and peers read them block
+		// after block, so the kernel can read ahead and drop the pages behind
+		(void)madvise(m_data, m_length, MADV_SEQUENTIAL);
+	}
+
+	Window(const Window &other) = delete;
+	Window &operator=(const Window &other) = delete;
+	Window(Window &&other) = delete;
+	Window &operator=(Window &&other) = delete;
+
+	[[nodiscard]] std::span<uint8_t> get_data() const
+	{
+		return { m_data, m_length };
+	}
+
+	/**
+	 * @brief Calls msync() for the pages that hold the part of the window
+	 */
+	void sync(const size_t begin, const size_t length, const int flags) const
+	{
+		const size_t aligned = begin & ~(page_size() - 1);
+		if (msync(m_data + aligned, begin + length - aligned, flags) == -1)
+		{
+			throw_errno("msync()");
+		}
+	}
+
+	~Window()
+	{
+		if (m_data != nullptr)
+		{
+			munmap(m_data, m_length);
+		}
+	}
+};
+
+MmapStorage::MmapStorage(FileLayout layout, const size_t max_open_files,
+			 const size_t window_size, const size_t max_windows,
+			 const SyncPolicy policy)
+	: Storage(std::move(layout))
+	, m_window_size((std::max<size_t>(window_size, 1) + page_size() - 1) & ~(page_size() - 1))
+	, m_max_windows(std::max<size_t>(max_windows, 1))
+	, m_policy(policy)
+	, m_file_cache(max_open_files)
+{
+}
+
+void MmapStorage::reserve(const size_t file, const size_t offset, const size_t length)
+{
+	const auto &path = m_layout.files()[file].path;
+	const int fd = m_file_cache.open(path)->get_fd();
+	if (fallocate(fd, 0, static_cast<off_t>(offset), static_cast<off_t>(length)) == 0)
+	{
+		return;
+	}
+	if (errno != EOPNOTSUPP)
+	{
+		throw_errno("fallocate() " + path.string());
+	}
+
+	// touching a page past the end of the file raises SIGBUS, so the file is extended
+	const std::lock_guard lock(m_resize_mutex);
+	struct stat st {};
+	if (fstat(fd, &st) == -1)
+	{
+		throw_errno("fstat() " + path.string());
+	}
+	if (static_cast<size_t>(st.st_size) < offset + length &&
+	    ftruncate(fd, static_cast<off_t>(offset + length)) == -1)
+	{
+		throw_errno("ftruncate() " + path.string());
+	}
+}
+
+std::shared_ptr<MmapStorage::Window> MmapStorage::window_of(const size_t file, const size_t offset)
+{
+	const std::pair key{ file, offset / m_window_size };
+	const std::lock_guard lock(m_mutex);
+
+	const auto it = m_windows.find(key);
+	if (it != m_windows.end())
+	{
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		return it->second->second;
+	}
+
+	const size_t begin = key.second * m_window_size;
+	const size_t length = std::min(m_window_size, m_layout.files()[file].length - begin);
+	// the mapping stays valid after the cache closes the file
+	auto window =
+		std::make_shared<Window>(m_file_cache.open(m_layout.files()[file].path)->get_fd(), begin, length);
+	m_lru.emplace_front(key, window);
+	m_windows.emplace(key, m_lru.begin());
+	while (m_lru.size() > m_max_windows)
+	{
+		// stays mapped until the threads that use it are done
+		m_windows.erase(m_lru.back().first);
+		m_lru.pop_back();
+	}
+	return window;
+}
+
+void MmapStorage::write_piece(const ReceivedPiece &piece)
+{
+	const auto data = piece.get_data();
+	const uint8_t *src = data.data();
+	const size_t offset = piece.get_index() * m_layout.piece_length();
+	for (const auto &extent : m_layout.extents_of(offset, data.size()))
+	{
+		reserve(extent.file, extent.offset, extent.length);
+
+		size_t done = 0;
+		while (done < extent.length)
+		{
+			const size_t offset = extent.offset + done;
+			const auto window = window_of(extent.file, offset);
+			const size_t in_window = offset % m_window_size;
+			const size_t part = std::min(extent.length - done,
+						     window->get_data().size() - in_window);
+			std::memcpy(window->get_data().data() + in_window, src, part);
+
+			switch (m_policy)
+			{
+			case SyncPolicy::NONE:
+				break;
+			case SyncPolicy::ASYNC:
+				window->sync(in_window, part, MS_ASYNC);
+				break;
+			case SyncPolicy::SYNC:
+				window->sync(in_window, part, MS_SYNC);
+				break;
+			}
+			src += part;
+			done += part;
+		}
+	}
+}
+
+void MmapStorage::read(const size_t offset, std::span<uint8_t> data)
+{
+	uint8_t *dst = data.data();
+	for (const auto &extent : m_layout.extents_of(offset, data.size()))
+	{
+		size_t done = 0;
+		while (done < extent.length)
+		{
+			const size_t file_offset = extent.offset + done;
+			const auto window = window_of(extent.file, file_offset);
+			const size_t in_window = file_offset % m_window_size;
+			const size_t part = std::min(extent.length - done,
+						     window->get_data().size() - in_window);
+			const auto src = window->get_data().subspan(in_window, part);
+			const size_t aligned = in_window & ~(page_size() - 1);
+			(void)madvise(window->get_data().data() + aligned, in_window + part - aligned,
+				      MADV_WILLNEED);
+			std::memcpy(dst, src.data(), part);
+			dst += part;
+			done += part;
+		}
+	}
+}
+
+std::vector<Storage::FileRange> MmapStorage::file_ranges(const size_t offset, const size_t length)
+{
+	// the mappings are shared, so the files have what was copied into them
+	std::vector<FileRange> ret;
+	for (const auto &extent : m_layout.extents_of(offset, length))
+	{
+		ret.push_back({ m_file_cache.open(m_layout.files()[extent.file].path), extent.offset,
+				extent.length });
+	}
+	return ret;
+}
+
+void MmapStorage::sync()
+{
+	std::vector<std::shared_ptr<Window>> windows;
+	{
+		const std::lock_guard lock(m_mutex);
+		for (const auto &entry : m_lru)
+		{
+			windows.push_back(entry.second);
+		}
+	}
+	for (const auto &window : windows)
+	{
+		window->sync(0, window->get_data().size(), MS_SYNC);
+	}
+	// covers the windows that were already unmapped
+	for (const auto &file : m_layout.files())
+	{
+		if (file.length != 0 && fdatasync(m_file_cache.open(file.path)->get_fd()) == -1)
+		{
+			throw_errno("fdatasync()");
+		}
+	}
+}
+
+// make_storage ------------------------------------------------------------------------
+
+std::unique_ptr<Storage> make_storage(FileLayout layout)
+{
+	const std::string backend = config::get_value("storage").value_or("pwrite");
+	const auto max_open_files =
+		static_cast<size_t>(std::max(config::get_int("max_open_files", 64), 1LL));
+	if (backend == "mmap")
+	{
+		if (config::get_int("direct_io", 0) != 0)
+		{
+			std::cerr << "Direct I/O is not used with mmap storage" << '\n';
+		}
+		const std::string sync = config::get_value("mmap_sync").value_or("none");
+		auto policy = MmapStorage::SyncPolicy::NONE;
+		if (sync == "async")
+		{
+			policy = MmapStorage::SyncPolicy::ASYNC;
+		}
+		else if (sync == "sync")
+		{
+			policy = MmapStorage::SyncPolicy::SYNC;
+		}
+		else if (sync != "none")
+		{
+			std::cerr << "Unknown mmap_sync " << sync << ", using none" << '\n';
+		}
+		const auto window = static_cast<size_t>(
+			std::max(config::get_int("mmap_window", 64), 1LL) * 1024 * 1024);
+		const auto windows =
+			static_cast<size_t>(std::max(config::get_int("mmap_windows", 64), 1LL));
+		return std::make_unique<MmapStorage>(std::move(layout), max_open_files, window,
+						     windows, policy);
+	}
+	if (backend != "pwrite")
+	{
+		std::cerr << "Unknown storage " << backend << ", falling back to pwrite" << '\n';
+	}
+	return std::make_unique<PwriteStorage>(std::move(layout), max_open_files,
+					       config::get_int("direct_io", 0) != 0);
+}
@@ -0,0 +1,251 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+
+TimerWheel::TimerWheel(const clock::time_point now)
+	: m_start(now)
+{
+	for (auto &level : m_slots)
+	{
+		level.fill(none);
+	}
+}
+
+uint64_t TimerWheel::to_ticks(const clock::time_point tp, const bool round_up) const
+{
+	using std::chrono::milliseconds;
+	if (tp <= m_start)
+	{
+		return 0;
+	}
+	const auto since_start = tp - m_start;
+	auto ticks = std::chrono::duration_cast<milliseconds>(since_start);
+	if (round_up && ticks < since_start)
+	{
+		// a timer must never fire early
+		++ticks;
+	}
+	return static_cast<uint64_t>(ticks.count());
+}
+
+void TimerWheel::link(const uint32_t index, const size_t level, const size_t slot)
+{
+	Entry &entry = m_entries[index];
+	entry.level = static_cast<uint8_t>(level);
+	entry.slot = static_cast<uint8_t>(slot);
+	entry.prev = none;
+	entry.next = m_slots[level][slot];
+	if (entry.next != none)
+	{
+		m_entries[entry.next].prev = index;
+	}
+	m_slots[level][slot] = index;
+	m_occupied[level] |= 1ULL << slot;
+}
+
+void TimerWheel::unlink(const uint32_t index)
+{
+	const Entry &entry = m_entries[index];
+	if (entry.prev != none)
+	{
+		m_entries[entry.prev].next = entry.next;
+	}
+	else
+	{
+		m_slots[entry.level][entry.slot] = entry.next;
+	}
+	if (entry.next != none)
+	{
+		m_entries[entry.next].prev = entry.prev;
+	}
+	if (m_slots[entry.level][entry.slot] == none)
+	{
+		m_occupied[entry.level] &= ~(1ULL << entry.slot);
+	}
+}
+
+void TimerWheel::release(const uint32_t index)
+{
+	Entry &entry = m_entries[index];
+	entry.active = false;
+	++entry.generation;
+	m_free_entries.push_back(index);
+	--m_size;
+}
+
+void TimerWheel::place(const uint32_t index)
+{
+	const uint64_t expiry = m_entries[index].expiry;
+	const uint64_t delta = expiry - m_now;
+
+	for (size_t level = 0; level < levels; ++level)
+	{
+		const size_t shift = level * slot_bits;
+		if (delta < (1ULL << (shift + slot_bits)))
+		{
+			link(index, level, (expiry >> shift) & (slots - 1));
+			return;
+		}
+	}
+
+	// too far away, park it in the last slot and place again when the slot is reached
+	const size_t shift = (levels - 1) * slot_bits;
+	link(index, levels - 1, ((m_now >> shift) + slots - 1) & (slots - 1));
+}
+
+uint64_t TimerWheel::next_boundary() const
+{
+	uint64_t ret = std::numeric_limits<uint64_t>::max();
+	for (size_t level = 0; level < levels; ++level)
+	{
+		if (m_occupied[level] == 0)
+		{
+			continue;
+		}
+		const size_t shift = level * slot_bits;
+		const uint64_t prefix = m_now >> shift;
+		// slots after the current one, in the order they will be reached
+		const uint64_t rotated =
+			std::rotr(m_occupied[level], static_cast<int>((prefix + 1) & (slots - 1)));
+		const auto ahead = static_cast<uint64_t>(std::countr_zero(rotated));
+		ret = std::min(ret, (prefix + ahead + 1) << shift);
+	}
+	return ret;
+}
+
+void TimerWheel::process_tick()
+{
+	// timers of higher levels are moved down once their slot is reached
+	for (size_t level = levels - 1; level > 0; --level)
+	{
+		const size_t shift = level * slot_bits;
+		if ((m_now & ((1ULL << shift) - 1)) != 0)
+		{
+			continue;
+		}
+		const size_t slot = (m_now >> shift) & (slots - 1);
+		uint32_t index = m_slots[level][slot];
+		m_slots[level][slot] = none;
+		m_occupied[level] &= ~(1ULL << slot);
+
+		while (index != none)
+		{
+			const uint32_t next = m_entries[index].next;
+			if (m_entries[index].expiry <= m_now)
+			{
+				m_expired.push_back(m_entries[index].timer);
+				release(index);
+			}
+			else
+			{
+				place(index);
+			}
+			index = next;
+		}
+	}
+
+	const size_t slot = m_now & (slots - 1);
+	uint32_t index = m_slots[0][slot];
+	m_slots[0][slot] = none;
+	m_occupied[0] &= ~(1ULL << slot);
+	while (index != none)
+	{
+		const uint32_t next = m_entries[index].next;
+		m_expired.push_back(m_entries[index].timer);
+		release(index);
+		index = next;
+	}
+}
+
+TimerHandle TimerWheel::schedule(const clock::time_point deadline, const Timer timer)
+{
+	uint32_t index = 0;
+	if (!m_free_entries.empty())
+	{
+		index = m_free_entries.back();
+		m_free_entries.pop_back();
+	}
+	else
+	{
+		index = static_cast<uint32_t>(m_entries.size());
+		m_entries.emplace_back();
+	}
+
+	Entry &entry = m_entries[index];
+	// the current tick has already been processed
+	entry.expiry = std::max(to_ticks(deadline, true), m_now + 1);
+	entry.timer = timer;
+	entry.active = true;
+	++m_size;
+	place(index);
+
+	return { index, entry.generation };
+}
+
+bool TimerWheel::cancel(const TimerHandle handle)
+{
+	if (handle.index >= m_entries.size())
+	{
+		return false;
+	}
+	const Entry &entry = m_entries[handle.index];
+	if (!entry.active || entry.generation != handle.generation)
+	{
+		return false;
+	}
+	unlink(handle.index);
+	release(handle.index);
+	return true;
+}
+
+std::span<const TimerWheel::Timer> TimerWheel::advance(const clock::time_point now)
+{
+	m_expired.clear();
+	const uint64_t target = to_ticks(now, false);
+
+	while (m_size > 0)
+	{
+		const uint64_t boundary = next_boundary();
+		if (boundary > target)
+		{
+			break;
+		}
+		m_now = boundary;
+		process_tick();
+	}
+	m_now = std::max(m_now, target);
+
+	return m_expired;
+}
+
+int TimerWheel::timeout_ms(const clock::time_point now) const
+{
+	if (m_size == 0)
+	{
+		return -1;
+	}
+	const uint64_t boundary = next_boundary();
+	const uint64_t current = to_ticks(now, false);
+	if (boundary <= current)
+	{
+		return 0;
+	}
+	return static_cast<int>(
+		std::min<uint64_t>(boundary - current, std::numeric_limits<int>::max()));
+}
+
+size_t TimerWheel::size() const
+{
+	return m_size;
+}
+
+bool TimerWheel::empty() const
+{
+	return m_size == 0;
+}
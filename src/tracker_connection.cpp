@@ -1,8 +1,8 @@
 #include "tracker_connection.hpp"
 
+#include "event_loop.hpp"
 #include "socket.hpp"
 
-#include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <span>
@@ -11,10 +11,11 @@
 #include <utility>
 #include <vector>
 
-TrackerConnection::TrackerConnection(const std::string &hostname, const std::string &port,
-				     const TrackerRequestParams &param)
+TrackerConnection::TrackerConnection(EventLoop &loop, const uint64_t token,
+				     const std::span<const Endpoint> endpoints,
+				     const std::string &hostname, const TrackerRequestParams &param)
 {
-	connect(hostname, port, param);
+	connect(loop, token, endpoints, hostname, param);
 }
 /**
  * @brief Generates query string
@@ -56,21 +57,22 @@ std::string generate_query(const TrackerRequestParams &param)
 	return query;
 }
 
-void TrackerConnection::connect(const std::string &hostname, const std::string &port,
+void TrackerConnection::connect(EventLoop &loop, const uint64_t token,
+				const std::span<const Endpoint> endpoints, const std::string &hostname,
 				const TrackerRequestParams &param)
 
 {
 	if (m_socket.connected())
 	{
-		m_socket.disconnect();
+		disconnect();
 	}
 
-	m_socket.connect(hostname, port);
+	m_socket.connect(endpoints);
+	m_registration.attach(loop, m_socket.get_fd(), token, EventLoop::writable);
 
 	m_send_offset = 0;
 	m_recv_offset = 0;
 	m_request_sent = false;
-	m_timeout = 0;
 
 	const std::string query = generate_query(param);
 
@@ -86,6 +88,7 @@ void TrackerConnection::connect(const std::string &hostname, const std::string &
 
 void TrackerConnection::disconnect()
 {
+	m_registration.detach();
 	m_socket.disconnect();
 }
 
@@ -113,81 +116,53 @@ std::vector<std::uint8_t> &&TrackerConnection::get_recv_message()
 
 int TrackerConnection::send()
 {
-	long ret = m_socket.send(
-		{ m_send_buffer.data() + m_send_offset, m_send_buffer.size() - m_send_offset });
-
-	// if something unexpected happened somewhen between poll() and send()
-	if (ret == -1)
+	while (m_send_offset != m_send_buffer.size())
 	{
-		return 1;
-	}
+		long ret = m_socket.send({ m_send_buffer.data() + m_send_offset,
+					   m_send_buffer.size() - m_send_offset });
 
-	m_send_offset += ret;
+		// on partial send, we will be notified when there is space in the socket again
+		if (ret == -1)
+		{
+			return 1;
+		}
 
-	// on full send
-	if (m_send_offset == m_send_buffer.size())
-	{
-		m_request_sent = true;
-		return 0;
+		m_send_offset += ret;
 	}
 
-	// on partial send
-	return 1;
+	// on full send
+	m_request_sent = true;
+	m_registration.set_events(EventLoop::readable);
+	return 0;
 }
 
 int TrackerConnection::recv()
 {
-	long ret = m_socket.recv(
-		{ m_recv_buffer.data() + m_recv_offset, m_recv_buffer.size() - m_recv_offset });
-
-	// if expected data was dropped somewhen between poll() and recv()
-	if (ret == -1)
-	{
-		return 1;
-	}
-
-	m_recv_offset += ret;
-
-	// if buffer was filled up and there is no more space available
-	if (m_recv_offset == m_recv_buffer.size())
-	{
-		std::cerr << "HTTP response is too large" << '\n';
-		throw std::runtime_error("recv() failed");
-	}
-
-	// on full recv
-	if (ret == 0)
-	{
-		m_socket.disconnect();
-		return 0;
-	}
-
-	// on partial recv
-	return 1;
-}
-
-void TrackerConnection::set_timeout(long long seconds)
-{
-	m_tp = std::chrono::steady_clock::now();
-	m_timeout = seconds;
-	// std::cout << "Timeout was set to " << m_timeout << " seconds\n";
-}
-
-bool TrackerConnection::update_time()
-{
-	using std::chrono::steady_clock;
-	using std::chrono::seconds;
-	if (m_timeout == 0)
-	{
-		return false;
-	}
-
-	auto seconds_passed = duration_cast<seconds>(steady_clock::now() - m_tp).count();
-	// std::cout << "Seconds passed since last tracker call: " << seconds_passed << "\n";
-	if (seconds_passed >= m_timeout)
+	while (true)
 	{
-		m_timeout = 0;
-		return true;
+		long ret = m_socket.recv({ m_recv_buffer.data() + m_recv_offset,
+					   m_recv_buffer.size() - m_recv_offset });
+
+		// on partial recv, the socket is drained until the next event
+		if (ret == -1)
+		{
+			return 1;
+		}
+
+		m_recv_offset += ret;
+
+		// if buffer was filled up and there is no more space available
+		if (m_recv_offset == m_recv_buffer.size())
+		{
+			std::cerr << "HTTP response is too large" << '\n';
+			throw std::runtime_error("recv() failed");
+		}
+
+		// on full recv
+		if (ret == 0)
+		{
+			disconnect();
+			return 0;
+		}
 	}
-	return false;
 }
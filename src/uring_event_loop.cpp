@@ -0,0 +1,671 @@
+#include "uring_event_loop.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// user_data of requests that are not polls (like POLL_REMOVE) has this bit set
+static constexpr uint64_t control_bit = 1ULL << 63;
+// user_data of receives and sends has one of these bits set
+static constexpr uint64_t receive_bit = 1ULL << 62;
+static constexpr uint64_t send_bit = 1ULL << 61;
+static constexpr uint64_t descriptor_mask = (1ULL << 29) - 1;
+// the receive that checks whether the kernel selects the buffers
+static constexpr uint64_t probe_user_data = control_bit | 1;
+
+static uint64_t poll_user_data(const int fd, const uint32_t generation)
+{
+	return (static_cast<uint64_t>(fd) << 32) | generation;
+}
+
+static uint64_t io_user_data(const uint64_t kind, const int fd, const uint32_t epoch)
+{
+	return kind | (static_cast<uint64_t>(fd) << 32) | epoch;
+}
+
+static unsigned load_acquire(unsigned *ptr)
+{
+	return std::atomic_ref<unsigned>(*ptr).load(std::memory_order_acquire);
+}
+
+static void store_release(unsigned *ptr, const unsigned value)
+{
+	std::atomic_ref<unsigned>(*ptr).store(value, std::memory_order_release);
+}
+
+// UringEventLoop ----------------------------------------------------------------------
+
+UringEventLoop::UringEventLoop(const unsigned entries, const unsigned buffers,
+			       const size_t buffer_size)
+{
+	struct io_uring_params params {};
+	params.flags = IORING_SETUP_CQSIZE;
+	// every registered descriptor may have a completion pending
+	params.cq_entries = entries * 4;
+
+	m_ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (m_ring_fd == -1)
+	{
+		throw std::runtime_error(std::string("io_uring_setup(): ") + strerror(errno));
+	}
+
+	const auto cleanup_and_throw = [this](const std::string &what) {
+		const std::string message = what + strerror(errno);
+		release();
+		throw std::runtime_error(message);
+	};
+
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+	{
+		errno = ENOSYS;
+		cleanup_and_throw("io_uring_setup(): timeouts are not supported: ");
+	}
+
+	m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+	{
+		m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+	}
+
+	m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ring == MAP_FAILED)
+	{
+		m_sq_ring = nullptr;
+		cleanup_and_throw("mmap(SQ_RING): ");
+	}
+
+	if (single_mmap)
+	{
+		m_cq_ring = m_sq_ring;
+	}
+	else
+	{
+		m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ring == MAP_FAILED)
+		{
+			m_cq_ring = nullptr;
+			cleanup_and_throw("mmap(CQ_RING): ");
+		}
+	}
+
+	m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  m_ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		cleanup_and_throw("mmap(SQES): ");
+	}
+	m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+	auto *sq = static_cast<uint8_t *>(m_sq_ring);
+	m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	m_sq_entries = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+	// the indirection array is never reordered, so slot i always points to sqe i
+	auto *sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	for (unsigned i = 0; i < m_sq_entries; ++i)
+	{
+		sq_array[i] = i;
+	}
+
+	auto *cq = static_cast<uint8_t *>(m_cq_ring);
+	m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	// the loop still watches readiness without them
+	m_performs_io = setup_buffers(buffers, buffer_size);
+}
+
+bool UringEventLoop::setup_buffers(const unsigned count, const size_t size)
+{
+	// the pages are only taken once the kernel receives into them
+	void *buffers = mmap(nullptr, count * size, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers == MAP_FAILED)
+	{
+		return false;
+	}
+	m_buffers = static_cast<uint8_t *>(buffers);
+	m_buffers_size = count * size;
+	m_buffer_size = size;
+
+	std::vector<uint16_t> all(count);
+	std::iota(all.begin(), all.end(), 0);
+	give_back(all);
+	// the buffers stay mapped until the ring is closed either way, the kernel holds them
+	return probe_receive();
+}
+
+bool UringEventLoop::probe_receive()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+	{
+		return false;
+	}
+	const uint8_t byte = 0;
+	bool received_byte = false;
+	if (::send(fds[1], &byte, 1, MSG_NOSIGNAL) == 1)
+	{
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fds[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = m_buffer_group;
+		sqe->user_data = probe_user_data;
+		store_release(m_sq_tail, *m_sq_tail + 1);
+		++m_to_submit;
+
+		// the byte is already there, so the receive completes as it is submitted. The
+		// other completions are the ones of the requests that handed over the buffers
+		bool completed = false;
+		int res = 0;
+		uint32_t flags = 0;
+		for (int i = 0; i < 4 && !completed; ++i)
+		{
+			enter(1, 100);
+			unsigned head = *m_cq_head;
+			const unsigned tail = load_acquire(m_cq_tail);
+			for (; head != tail; ++head)
+			{
+				const struct io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+				if (cqe.user_data == probe_user_data && !completed)
+				{
+					completed = true;
+					res = cqe.res;
+					flags = cqe.flags;
+				}
+			}
+			store_release(m_cq_head, head);
+		}
+
+		if (completed && (flags & IORING_CQE_F_BUFFER) != 0)
+		{
+			received_byte = res == 1;
+			const auto buffer = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+			give_back(std::span(&buffer, 1));
+		}
+		// the later completions of the probe are ignored like any other control request
+		cancel(probe_user_data);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	return received_byte;
+}
+
+void UringEventLoop::give_back(const std::span<const uint16_t> buffers)
+{
+	for (size_t i = 0; i < buffers.size();)
+	{
+		// the buffers are adjacent in memory, so a run of them is a single request
+		size_t count = 1;
+		while (i + count < buffers.size() && buffers[i + count] == buffers[i] + count)
+		{
+			++count;
+		}
+
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		// the number of buffers
+		sqe->fd = static_cast<int>(count);
+		sqe->addr = reinterpret_cast<uint64_t>(m_buffers + buffers[i] * m_buffer_size);
+		sqe->len = static_cast<uint32_t>(m_buffer_size);
+		sqe->buf_group = m_buffer_group;
+		sqe->off = buffers[i];
+		sqe->user_data = control_bit;
+
+		store_release(m_sq_tail, *m_sq_tail + 1);
+		++m_to_submit;
+		i += count;
+	}
+}
+
+struct io_uring_sqe *UringEventLoop::get_sqe()
+{
+	const unsigned tail = *m_sq_tail;
+	if (tail - load_acquire(m_sq_head) >= m_sq_entries)
+	{
+		// the submission queue is full, so flush it without waiting
+		enter(0, 0);
+	}
+
+	struct io_uring_sqe *sqe = &m_sqes[tail & m_sq_mask];
+	std::memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+void UringEventLoop::enter(const unsigned wait_nr, const int timeout_ms)
+{
+	if (wait_nr == 0 && m_to_submit == 0)
+	{
+		return;
+	}
+
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	struct __kernel_timespec ts {};
+	struct io_uring_getevents_arg arg {};
+	if (wait_nr > 0)
+	{
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_ms >= 0)
+		{
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+			arg.ts = reinterpret_cast<uint64_t>(&ts);
+		}
+	}
+
+	const long rc = syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit, wait_nr, flags, &arg,
+				sizeof arg);
+	if (rc == -1)
+	{
+		if (errno == ETIME || errno == EINTR)
+		{
+			return;
+		}
+		throw std::runtime_error(std::string("io_uring_enter(): ") + strerror(errno));
+	}
+	m_to_submit -= static_cast<unsigned>(rc);
+}
+
+void UringEventLoop::arm(const int fd)
+{
+	const Registration &reg = m_registrations[fd];
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	// errors and hangups are reported regardless
+	sqe->poll32_events = reg.receiving ? reg.events & ~readable : reg.events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = poll_user_data(fd, reg.generation);
+
+	store_release(m_sq_tail, *m_sq_tail + 1);
+	++m_to_submit;
+}
+
+void UringEventLoop::disarm(const int fd)
+{
+	const Registration &reg = m_registrations[fd];
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = poll_user_data(fd, reg.generation);
+	sqe->user_data = control_bit;
+
+	store_release(m_sq_tail, *m_sq_tail + 1);
+	++m_to_submit;
+}
+
+void UringEventLoop::arm_receive(const int fd)
+{
+	const Registration &reg = m_registrations[fd];
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = m_buffer_group;
+	sqe->user_data = io_user_data(receive_bit, fd, reg.epoch);
+
+	store_release(m_sq_tail, *m_sq_tail + 1);
+	++m_to_submit;
+}
+
+void UringEventLoop::cancel(const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = control_bit;
+
+	store_release(m_sq_tail, *m_sq_tail + 1);
+	++m_to_submit;
+}
+
+void UringEventLoop::add(const int fd, const uint64_t token, const uint32_t events)
+{
+	if (fd < 0)
+	{
+		throw std::runtime_error("io_uring add(): invalid descriptor");
+	}
+	if (static_cast<size_t>(fd) >= m_registrations.size())
+	{
+		m_registrations.resize(static_cast<size_t>(fd) + 1);
+	}
+
+	Registration &reg = m_registrations[fd];
+	reg.token = token;
+	reg.events = events;
+	++reg.generation;
+	reg.active = true;
+	arm(fd);
+}
+
+void UringEventLoop::modify(const int fd, const uint64_t token, const uint32_t events)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= m_registrations.size() ||
+	    !m_registrations[fd].active)
+	{
+		throw std::runtime_error("io_uring modify(): descriptor is not registered");
+	}
+
+	// the old request is cancelled and its completions are ignored due to new generation
+	disarm(fd);
+	Registration &reg = m_registrations[fd];
+	reg.token = token;
+	reg.events = events;
+	++reg.generation;
+	arm(fd);
+}
+
+void UringEventLoop::remove(const int fd)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= m_registrations.size() ||
+	    !m_registrations[fd].active)
+	{
+		return;
+	}
+
+	disarm(fd);
+	Registration &reg = m_registrations[fd];
+	if (reg.receiving)
+	{
+		cancel(io_user_data(receive_bit, fd, reg.epoch));
+	}
+	if (reg.send.has_value())
+	{
+		// the data stays alive until the completion comes
+		const uint64_t send = io_user_data(send_bit, fd, reg.epoch);
+		cancel(send);
+		m_cancelled_sends.emplace(send, std::move(reg.send->owner));
+		reg.send.reset();
+	}
+	reg.active = false;
+	reg.receiving = false;
+	++reg.generation;
+	++reg.epoch;
+}
+
+bool UringEventLoop::performs_io() const
+{
+	return m_performs_io;
+}
+
+void UringEventLoop::receive(const int fd)
+{
+	if (!performs_io())
+	{
+		throw std::logic_error("io_uring receive(): the kernel can't receive into buffers");
+	}
+	if (fd < 0 || static_cast<size_t>(fd) >= m_registrations.size() ||
+	    !m_registrations[fd].active)
+	{
+		throw std::runtime_error("io_uring receive(): descriptor is not registered");
+	}
+
+	Registration &reg = m_registrations[fd];
+	if (reg.receiving)
+	{
+		return;
+	}
+	// the poll request stops watching readability
+	disarm(fd);
+	reg.receiving = true;
+	++reg.generation;
+	arm(fd);
+	arm_receive(fd);
+}
+
+void UringEventLoop::send(const int fd, std::shared_ptr<const void> owner,
+			  const std::span<const uint8_t> data)
+{
+	if (!performs_io())
+	{
+		throw std::logic_error("io_uring send(): the kernel can't receive into buffers");
+	}
+	if (fd < 0 || static_cast<size_t>(fd) >= m_registrations.size() ||
+	    !m_registrations[fd].active)
+	{
+		throw std::runtime_error("io_uring send(): descriptor is not registered");
+	}
+
+	Registration &reg = m_registrations[fd];
+	if (reg.send.has_value())
+	{
+		throw std::logic_error("io_uring send(): the previous send is not completed");
+	}
+	reg.send = Send{ std::move(owner), data };
+	const uint64_t user_data = io_user_data(send_bit, fd, reg.epoch);
+
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(data.data());
+	sqe->len = static_cast<uint32_t>(data.size());
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+
+	store_release(m_sq_tail, *m_sq_tail + 1);
+	++m_to_submit;
+}
+
+void UringEventLoop::reap_receive(const struct io_uring_cqe &cqe)
+{
+	const auto fd = static_cast<size_t>((cqe.user_data >> 32) & descriptor_mask);
+	const auto epoch = static_cast<uint32_t>(cqe.user_data);
+	const bool has_buffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+	const auto buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	if (has_buffer)
+	{
+		// the owner may look at the data until the next wait()
+		m_lent.push_back(buffer);
+	}
+	if (fd >= m_registrations.size() || !m_registrations[fd].active ||
+	    m_registrations[fd].epoch != epoch)
+	{
+		// the descriptor was removed
+		return;
+	}
+
+	const Registration &reg = m_registrations[fd];
+	if (cqe.res > 0 && has_buffer)
+	{
+		m_ready.push_back({ reg.token, received,
+				    { m_buffers + buffer * m_buffer_size,
+				      static_cast<size_t>(cqe.res) } });
+	}
+	else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+	{
+		// the connection is closed or failed, so there is nothing more to receive
+		m_ready.push_back({ reg.token, error });
+		return;
+	}
+
+	if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+	{
+		// the kernel terminates a multishot request once it runs out of buffers, which
+		// are given back by the next wait() before this request is submitted
+		arm_receive(static_cast<int>(fd));
+	}
+}
+
+void UringEventLoop::reap_send(const struct io_uring_cqe &cqe)
+{
+	const auto fd = static_cast<size_t>((cqe.user_data >> 32) & descriptor_mask);
+	const auto epoch = static_cast<uint32_t>(cqe.user_data);
+	if (fd >= m_registrations.size() || !m_registrations[fd].active ||
+	    m_registrations[fd].epoch != epoch || !m_registrations[fd].send.has_value())
+	{
+		// the descriptor was removed, the data is not needed anymore
+		m_cancelled_sends.erase(cqe.user_data);
+		return;
+	}
+
+	Registration &reg = m_registrations[fd];
+	Send send = std::move(reg.send.value());
+	reg.send.reset();
+	if (cqe.res >= 0)
+	{
+		const auto length = static_cast<size_t>(cqe.res);
+		m_ready.push_back({ reg.token, sent, send.data.first(length) });
+		m_sent.push_back(std::move(send.owner));
+	}
+	else
+	{
+		m_ready.push_back({ reg.token, error });
+	}
+}
+
+void UringEventLoop::reap()
+{
+	unsigned head = *m_cq_head;
+	const unsigned tail = load_acquire(m_cq_tail);
+
+	for (; head != tail; ++head)
+	{
+		const struct io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+		if ((cqe.user_data & control_bit) != 0)
+		{
+			continue;
+		}
+		if ((cqe.user_data & receive_bit) != 0)
+		{
+			reap_receive(cqe);
+			continue;
+		}
+		if ((cqe.user_data & send_bit) != 0)
+		{
+			reap_send(cqe);
+			continue;
+		}
+
+		const auto fd = static_cast<size_t>(cqe.user_data >> 32);
+		const auto generation = static_cast<uint32_t>(cqe.user_data);
+		if (fd >= m_registrations.size() || !m_registrations[fd].active ||
+		    m_registrations[fd].generation != generation)
+		{
+			// completion of a request that was already cancelled
+			continue;
+		}
+
+		const Registration &reg = m_registrations[fd];
+		if (cqe.res >= 0)
+		{
+			m_ready.push_back({ reg.token, static_cast<uint32_t>(cqe.res) });
+		}
+		else if (cqe.res != -ECANCELED)
+		{
+			m_ready.push_back({ reg.token, error });
+		}
+
+		if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+		{
+			// the kernel may terminate a multishot request at any time
+			arm(static_cast<int>(fd));
+		}
+	}
+
+	store_release(m_cq_head, head);
+}
+
+std::span<const EventLoop::Event> UringEventLoop::wait(const int timeout_ms)
+{
+	m_ready.clear();
+	m_sent.clear();
+	if (!m_lent.empty())
+	{
+		std::ranges::sort(m_lent);
+		give_back(m_lent);
+		m_lent.clear();
+	}
+
+	const auto deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	int remaining = timeout_ms;
+	while (true)
+	{
+		const bool has_completions = *m_cq_head != load_acquire(m_cq_tail);
+		enter(has_completions ? 0 : 1, remaining);
+		reap();
+		// cancellations and stale requests complete without an event, the owners are not
+		// woken up for nothing
+		if (!m_ready.empty() || remaining == 0)
+		{
+			break;
+		}
+		if (remaining > 0)
+		{
+			remaining = static_cast<int>(std::max<long long>(
+				std::chrono::ceil<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now())
+					.count(),
+				0));
+		}
+	}
+
+	return m_ready;
+}
+
+void UringEventLoop::release()
+{
+	if (m_sqes != nullptr)
+	{
+		munmap(m_sqes, m_sqes_size);
+		m_sqes = nullptr;
+	}
+	if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring)
+	{
+		munmap(m_cq_ring, m_cq_ring_size);
+	}
+	m_cq_ring = nullptr;
+	if (m_sq_ring != nullptr)
+	{
+		munmap(m_sq_ring, m_sq_ring_size);
+		m_sq_ring = nullptr;
+	}
+	if (m_ring_fd >= 0)
+	{
+		close(m_ring_fd);
+		m_ring_fd = -1;
+	}
+	// the kernel stops writing into the buffers once the ring is closed
+	if (m_buffers != nullptr)
+	{
+		munmap(m_buffers, m_buffers_size);
+		m_buffers = nullptr;
+	}
+}
+
+UringEventLoop::~UringEventLoop()
+{
+	release();
+}
@@ -1,6 +1,6 @@
 #include "utils.hpp"
 
-#include <openssl/evp.h>
+#include "sha1.hpp"
 
 #include <array>
 #include <cctype>
@@ -19,28 +19,7 @@ namespace utils
 
 std::array<uint8_t, sha1_length> compute_sha1(std::span<const uint8_t> input)
 {
-	std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
-								    EVP_MD_CTX_free);
-	if (ctx == nullptr)
-	{
-		throw std::runtime_error("EVP_MD_CTX_new() has failed");
-	}
-	if (EVP_DigestInit_ex2(ctx.get(), EVP_sha1(), nullptr) == 0)
-	{
-		throw std::runtime_error("EVP_DigestInit_ex2() has failed");
-	}
-	if (EVP_DigestUpdate(ctx.get(), input.data(), input.size()) == 0)
-	{
-		throw std::runtime_error("EVP_DigestUpdate() has failed");
-	}
-	std::array<uint8_t, sha1_length> hash{};
-
-	if (EVP_DigestFinal_ex(ctx.get(), hash.data(), nullptr) == 0)
-	{
-		throw std::runtime_error("EVP_DigestFinal_ex() has failed");
-	}
-
-	return hash;
+	return sha1::hash(input);
 }
 
 std::string convert_to_url(std::span<const uint8_t> input)
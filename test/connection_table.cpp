@@ -0,0 +1,74 @@
+#include "connection_table.hpp"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <vector>
+
+TEST(ConnectionTableTest, InsertUntilFull)
+{
+	ConnectionTable<int> table(3);
+	for (int i = 0; i < 3; ++i)
+	{
+		EXPECT_TRUE(table.insert().has_value());
+	}
+	EXPECT_TRUE(table.full());
+	EXPECT_FALSE(table.insert().has_value());
+	EXPECT_EQ(table.size(), 3);
+}
+
+TEST(ConnectionTableTest, FreedSlotIsReused)
+{
+	ConnectionTable<int> table(2);
+	const auto first = table.insert().value();
+	const auto second = table.insert().value();
+	*table.get(second) = 42;
+
+	table.erase(first);
+	EXPECT_EQ(table.size(), 1);
+
+	const auto third = table.insert().value();
+	EXPECT_EQ(third.index, first.index);
+	EXPECT_NE(third.generation, first.generation);
+	EXPECT_EQ(*table.get(second), 42);
+}
+
+TEST(ConnectionTableTest, StaleHandleIsRejected)
+{
+	ConnectionTable<int> table(1);
+	const auto old_handle = table.insert().value();
+	table.erase(old_handle);
+	const auto new_handle = table.insert().value();
+
+	EXPECT_EQ(table.get(old_handle), nullptr);
+	EXPECT_NE(table.get(new_handle), nullptr);
+
+	// erasing by a stale handle must not touch the new connection
+	table.erase(old_handle);
+	EXPECT_NE(table.get(new_handle), nullptr);
+	EXPECT_EQ(table.size(), 1);
+}
+
+TEST(ConnectionTableTest, TokenRoundTrip)
+{
+	const ConnectionHandle handle{ 7, 3 };
+	EXPECT_EQ(ConnectionHandle::from_token(handle.token()), handle);
+}
+
+TEST(ConnectionTableTest, ForEachVisitsOnlyStoredConnections)
+{
+	ConnectionTable<int> table(4);
+	std::vector<ConnectionHandle> handles;
+	for (int i = 0; i < 4; ++i)
+	{
+		handles.push_back(table.insert().value());
+		*table.get(handles.back()) = i;
+	}
+	table.erase(handles[1]);
+	table.erase(handles[2]);
+
+	std::set<int> visited;
+	table.for_each([&visited](ConnectionHandle /*handle*/, int &value) {
+		visited.insert(value);
+	});
+	EXPECT_EQ(visited, (std::set<int>{ 0, 3 }));
+}
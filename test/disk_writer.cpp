@@ -0,0 +1,141 @@
+#include "disk_writer.hpp"
+
+#include "piece.hpp"
+#include "piece_arena.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+TEST(DiskWriterTest, ReportsWrittenPiecesAndBackpressure)
+{
+	PieceArena arena(2 * 4096, false);
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool released = false;
+
+	DiskWriter::CompletionQueue queue;
+	DiskWriter writer(1, 2, [&](const ReceivedPiece &piece) {
+		std::unique_lock lock(mutex);
+		cv.wait(lock, [&] { return released; });
+		if (piece.get_index() == 1)
+		{
+			throw std::runtime_error("disk is full");
+		}
+	});
+	bool available = false;
+	writer.set_on_available([&] {
+		{
+			const std::lock_guard lock(mutex);
+			available = true;
+		}
+		cv.notify_all();
+	});
+
+	writer.submit(queue, ReceivedPiece(0, 10, arena.acquire(10)));
+	EXPECT_FALSE(writer.full());
+	writer.submit(queue, ReceivedPiece(1, 10, arena.acquire(10)));
+	EXPECT_TRUE(writer.full());
+	EXPECT_EQ(writer.get_stats().depth, 2);
+	{
+		const std::lock_guard lock(mutex);
+		released = true;
+	}
+	cv.notify_all();
+
+	std::vector<DiskWriter::Result> results;
+	while (results.size() < 2)
+	{
+		std::this_thread::yield();
+		for (auto &result : queue.take_results())
+		{
+			results.push_back(std::move(result));
+		}
+	}
+	EXPECT_EQ(results[0].piece.get_index(), 0);
+	EXPECT_TRUE(results[0].written);
+	EXPECT_FALSE(results[1].written);
+
+	const auto stats = writer.get_stats();
+	EXPECT_EQ(stats.depth, 0);
+	EXPECT_EQ(stats.max_depth, 2);
+	EXPECT_EQ(stats.pieces_written, 1);
+	EXPECT_EQ(stats.write_errors, 1);
+	EXPECT_FALSE(writer.full());
+	// is called after the last result is delivered
+	std::unique_lock lock(mutex);
+	cv.wait(lock, [&] { return available; });
+}
+
+TEST(DiskWriterTest, ReadsPiecesBeforeQueuedWrites)
+{
+	PieceArena arena(2 * 4096, false);
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool started = false;
+	bool released = false;
+	std::vector<std::string> order;
+
+	DiskWriter::CompletionQueue queue;
+	DiskWriter::ReadQueue reads;
+	DiskWriter writer(
+		1, 2,
+		[&](const ReceivedPiece &piece) {
+			std::unique_lock lock(mutex);
+			started = true;
+			cv.notify_all();
+			cv.wait(lock, [&] { return released; });
+			order.push_back("write " + std::to_string(piece.get_index()));
+		},
+		[&](const size_t index) {
+			const std::lock_guard lock(mutex);
+			order.push_back("read " + std::to_string(index));
+			if (index == 9)
+			{
+				throw std::runtime_error("no such piece");
+			}
+			return std::make_shared<const std::vector<uint8_t>>(3, static_cast<uint8_t>(index));
+		});
+
+	writer.submit(queue, ReceivedPiece(0, 10, arena.acquire(10)));
+	{
+		// the first write holds the only worker
+		std::unique_lock lock(mutex);
+		cv.wait(lock, [&] { return started; });
+	}
+	writer.submit(queue, ReceivedPiece(1, 10, arena.acquire(10)));
+	writer.submit_read(reads, 7);
+	writer.submit_read(reads, 9);
+	EXPECT_EQ(writer.get_stats().depth, 2);
+	{
+		const std::lock_guard lock(mutex);
+		released = true;
+	}
+	cv.notify_all();
+
+	std::vector<DiskWriter::ReadResult> results;
+	size_t written = 0;
+	while (results.size() < 2 || written < 2)
+	{
+		std::this_thread::yield();
+		for (auto &result : reads.take_results())
+		{
+			results.push_back(std::move(result));
+		}
+		written += queue.take_results().size();
+	}
+	EXPECT_EQ(order, (std::vector<std::string>{ "write 0", "read 7", "read 9", "write 1" }));
+	ASSERT_EQ(results[0].index, 7);
+	ASSERT_NE(results[0].data, nullptr);
+	EXPECT_EQ(*results[0].data, std::vector<uint8_t>(3, 7));
+	EXPECT_EQ(results[1].index, 9);
+	EXPECT_EQ(results[1].data, nullptr);
+}
@@ -7,15 +7,12 @@
  * * unexpected things or not
  */
 
-#include "config.hpp"
 #include "download_strategy.hpp"
 #include "expected.hpp"
 
-#include "file_handler.hpp"
 #include "peer_message.hpp"
-#include "piece.hpp"
+#include <cstddef>
 #include <gtest/gtest.h>
-#include <utility>
 
 class StrategyTest : public ::testing::Test {
 protected:
@@ -68,17 +65,30 @@ TEST_F(StrategyTest, PeekingTest)
 
 TEST_F(StrategyTest, OtherTest)
 {
-	config::load_configs();
+	auto dl_strt = DownloadStrategySequential(len);
+
+	// only the pieces the peer has are handed out
+	for (size_t i = 0; i < len / 2; ++i)
+	{
+		const auto ind = dl_strt.next_piece_to_dl(partial_bf);
+		ASSERT_TRUE(ind.has_value());
+		EXPECT_LT(ind.value(), len / 2);
+	}
+	EXPECT_FALSE(dl_strt.have_missing_pieces(partial_bf));
+	EXPECT_EQ(dl_strt.next_piece_to_dl(partial_bf).error(),
+		  DownloadStrategy::ReturnStatus::NO_PIECE_FOUND);
+	EXPECT_TRUE(dl_strt.have_missing_pieces(full_bf));
+	EXPECT_TRUE(dl_strt.is_piece_missing(message::Have(len - 1)));
 
-	message::Piece piece1{ { 0, 0, 0, 19, 7, 0, 0, 0, 0, 0, 0, 0,
-				 0, 1, 1, 1,  1, 1, 1, 1, 1, 1, 1 } };
-	message::Piece piece2{ { 0,  0, 0, 19, 7, 0, 0, 0, 0, 0, 0, 0,
-				 10, 2, 2, 2,  2, 2, 2, 2, 2, 2, 2 } };
-	message::Piece piece3{ { 0, 0, 0, 12, 7, 0, 0, 0, 0, 0, 0, 0, 20, 3, 4, 5 } };
-	ReceivedPiece rp;
-	rp.add_block(std::move(piece1));
-	rp.add_block(std::move(piece2));
-	rp.add_block(std::move(piece3));
-	FileHandler fh({ "testfile", 1 }, { 0 }, 1, 21);
-	fh.write_piece(rp, ".", 23);
+	// a discarded piece is handed out again
+	dl_strt.mark_as_discarded(3);
+	EXPECT_EQ(dl_strt.next_piece_to_dl(partial_bf), size_t{ 3 });
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		dl_strt.mark_as_downloaded(i);
+	}
+	EXPECT_FALSE(dl_strt.have_missing_pieces(full_bf));
+	EXPECT_EQ(dl_strt.next_piece_to_dl(full_bf).error(),
+		  DownloadStrategy::ReturnStatus::DOWNLOAD_COMPLETED);
 }
@@ -0,0 +1,267 @@
+#include "download.hpp"
+
+#include "config.hpp"
+#include "metainfo_file.hpp"
+#include "peer_listener.hpp"
+#include "peer_message.hpp"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+class DownloadTest : public ::testing::TestWithParam<std::string> {
+protected:
+	// the tracker refuses the connections, so the only peers are the ones of the test
+	static constexpr std::string_view m_announce = "http://127.0.0.1:1/announce";
+	static constexpr size_t m_piece_length = 16384;
+
+	std::vector<std::filesystem::path> m_created;
+
+	void SetUp() override
+	{
+		config::load_configs();
+		config::create_cache_dir();
+		config::create_downloads_dir();
+		config::set_value("threads", "1");
+		config::set_value("max_peers", "2");
+		config::set_value("hash_threads", "1");
+		config::set_value("resolver_threads", "1");
+		// falls back to epoll if io_uring is not built in
+		config::set_value("event_loop", GetParam());
+	}
+
+	void TearDown() override
+	{
+		for (const auto &path : m_created)
+		{
+			std::filesystem::remove_all(path);
+		}
+	}
+
+	/**
+	 * @brief Writes a torrent of a single piece
+	 *
+	 * @return The path to the .torrent file
+	 */
+	std::string write_torrent(const std::string &name)
+	{
+		const std::string pieces(20, name.back());
+		const std::string torrent =
+			"d8:announce" + std::to_string(m_announce.size()) + ":" +
+			std::string(m_announce) + "4:infod6:lengthi" + std::to_string(m_piece_length) +
+			"e4:name" + std::to_string(name.size()) + ":" + name + "12:piece lengthi" +
+			std::to_string(m_piece_length) + "e6:pieces20:" + pieces + "ee";
+		const auto path = std::filesystem::temp_directory_path() / (name + ".torrent");
+		std::ofstream(path, std::ios_base::binary) << torrent;
+		m_created.push_back(path);
+		m_created.push_back(config::get_path_to_downloads_dir() / name);
+
+		std::string resume;
+		for (const uint8_t byte : MetainfoFile(path).info.get_sha1())
+		{
+			static constexpr std::string_view digits = "0123456789abcdef";
+			resume += digits[byte >> 4];
+			resume += digits[byte & 0xF];
+		}
+		m_created.push_back(config::get_path_to_cache_dir() / (resume + ".resume"));
+		return path;
+	}
+};
+
+std::vector<uint8_t> info_hash_of(const std::string &path)
+{
+	const auto info_hash = MetainfoFile(path).info.get_sha1();
+	return { info_hash.begin(), info_hash.end() };
+}
+
+/**
+ * @brief Waits for the given number of bytes from the download
+ *
+ * @return The bytes or nothing if the connection was closed instead
+ */
+std::optional<std::vector<uint8_t>> receive_exactly(const TCPClient &client, const size_t size)
+{
+	std::vector<uint8_t> data(size);
+	size_t received = 0;
+	for (int i = 0; i < 5000 && received < data.size(); ++i)
+	{
+		long rc = 0;
+		try
+		{
+			rc = client.recv(std::span(data).subspan(received));
+		} catch (const std::exception &)
+		{
+			return std::nullopt;
+		}
+		if (rc == 0)
+		{
+			return std::nullopt;
+		}
+		if (rc == -1)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		received += static_cast<size_t>(rc);
+	}
+	if (received < data.size())
+	{
+		return std::nullopt;
+	}
+	return data;
+}
+
+/**
+ * @brief Waits for the handshake of the download
+ *
+ * @return The handshake or nothing if the connection was closed instead
+ */
+std::optional<std::array<uint8_t, message::Handshake::size>> reply_of(const TCPClient &client)
+{
+	const auto data = receive_exactly(client, message::Handshake::size);
+	if (!data.has_value())
+	{
+		return std::nullopt;
+	}
+	std::array<uint8_t, message::Handshake::size> reply{};
+	std::ranges::copy(data.value(), reply.begin());
+	return reply;
+}
+
+void send_all(const TCPClient &client, const std::span<const uint8_t> data)
+{
+	size_t written = 0;
+	for (int i = 0; i < 1000 && written < data.size(); ++i)
+	{
+		const long rc = client.send(data.subspan(written));
+		written += rc > 0 ? static_cast<size_t>(rc) : 0;
+		if (rc <= 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+/**
+ * @brief Connects to the listener and sends the handshake for the torrent
+ */
+TCPClient connect_peer(const PeerListener &listener, const std::span<const uint8_t> info_hash)
+{
+	TCPClient client("127.0.0.1", std::to_string(listener.get_port()));
+	std::array<uint8_t, 20> id{};
+	id.fill('p');
+	const message::Handshake handshake(info_hash, id);
+	send_all(client, handshake.serialized());
+	return client;
+}
+
+/**
+ * @brief Runs the download on its own thread until it goes out of scope
+ */
+class RunningDownload {
+	Download &m_download;
+	std::jthread m_thread;
+
+public:
+	explicit RunningDownload(Download &download)
+		: m_download(download)
+		, m_thread([&download] { download.start(); })
+	{
+	}
+
+	RunningDownload(const RunningDownload &other) = delete;
+	RunningDownload &operator=(const RunningDownload &other) = delete;
+	RunningDownload(RunningDownload &&other) = delete;
+	RunningDownload &operator=(RunningDownload &&other) = delete;
+
+	~RunningDownload()
+	{
+		m_download.stop();
+	}
+};
+
+} // namespace
+
+TEST_P(DownloadTest, RoutesIncomingPeersAndLimitsThem)
+{
+	const std::string first_path = write_torrent("download_test_first");
+	const std::string second_path = write_torrent("download_test_second");
+	const auto first_hash = info_hash_of(first_path);
+	const auto second_hash = info_hash_of(second_path);
+
+	PeerListener listener(0);
+	Download first(first_path, &listener);
+	Download second(second_path, &listener);
+	const RunningDownload first_running(first);
+	const RunningDownload second_running(second);
+
+	// both downloads share the port, each peer gets the torrent it asked for
+	std::vector<TCPClient> first_peers;
+	for (int i = 0; i < 2; ++i)
+	{
+		first_peers.push_back(connect_peer(listener, first_hash));
+		const auto reply = reply_of(first_peers.back());
+		ASSERT_TRUE(reply.has_value());
+		EXPECT_TRUE(std::ranges::equal(message::Handshake(reply.value()).get_info_hash(),
+					       first_hash));
+	}
+	const TCPClient second_peer = connect_peer(listener, second_hash);
+	const auto reply = reply_of(second_peer);
+	ASSERT_TRUE(reply.has_value());
+	EXPECT_TRUE(
+		std::ranges::equal(message::Handshake(reply.value()).get_info_hash(), second_hash));
+
+	// the first download has no slots left
+	const TCPClient over_limit = connect_peer(listener, first_hash);
+	EXPECT_FALSE(reply_of(over_limit).has_value());
+
+	const std::array<uint8_t, 20> unknown{};
+	const TCPClient stranger = connect_peer(listener, unknown);
+	EXPECT_FALSE(reply_of(stranger).has_value());
+}
+
+TEST_P(DownloadTest, ExchangesMessagesWithPeer)
+{
+	const std::string path = write_torrent("download_test_exchange");
+	const auto info_hash = info_hash_of(path);
+
+	PeerListener listener(0);
+	Download download(path, &listener);
+	const RunningDownload running(download);
+
+	const TCPClient peer = connect_peer(listener, info_hash);
+	ASSERT_TRUE(reply_of(peer).has_value());
+	// the bitfield of a torrent of a single piece, which we don't have yet
+	const std::vector<uint8_t> bitfield = { 0, 0, 0, 2, 5, 0 };
+	EXPECT_EQ(receive_exactly(peer, bitfield.size()), bitfield);
+
+	// the peer has the piece, so the download wants it once it is unchoked
+	send_all(peer, std::vector<uint8_t>{ 0, 0, 0, 2, 5, 0x80 });
+	const std::vector<uint8_t> interested = { 0, 0, 0, 1, 2 };
+	EXPECT_EQ(receive_exactly(peer, interested.size()), interested);
+
+	send_all(peer, std::vector<uint8_t>{ 0, 0, 0, 1, 1 });
+	const std::vector<uint8_t> request = { 0, 0, 0, 13, 6, 0, 0, 0, 0, 0, 0, 0, 0,
+					       0, 0, 0x40, 0 };
+	EXPECT_EQ(receive_exactly(peer, request.size()), request);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, DownloadTest, ::testing::Values("epoll", "io_uring"),
+			 [](const auto &info) { return info.param; });
@@ -0,0 +1,383 @@
+#include "event_loop.hpp"
+
+#ifdef MYTORRENT_IO_URING
+#include "uring_event_loop.hpp"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <exception>
+#include <gtest/gtest.h>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+enum class Backend { EPOLL, IO_URING };
+
+class EventLoopTest : public ::testing::TestWithParam<Backend> {
+protected:
+	std::unique_ptr<EventLoop> m_loop;
+	// a connected pair of non-blocking sockets
+	std::array<int, 2> m_fds{ -1, -1 };
+
+	void SetUp() override
+	{
+		if (GetParam() == Backend::EPOLL)
+		{
+			m_loop = std::make_unique<EpollEventLoop>();
+		}
+		else
+		{
+#ifdef MYTORRENT_IO_URING
+			try
+			{
+				m_loop = std::make_unique<UringEventLoop>();
+			} catch (const std::exception &ex)
+			{
+				GTEST_SKIP() << "io_uring is unavailable: " << ex.what();
+			}
+#else
+			GTEST_SKIP() << "built without io_uring";
+#endif
+		}
+		ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, m_fds.data()), 0);
+	}
+
+	void TearDown() override
+	{
+		for (const int fd : m_fds)
+		{
+			if (fd >= 0)
+			{
+				m_loop->remove(fd);
+				close(fd);
+			}
+		}
+	}
+
+	void send_byte(const int fd) const
+	{
+		const char byte = 'x';
+		ASSERT_EQ(write(fd, &byte, 1), 1);
+	}
+
+	void drain(const int fd) const
+	{
+		std::array<char, 64> buf{};
+		while (read(fd, buf.data(), buf.size()) > 0)
+		{
+		}
+	}
+
+	// waits until at least one event comes or the timeout expires
+	[[nodiscard]] std::vector<EventLoop::Event> wait(const int timeout_ms = 1000) const
+	{
+		const auto events = m_loop->wait(timeout_ms);
+		return { events.begin(), events.end() };
+	}
+};
+
+} // namespace
+
+TEST_P(EventLoopTest, ReportsReadableWithToken)
+{
+	m_loop->add(m_fds[0], 42, EventLoop::readable);
+	send_byte(m_fds[1]);
+
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 42);
+	EXPECT_NE(events[0].events & EventLoop::readable, 0);
+}
+
+TEST_P(EventLoopTest, TimesOutWithoutEvents)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	EXPECT_TRUE(wait(10).empty());
+}
+
+TEST_P(EventLoopTest, IsEdgeTriggered)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	send_byte(m_fds[1]);
+	ASSERT_EQ(wait().size(), 1);
+	// the data was not read, but nothing new arrived either
+	EXPECT_TRUE(wait(10).empty());
+
+	send_byte(m_fds[1]);
+	EXPECT_EQ(wait().size(), 1);
+}
+
+TEST_P(EventLoopTest, ReportsEventsAgainAfterDraining)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	for (int i = 0; i < 3; ++i)
+	{
+		send_byte(m_fds[1]);
+		ASSERT_EQ(wait().size(), 1) << "round " << i;
+		drain(m_fds[0]);
+	}
+}
+
+TEST_P(EventLoopTest, ModifyReportsEventsThatAreAlreadyReady)
+{
+	// an idle socket is writable right away, but only readable is watched
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	EXPECT_TRUE(wait(10).empty());
+
+	m_loop->modify(m_fds[0], 2, EventLoop::readable | EventLoop::writable);
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 2);
+	EXPECT_NE(events[0].events & EventLoop::writable, 0);
+}
+
+TEST_P(EventLoopTest, ModifyReplacesToken)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->modify(m_fds[0], 7, EventLoop::readable);
+	send_byte(m_fds[1]);
+
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 7);
+}
+
+TEST_P(EventLoopTest, RemovedDescriptorIsNotReported)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->remove(m_fds[0]);
+	send_byte(m_fds[1]);
+	EXPECT_TRUE(wait(10).empty());
+
+	// it can be registered again
+	m_loop->add(m_fds[0], 3, EventLoop::readable);
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 3);
+}
+
+TEST_P(EventLoopTest, RemovingUnknownDescriptorIsNotAnError)
+{
+	EXPECT_NO_THROW(m_loop->remove(m_fds[0]));
+}
+
+TEST_P(EventLoopTest, ReportsHangup)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	close(m_fds[1]);
+	m_fds[1] = -1;
+
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_NE(events[0].events & (EventLoop::readable | EventLoop::error), 0);
+}
+
+TEST_P(EventLoopTest, ReportsSeveralDescriptorsInOneWait)
+{
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->add(m_fds[1], 2, EventLoop::readable);
+	send_byte(m_fds[0]);
+	send_byte(m_fds[1]);
+
+	std::vector<uint64_t> tokens;
+	while (tokens.size() < 2)
+	{
+		const auto events = wait();
+		ASSERT_FALSE(events.empty());
+		for (const auto &event : events)
+		{
+			tokens.push_back(event.token);
+		}
+	}
+	std::sort(tokens.begin(), tokens.end());
+	EXPECT_EQ(tokens, (std::vector<uint64_t>{ 1, 2 }));
+}
+
+TEST_P(EventLoopTest, NotifierWakesLoopFromAnotherThread)
+{
+	const EventNotifier notifier;
+	m_loop->add(notifier.get_fd(), 5, EventLoop::readable);
+
+	std::thread thread([&notifier] { notifier.notify(); });
+	const auto events = wait(5000);
+	thread.join();
+
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 5);
+	notifier.drain();
+	m_loop->remove(notifier.get_fd());
+}
+
+TEST_P(EventLoopTest, ReceivesDataByItself)
+{
+	if (!m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop only reports readiness";
+	}
+	m_loop->add(m_fds[0], 7, EventLoop::readable);
+	m_loop->receive(m_fds[0]);
+	const std::string message = "hello";
+	ASSERT_EQ(write(m_fds[1], message.data(), message.size()), message.size());
+
+	std::string received;
+	while (received.size() < message.size())
+	{
+		const auto events = wait();
+		ASSERT_FALSE(events.empty());
+		for (const auto &event : events)
+		{
+			EXPECT_EQ(event.token, 7);
+			ASSERT_NE(event.events & EventLoop::received, 0);
+			received.append(event.data.begin(), event.data.end());
+		}
+	}
+	EXPECT_EQ(received, message);
+}
+
+TEST_P(EventLoopTest, ReusesReceiveBuffers)
+{
+	if (!m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop only reports readiness";
+	}
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->receive(m_fds[0]);
+
+	// much more than all the buffers of the loop together
+	static constexpr size_t size = 16 * 1024 * 1024;
+	std::thread writer([fd = m_fds[1]] {
+		std::vector<uint8_t> data(size);
+		for (size_t i = 0; i < size; ++i)
+		{
+			data[i] = static_cast<uint8_t>(i * 7);
+		}
+		size_t written = 0;
+		while (written < size)
+		{
+			const ssize_t rc = write(fd, data.data() + written, size - written);
+			if (rc > 0)
+			{
+				written += static_cast<size_t>(rc);
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	size_t received = 0;
+	bool intact = true;
+	while (received < size)
+	{
+		const auto events = wait();
+		ASSERT_FALSE(events.empty());
+		for (const auto &event : events)
+		{
+			ASSERT_NE(event.events & EventLoop::received, 0);
+			for (const uint8_t byte : event.data)
+			{
+				intact = intact && byte == static_cast<uint8_t>(received * 7);
+				++received;
+			}
+		}
+	}
+	writer.join();
+	EXPECT_TRUE(intact);
+	EXPECT_EQ(received, size);
+}
+
+TEST_P(EventLoopTest, ReportsClosedConnectionItReceivesFrom)
+{
+	if (!m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop only reports readiness";
+	}
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->receive(m_fds[0]);
+	close(m_fds[1]);
+	m_fds[1] = -1;
+
+	bool closed = false;
+	for (int i = 0; i < 10 && !closed; ++i)
+	{
+		for (const auto &event : wait())
+		{
+			EXPECT_EQ(event.events & EventLoop::received, 0);
+			closed = closed || (event.events & EventLoop::error) != 0;
+		}
+	}
+	EXPECT_TRUE(closed);
+}
+
+TEST_P(EventLoopTest, DoesNotReportReceivesOfRemovedDescriptor)
+{
+	if (!m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop only reports readiness";
+	}
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	m_loop->receive(m_fds[0]);
+	(void)wait(10);
+	m_loop->remove(m_fds[0]);
+	send_byte(m_fds[1]);
+
+	EXPECT_TRUE(wait(100).empty());
+}
+
+TEST_P(EventLoopTest, SendsDataByItself)
+{
+	if (!m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop only reports readiness";
+	}
+	m_loop->add(m_fds[0], 3, EventLoop::readable);
+	auto message = std::make_shared<const std::string>("hello");
+	const std::span data(reinterpret_cast<const uint8_t *>(message->data()), message->size());
+	m_loop->send(m_fds[0], message, data);
+	// the data is kept alive by the loop
+	message.reset();
+
+	const auto events = wait();
+	ASSERT_EQ(events.size(), 1);
+	EXPECT_EQ(events[0].token, 3);
+	ASSERT_NE(events[0].events & EventLoop::sent, 0);
+	EXPECT_EQ(events[0].data.size(), data.size());
+
+	std::array<char, 16> buf{};
+	ASSERT_EQ(read(m_fds[1], buf.data(), buf.size()), 5);
+	EXPECT_EQ(std::string(buf.data(), 5), "hello");
+}
+
+TEST_P(EventLoopTest, ReadinessLoopDoesNotPerformIo)
+{
+	if (m_loop->performs_io())
+	{
+		GTEST_SKIP() << "the loop performs the I/O";
+	}
+	m_loop->add(m_fds[0], 1, EventLoop::readable);
+	EXPECT_THROW(m_loop->receive(m_fds[0]), std::logic_error);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, EventLoopTest,
+			 ::testing::Values(Backend::EPOLL, Backend::IO_URING),
+			 [](const auto &info) {
+				 switch (info.param)
+				 {
+				 case Backend::EPOLL:
+					 return "epoll";
+				 case Backend::IO_URING:
+					 return "io_uring";
+				 }
+				 return "";
+			 });
@@ -0,0 +1,24 @@
+#include "file_cache.hpp"
+
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+
+TEST(FileCacheTest, KeepsRecentlyUsedFilesOpen)
+{
+	const auto dir = std::filesystem::temp_directory_path() / "file_cache_test";
+	std::filesystem::create_directories(dir);
+
+	FileCache cache(2);
+	const auto first = cache.open(dir / "a");
+	EXPECT_EQ(cache.open(dir / "a"), first);
+	const auto second = cache.open(dir / "b");
+	EXPECT_NE(second->get_fd(), first->get_fd());
+	// "a" was used last before "b", so "c" pushes it out
+	(void)cache.open(dir / "c");
+	EXPECT_NE(cache.open(dir / "a"), first);
+	// a dropped file stays open for whoever still holds it
+	EXPECT_NE(fcntl(first->get_fd(), F_GETFD), -1);
+
+	std::filesystem::remove_all(dir);
+}
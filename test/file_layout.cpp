@@ -0,0 +1,68 @@
+#include "file_layout.hpp"
+
+#include <cstddef>
+#include <gtest/gtest.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// pieces of 10 bytes: 0-1 in the first file, 1 spans an empty file, 1-3 in the third
+FileLayout make_layout()
+{
+	std::vector<FileLayout::File> files;
+	size_t offset = 0;
+	for (const size_t length : { 15, 0, 25, 0 })
+	{
+		files.push_back({ std::to_string(offset), offset, length });
+		offset += length;
+	}
+	return { std::move(files), 10 };
+}
+
+} // namespace
+
+TEST(FileLayoutTest, FindsFilesOfRange)
+{
+	const FileLayout layout = make_layout();
+	EXPECT_EQ(layout.length(), 40);
+	using Range = std::pair<size_t, size_t>;
+	EXPECT_EQ(layout.files_of(0, 10), Range(0, 1));
+	EXPECT_EQ(layout.files_of(10, 20), Range(0, 3));
+	EXPECT_EQ(layout.files_of(30, 40), Range(2, 3));
+	// a range that ends where a file starts doesn't overlap it
+	EXPECT_EQ(layout.files_of(5, 15), Range(0, 1));
+}
+
+TEST(FileLayoutTest, SplitsRangeIntoExtents)
+{
+	const FileLayout layout = make_layout();
+	const auto extents = layout.extents_of(10, 10);
+	// the empty file in between holds no data
+	ASSERT_EQ(extents.size(), 2);
+	EXPECT_EQ(extents[0].file, 0);
+	EXPECT_EQ(extents[0].offset, 10);
+	EXPECT_EQ(extents[0].length, 5);
+	EXPECT_EQ(extents[1].file, 2);
+	EXPECT_EQ(extents[1].offset, 0);
+	EXPECT_EQ(extents[1].length, 5);
+
+	const auto last = layout.extents_of(30, 10);
+	ASSERT_EQ(last.size(), 1);
+	EXPECT_EQ(last[0].file, 2);
+	EXPECT_EQ(last[0].offset, 15);
+	EXPECT_EQ(last[0].length, 10);
+}
+
+TEST(FileLayoutTest, FindsPiecesOfFile)
+{
+	const FileLayout layout = make_layout();
+	using Range = std::pair<size_t, size_t>;
+	EXPECT_EQ(layout.pieces_of(0), Range(0, 1));
+	EXPECT_EQ(layout.pieces_of(1), Range(1, 1));
+	EXPECT_EQ(layout.pieces_of(2), Range(1, 3));
+	// the empty file at the end starts where a fifth piece would
+	EXPECT_EQ(layout.pieces_of(3), Range(4, 4));
+}
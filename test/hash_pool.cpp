@@ -0,0 +1,148 @@
+#include "hash_pool.hpp"
+
+#include "piece.hpp"
+#include "piece_arena.hpp"
+#include "utils.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// waits on the descriptor of the queue, like a reactor would
+std::vector<HashPool::Result> wait_for_results(HashPool::CompletionQueue &queue,
+					       const size_t count)
+{
+	std::vector<HashPool::Result> ret;
+	pollfd fd{ queue.get_fd(), POLLIN, 0 };
+	while (ret.size() < count && poll(&fd, 1, 5000) > 0)
+	{
+		for (HashPool::Result &result : queue.take_results())
+		{
+			ret.push_back(std::move(result));
+		}
+	}
+	return ret;
+}
+
+ReceivedPiece make_piece(PieceArena &arena, const size_t index, const size_t length,
+			 HashPool *pool = nullptr)
+{
+	ReceivedPiece ret(index, length, arena.acquire(length), pool);
+	const auto data = ret.get_block(0, length);
+	for (size_t i = 0; i < length; ++i)
+	{
+		data[i] = static_cast<uint8_t>(i * 7 + index);
+	}
+	return ret;
+}
+
+std::string sha1_of(const ReceivedPiece &piece)
+{
+	const auto digest = utils::compute_sha1(piece.get_data());
+	return { digest.begin(), digest.end() };
+}
+
+} // namespace
+
+TEST(HashPoolTest, HashesBlocksThatArriveOutOfOrder)
+{
+	PieceArena arena(4 * 4096, false);
+	// the queue must outlive the pool
+	HashPool::CompletionQueue queue;
+	HashPool pool(2);
+	std::vector<std::string> expected;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		ReceivedPiece piece = make_piece(arena, i, 1000, &pool);
+		expected.push_back(sha1_of(piece));
+		piece.add_block(300, 300);
+		piece.add_block(600, 400);
+		piece.add_block(0, 300);
+		pool.submit(queue, std::move(piece), 42 + i);
+	}
+
+	const auto results = wait_for_results(queue, 3);
+	ASSERT_EQ(results.size(), 3);
+	for (const HashPool::Result &result : results)
+	{
+		EXPECT_EQ(result.token, 42 + result.piece.get_index());
+		EXPECT_EQ(result.sha1, expected[result.piece.get_index()]);
+	}
+}
+
+TEST(HashPoolTest, HashesPieceWithoutBlocks)
+{
+	PieceArena arena(4096, false);
+	ReceivedPiece piece = make_piece(arena, 0, 1000);
+	const std::string expected = sha1_of(piece);
+
+	HashPool::CompletionQueue queue;
+	HashPool pool(1);
+	pool.submit(queue, std::move(piece), 0);
+	const auto results = wait_for_results(queue, 1);
+	ASSERT_EQ(results.size(), 1);
+	EXPECT_EQ(results[0].sha1, expected);
+}
+
+TEST(HashPoolTest, ReturnsBufferOfDiscardedPiece)
+{
+	PieceArena arena(4096, false);
+	HashPool::CompletionQueue queue;
+	HashPool pool(1);
+	{
+		ReceivedPiece piece = make_piece(arena, 0, 1000, &pool);
+		piece.add_block(0, 500);
+	}
+	// the buffer is held by the queued part until it is hashed
+	for (size_t i = 0; i < 500 && arena.in_use() != 0; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	EXPECT_EQ(arena.in_use(), 0);
+
+	// the context of the discarded piece doesn't affect the next one
+	ReceivedPiece piece = make_piece(arena, 1, 1000, &pool);
+	const std::string expected = sha1_of(piece);
+	piece.add_block(0, 1000);
+	pool.submit(queue, std::move(piece), 1);
+	const auto results = wait_for_results(queue, 1);
+	ASSERT_EQ(results.size(), 1);
+	EXPECT_EQ(results[0].sha1, expected);
+}
+
+TEST(HashPoolTest, DeliversResultsToTheQueueOfTheSubmitter)
+{
+	constexpr size_t pieces = 8;
+	PieceArena arena(2 * pieces * 4096, false);
+	HashPool::CompletionQueue first;
+	HashPool::CompletionQueue second;
+	std::vector<std::string> expected;
+	HashPool pool(3);
+	for (size_t i = 0; i < 2 * pieces; ++i)
+	{
+		ReceivedPiece piece = make_piece(arena, i, 4000);
+		expected.push_back(sha1_of(piece));
+		pool.submit(i % 2 == 0 ? first : second, std::move(piece), i);
+	}
+
+	for (auto *queue : { &first, &second })
+	{
+		const auto results = wait_for_results(*queue, pieces);
+		ASSERT_EQ(results.size(), pieces);
+		for (const HashPool::Result &result : results)
+		{
+			EXPECT_EQ(result.token % 2, queue == &first ? 0 : 1);
+			EXPECT_EQ(result.piece.get_index(), result.token);
+			EXPECT_EQ(result.sha1, expected[result.token]);
+		}
+	}
+}
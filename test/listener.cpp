@@ -0,0 +1,241 @@
+#include "socket.hpp"
+
+#include "event_loop.hpp"
+#include "peer_connection.hpp"
+#include "peer_listener.hpp"
+#include "peer_message.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <unistd.h>
+#include <vector>
+
+TEST(ListenerTest, AcceptsPeersThatSendHandshakeFirst)
+{
+	const TCPListener listener(0, true);
+	const uint16_t port = listener.get_port();
+	ASSERT_NE(port, 0);
+	// another shard may listen on the same port
+	EXPECT_NO_THROW(TCPListener(port, true));
+	EXPECT_FALSE(listener.accept().has_value());
+
+	TCPClient client("127.0.0.1", std::to_string(port));
+	std::optional<TCPClient> socket;
+	for (int i = 0; i < 100 && !socket.has_value(); ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		socket = listener.accept();
+	}
+	ASSERT_TRUE(socket.has_value());
+
+	EpollEventLoop loop;
+	PeerConnection conn;
+	conn.accept(loop, 0, std::move(socket.value()), 8);
+	EXPECT_FALSE(conn.handshake_sent());
+	EXPECT_FALSE(conn.should_wait_for_send());
+	// the dual-stack socket shows IPv4 peers the way trackers send them
+	EXPECT_EQ(std::get<0>(conn.peer_ip_and_port()), "127.0.0.1");
+
+	const std::array<uint8_t, 20> id{};
+	const message::Handshake handshake(id, id);
+	const auto greeting = handshake.serialized();
+	size_t written = 0;
+	while (written < greeting.size())
+	{
+		const long rc = client.send(greeting.subspan(written));
+		written += rc > 0 ? static_cast<size_t>(rc) : 0;
+	}
+	std::optional<std::span<const uint8_t>> message;
+	for (int i = 0; i < 100 && !message.has_value(); ++i)
+	{
+		(void)loop.wait(10);
+		(void)conn.recv();
+		message = conn.next_message();
+	}
+	ASSERT_TRUE(message.has_value());
+	EXPECT_TRUE(std::equal(message->begin(), message->end(), greeting.begin(), greeting.end()));
+	EXPECT_TRUE(conn.handshake_received());
+
+	conn.send_handshake(handshake, message::Bitfield(8));
+	EXPECT_TRUE(conn.handshake_sent());
+	while (conn.send() != 0)
+	{
+		(void)loop.wait(1000);
+	}
+	std::array<uint8_t, 68 + 6> reply{};
+	size_t received = 0;
+	for (int i = 0; i < 100 && received < reply.size(); ++i)
+	{
+		const long rc = client.recv(std::span(reply).subspan(received));
+		if (rc > 0)
+		{
+			received += static_cast<size_t>(rc);
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	ASSERT_EQ(received, reply.size());
+	EXPECT_TRUE(std::equal(greeting.begin(), greeting.end(), reply.begin()));
+	conn.disconnect();
+}
+
+namespace
+{
+
+void send_all(const TCPClient &client, const std::span<const uint8_t> data)
+{
+	size_t written = 0;
+	while (written < data.size())
+	{
+		const long rc = client.send(data.subspan(written));
+		written += rc > 0 ? static_cast<size_t>(rc) : 0;
+	}
+}
+
+// waits until the peer closes the connection
+bool closed_by_peer(const TCPClient &client)
+{
+	std::array<uint8_t, 1> byte{};
+	for (int i = 0; i < 1000; ++i)
+	{
+		if (client.recv(byte) == 0)
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return false;
+}
+
+} // namespace
+
+TEST(ListenerTest, RoutesPeersByInfoHash)
+{
+	PeerListener listener(0);
+	std::mutex mutex;
+	// the info_hash each socket was routed for
+	std::vector<std::pair<uint8_t, TCPClient>> routed;
+	for (const uint8_t torrent : { 1, 2 })
+	{
+		const std::array<uint8_t, 20> info_hash{ torrent };
+		listener.add(info_hash,
+			     [&, torrent](TCPClient socket, const std::span<const uint8_t> handshake) {
+				     EXPECT_EQ(message::Handshake(handshake).get_info_hash()[0], torrent);
+				     const std::lock_guard lock(mutex);
+				     routed.emplace_back(torrent, std::move(socket));
+			     });
+	}
+
+	const std::array<uint8_t, 20> id{};
+	std::vector<TCPClient> clients;
+	for (const uint8_t torrent : { 2, 1, 3 })
+	{
+		clients.emplace_back("127.0.0.1", std::to_string(listener.get_port()));
+		const std::array<uint8_t, 20> info_hash{ torrent };
+		// the handshake may come in parts
+		const message::Handshake handshake(info_hash, id);
+		send_all(clients.back(), handshake.serialized().first(10));
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		send_all(clients.back(), handshake.serialized().subspan(10));
+	}
+	// nobody has the third torrent
+	EXPECT_TRUE(closed_by_peer(clients[2]));
+
+	for (int i = 0; i < 1000; ++i)
+	{
+		const std::lock_guard lock(mutex);
+		if (routed.size() == 2)
+		{
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	listener.remove(std::array<uint8_t, 20>{ 1 });
+	listener.remove(std::array<uint8_t, 20>{ 2 });
+	ASSERT_EQ(routed.size(), 2);
+	// the sockets are handed over in the order the handshakes were completed
+	EXPECT_EQ(routed[0].first, 2);
+	EXPECT_EQ(routed[1].first, 1);
+	for (auto &[torrent, socket] : routed)
+	{
+		// the socket is connected to the client that sent the handshake
+		const std::array<uint8_t, 1> byte{ torrent };
+		send_all(socket, byte);
+		std::array<uint8_t, 1> received{};
+		TCPClient &client = clients[torrent == 2 ? 0 : 1];
+		long rc = -1;
+		for (int i = 0; i < 1000 && rc == -1; ++i)
+		{
+			rc = client.recv(received);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		EXPECT_EQ(rc, 1);
+		EXPECT_EQ(received[0], torrent);
+	}
+}
+
+TEST(ListenerTest, AcceptsAgainAfterRunningOutOfDescriptors)
+{
+	PeerListener listener(0);
+	std::atomic<bool> routed = false;
+	const std::array<uint8_t, 20> info_hash{ 1 };
+	listener.add(info_hash, [&routed](TCPClient, std::span<const uint8_t>) { routed = true; });
+
+	// so that the descriptors run out quickly
+	rlimit old_limit{};
+	ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &old_limit), 0);
+	rlimit limit = old_limit;
+	limit.rlim_cur = std::min<rlim_t>(limit.rlim_cur, 1024);
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+
+	// leaves a single descriptor for the client, so the listener can't accept it
+	std::vector<int> fillers;
+	for (int fd = dup(0); fd != -1; fd = dup(0))
+	{
+		fillers.push_back(fd);
+	}
+	ASSERT_FALSE(fillers.empty());
+	close(fillers.back());
+	fillers.pop_back();
+	std::optional<TCPClient> client;
+	try
+	{
+		client.emplace("127.0.0.1", std::to_string(listener.get_port()));
+	} catch (const std::exception &ex)
+	{
+		ADD_FAILURE() << ex.what();
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	for (const int fd : fillers)
+	{
+		close(fd);
+	}
+	setrlimit(RLIMIT_NOFILE, &old_limit);
+	ASSERT_TRUE(client.has_value());
+
+	// no new event comes for the peer waiting in the backlog
+	const std::array<uint8_t, 20> id{};
+	send_all(client.value(), message::Handshake(info_hash, id).serialized());
+	for (int i = 0; i < 1000 && !routed; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	EXPECT_TRUE(routed);
+	listener.remove(info_hash);
+}
@@ -0,0 +1,45 @@
+#include "piece.hpp"
+
+#include "piece_arena.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <stdexcept>
+
+TEST(PieceArenaTest, FailsOnceBudgetIsUsedUp)
+{
+	PieceArena arena(4096, false);
+	PieceBuffer buffer = arena.acquire(23);
+	EXPECT_FALSE(buffer.empty());
+	EXPECT_TRUE(arena.acquire(23).empty());
+
+	// the returned slab is reused
+	buffer.reset();
+	EXPECT_FALSE(arena.acquire(23).empty());
+}
+
+TEST(ReceivedPieceTest, KeepsBlocksInPlace)
+{
+	PieceArena arena(4096, false);
+	ReceivedPiece piece(0, 23, arena.acquire(23));
+	const auto block1 = piece.get_block(0, 10);
+	std::fill(block1.begin(), block1.end(), 1);
+	const auto block2 = piece.get_block(10, 13);
+	std::fill(block2.begin(), block2.end(), 2);
+
+	const auto data = piece.get_data();
+	ASSERT_EQ(data.size(), 23);
+	EXPECT_EQ(std::count(data.begin(), data.end(), 1), 10);
+	EXPECT_EQ(std::count(data.begin(), data.end(), 2), 13);
+}
+
+TEST(ReceivedPieceTest, RejectsBlocksOutsideThePiece)
+{
+	PieceArena arena(4096, false);
+	ReceivedPiece piece(0, 23, arena.acquire(23));
+	EXPECT_THROW((void)piece.get_block(20, 4), std::out_of_range);
+	EXPECT_THROW((void)piece.get_block(24, 0), std::out_of_range);
+	EXPECT_NO_THROW((void)piece.get_block(23, 0));
+}
@@ -0,0 +1,182 @@
+#include "recheck.hpp"
+
+#include "resume_data.hpp"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr size_t piece_length = 64 * 1024;
+
+class RecheckTest : public ::testing::Test {
+protected:
+	std::filesystem::path m_dir;
+	std::vector<uint8_t> m_torrent;
+	std::string m_hashes;
+	std::vector<FileLayout::File> m_files;
+
+	void SetUp() override
+	{
+		m_dir = std::filesystem::temp_directory_path() /
+			("recheck_test_" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()));
+		std::filesystem::remove_all(m_dir);
+		std::filesystem::create_directories(m_dir);
+
+		// pieces 0-2 are in the first file, piece 3 spans an empty file and the third one
+		set_layout({ 3 * piece_length + 100, 0, 2 * piece_length });
+	}
+
+	void set_layout(const std::vector<size_t> &lengths)
+	{
+		m_files.clear();
+		m_hashes.clear();
+		size_t offset = 0;
+		for (size_t i = 0; i < lengths.size(); ++i)
+		{
+			m_files.push_back({ m_dir / std::to_string(i), offset, lengths[i] });
+			offset += lengths[i];
+		}
+		m_torrent.resize(offset);
+		for (size_t i = 0; i < m_torrent.size(); ++i)
+		{
+			m_torrent[i] = static_cast<uint8_t>(i * 31 + i / 7);
+		}
+		for (size_t begin = 0; begin < m_torrent.size(); begin += piece_length)
+		{
+			const size_t length = std::min(piece_length, m_torrent.size() - begin);
+			const auto sha1 =
+				utils::compute_sha1(std::span(m_torrent).subspan(begin, length));
+			m_hashes.append(sha1.begin(), sha1.end());
+		}
+	}
+
+	void TearDown() override
+	{
+		std::filesystem::remove_all(m_dir);
+	}
+
+	void write_file(const size_t index, const size_t length)
+	{
+		std::ofstream out(m_files[index].path, std::ios::binary);
+		out.write(reinterpret_cast<const char *>(m_torrent.data() + m_files[index].offset),
+			  static_cast<std::streamsize>(length));
+	}
+
+	[[nodiscard]] std::vector<bool> run(const size_t threads)
+	{
+		Recheck recheck(FileLayout(m_files, piece_length), m_hashes);
+		const message::Bitfield bitfield = recheck.run(threads);
+		std::vector<bool> ret;
+		for (size_t i = 0; i < bitfield.get_bf_size(); ++i)
+		{
+			ret.push_back(bitfield.get_index(i));
+		}
+		return ret;
+	}
+};
+
+} // namespace
+
+TEST_F(RecheckTest, VerifiesCompleteData)
+{
+	for (size_t i = 0; i < m_files.size(); ++i)
+	{
+		write_file(i, m_files[i].length);
+	}
+	EXPECT_EQ(run(3), std::vector<bool>(6, true));
+}
+
+TEST_F(RecheckTest, ReportsMissingAndCorruptedPieces)
+{
+	// the first file is cut in the middle of piece 2, the last one is missing
+	write_file(0, 2 * piece_length + 10);
+	write_file(1, 0);
+	EXPECT_EQ(run(1), std::vector<bool>({ true, true, false, false, false, false }));
+
+	write_file(0, m_files[0].length);
+	write_file(2, m_files[2].length);
+	m_torrent[piece_length + 5] ^= 1;
+	write_file(0, m_files[0].length);
+	EXPECT_EQ(run(2), std::vector<bool>({ true, false, true, true, true, true }));
+}
+
+TEST_F(RecheckTest, VerifiesPiecesThatAllSpanSeveralFiles)
+{
+	// every piece is copied, so the copies can't all wait in a single batch
+	set_layout(std::vector<size_t>(20, piece_length / 3 + 7));
+	m_torrent[2 * piece_length + 1] ^= 1;
+	for (size_t i = 0; i < m_files.size(); ++i)
+	{
+		write_file(i, m_files[i].length);
+	}
+
+	std::vector<bool> expected(7, true);
+	expected[2] = false;
+	EXPECT_EQ(run(1), expected);
+}
+
+TEST_F(RecheckTest, SkipsHoles)
+{
+	for (size_t i = 0; i < m_files.size(); ++i)
+	{
+		std::ofstream(m_files[i].path, std::ios::binary).close();
+		std::filesystem::resize_file(m_files[i].path, m_files[i].length);
+	}
+	EXPECT_EQ(run(2), std::vector<bool>(6, false));
+}
+
+TEST_F(RecheckTest, ChecksOnlyWantedPieces)
+{
+	for (size_t i = 0; i < m_files.size(); ++i)
+	{
+		write_file(i, m_files[i].length);
+	}
+	message::Bitfield wanted(6);
+	wanted.set_index(1, true);
+	wanted.set_index(3, true);
+	Recheck recheck(FileLayout(m_files, piece_length), m_hashes);
+	const message::Bitfield verified = recheck.run(2, wanted);
+	for (size_t i = 0; i < 6; ++i)
+	{
+		EXPECT_EQ(verified.get_index(i), i == 1 || i == 3) << "piece " << i;
+	}
+}
+
+TEST_F(RecheckTest, ResumeDataRoundTrip)
+{
+	write_file(0, m_files[0].length);
+
+	ResumeData data;
+	data.info_hash = m_hashes.substr(0, utils::sha1_length);
+	data.piece_length = piece_length;
+	data.pieces = message::Bitfield(11);
+	data.pieces.set_index(0, true);
+	data.pieces.set_index(9, true);
+	for (const auto &file : m_files)
+	{
+		data.files.push_back(ResumeData::stat_file(file.path));
+	}
+	EXPECT_GT(data.files[0].mtime, 0);
+	EXPECT_EQ(data.files[2].length, -1);
+
+	const auto path = m_dir / "record.resume";
+	data.save(path);
+	EXPECT_FALSE(ResumeData::load(path, 17).has_value());
+	const auto loaded = ResumeData::load(path, 11);
+	ASSERT_TRUE(loaded.has_value());
+	EXPECT_EQ(loaded->info_hash, data.info_hash);
+	EXPECT_EQ(loaded->piece_length, data.piece_length);
+	EXPECT_EQ(loaded->files, data.files);
+	for (size_t i = 0; i < 11; ++i)
+	{
+		EXPECT_EQ(loaded->pieces.get_index(i), i == 0 || i == 9) << "piece " << i;
+	}
+}
@@ -0,0 +1,134 @@
+#include "sha1.hpp"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+sha1::Digest reference(std::span<const uint8_t> input)
+{
+	sha1::Digest ret{};
+	unsigned int size = 0;
+	EVP_Digest(input.data(), input.size(), ret.data(), &size, EVP_sha1(), nullptr);
+	return ret;
+}
+
+std::vector<uint8_t> random_bytes(std::mt19937 &rng, size_t size)
+{
+	std::uniform_int_distribution<int> dist(0, 255);
+	std::vector<uint8_t> ret(size);
+	for (auto &byte : ret)
+	{
+		byte = static_cast<uint8_t>(dist(rng));
+	}
+	return ret;
+}
+
+std::string kernel_label(const sha1::Kernel kernel)
+{
+	switch (kernel)
+	{
+	case sha1::Kernel::SHA_NI:
+		return "SHA_NI";
+	case sha1::Kernel::AVX2:
+		return "AVX2";
+	default:
+		return "EVP";
+	}
+}
+
+class Sha1Test : public ::testing::TestWithParam<sha1::Kernel> {
+protected:
+	void SetUp() override
+	{
+		if (!sha1::is_supported(GetParam()))
+		{
+			GTEST_SKIP() << sha1::kernel_name(GetParam()) << " is not supported";
+		}
+	}
+};
+
+} // namespace
+
+TEST_P(Sha1Test, MatchesOpenSSLAtPaddingBoundaries)
+{
+	std::mt19937 rng(1);
+	// the padding takes one or two blocks depending on the tail
+	for (size_t size = 0; size < 300; ++size)
+	{
+		const auto data = random_bytes(rng, size);
+		EXPECT_EQ(sha1::hash(data, GetParam()), reference(data)) << "size " << size;
+	}
+}
+
+TEST_P(Sha1Test, MatchesOpenSSLInBatches)
+{
+	std::mt19937 rng(2);
+	std::vector<std::vector<uint8_t>> buffers;
+	// a full batch of equal pieces, a shorter last one and a partial second batch
+	for (size_t i = 0; i < sha1::max_lanes; ++i)
+	{
+		buffers.push_back(random_bytes(rng, 16384));
+	}
+	buffers.push_back(random_bytes(rng, 5000));
+	buffers.push_back(random_bytes(rng, 16384));
+	buffers.push_back(random_bytes(rng, 0));
+
+	std::vector<std::span<const uint8_t>> inputs(buffers.begin(), buffers.end());
+	std::vector<sha1::Digest> outputs(inputs.size());
+	sha1::hash(inputs, outputs, GetParam());
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		EXPECT_EQ(outputs[i], reference(inputs[i])) << "buffer " << i;
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(Kernels, Sha1Test,
+			 ::testing::Values(sha1::Kernel::EVP, sha1::Kernel::SHA_NI,
+					   sha1::Kernel::AVX2),
+			 [](const auto &info) { return kernel_label(info.param); });
+
+TEST(Sha1ContextTest, MatchesOpenSSLWhenFedInParts)
+{
+	std::mt19937 rng(3);
+	std::uniform_int_distribution<size_t> part_size(0, 200);
+	for (const size_t size : { 0, 1, 55, 56, 64, 119, 120, 1000, 16384 + 17 })
+	{
+		const auto data = random_bytes(rng, size);
+		sha1::Context ctx;
+		// parts that are smaller, equal and bigger than a block
+		size_t offset = 0;
+		while (offset < size)
+		{
+			const size_t part = std::min(part_size(rng), size - offset);
+			ctx.update(std::span(data).subspan(offset, part));
+			offset += part;
+		}
+		EXPECT_EQ(ctx.finish(), reference(data)) << "size " << size;
+	}
+}
+
+TEST(Sha1ContextTest, StartsOverAfterReset)
+{
+	std::mt19937 rng(5);
+	const auto first = random_bytes(rng, 1000);
+	const auto second = random_bytes(rng, 300);
+	sha1::Context ctx;
+	ctx.update(first);
+	(void)ctx.finish();
+	ctx.reset();
+	// a message left unfinished is dropped as well
+	ctx.update(std::span(first).first(70));
+	ctx.reset();
+	ctx.update(second);
+	EXPECT_EQ(ctx.finish(), reference(second));
+}
@@ -0,0 +1,227 @@
+#include "storage.hpp"
+
+#include "piece.hpp"
+#include "piece_arena.hpp"
+#include "piece_cache.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr size_t piece_length = 16 * 1024;
+
+enum class Backend { PWRITE, DIRECT, MMAP };
+
+class StorageTest : public ::testing::TestWithParam<Backend> {
+protected:
+	std::filesystem::path m_dir;
+	std::vector<FileLayout::File> m_files;
+	std::vector<uint8_t> m_torrent;
+	PieceArena m_arena{ 4 * piece_length, false };
+
+	void SetUp() override
+	{
+		m_dir = std::filesystem::temp_directory_path() /
+			("storage_test_" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()));
+		std::filesystem::remove_all(m_dir);
+		std::filesystem::create_directories(m_dir);
+
+		// piece 1 spans all three files, the last piece is short
+		const std::vector<size_t> lengths = { piece_length + 100, 0, 2 * piece_length - 150 };
+		size_t offset = 0;
+		for (size_t i = 0; i < lengths.size(); ++i)
+		{
+			m_files.push_back({ m_dir / std::to_string(i), offset, lengths[i] });
+			std::ofstream(m_files.back().path, std::ios::binary).close();
+			offset += lengths[i];
+		}
+		m_torrent.resize(offset);
+		for (size_t i = 0; i < m_torrent.size(); ++i)
+		{
+			m_torrent[i] = static_cast<uint8_t>(i * 13 + i / 5);
+		}
+	}
+
+	void TearDown() override
+	{
+		std::filesystem::remove_all(m_dir);
+	}
+
+	[[nodiscard]] std::unique_ptr<Storage> make() const
+	{
+		if (GetParam() == Backend::MMAP)
+		{
+			// windows of a single page, so a piece crosses several of them
+			return std::make_unique<MmapStorage>(FileLayout(m_files, piece_length), 1,
+							     4096, 2,
+							     MmapStorage::SyncPolicy::ASYNC);
+		}
+		// is written through the page cache where O_DIRECT is not supported
+		return std::make_unique<PwriteStorage>(FileLayout(m_files, piece_length), 1,
+						       GetParam() == Backend::DIRECT);
+	}
+
+	[[nodiscard]] ReceivedPiece piece(const size_t index)
+	{
+		const size_t begin = index * piece_length;
+		const size_t length = std::min(piece_length, m_torrent.size() - begin);
+		ReceivedPiece ret(index, length, m_arena.acquire(length));
+		const auto block = ret.get_block(0, length);
+		std::copy_n(m_torrent.begin() + static_cast<std::ptrdiff_t>(begin), length,
+			    block.begin());
+		return ret;
+	}
+
+	[[nodiscard]] std::vector<uint8_t> file_content(const size_t index) const
+	{
+		std::ifstream in(m_files[index].path, std::ios::binary);
+		return { std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+	}
+};
+
+} // namespace
+
+TEST_P(StorageTest, WritesPiecesAcrossFiles)
+{
+	{
+		const auto storage = make();
+		for (const size_t index : { 2, 0, 1 })
+		{
+			storage->write_piece(piece(index));
+		}
+		storage->sync();
+	}
+	for (size_t i = 0; i < m_files.size(); ++i)
+	{
+		const auto begin = m_torrent.begin() + static_cast<std::ptrdiff_t>(m_files[i].offset);
+		EXPECT_EQ(file_content(i),
+			  std::vector<uint8_t>(begin,
+					       begin + static_cast<std::ptrdiff_t>(m_files[i].length)))
+			<< "file " << i;
+	}
+}
+
+TEST_P(StorageTest, ReadsWhatWasWritten)
+{
+	const auto storage = make();
+	for (const size_t index : { 0, 1, 2 })
+	{
+		storage->write_piece(piece(index));
+	}
+	// starts in the first file and ends in the third one
+	const size_t offset = piece_length - 10;
+	std::vector<uint8_t> data(piece_length + 200);
+	storage->read(offset, data);
+	EXPECT_TRUE(std::equal(data.begin(), data.end(),
+			       m_torrent.begin() + static_cast<std::ptrdiff_t>(offset)));
+}
+
+TEST_P(StorageTest, SizesOnlyTheFilesItWrites)
+{
+	const auto storage = make();
+	// the files are sized by the preallocation, not by the storage
+	for (const auto &file : m_files)
+	{
+		EXPECT_EQ(std::filesystem::file_size(file.path), 0) << file.path;
+	}
+	storage->write_piece(piece(0));
+	storage->sync();
+	EXPECT_EQ(std::filesystem::file_size(m_files[0].path), piece_length);
+	EXPECT_EQ(std::filesystem::file_size(m_files[2].path), 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, StorageTest,
+			 ::testing::Values(Backend::PWRITE, Backend::DIRECT, Backend::MMAP),
+			 [](const auto &info) {
+				 switch (info.param)
+				 {
+				 case Backend::PWRITE:
+					 return "pwrite";
+				 case Backend::DIRECT:
+					 return "direct";
+				 case Backend::MMAP:
+					 return "mmap";
+				 }
+				 return "";
+			 });
+
+namespace
+{
+
+PieceCache::Data cache_piece(const uint8_t value)
+{
+	return std::make_shared<const std::vector<uint8_t>>(1024, value);
+}
+
+} // namespace
+
+TEST(PieceCacheTest, CountsHitsAndMisses)
+{
+	PieceCache cache(4 * 1024);
+	EXPECT_EQ(cache.find(0), nullptr);
+	cache.insert(0, cache_piece(7));
+	const auto piece = cache.find(0);
+	ASSERT_NE(piece, nullptr);
+	EXPECT_EQ((*piece)[0], 7);
+
+	const auto stats = cache.get_stats();
+	EXPECT_EQ(stats.hits, 1);
+	EXPECT_EQ(stats.misses, 1);
+	EXPECT_EQ(stats.pieces, 1);
+	EXPECT_EQ(stats.bytes, 1024);
+}
+
+TEST(PieceCacheTest, StaysWithinBudget)
+{
+	PieceCache cache(4 * 1024);
+	for (uint8_t i = 0; i < 10; ++i)
+	{
+		cache.insert(i, cache_piece(i));
+	}
+	const auto stats = cache.get_stats();
+	EXPECT_EQ(stats.pieces, 4);
+	EXPECT_EQ(stats.bytes, 4 * 1024);
+	EXPECT_EQ(stats.evictions, 6);
+	// the oldest are evicted first
+	EXPECT_EQ(cache.find(5), nullptr);
+	EXPECT_NE(cache.find(6), nullptr);
+}
+
+TEST(PieceCacheTest, KeepsReusedPiecesDuringScan)
+{
+	PieceCache cache(4 * 1024);
+	for (uint8_t i = 0; i < 5; ++i)
+	{
+		cache.insert(i, cache_piece(i));
+	}
+	ASSERT_EQ(cache.find(0), nullptr);
+	// it was evicted recently, so it goes to the main queue this time
+	cache.insert(0, cache_piece(0));
+	for (uint8_t i = 10; i < 30; ++i)
+	{
+		cache.insert(i, cache_piece(i));
+	}
+	EXPECT_NE(cache.find(0), nullptr);
+}
+
+TEST(PieceCacheTest, SkipsPiecesOverBudget)
+{
+	PieceCache cache(512);
+	cache.insert(0, cache_piece(0));
+	EXPECT_EQ(cache.find(0), nullptr);
+
+	PieceCache disabled(0);
+	EXPECT_FALSE(disabled.enabled());
+	disabled.insert(0, cache_piece(0));
+	EXPECT_EQ(disabled.get_stats().pieces, 0);
+}
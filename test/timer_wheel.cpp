@@ -0,0 +1,112 @@
+#include "timer_wheel.hpp"
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+
+std::vector<uint64_t> tokens(std::span<const TimerWheel::Timer> timers)
+{
+	std::vector<uint64_t> ret;
+	for (const auto &timer : timers)
+	{
+		ret.push_back(timer.token);
+	}
+	return ret;
+}
+
+} // namespace
+
+TEST(TimerWheelTest, FiresNotEarlierThanDeadline)
+{
+	const auto start = TimerWheel::clock::now();
+	TimerWheel wheel(start);
+	wheel.schedule(start + 10ms, { 1, 0 });
+
+	EXPECT_TRUE(wheel.advance(start + 9ms).empty());
+	EXPECT_EQ(tokens(wheel.advance(start + 10ms)), std::vector<uint64_t>{ 1 });
+	EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheelTest, TimersOnHigherLevelsAreCascaded)
+{
+	const auto start = TimerWheel::clock::now();
+	TimerWheel wheel(start);
+	wheel.schedule(start + 115s, { 1, 0 });
+	wheel.schedule(start + 1800s, { 2, 0 });
+	// further than the wheel covers
+	wheel.schedule(start + 24h, { 3, 0 });
+
+	EXPECT_TRUE(wheel.advance(start + 114999ms).empty());
+	EXPECT_EQ(tokens(wheel.advance(start + 115s)), std::vector<uint64_t>{ 1 });
+	EXPECT_TRUE(wheel.advance(start + 1799s).empty());
+	EXPECT_EQ(tokens(wheel.advance(start + 1800s)), std::vector<uint64_t>{ 2 });
+	EXPECT_TRUE(wheel.advance(start + 24h - 1ms).empty());
+	EXPECT_EQ(tokens(wheel.advance(start + 24h)), std::vector<uint64_t>{ 3 });
+}
+
+TEST(TimerWheelTest, CancelledTimerDoesNotFire)
+{
+	const auto start = TimerWheel::clock::now();
+	TimerWheel wheel(start);
+	const auto handle = wheel.schedule(start + 5s, { 1, 0 });
+	wheel.schedule(start + 5s, { 2, 0 });
+
+	EXPECT_TRUE(wheel.cancel(handle));
+	EXPECT_FALSE(wheel.cancel(handle));
+	EXPECT_EQ(tokens(wheel.advance(start + 5s)), std::vector<uint64_t>{ 2 });
+	EXPECT_EQ(wheel.timeout_ms(start + 5s), -1);
+}
+
+TEST(TimerWheelTest, TimeoutDoesNotOversleep)
+{
+	const auto start = TimerWheel::clock::now();
+	TimerWheel wheel(start);
+	wheel.schedule(start + 100s, { 1, 0 });
+
+	auto now = start;
+	int wakeups = 0;
+	while (wheel.advance(now).empty())
+	{
+		const int timeout = wheel.timeout_ms(now);
+		ASSERT_GT(timeout, 0);
+		now += std::chrono::milliseconds(timeout);
+		++wakeups;
+	}
+	EXPECT_EQ(now, start + 100s);
+	// the loop only wakes up when a level has to be cascaded
+	EXPECT_LT(wakeups, 10);
+}
+
+TEST(TimerWheelTest, RandomDeadlinesFireInTime)
+{
+	const auto start = TimerWheel::clock::now();
+	TimerWheel wheel(start);
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<int> dist(1, 20'000'000);
+
+	std::vector<std::chrono::milliseconds> deadlines;
+	for (uint64_t i = 0; i < 1000; ++i)
+	{
+		deadlines.emplace_back(dist(gen));
+		wheel.schedule(start + deadlines.back(), { i, 0 });
+	}
+
+	auto now = start;
+	size_t fired = 0;
+	while (!wheel.empty())
+	{
+		now += std::chrono::milliseconds(wheel.timeout_ms(now));
+		for (const auto &timer : wheel.advance(now))
+		{
+			EXPECT_EQ(start + deadlines[timer.token], now);
+			++fired;
+		}
+	}
+	EXPECT_EQ(fired, deadlines.size());
+}
@@ -0,0 +1,167 @@
+#include "peer_connection.hpp"
+
+#include "event_loop.hpp"
+#include "peer_message.hpp"
+#include "storage.hpp"
+
+#include <arpa/inet.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <memory>
+#include <netinet/in.h>
+#include <span>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+class UploadPathTest : public ::testing::Test {
+protected:
+	static constexpr size_t block = 1024;
+	// the second block spans both files
+	static constexpr size_t first_file = block + block / 2;
+	static constexpr size_t second_file = block;
+
+	std::filesystem::path m_dir =
+		std::filesystem::temp_directory_path() / "myTorrent_upload_path_test";
+	std::vector<uint8_t> m_torrent;
+	std::unique_ptr<PwriteStorage> m_storage;
+	int m_listener = -1;
+	int m_peer = -1;
+	EpollEventLoop m_loop;
+	PeerConnection m_conn;
+
+	void SetUp() override
+	{
+		std::filesystem::create_directories(m_dir);
+		for (size_t i = 0; i < first_file + second_file; ++i)
+		{
+			m_torrent.push_back(static_cast<uint8_t>(i % 251));
+		}
+		std::ofstream(m_dir / "a", std::ios::binary)
+			.write(reinterpret_cast<const char *>(m_torrent.data()), first_file);
+		std::ofstream(m_dir / "b", std::ios::binary)
+			.write(reinterpret_cast<const char *>(m_torrent.data()) + first_file,
+			       second_file);
+		m_storage = std::make_unique<PwriteStorage>(
+			FileLayout({ { m_dir / "a", 0, first_file },
+				     { m_dir / "b", first_file, second_file } },
+				   2 * block),
+			2);
+
+		m_listener = socket(AF_INET, SOCK_STREAM, 0);
+		ASSERT_NE(m_listener, -1);
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addr_len = sizeof addr;
+		ASSERT_EQ(bind(m_listener, reinterpret_cast<sockaddr *>(&addr), addr_len), 0);
+		ASSERT_EQ(listen(m_listener, 1), 0);
+		ASSERT_EQ(getsockname(m_listener, reinterpret_cast<sockaddr *>(&addr), &addr_len), 0);
+
+		const std::array<uint8_t, 20> id{};
+		m_conn.connect(m_loop, 0, "127.0.0.1", std::to_string(ntohs(addr.sin_port)),
+			       message::Handshake(id, id), message::Bitfield(8));
+		m_peer = accept(m_listener, nullptr, nullptr);
+		ASSERT_NE(m_peer, -1);
+		// the handshake and the bitfield
+		flush();
+		EXPECT_EQ(receive(68 + 6).size(), 68 + 6);
+	}
+
+	void TearDown() override
+	{
+		m_conn.disconnect();
+		close(m_peer);
+		close(m_listener);
+		std::filesystem::remove_all(m_dir);
+	}
+
+	void flush()
+	{
+		while (m_conn.send() != 0)
+		{
+			(void)m_loop.wait(1000);
+		}
+	}
+
+	std::vector<uint8_t> receive(const size_t size) const
+	{
+		std::vector<uint8_t> ret(size);
+		size_t done = 0;
+		while (done < size)
+		{
+			const ssize_t n = read(m_peer, ret.data() + done, size - done);
+			if (n <= 0)
+			{
+				break;
+			}
+			done += static_cast<size_t>(n);
+		}
+		ret.resize(done);
+		return ret;
+	}
+
+	static std::vector<uint8_t> piece_message(const uint32_t index, const uint32_t begin,
+						  std::span<const uint8_t> data)
+	{
+		const message::PieceHeader header(index, begin, static_cast<uint32_t>(data.size()));
+		std::vector<uint8_t> ret(header.serialized().begin(), header.serialized().end());
+		ret.insert(ret.end(), data.begin(), data.end());
+		return ret;
+	}
+};
+
+} // namespace
+
+TEST_F(UploadPathTest, SendsBlocksFromFilesAndMemoryInOrder)
+{
+	m_conn.send_file_block(message::Request(0, 0, block), m_storage->file_ranges(0, block));
+	m_conn.send_file_block(message::Request(0, block, block),
+			       m_storage->file_ranges(block, block));
+	m_conn.send_keepalive();
+	const auto piece = std::make_shared<const std::vector<uint8_t>>(64, 7);
+	m_conn.send_cached_block(message::Request(1, 16, 16), piece);
+	EXPECT_EQ(m_conn.bytes_uploaded(), 2 * block + 16);
+	flush();
+
+	std::vector<uint8_t> expected = piece_message(0, 0, std::span(m_torrent).first(block));
+	const auto second = piece_message(0, block, std::span(m_torrent).subspan(block, block));
+	expected.insert(expected.end(), second.begin(), second.end());
+	expected.insert(expected.end(), { 0, 0, 0, 0 });
+	const auto third = piece_message(1, 16, std::span(*piece).subspan(16, 16));
+	expected.insert(expected.end(), third.begin(), third.end());
+	EXPECT_EQ(receive(expected.size()), expected);
+}
+
+TEST_F(UploadPathTest, ReleasesZerocopyBlocksOnceSent)
+{
+	if (!m_conn.enable_zerocopy())
+	{
+		GTEST_SKIP() << "MSG_ZEROCOPY is not supported";
+	}
+	auto piece = std::make_shared<const std::vector<uint8_t>>(2 * block, 3);
+	m_conn.send_cached_block(message::Request(0, 0, block), piece);
+	m_conn.send_cached_block(message::Request(0, block, block), piece);
+	flush();
+
+	std::vector<uint8_t> expected = piece_message(0, 0, std::span(*piece).first(block));
+	const auto second = piece_message(0, block, std::span(*piece).subspan(block));
+	expected.insert(expected.end(), second.begin(), second.end());
+	EXPECT_EQ(receive(expected.size()), expected);
+
+	// the reports may come a bit later than the data
+	for (int i = 0; i < 100 && piece.use_count() > 1; ++i)
+	{
+		(void)m_loop.wait(10);
+		(void)m_conn.release_zerocopy_blocks();
+	}
+	EXPECT_EQ(piece.use_count(), 1);
+}
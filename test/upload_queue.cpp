@@ -0,0 +1,37 @@
+#include "peer_connection.hpp"
+
+#include "peer_message.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <span>
+
+TEST(UploadQueueTest, ServesRequestsInOrderAndHonoursCancel)
+{
+	PeerConnection conn;
+	EXPECT_TRUE(conn.queue_upload(message::Request(0, 0, 4)));
+	EXPECT_TRUE(conn.queue_upload(message::Request(0, 4, 4)));
+	EXPECT_TRUE(conn.queue_upload(message::Request(1, 0, 4)));
+	conn.cancel_upload(message::Cancel(0, 4, 4));
+
+	const auto first = conn.next_upload();
+	ASSERT_TRUE(first.has_value());
+	EXPECT_EQ(first->get_begin(), 0);
+	conn.send_block(first.value(), [](const std::span<uint8_t> block) {
+		std::fill(block.begin(), block.end(), 1);
+	});
+	EXPECT_EQ(conn.bytes_uploaded(), 4);
+
+	const auto second = conn.next_upload();
+	ASSERT_TRUE(second.has_value());
+	EXPECT_EQ(second->get_index(), 1);
+	EXPECT_FALSE(conn.next_upload().has_value());
+
+	for (size_t i = 0; i < PeerConnection::max_upload_queue; ++i)
+	{
+		EXPECT_TRUE(conn.queue_upload(message::Request(2, 0, 4)));
+	}
+	EXPECT_FALSE(conn.queue_upload(message::Request(2, 0, 4)));
+}